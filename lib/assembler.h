@@ -11,35 +11,35 @@
 
 /* Macros for E-encoded instructions */
 
-#define ASMImm_E(instruction) ((instruction & 0xFF) << 8)
-#define ASMFunc_E(instruction) ((instruction & 0xF) << 16)
-#define ASMRs2_E(instruction) ((instruction & 0xF) << 20)
-#define ASMRs1_E(instruction) ((instruction & 0xF) << 24)
-#define ASMRde_E(instruction) ((instruction & 0xF) << 28)
+#define ASMImm_E(instruction) (((instruction) & 0xFF) << 8)
+#define ASMFunc_E(instruction) (((instruction) & 0xF) << 16)
+#define ASMRs2_E(instruction) (((instruction) & 0xF) << 20)
+#define ASMRs1_E(instruction) (((instruction) & 0xF) << 24)
+#define ASMRde_E(instruction) (((instruction) & 0xF) << 28)
 
 /* Macros for R-encoded instructions */
 
-#define ASMImm_R(instruction) ((instruction & 0xFFF) << 8)
-#define ASMRs2_R(instruction) ((instruction & 0xF) << 20)
-#define ASMRs1_R(instruction) ((instruction & 0xF) << 24)
-#define ASMRde_R(instruction) ((instruction & 0xF) << 28)
+#define ASMImm_R(instruction) (((instruction) & 0xFFF) << 8)
+#define ASMRs2_R(instruction) (((instruction) & 0xF) << 20)
+#define ASMRs1_R(instruction) (((instruction) & 0xF) << 24)
+#define ASMRde_R(instruction) (((instruction) & 0xF) << 28)
 
 /* Macros for M-encoded instructions */
 
-#define ASMImm_M(instruction) ((instruction & 0xFFFF) << 8)
-#define ASMRs1_M(instruction) ((instruction & 0xF) << 24)
-#define ASMRde_M(instruction) ((instruction & 0xF) << 28)
+#define ASMImm_M(instruction) (((instruction) & 0xFFFF) << 8)
+#define ASMRs1_M(instruction) (((instruction) & 0xF) << 24)
+#define ASMRde_M(instruction) (((instruction) & 0xF) << 28)
 
 /* Macros for F-encoded instructions */
 
-#define ASMImm_F(instruction) ((instruction & 0xFFFF) << 8)
-#define ASMFunc_F(instruction) ((instruction & 0xF) << 24)
-#define ASMRde_F(instruction) ((instruction & 0xF) << 28)
+#define ASMImm_F(instruction) (((instruction) & 0xFFFF) << 8)
+#define ASMFunc_F(instruction) (((instruction) & 0xF) << 24)
+#define ASMRde_F(instruction) (((instruction) & 0xF) << 28)
 
 /* Macros for B-encoded instructions */
 
-#define ASMImm_B(instruction) ((instruction & 0xFFFFF) << 8)
-#define ASMFunc_B(instruction) ((instruction & 0xF) << 28)
+#define ASMImm_B(instruction) (((instruction) & 0xFFFFF) << 8)
+#define ASMFunc_B(instruction) (((instruction) & 0xF) << 28)
 
 #define HL_INSTRUCTION(mnemonic, opcode, func, format, comment)\
 /** comment */\
@@ -0,0 +1,287 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "block_engine_p.h"
+#include "interpreter_p.h"
+#include "system_p.h"
+#include "thread_p.h"
+
+void HLBlockCacheFlush(struct HLBlockCache *cache)
+{
+    size_t i;
+
+    for (i = 0; i < HLBlockCacheSize; i++) {
+        cache->blocks[i].address = HLDecodeCacheEmpty;
+    }
+}
+
+void HLBlockCacheInvalidatePage(struct HLBlockCache *cache, uint64_t address)
+{
+    uint64_t page = address >> HLPageShift;
+    size_t i;
+
+    for (i = 0; i < HLBlockCacheSize; i++) {
+        if (cache->blocks[i].address != HLDecodeCacheEmpty
+            && (cache->blocks[i].physicalAddress >> HLPageShift) == page) {
+            cache->blocks[i].address = HLDecodeCacheEmpty;
+        }
+    }
+}
+
+void HLBlockCacheInvalidateTranslations(struct HLBlockCache *cache,
+                                        uint64_t address,
+                                        bool all)
+{
+    uint64_t page = address >> HLPageShift;
+    size_t i;
+
+    for (i = 0; i < HLBlockCacheSize; i++) {
+        if (cache->blocks[i].address != HLDecodeCacheEmpty
+            && cache->blocks[i].mode
+            && (all || (cache->blocks[i].address >> HLPageShift) == page)) {
+            cache->blocks[i].address = HLDecodeCacheEmpty;
+        }
+    }
+}
+
+/** Whether execution may continue at the next instruction after this one. */
+static bool
+HLInstructionEndsBlock(const struct HLDecodedInstruction *instruction)
+{
+    /* anything that writes IP is a jump, whatever its operation */
+    if (instruction->rde == HLRegIP) {
+        return true;
+    }
+
+    switch (instruction->operation) {
+    case HLOperation_int:
+    case HLOperation_iret:
+    case HLOperation_ires:
+    case HLOperation_usr:
+    case HLOperation_jal:
+    case HLOperation_jalr:
+    case HLOperation_ret:
+    case HLOperation_retr:
+    case HLOperation_bra:
+    case HLOperation_beq:
+    case HLOperation_bez:
+    case HLOperation_blt:
+    case HLOperation_ble:
+    case HLOperation_bltu:
+    case HLOperation_bleu:
+    case HLOperation_bne:
+    case HLOperation_bnz:
+    case HLOperation_bge:
+    case HLOperation_bgt:
+    case HLOperation_bgeu:
+    case HLOperation_bgtu:
+    case HLOperationUnknown:
+    case HLOperationCompareBranch:
+    case HLOperationCompareImmediateBranch:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Translates the block starting at address into its cache slot.
+ * Returns NULL and sets result if not even the first instruction can be
+ * fetched; a fault later in the run just ends the block early.
+ */
+static struct HLBlock *HLBlockTranslate(struct HLSystem *system,
+                                        uint64_t address,
+                                        uint64_t mode,
+                                        HLMemoryResult *result)
+{
+    struct HLMemoryManagementUnit *mmu = &system->memory;
+    struct HLBlock *block = HLBlockCacheSlot(system->blockCache, address);
+    struct HLDecodedInstruction *instruction;
+    uint64_t physical = address;
+    uint64_t page;
+    HLInstruction raw;
+    HLMemoryResult fetchResult;
+
+    if (mode) {
+        physical = HLMemoryManagementUnitTranslateAddress(
+            mmu, address, HLMemoryPermissionExecute, result);
+        if (*result != HLMemoryResultOK) {
+            return NULL;
+        }
+    }
+    page = physical >> HLPageShift;
+
+    raw = HLMemoryManagementUnitReadPhysicalInstruction(mmu, physical, result);
+    if (*result != HLMemoryResultOK) {
+        return NULL;
+    }
+
+    block->physicalAddress = physical;
+    block->mode = mode;
+    block->successors[0] = NULL;
+    block->successors[1] = NULL;
+    block->native = NULL;
+    block->executions = 0;
+    block->nextSuccessor = 0;
+    block->length = 0;
+    block->cycles = 0;
+
+    while (1) {
+        instruction = &block->instructions[block->length++];
+        HLDecodeInstructionAt(mmu, physical, raw, instruction);
+        instruction->address = physical;
+        instruction->handler = HLOperationHandlers[instruction->operation];
+        block->cycles += instruction->length;
+
+        if (HLInstructionEndsBlock(instruction)
+            || block->length == HLBlockMaxLength) {
+            break;
+        }
+
+        /* blocks never span pages, so one translation covers all of it */
+        physical += 4 * instruction->length;
+        if ((physical >> HLPageShift) != page) {
+            break;
+        }
+
+        fetchResult = HLMemoryResultOK;
+        raw = HLMemoryManagementUnitReadPhysicalInstruction(mmu,
+                                                            physical,
+                                                            &fetchResult);
+        if (fetchResult != HLMemoryResultOK) {
+            /* let the fault happen when execution gets there */
+            break;
+        }
+    }
+
+    system->blockCache->translations++;
+
+    /* only keep the block if we'll hear about writes to it */
+    if (page < mmu->codePageCount) {
+        HLAtomicOr8(&mmu->codePages[page], HLCodePageBlocks);
+        block->address = address;
+    } else {
+        block->address = HLDecodeCacheEmpty;
+    }
+
+    return block;
+}
+
+static struct HLBlock *HLBlockLookup(struct HLSystem *system,
+                                     uint64_t address,
+                                     uint64_t mode,
+                                     HLMemoryResult *result)
+{
+    struct HLBlock *block = HLBlockCacheSlot(system->blockCache, address);
+
+    system->blockCache->lookups++;
+    if (block->address == address && block->mode == mode) {
+        return block;
+    }
+    return HLBlockTranslate(system, address, mode, result);
+}
+
+void HLBlockEngineRun(struct HLSystem *system)
+{
+    struct HLBlockCache *cache = system->blockCache;
+    struct HLBlock *previous = NULL;
+    struct HLBlock *block;
+    const struct HLDecodedInstruction *instruction;
+    const struct HLDecodedInstruction *end;
+    uint64_t address;
+    uint64_t mode;
+    HLMemoryResult result = HLMemoryResultOK;
+
+    /* left over from something that happened outside a block */
+    system->cpu.faulted = false;
+    while (system->cpu.cycles < system->cpu.stopCycle) {
+        if (HLInterruptControllerRaised(&system->interrupts)) {
+            HLSystemTakeInterrupts(system);
+            if (system->cpu.cycles >= system->cpu.stopCycle) {
+                return;
+            }
+        }
+        if (HLSystemCodeChanged(system)) {
+            HLSystemFlushCodeCaches(system);
+            system->cpu.faulted = false;
+            previous = NULL;
+        }
+        if (cache->pageTableBase != system->memory.pageTableBase) {
+            HLBlockCacheFlush(cache);
+            cache->pageTableBase = system->memory.pageTableBase;
+            previous = NULL;
+        }
+
+        address = system->cpu.registers[HLRegIP];
+        mode = system->cpu.registers[HLRegStatus] & HLFlag(HLFlagMode);
+
+        /* follow a link from the previous block if one matches */
+        block = NULL;
+        if (previous != NULL) {
+            if (previous->successors[0] != NULL
+                && previous->successors[0]->address == address
+                && previous->successors[0]->mode == mode) {
+                block = previous->successors[0];
+            } else if (previous->successors[1] != NULL
+                       && previous->successors[1]->address == address
+                       && previous->successors[1]->mode == mode) {
+                block = previous->successors[1];
+            }
+        }
+
+        if (block != NULL) {
+            cache->chainedTransfers++;
+        } else {
+            block = HLBlockLookup(system, address, mode, &result);
+            if (HLUnlikely(result != HLMemoryResultOK)) {
+                HLSystemMemoryFault(system, result);
+                system->cpu.faulted = false;
+                result = HLMemoryResultOK;
+                previous = NULL;
+                continue;
+            }
+            if (previous != NULL && block->address == address) {
+                previous->successors[previous->nextSuccessor] = block;
+                previous->nextSuccessor ^= 1;
+            }
+        }
+
+#if HL_JIT
+        if (block->native == NULL && system->jit != NULL
+            && block->address == address
+            && block->executions++ >= system->jit->threshold) {
+            HLJITCompile(system, block);
+        }
+#endif
+
+        /* a block that would overrun the budget is run up to the budget */
+        if (block->native != NULL
+            && system->cpu.stopCycle - system->cpu.cycles >= block->cycles) {
+            block->native(system);
+            system->cpu.faulted = false;
+        } else {
+            end = block->instructions + block->length;
+            for (instruction = block->instructions;
+                 instruction != end
+                 && system->cpu.cycles < system->cpu.stopCycle;
+                 instruction++) {
+                system->cpu.cycles++;
+                system->cpu.registers[HLRegIP] += 4;
+                instruction->handler(system, instruction);
+                if (HLUnlikely(system->cpu.faulted)) {
+                    /* the rest of the block never runs */
+                    system->cpu.faulted = false;
+                    break;
+                }
+            }
+        }
+
+        previous = block;
+    }
+}
@@ -0,0 +1,92 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_BLOCK_ENGINE_P_H
+#define HALLEY_BLOCK_ENGINE_P_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "decoder_p.h"
+#include "jit_p.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSystem;
+
+/** longest run of instructions translated into one block */
+#define HLBlockMaxLength 32
+/** number of block slots; must be a power of two */
+#define HLBlockCacheSize 512
+
+/**
+ * A straight-line run of instructions ending in a control transfer, a
+ * system control instruction, a page boundary or HLBlockMaxLength.
+ */
+struct HLBlock {
+    /** IP of the first instruction; HLDecodeCacheEmpty for a free slot */
+    uint64_t address;
+    /** physical address of the first instruction */
+    uint64_t physicalAddress;
+    /** HLFlag(HLFlagMode) if the block was translated in user mode */
+    uint64_t mode;
+    /**
+     * Blocks execution has continued into from this one. The engine's loop
+     * looks at these before the cache slot, which only saves the hash
+     * lookup; every block, native or not, still returns to the loop. A
+     * link is only followed if the target's address and mode still match,
+     * so evicted or invalidated targets never need to be unlinked.
+     */
+    struct HLBlock *successors[2];
+    /** compiled form of the block, if the JIT has got to it */
+    HLNativeBlock native;
+    uint32_t executions;
+    uint8_t nextSuccessor;
+    /** entries in instructions */
+    uint8_t length;
+    /** instructions the block runs, counting each one fused into another */
+    uint8_t cycles;
+    struct HLDecodedInstruction instructions[HLBlockMaxLength];
+};
+
+struct HLBlockCache {
+    struct HLBlock blocks[HLBlockCacheSize];
+    /** page tables the cached blocks were translated under */
+    uint64_t pageTableBase;
+
+    uint64_t translations;
+    uint64_t chainedTransfers;
+    uint64_t lookups;
+};
+
+#define HLBlockCacheSlot(cache, address)                                       \
+    (&(cache)->blocks[((address) >> 2) & (HLBlockCacheSize - 1)])
+
+void HLBlockCacheFlush(struct HLBlockCache *cache);
+/** Drops every block translated from the physical page containing address. */
+void HLBlockCacheInvalidatePage(struct HLBlockCache *cache, uint64_t address);
+/**
+ * Drops the user mode blocks translated through the virtual page containing
+ * address, or every user mode block if all is set. Kernel mode blocks don't
+ * go through the page tables and stay.
+ */
+void HLBlockCacheInvalidateTranslations(struct HLBlockCache *cache,
+                                        uint64_t address,
+                                        bool all);
+
+/**
+ * Executes blocks until system->cpu.cycles reaches stopCycle, compiling hot ones
+ * if system->jit is set.
+ */
+void HLBlockEngineRun(struct HLSystem *system);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,225 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "interrupt_controller_p.h"
+#include "memory_allocation.h"
+#include "system.h"
+#include "system_p.h"
+#include "thread_p.h"
+
+struct HLCoreThread {
+    struct HLThread thread;
+    struct HLCoreThreads *threads;
+    struct HLSystem *core;
+};
+
+/**
+ * Host threads for cores 1 and up. Core 0 runs on whichever thread calls
+ * HLSystemRunCores; the others wait for it to hand out a budget.
+ */
+struct HLCoreThreads {
+    HLMutex lock;
+    /** broadcast when generation changes or stopping is set */
+    HLCondition start;
+    /** signalled when running drops to zero */
+    HLCondition finished;
+    uint64_t generation;
+    uint64_t budget;
+    uint32_t running;
+    bool stopping;
+    /** coreCount - 1 of them */
+    struct HLCoreThread *threads;
+};
+
+static void HLCoreThreadMain(void *argument)
+{
+    struct HLCoreThread *thread = argument;
+    struct HLCoreThreads *threads = thread->threads;
+    uint64_t generation = 0;
+    uint64_t budget;
+
+    HLMutexLock(&threads->lock);
+    while (1) {
+        while (!threads->stopping && threads->generation == generation) {
+            HLConditionWait(&threads->start, &threads->lock);
+        }
+        if (threads->stopping) {
+            break;
+        }
+        generation = threads->generation;
+        budget = threads->budget;
+        HLMutexUnlock(&threads->lock);
+
+        HLSystemRun(thread->core, budget);
+
+        HLMutexLock(&threads->lock);
+        if (--threads->running == 0) {
+            HLConditionSignal(&threads->finished);
+        }
+    }
+    HLMutexUnlock(&threads->lock);
+}
+
+uint32_t HLSystemSetCoreCount(struct HLSystem *system, uint32_t count)
+{
+    struct HLMemoryAllocation *alloc = system->allocator;
+    struct HLCoreThreads *threads;
+    struct HLSystem *core;
+    uint32_t i;
+
+    assert(system->primary == system && system->cores == NULL);
+    if (count <= 1) {
+        return system->coreCount;
+    }
+
+    system->cores = alloc->alloc(alloc,
+                                 (long)(count * sizeof(struct HLSystem *)));
+    threads = alloc->alloc(alloc, sizeof(struct HLCoreThreads));
+    if (threads != NULL) {
+        threads->threads = alloc->alloc(
+            alloc, (long)((count - 1) * sizeof(struct HLCoreThread)));
+    }
+    if (system->cores == NULL || threads == NULL || threads->threads == NULL) {
+        if (threads != NULL) {
+            if (threads->threads != NULL) {
+                alloc->free(alloc, threads->threads);
+            }
+            alloc->free(alloc, threads);
+        }
+        if (system->cores != NULL) {
+            alloc->free(alloc, system->cores);
+            system->cores = NULL;
+        }
+        return system->coreCount;
+    }
+
+    HLMutexInit(&threads->lock);
+    HLConditionInit(&threads->start);
+    HLConditionInit(&threads->finished);
+    threads->generation = 0;
+    threads->budget = 0;
+    threads->running = 0;
+    threads->stopping = false;
+    system->coreThreads = threads;
+
+    system->cores[0] = system;
+    for (i = 1; i < count; i++) {
+        HLSystemInitCore(&core, system, i);
+        if (core == NULL) {
+            break;
+        }
+
+        threads->threads[i - 1].threads = threads;
+        threads->threads[i - 1].core = core;
+        if (!HLThreadStart(&threads->threads[i - 1].thread,
+                           HLCoreThreadMain,
+                           &threads->threads[i - 1])) {
+            HLSystemDone(&core);
+            break;
+        }
+
+        system->cores[i] = core;
+        system->coreCount++;
+    }
+
+    /* a system with only some of its cores would run guests that expect
+     * the rest, so give back the ones that did come up
+     */
+    if (system->coreCount != count) {
+        HLSystemDoneCores(system);
+    }
+    return system->coreCount;
+}
+
+void HLSystemDoneCores(struct HLSystem *system)
+{
+    struct HLMemoryAllocation *alloc = system->allocator;
+    struct HLCoreThreads *threads = system->coreThreads;
+    uint32_t i;
+
+    HLMutexLock(&threads->lock);
+    threads->stopping = true;
+    HLConditionBroadcast(&threads->start);
+    HLMutexUnlock(&threads->lock);
+
+    for (i = 1; i < system->coreCount; i++) {
+        HLThreadJoin(&threads->threads[i - 1].thread);
+        HLSystemDone(&system->cores[i]);
+    }
+
+    HLConditionDone(&threads->finished);
+    HLConditionDone(&threads->start);
+    HLMutexDone(&threads->lock);
+    alloc->free(alloc, threads->threads);
+    alloc->free(alloc, threads);
+    alloc->free(alloc, system->cores);
+    system->coreThreads = NULL;
+    system->cores = NULL;
+    system->coreCount = 1;
+}
+
+uint32_t HLSystemCoreCount(struct HLSystem *system)
+{
+    return system->primary->coreCount;
+}
+
+struct HLSystem *HLSystemCore(struct HLSystem *system, uint32_t index)
+{
+    system = system->primary;
+    if (index >= system->coreCount) {
+        return NULL;
+    }
+    if (system->cores == NULL) {
+        return system;
+    }
+    return system->cores[index];
+}
+
+HLStopReason HLSystemRunCores(struct HLSystem *system, uint64_t cycles)
+{
+    struct HLCoreThreads *threads = system->coreThreads;
+    HLStopReason reason;
+    uint32_t i;
+
+    if (system->coreCount == 1) {
+        return HLSystemRun(system, cycles);
+    }
+
+    /* the other cores pick up memory from core 0 when they start */
+    HLSystemPrepareCodePages(system);
+    HLSystemPrepareDirtyPages(system);
+
+    HLMutexLock(&threads->lock);
+    threads->budget = cycles;
+    threads->running = system->coreCount - 1;
+    threads->generation++;
+    HLConditionBroadcast(&threads->start);
+    HLMutexUnlock(&threads->lock);
+
+    HLSystemRun(system, cycles);
+
+    HLMutexLock(&threads->lock);
+    while (threads->running > 0) {
+        HLConditionWait(&threads->finished, &threads->lock);
+    }
+    HLMutexUnlock(&threads->lock);
+
+    for (i = 0; i < system->coreCount; i++) {
+        reason = system->cores[i]->cpu.stopReason;
+        if (reason != HLStopBudgetExhausted) {
+            return reason;
+        }
+    }
+    return HLStopBudgetExhausted;
+}
+
+void HLSystemRaiseInterrupt(struct HLSystem *core, uint8_t interrupt)
+{
+    HLInterruptControllerRaise(&core->interrupts, interrupt);
+}
@@ -0,0 +1,439 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <stddef.h>
+
+#include "decoder_p.h"
+#include "system_p.h"
+
+struct HLInstructionDescription {
+    uint8_t opcode;
+    uint8_t func;
+    HLInstructionFormat format;
+    HLOperation operation;
+};
+
+#define HL_INSTRUCTION(mnemonic, opcode, func, format, comment)                \
+    {opcode, func, format, HLOperation_##mnemonic},
+static const struct HLInstructionDescription HLInstructionDescriptions[] = {
+#include "instructions.h"
+};
+#undef HL_INSTRUCTION
+
+#define HLNInstructionDescriptions                                             \
+    (sizeof(HLInstructionDescriptions) / sizeof(HLInstructionDescriptions[0]))
+
+static const struct HLInstructionDescription *
+HLDescribeInstruction(HLInstruction raw)
+{
+    size_t i;
+    const struct HLInstructionDescription *description;
+
+    for (i = 0; i < HLNInstructionDescriptions; i++) {
+        description = &HLInstructionDescriptions[i];
+        if (description->opcode != HLOpcode(raw)) {
+            continue;
+        }
+        /* only the F and B formats select the operation by function */
+        switch (description->format) {
+        case HLFormatF:
+            if (description->func != HLFunc_F(raw)) {
+                continue;
+            }
+            break;
+        case HLFormatB:
+            if (description->func != HLFunc_B(raw)) {
+                continue;
+            }
+            break;
+        }
+        return description;
+    }
+
+    return NULL;
+}
+
+void HLDecodeInstruction(HLInstruction raw,
+                         struct HLDecodedInstruction *decoded)
+{
+    const struct HLInstructionDescription *description =
+        HLDescribeInstruction(raw);
+
+    decoded->raw = raw;
+    decoded->imm = 0;
+    decoded->rde = HLRegRZ;
+    decoded->rs1 = HLRegRZ;
+    decoded->rs2 = HLRegRZ;
+    decoded->func = 0;
+    decoded->length = 1;
+    decoded->branch = 0;
+
+    if (description == NULL) {
+        decoded->operation = HLOperationUnknown;
+        return;
+    }
+    decoded->operation = description->operation;
+
+    switch (description->format) {
+    case HLFormatE:
+        decoded->imm = HLSignExtend64(HLImm_E(raw), 8);
+        decoded->func = HLFunc_E(raw);
+        decoded->rs2 = HLRs2_E(raw);
+        decoded->rs1 = HLRs1_E(raw);
+        decoded->rde = HLRde_E(raw);
+        break;
+    case HLFormatR:
+        decoded->imm = HLSignExtend64(HLImm_R(raw), 12);
+        decoded->rs2 = HLRs2_R(raw);
+        decoded->rs1 = HLRs1_R(raw);
+        decoded->rde = HLRde_R(raw);
+        break;
+    case HLFormatM:
+        decoded->imm = HLSignExtend64(HLImm_M(raw), 16);
+        decoded->rs1 = HLRs1_M(raw);
+        decoded->rde = HLRde_M(raw);
+        break;
+    case HLFormatF:
+        decoded->imm = HLSignExtend64(HLImm_F(raw), 16);
+        decoded->func = HLFunc_F(raw);
+        decoded->rde = HLRde_F(raw);
+        break;
+    case HLFormatB:
+        decoded->imm = HLSignExtend64(HLImm_B(raw), 20);
+        decoded->func = HLFunc_B(raw);
+        break;
+    }
+}
+
+static bool HLOperationIsConditionalBranch(HLOperation operation)
+{
+    switch (operation) {
+    case HLOperation_beq:
+    case HLOperation_bez:
+    case HLOperation_blt:
+    case HLOperation_ble:
+    case HLOperation_bltu:
+    case HLOperation_bleu:
+    case HLOperation_bne:
+    case HLOperation_bnz:
+    case HLOperation_bge:
+    case HLOperation_bgt:
+    case HLOperation_bgeu:
+    case HLOperation_bgtu:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/** Which 16 bit lane of rde a load immediate writes, or -1. */
+static int HLLoadImmediateLane(HLOperation operation)
+{
+    switch (operation) {
+    case HLOperation_lli:
+    case HLOperation_llis:
+        return 0;
+    case HLOperation_lui:
+    case HLOperation_luis:
+        return 1;
+    case HLOperation_lti:
+    case HLOperation_ltis:
+        return 2;
+    case HLOperation_ltui:
+    case HLOperation_ltuis:
+        return 3;
+    default:
+        return -1;
+    }
+}
+
+/** Whether a load immediate keeps the lanes of rde it doesn't write. */
+#define HLLoadImmediateIsPartial(operation)                                    \
+    ((operation) == HLOperation_lli || (operation) == HLOperation_lui          \
+     || (operation) == HLOperation_lti || (operation) == HLOperation_ltui)
+
+/** Whether HLDecodeFuse could fuse anything onto an operation. */
+static bool HLOperationMayFuse(HLOperation operation)
+{
+    return operation == HLOperation_cmpr || operation == HLOperation_cmpi
+           || operation == HLOperationLoadConstant
+           || HLLoadImmediateLane(operation) >= 0;
+}
+
+bool HLDecodeFuse(struct HLDecodedInstruction *decoded, HLInstruction next)
+{
+    struct HLDecodedInstruction second;
+    uint64_t lane;
+    int shift;
+
+    if (decoded->length == HLDecodeMaxFusedLength) {
+        return false;
+    }
+    HLDecodeInstruction(next, &second);
+
+    switch (decoded->operation) {
+    case HLOperation_cmpr:
+        if (!HLOperationIsConditionalBranch(second.operation)) {
+            return false;
+        }
+        decoded->operation = HLOperationCompareBranch;
+        decoded->rs2 = decoded->rs1;
+        decoded->rs1 = decoded->rde;
+        decoded->rde = HLRegRZ;
+        decoded->func = second.operation;
+        decoded->branch = (int32_t)second.imm;
+        decoded->length++;
+        return true;
+    case HLOperation_cmpi:
+        /* an invalid function has to fault on its own */
+        if (decoded->rde > 1
+            || !HLOperationIsConditionalBranch(second.operation)) {
+            return false;
+        }
+        decoded->operation = HLOperationCompareImmediateBranch;
+        decoded->func = second.operation;
+        decoded->branch = (int32_t)second.imm;
+        decoded->length++;
+        return true;
+    default:
+        break;
+    }
+
+    /*
+     * only partial loads into the same register build on a constant; a
+     * load into IP is a jump, so the next one is never reached
+     */
+    if (!HLLoadImmediateIsPartial(second.operation)
+        || second.rde != decoded->rde || decoded->rde == HLRegIP) {
+        return false;
+    }
+    if (decoded->operation != HLOperationLoadConstant) {
+        shift = HLLoadImmediateLane(decoded->operation);
+        if (shift < 0) {
+            return false;
+        }
+        lane = (uint64_t)0xFFFF << (16 * shift);
+        if (HLLoadImmediateIsPartial(decoded->operation)) {
+            decoded->func = 0xF & ~(1 << shift);
+            decoded->imm =
+                (int64_t)(((uint64_t)decoded->imm << (16 * shift)) & lane);
+        } else {
+            decoded->func = 0;
+            decoded->imm = (int64_t)((uint64_t)decoded->imm << (16 * shift));
+        }
+        decoded->operation = HLOperationLoadConstant;
+    }
+
+    shift = HLLoadImmediateLane(second.operation);
+    lane = (uint64_t)0xFFFF << (16 * shift);
+    decoded->func &= ~(1 << shift);
+    decoded->imm = (int64_t)(((uint64_t)decoded->imm & ~lane)
+                             | (((uint64_t)second.imm << (16 * shift)) & lane));
+    decoded->length++;
+    return true;
+}
+
+/**
+ * Whether an operation does nothing but write rde, without setting flags
+ * or faulting, so it does nothing at all if rde is RZ.
+ */
+static bool HLOperationOnlyWritesRde(HLOperation operation)
+{
+    switch (operation) {
+    case HLOperation_imulr:
+    case HLOperation_imuli:
+    case HLOperation_umulr:
+    case HLOperation_umuli:
+    case HLOperation_andr:
+    case HLOperation_andi:
+    case HLOperation_orr:
+    case HLOperation_ori:
+    case HLOperation_norr:
+    case HLOperation_nori:
+    case HLOperation_xorr:
+    case HLOperation_xori:
+    case HLOperation_shlr:
+    case HLOperation_shli:
+    case HLOperation_asrr:
+    case HLOperation_asri:
+    case HLOperation_lsrr:
+    case HLOperation_lsri:
+    case HLOperation_bitr:
+    case HLOperation_biti:
+        return true;
+    default:
+        return HLLoadImmediateLane(operation) >= 0;
+    }
+}
+
+static void HLSpecializeMove(struct HLDecodedInstruction *decoded,
+                             uint8_t source)
+{
+    decoded->operation = HLOperationMove;
+    decoded->rs1 = source;
+    decoded->rs2 = HLRegRZ;
+    decoded->imm = 0;
+    decoded->func = 0;
+}
+
+static void HLSpecializeMoveImmediate(struct HLDecodedInstruction *decoded,
+                                      uint64_t value,
+                                      bool setsFlags)
+{
+    decoded->operation = HLOperationMoveImmediate;
+    decoded->rs1 = HLRegRZ;
+    decoded->rs2 = HLRegRZ;
+    decoded->imm = (int64_t)value;
+    decoded->func = setsFlags;
+}
+
+void HLDecodeSpecialize(struct HLDecodedInstruction *decoded)
+{
+    /* negative immediates are as good as too big to shift by */
+    uint64_t imm = (uint64_t)decoded->imm;
+
+    if (decoded->rde == HLRegRZ
+        && HLOperationOnlyWritesRde(decoded->operation)) {
+        decoded->operation = HLOperationNop;
+        return;
+    }
+
+    switch (decoded->operation) {
+    case HLOperation_addi:
+        if (decoded->rs1 == HLRegRZ) {
+            HLSpecializeMoveImmediate(decoded, imm, true);
+        }
+        break;
+    case HLOperation_ori:
+    case HLOperation_xori:
+        if (decoded->rs1 == HLRegRZ) {
+            HLSpecializeMoveImmediate(decoded, imm, false);
+        } else if (imm == 0) {
+            HLSpecializeMove(decoded, decoded->rs1);
+        }
+        break;
+    case HLOperation_nori:
+        if (decoded->rs1 == HLRegRZ) {
+            HLSpecializeMoveImmediate(decoded, ~imm, false);
+        }
+        break;
+    case HLOperation_andi:
+        if (decoded->rs1 == HLRegRZ || imm == 0) {
+            HLSpecializeMoveImmediate(decoded, 0, false);
+        }
+        break;
+    case HLOperation_andr:
+        if (decoded->rs1 == HLRegRZ || decoded->rs2 == HLRegRZ) {
+            HLSpecializeMoveImmediate(decoded, 0, false);
+        }
+        break;
+    case HLOperation_orr:
+    case HLOperation_xorr:
+        if (decoded->rs2 == HLRegRZ) {
+            HLSpecializeMove(decoded, decoded->rs1);
+        } else if (decoded->rs1 == HLRegRZ) {
+            HLSpecializeMove(decoded, decoded->rs2);
+        }
+        break;
+    case HLOperation_shli:
+    case HLOperation_lsri:
+        if (imm == 0) {
+            HLSpecializeMove(decoded, decoded->rs1);
+        } else if (imm >= 64) {
+            HLSpecializeMoveImmediate(decoded, 0, false);
+        } else if (decoded->operation == HLOperation_shli) {
+            decoded->operation = HLOperationShiftLeftImmediate;
+        } else {
+            decoded->operation = HLOperationShiftRightLogicalImmediate;
+        }
+        break;
+    case HLOperation_asri:
+        if (imm == 0) {
+            HLSpecializeMove(decoded, decoded->rs1);
+        } else if (imm < 64) {
+            decoded->operation = HLOperationShiftRightArithmeticImmediate;
+        }
+        break;
+    case HLOperation_biti:
+        if (imm < 64) {
+            decoded->operation = HLOperationBitImmediate;
+        } else {
+            HLSpecializeMoveImmediate(decoded, 0, false);
+        }
+        break;
+    case HLOperation_cmpr:
+        if (decoded->rs1 == HLRegRZ) {
+            decoded->operation = HLOperationCompareZero;
+            decoded->rs1 = decoded->rde;
+            decoded->rde = HLRegRZ;
+        }
+        break;
+    case HLOperation_cmpi:
+        if (decoded->rde == 0 && imm == 0) {
+            decoded->operation = HLOperationCompareZero;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void HLDecodeInstructionAt(struct HLMemoryManagementUnit *mmu,
+                           uint64_t physical,
+                           HLInstruction raw,
+                           struct HLDecodedInstruction *decoded)
+{
+    uint64_t next = physical + 4;
+    HLMemoryResult result = HLMemoryResultOK;
+
+    HLDecodeInstruction(raw, decoded);
+
+    /* fused instructions stay on the page, where writes to them are seen */
+    while (HLOperationMayFuse(decoded->operation)
+           && (next >> HLPageShift) == (physical >> HLPageShift)) {
+        raw = HLMemoryManagementUnitReadPhysicalInstruction(mmu, next, &result);
+        if (result != HLMemoryResultOK || !HLDecodeFuse(decoded, raw)) {
+            break;
+        }
+        next += 4;
+    }
+
+    if (decoded->length == 1) {
+        HLDecodeSpecialize(decoded);
+    }
+}
+
+void HLDecodeCacheFlush(struct HLDecodeCache *cache)
+{
+    size_t i;
+
+    for (i = 0; i < HLDecodeCacheSize; i++) {
+        cache->entries[i].address = HLDecodeCacheEmpty;
+    }
+}
+
+void HLDecodeCacheInvalidate(struct HLDecodeCache *cache,
+                             uint64_t address,
+                             uint64_t size)
+{
+    uint64_t word = address & ~(uint64_t)3;
+    struct HLDecodedInstruction *slot;
+
+    /* instructions before the write may have fused the words it touches */
+    if (word >= 4 * (HLDecodeMaxFusedLength - 1)) {
+        word -= 4 * (HLDecodeMaxFusedLength - 1);
+    } else {
+        word = 0;
+    }
+
+    /* writes are aligned, so every word they touch starts at a multiple of 4 */
+    for (; word < address + size; word += 4) {
+        slot = HLDecodeCacheSlot(cache, word);
+        if (slot->address == word) {
+            slot->address = HLDecodeCacheEmpty;
+        }
+    }
+}
@@ -0,0 +1,127 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_DECODER_P_H
+#define HALLEY_DECODER_P_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "memory_management_unit_p.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSystem;
+struct HLDecodedInstruction;
+
+typedef uint8_t HLOperation;
+
+#undef HL_INSTRUCTION
+#define HL_INSTRUCTION(mnemonic, opcode, func, format, comment)                \
+    HLOperation_##mnemonic,
+enum {
+#include "instructions.h"
+    /** opcode or secondary function not listed in instructions.h */
+    HLOperationUnknown,
+
+#define HL_OPERATION(name, comment) HLOperation##name,
+#include "operations.h"
+#undef HL_OPERATION
+    HLNOperation,
+};
+#undef HL_INSTRUCTION
+
+typedef void (*HLOperationHandler)(
+    struct HLSystem *system,
+    const struct HLDecodedInstruction *instruction);
+
+#define HLSignExtend64(value, bits)                                            \
+    ((int64_t)((((uint64_t)(value) ^ ((uint64_t)1 << ((bits)-1)))             \
+                - ((uint64_t)1 << ((bits)-1)))))
+
+/**
+ * An instruction with its fields pulled out of the encoding.
+ *
+ * Fields that the instruction's format does not have are zero.
+ */
+struct HLDecodedInstruction {
+    /** physical address the instruction was fetched from */
+    uint64_t address;
+    /** the immediate sign-extended from its width in the encoding */
+    int64_t imm;
+    HLOperationHandler handler;
+    HLInstruction raw;
+    HLOperation operation;
+    /* HLRegister values */
+    uint8_t rde;
+    uint8_t rs1;
+    uint8_t rs2;
+    uint8_t func;
+    /** instructions this stands for; more than one if it's fused */
+    uint8_t length;
+    /** immediate of the branch of a fused compare-and-branch */
+    int32_t branch;
+};
+
+/** most instructions HLDecodeFuse puts together */
+#define HLDecodeMaxFusedLength 4
+
+/** one instruction slot per four bytes; must be a power of two */
+#define HLDecodeCacheSize 4096
+/** tag of an empty slot, never a valid instruction address */
+#define HLDecodeCacheEmpty (~(uint64_t)0)
+
+/**
+ * Direct-mapped cache of decoded instructions keyed by physical address.
+ *
+ * The cache is kept coherent with memory by invalidating slots from the
+ * MMU's code write observer.
+ */
+struct HLDecodeCache {
+    struct HLDecodedInstruction entries[HLDecodeCacheSize];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+#define HLDecodeCacheSlot(cache, address)                                      \
+    (&(cache)->entries[((address) >> 2) & (HLDecodeCacheSize - 1)])
+
+void HLDecodeInstruction(HLInstruction raw,
+                         struct HLDecodedInstruction *decoded);
+/**
+ * Fuses next, the instruction after the ones decoded stands for, into it
+ * if together they make one of the idioms with a fused operation. Returns
+ * whether it did; raw is left as the first instruction's.
+ */
+bool HLDecodeFuse(struct HLDecodedInstruction *decoded, HLInstruction next);
+/**
+ * Gives decoded a specialised operation if it is one of the common forms
+ * with one, such as a move or a compare with zero. Only for instructions
+ * that aren't fused.
+ */
+void HLDecodeSpecialize(struct HLDecodedInstruction *decoded);
+/**
+ * Decodes raw, fetched from physical, and fuses as many of the
+ * instructions after it on the same page into it as it can, or
+ * specialises it if there are none.
+ */
+void HLDecodeInstructionAt(struct HLMemoryManagementUnit *mmu,
+                           uint64_t physical,
+                           HLInstruction raw,
+                           struct HLDecodedInstruction *decoded);
+
+void HLDecodeCacheFlush(struct HLDecodeCache *cache);
+void HLDecodeCacheInvalidate(struct HLDecodeCache *cache,
+                             uint64_t address,
+                             uint64_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
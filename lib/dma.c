@@ -0,0 +1,221 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <stddef.h>
+
+#include "dma_p.h"
+#include "system_p.h"
+#include "thread_p.h"
+
+/*
+ * The transfer has a copy of core 0's MMU, so it never touches a core's
+ * own state. That means it can't invalidate any core's caches directly
+ * either, so code writes bump the code generation, which every core
+ * checks between blocks and after port reads.
+ */
+static void HLDMACodeWritten(void *userData, uint64_t address, uint64_t size)
+{
+    struct HLSystem *system = userData;
+
+    HLAtomicAdd64(&system->codeGeneration, 1);
+}
+
+static void HLDMATransferRun(struct HLDMA *dma)
+{
+    struct HLDMATransfer *transfer = &dma->transfer;
+    HLMemoryResult result = HLMemoryResultOK;
+    uint64_t done;
+
+    if (transfer->command == HLDMACommandCopy) {
+        done = HLMemoryManagementUnitCopyPhysical(&dma->memory,
+                                                  transfer->destination,
+                                                  transfer->source,
+                                                  transfer->length,
+                                                  &result);
+    } else {
+        done = HLMemoryManagementUnitFillPhysical(&dma->memory,
+                                                  transfer->destination,
+                                                  transfer->value,
+                                                  transfer->length,
+                                                  &result);
+    }
+
+    HLMutexLock(&dma->lock);
+    dma->result = done;
+    dma->status =
+        result == HLMemoryResultOK ? HLDMAStatusIdle : HLDMAStatusFault;
+    if (transfer->vector <= 255) {
+        HLInterruptControllerRaise(transfer->interrupts,
+                                   (HLInterrupt)transfer->vector);
+    }
+    HLConditionBroadcast(&dma->completed);
+    HLMutexUnlock(&dma->lock);
+}
+
+static void HLDMAThreadMain(void *argument)
+{
+    struct HLDMA *dma = argument;
+
+    HLMutexLock(&dma->lock);
+    while (!dma->stopping) {
+        if (dma->status != HLDMAStatusBusy) {
+            HLConditionWait(&dma->requested, &dma->lock);
+            continue;
+        }
+        HLMutexUnlock(&dma->lock);
+        HLDMATransferRun(dma);
+        HLMutexLock(&dma->lock);
+    }
+    HLMutexUnlock(&dma->lock);
+}
+
+void HLDMAInit(struct HLDMA *dma, struct HLSystem *system)
+{
+    dma->system = system;
+    HLMutexInit(&dma->lock);
+    HLConditionInit(&dma->requested);
+    HLConditionInit(&dma->completed);
+    dma->threadStarted = false;
+    dma->stopping = false;
+
+    dma->registers.command = 0;
+    dma->registers.value = 0;
+    dma->registers.source = 0;
+    dma->registers.destination = 0;
+    dma->registers.length = 0;
+    dma->registers.vector = HLDMANoInterrupt;
+    dma->registers.interrupts = NULL;
+    dma->status = HLDMAStatusIdle;
+    dma->result = 0;
+}
+
+void HLDMADone(struct HLDMA *dma)
+{
+    HLDMAWait(dma);
+    if (dma->threadStarted) {
+        HLMutexLock(&dma->lock);
+        dma->stopping = true;
+        HLConditionSignal(&dma->requested);
+        HLMutexUnlock(&dma->lock);
+        HLThreadJoin(&dma->thread);
+    }
+    HLConditionDone(&dma->completed);
+    HLConditionDone(&dma->requested);
+    HLMutexDone(&dma->lock);
+}
+
+void HLDMAWait(struct HLDMA *dma)
+{
+    HLMutexLock(&dma->lock);
+    while (dma->status == HLDMAStatusBusy) {
+        HLConditionWait(&dma->completed, &dma->lock);
+    }
+    HLMutexUnlock(&dma->lock);
+}
+
+/** Called with the lock held. */
+static void HLDMAStart(struct HLDMA *dma,
+                       struct HLSystem *core,
+                       uint64_t command)
+{
+    struct HLSystem *system = dma->system;
+
+    if (dma->status == HLDMAStatusBusy
+        || (command != HLDMACommandCopy && command != HLDMACommandFill)) {
+        return;
+    }
+
+    dma->transfer = dma->registers;
+    dma->transfer.command = (HLDMACommand)command;
+    dma->transfer.interrupts = &core->interrupts;
+
+    dma->memory = system->memory;
+    dma->memory.codeWriteObserver = HLDMACodeWritten;
+    dma->memory.codeWriteObserverData = system;
+    dma->status = HLDMAStatusBusy;
+
+    if (!dma->threadStarted) {
+        dma->threadStarted =
+            HLThreadStart(&dma->thread, HLDMAThreadMain, dma);
+    }
+    if (dma->threadStarted) {
+        HLConditionSignal(&dma->requested);
+        return;
+    }
+
+    /* without a thread, the transfer is over before the guest goes on */
+    HLMutexUnlock(&dma->lock);
+    HLDMATransferRun(dma);
+    HLMutexLock(&dma->lock);
+}
+
+void HLDMAPortWrite(void *userData,
+                    struct HLSystem *core,
+                    uint16_t port,
+                    uint64_t value)
+{
+    struct HLDMA *dma = userData;
+
+    HLMutexLock(&dma->lock);
+    switch ((HLDMAPort)(port - HLDMAPortBase)) {
+    case HLDMAPortSource:
+        dma->registers.source = value;
+        break;
+    case HLDMAPortDestination:
+        dma->registers.destination = value;
+        break;
+    case HLDMAPortLength:
+        dma->registers.length = value;
+        break;
+    case HLDMAPortValue:
+        dma->registers.value = (uint8_t)value;
+        break;
+    case HLDMAPortVector:
+        dma->registers.vector = value <= 255 ? value : HLDMANoInterrupt;
+        break;
+    case HLDMAPortCommand:
+        HLDMAStart(dma, core, value);
+        break;
+    default:
+        break;
+    }
+    HLMutexUnlock(&dma->lock);
+}
+
+uint64_t HLDMAPortRead(void *userData, struct HLSystem *core, uint16_t port)
+{
+    struct HLDMA *dma = userData;
+    uint64_t value = 0;
+
+    HLMutexLock(&dma->lock);
+    switch ((HLDMAPort)(port - HLDMAPortBase)) {
+    case HLDMAPortSource:
+        value = dma->registers.source;
+        break;
+    case HLDMAPortDestination:
+        value = dma->registers.destination;
+        break;
+    case HLDMAPortLength:
+        value = dma->registers.length;
+        break;
+    case HLDMAPortValue:
+        value = dma->registers.value;
+        break;
+    case HLDMAPortVector:
+        value = dma->registers.vector;
+        break;
+    case HLDMAPortCommand:
+        value = dma->status;
+        break;
+    case HLDMAPortResult:
+        value = dma->result;
+        break;
+    default:
+        break;
+    }
+    HLMutexUnlock(&dma->lock);
+    return value;
+}
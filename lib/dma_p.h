@@ -0,0 +1,132 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_DMA_P_H
+#define HALLEY_DMA_P_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "interrupt_controller_p.h"
+#include "memory_management_unit_p.h"
+#include "thread_p.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSystem;
+
+/*
+ * DMA controller
+ *
+ * The guest sets up a transfer by writing its parameters to the ports
+ * below, then starts it by writing a command. The transfer runs on a host
+ * thread while the guest keeps executing; when it is over, the status
+ * port reads HLDMAStatusIdle or HLDMAStatusFault, the result port holds
+ * the number of bytes done, and the interrupt in the vector port is
+ * raised on the core that started it. Addresses are physical.
+ *
+ * Transfers don't go through the decode or block caches of a running
+ * core; like writes from another core, instruction fetch sees them from
+ * the core's next block, or right after it reads the status port.
+ */
+
+/** first of the DMA controller's HLDMANPorts ports */
+#define HLDMAPortBase 0x10
+
+typedef uint8_t HLDMAPort;
+enum {
+    /** physical address a copy reads from */
+    HLDMAPortSource,
+    /** physical address the transfer writes to */
+    HLDMAPortDestination,
+    /** number of bytes to transfer */
+    HLDMAPortLength,
+    /** byte a fill writes */
+    HLDMAPortValue,
+    /** interrupt raised when a transfer is over; none if above 255 */
+    HLDMAPortVector,
+    /** writes start an HLDMACommand, reads return the HLDMAStatus */
+    HLDMAPortCommand,
+    /** bytes the last transfer did before finishing or faulting */
+    HLDMAPortResult,
+    HLDMANPorts,
+};
+
+typedef uint8_t HLDMACommand;
+enum {
+    /** copies as if with memmove, so the ranges may overlap */
+    HLDMACommandCopy = 1,
+    HLDMACommandFill = 2,
+};
+
+typedef uint8_t HLDMAStatus;
+enum {
+    /** no transfer is running, and the last one, if any, finished */
+    HLDMAStatusIdle,
+    /** a transfer is running; commands are ignored until it is over */
+    HLDMAStatusBusy,
+    /** the last transfer hit the end of physical memory */
+    HLDMAStatusFault,
+};
+
+#define HLDMANoInterrupt ((uint64_t)-1)
+
+struct HLDMATransfer {
+    HLDMACommand command;
+    uint8_t value;
+    uint64_t source;
+    uint64_t destination;
+    uint64_t length;
+    uint64_t vector;
+    /** of the core that started the transfer */
+    struct HLInterruptController *interrupts;
+};
+
+/** The DMA controller of a system, shared by all of its cores. */
+struct HLDMA {
+    struct HLSystem *system;
+    HLMutex lock;
+    /** signalled when a transfer is started or stopping is set */
+    HLCondition requested;
+    /** broadcast when a transfer is over */
+    HLCondition completed;
+    /** started with the first transfer */
+    struct HLThread thread;
+    bool threadStarted;
+    bool stopping;
+
+    /* the ports, guarded by lock */
+    struct HLDMATransfer registers;
+    HLDMAStatus status;
+    uint64_t result;
+
+    /** what the running transfer does */
+    struct HLDMATransfer transfer;
+    /** core 0's view of physical memory when the transfer started */
+    struct HLMemoryManagementUnit memory;
+};
+
+void HLDMAInit(struct HLDMA *dma, struct HLSystem *system);
+/** Waits for the running transfer, if any, and stops the thread. */
+void HLDMADone(struct HLDMA *dma);
+/** Returns once no transfer is running. */
+void HLDMAWait(struct HLDMA *dma);
+
+/* HLPortDevice handlers; userData is the HLDMA */
+
+void HLDMAPortWrite(void *userData,
+                    struct HLSystem *core,
+                    uint16_t port,
+                    uint64_t value);
+uint64_t HLDMAPortRead(void *userData, struct HLSystem *core, uint16_t port);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,128 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <stddef.h>
+
+#include "event_queue_p.h"
+
+void HLEventInit(struct HLEvent *event, HLEventHandler handler, void *userData)
+{
+    event->cycle = UINT64_MAX;
+    event->handler = handler;
+    event->userData = userData;
+    event->index = -1;
+}
+
+void HLEventQueueInit(struct HLEventQueue *queue)
+{
+    queue->count = 0;
+}
+
+static void HLEventQueuePlace(struct HLEventQueue *queue,
+                              struct HLEvent *event,
+                              int index)
+{
+    queue->heap[index] = event;
+    event->index = index;
+}
+
+/** Moves the event at index towards the root until its parent is earlier. */
+static void HLEventQueueSiftUp(struct HLEventQueue *queue, int index)
+{
+    struct HLEvent *event = queue->heap[index];
+    int parent;
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+        if (queue->heap[parent]->cycle <= event->cycle) {
+            break;
+        }
+        HLEventQueuePlace(queue, queue->heap[parent], index);
+        index = parent;
+    }
+    HLEventQueuePlace(queue, event, index);
+}
+
+/** Moves the event at index down until its children are later. */
+static void HLEventQueueSiftDown(struct HLEventQueue *queue, int index)
+{
+    struct HLEvent *event = queue->heap[index];
+    int child;
+
+    while ((child = 2 * index + 1) < queue->count) {
+        if (child + 1 < queue->count
+            && queue->heap[child + 1]->cycle < queue->heap[child]->cycle) {
+            child++;
+        }
+        if (event->cycle <= queue->heap[child]->cycle) {
+            break;
+        }
+        HLEventQueuePlace(queue, queue->heap[child], index);
+        index = child;
+    }
+    HLEventQueuePlace(queue, event, index);
+}
+
+bool HLEventQueueSchedule(struct HLEventQueue *queue,
+                          struct HLEvent *event,
+                          uint64_t cycle)
+{
+    uint64_t previous = event->cycle;
+
+    if (event->index < 0) {
+        if (queue->count == HLEventQueueSize) {
+            return false;
+        }
+        event->cycle = cycle;
+        HLEventQueuePlace(queue, event, queue->count++);
+        HLEventQueueSiftUp(queue, event->index);
+        return true;
+    }
+
+    event->cycle = cycle;
+    if (cycle < previous) {
+        HLEventQueueSiftUp(queue, event->index);
+    } else {
+        HLEventQueueSiftDown(queue, event->index);
+    }
+    return true;
+}
+
+void HLEventQueueCancel(struct HLEventQueue *queue, struct HLEvent *event)
+{
+    int index = event->index;
+    struct HLEvent *last;
+
+    if (index < 0) {
+        return;
+    }
+    event->index = -1;
+
+    last = queue->heap[--queue->count];
+    if (last == event) {
+        return;
+    }
+    /* the last event takes the hole, then goes whichever way it has to */
+    HLEventQueuePlace(queue, last, index);
+    if (index > 0 && queue->heap[(index - 1) / 2]->cycle > last->cycle) {
+        HLEventQueueSiftUp(queue, index);
+    } else {
+        HLEventQueueSiftDown(queue, index);
+    }
+}
+
+struct HLEvent *HLEventQueuePopDue(struct HLEventQueue *queue,
+                                   uint64_t cycles)
+{
+    struct HLEvent *event;
+
+    if (queue->count == 0 || queue->heap[0]->cycle > cycles) {
+        return NULL;
+    }
+    event = queue->heap[0];
+    HLEventQueueCancel(queue, event);
+    return event;
+}
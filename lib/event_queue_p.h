@@ -0,0 +1,83 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_EVENT_QUEUE_P_H
+#define HALLEY_EVENT_QUEUE_P_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSystem;
+
+/*
+ * Event queue
+ *
+ * Devices that do something after some number of instructions schedule an
+ * event on the core's queue instead of being polled. HLSystemRun runs the
+ * execution engine up to the cycle the earliest event is due at, runs
+ * every event that is due, and goes on, so the engines never look at
+ * devices however many of them there are.
+ *
+ * The queue is a binary min-heap keyed on the cycle. Events live in the
+ * devices that own them and remember where they are in the heap, so
+ * moving or cancelling one doesn't have to search for it.
+ *
+ * A core's queue is only touched by the thread running the core, or by
+ * the host while the core is stopped.
+ */
+
+/** most events that can be scheduled on one core at once */
+#define HLEventQueueSize 64
+
+/** Called once the core has executed up to event->cycle. */
+typedef void (*HLEventHandler)(void *userData, struct HLSystem *core);
+
+struct HLEvent {
+    /** cycle the event is due at while it is scheduled */
+    uint64_t cycle;
+    HLEventHandler handler;
+    void *userData;
+    /** position in the heap, or -1 while not scheduled */
+    int index;
+};
+
+struct HLEventQueue {
+    struct HLEvent *heap[HLEventQueueSize];
+    int count;
+};
+
+/** The cycle the earliest event of queue is due at, or UINT64_MAX. */
+#define HLEventQueueNextCycle(queue)                                           \
+    ((queue)->count > 0 ? (queue)->heap[0]->cycle : UINT64_MAX)
+
+void HLEventInit(struct HLEvent *event, HLEventHandler handler, void *userData);
+void HLEventQueueInit(struct HLEventQueue *queue);
+
+/**
+ * Schedules event for cycle, moving it if it is already scheduled. Returns
+ * false if the queue is full.
+ */
+bool HLEventQueueSchedule(struct HLEventQueue *queue,
+                          struct HLEvent *event,
+                          uint64_t cycle);
+/** Takes event off queue if it is on it. */
+void HLEventQueueCancel(struct HLEventQueue *queue, struct HLEvent *event);
+/**
+ * Takes the earliest event off queue and returns it if it is due at or
+ * before cycles, otherwise returns NULL.
+ */
+struct HLEvent *HLEventQueuePopDue(struct HLEventQueue *queue,
+                                   uint64_t cycles);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
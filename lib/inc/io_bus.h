@@ -0,0 +1,78 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_IO_BUS_H
+#define HALLEY_IO_BUS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSystem;
+
+/*
+ * Devices on the IO port bus
+ *
+ * The out and in instructions address 65536 ports shared by every core of a
+ * system. Handlers run on the thread of the core doing the access, and that
+ * core is passed in; on a multi-core system they may be called from several
+ * threads at once. port is the port that was accessed, not an offset into
+ * the device's range, so one set of handlers can serve several ranges.
+ */
+
+typedef uint64_t (*HLPortReadHandler)(void *userData,
+                                      struct HLSystem *core,
+                                      uint16_t port);
+typedef void (*HLPortWriteHandler)(void *userData,
+                                   struct HLSystem *core,
+                                   uint16_t port,
+                                   uint64_t value);
+/** values holds count writes to port, oldest first. */
+typedef void (*HLPortWriteBatchHandler)(void *userData,
+                                        struct HLSystem *core,
+                                        uint16_t port,
+                                        const uint64_t *values,
+                                        uint32_t count);
+
+struct HLPortDevice {
+    /** NULL reads as zero */
+    HLPortReadHandler read;
+    /** NULL ignores writes */
+    HLPortWriteHandler write;
+    /**
+     * If set, writes to the device are posted: a core collects consecutive
+     * writes to the same port and hands them over in one call instead of
+     * calling write. They are delivered in order, and no later than the
+     * core's next access to another port, its next read, or the end of its
+     * HLSystemRun.
+     */
+    HLPortWriteBatchHandler writeBatch;
+    void *userData;
+};
+
+/**
+ * Attaches a copy of device to the ports [first, first + count). Fails if
+ * any of them already has a device, the range runs past the last port, or
+ * the system has no room for another device. The system must not be
+ * running.
+ */
+bool HLSystemAttachPortDevice(struct HLSystem *system,
+                              uint32_t first,
+                              uint32_t count,
+                              const struct HLPortDevice *device);
+/** Detaches whatever device answers to the ports [first, first + count). */
+void HLSystemDetachPortDevice(struct HLSystem *system,
+                              uint32_t first,
+                              uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
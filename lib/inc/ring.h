@@ -0,0 +1,120 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_RING_H
+#define HALLEY_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSystem;
+
+/*
+ * Ring devices
+ *
+ * A ring moves buffers between the guest and the embedder without a port
+ * access per word. The guest keeps two tables in its physical memory: the
+ * descriptor table, with an HLRingDescriptor per buffer, and the completion
+ * table, with an HLRingCompletion per buffer the host is done with. Both
+ * have the same power of two number of entries and are indexed by counters
+ * that only ever go up, modulo the table size.
+ *
+ * The guest fills in descriptors and then writes the count of descriptors
+ * it has published so far to the doorbell port. A host thread hands every
+ * new buffer to the embedder's handler, in order, writes a completion for
+ * each, and raises the ring's interrupt on the core that rang the doorbell
+ * once the batch is done. The used port reads the count of completions
+ * written so far. The guest must leave a buffer alone between publishing
+ * it and seeing its completion, and must not publish more than the table
+ * size ahead of the used count.
+ *
+ * Tables and buffers are little endian, and addresses are physical.
+ */
+
+/** ports of a ring, relative to where it was attached */
+typedef uint8_t HLRingPort;
+enum {
+    /** physical address of the descriptor table, 16 byte aligned */
+    HLRingPortDescriptors,
+    /** physical address of the completion table, 16 byte aligned */
+    HLRingPortCompletions,
+    /** entries in each table, a power of two up to 65536; 0 turns it off */
+    HLRingPortSize,
+    /** interrupt raised after a batch; none if above 255 */
+    HLRingPortVector,
+    /** descriptors published; reads return what the host has seen */
+    HLRingPortDoorbell,
+    /** completions written; read only */
+    HLRingPortUsed,
+    HLRingNPorts,
+};
+
+/* Only the doorbell may be written while a batch is running. */
+
+/** bits of HLRingDescriptor.flags */
+enum {
+    /** the host fills the buffer in rather than reading it */
+    HLRingDescriptorHostWrites = 0x1,
+};
+
+struct HLRingDescriptor {
+    uint64_t address;
+    uint32_t length;
+    uint32_t flags;
+};
+
+typedef uint32_t HLRingStatus;
+enum {
+    HLRingStatusOK,
+    /** the buffer wasn't entirely in physical memory and was skipped */
+    HLRingStatusFault,
+};
+
+struct HLRingCompletion {
+    /** the descriptor count when the buffer was published, i.e. its index */
+    uint32_t index;
+    HLRingStatus status;
+    /** what the handler returned */
+    uint64_t result;
+};
+
+/** A guest buffer as the handler sees it. */
+struct HLRingBuffer {
+    /** host view of the buffer */
+    uint8_t *data;
+    uint64_t address;
+    uint32_t length;
+    uint32_t flags;
+};
+
+/**
+ * Called on the ring's thread for each buffer. The return value goes into
+ * the buffer's completion; for buffers the host writes, it is usually the
+ * number of bytes filled in.
+ */
+typedef uint64_t (*HLRingHandler)(void *userData,
+                                  struct HLSystem *system,
+                                  const struct HLRingBuffer *buffer);
+
+/**
+ * Attaches a ring whose HLRingNPorts ports start at port, handing buffers
+ * to handler. Fails if any of the ports are taken. The system must not be
+ * running. The ring lives as long as the system.
+ */
+bool HLSystemAttachRing(struct HLSystem *system,
+                        uint32_t port,
+                        HLRingHandler handler,
+                        void *userData);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
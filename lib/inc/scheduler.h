@@ -0,0 +1,83 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_SCHEDULER_H
+#define HALLEY_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "system.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLScheduler;
+struct HLMemoryAllocation;
+
+typedef uint8_t HLGuestState;
+
+enum {
+    /** queued for or currently running on a worker thread */
+    HLGuestRunnable,
+    /** parked until HLSchedulerResume, e.g. while the embedder services IO
+     *  or a breakpoint
+     */
+    HLGuestWaiting,
+    /** the guest halted or faulted and will not run again */
+    HLGuestHalted,
+};
+
+struct HLSchedulerStatistics {
+    /** guest instructions executed across all workers and guest cores */
+    uint64_t cycles;
+    /** calls to HLSystemRunCores made by workers */
+    uint64_t slices;
+    /** slices a worker took from another worker's queue */
+    uint64_t steals;
+};
+
+/**
+ * Starts threadCount worker threads that run up to maxGuests systems in
+ * slices of sliceCycles instructions each. Returns false and leaves
+ * *scheduler NULL if the scheduler couldn't be allocated or not every worker
+ * could be started.
+ */
+bool HLSchedulerInit(struct HLScheduler **scheduler,
+                     struct HLMemoryAllocation *alloc,
+                     int threadCount,
+                     int maxGuests,
+                     uint64_t sliceCycles);
+/** Stops the workers and frees the scheduler and every guest system. */
+void HLSchedulerDone(struct HLScheduler **scheduler);
+
+/**
+ * Hands system over to the scheduler and makes it runnable. Returns the
+ * guest's index, or -1 if the scheduler is full.
+ */
+int HLSchedulerAdd(struct HLScheduler *scheduler, struct HLSystem *system);
+
+HLGuestState HLSchedulerGuestState(struct HLScheduler *scheduler, int guest);
+/** Why the guest's most recent slice ended. */
+HLStopReason HLSchedulerGuestStopReason(struct HLScheduler *scheduler,
+                                        int guest);
+/** Parks a runnable guest once its current slice ends. */
+void HLSchedulerSuspend(struct HLScheduler *scheduler, int guest);
+/** Makes a waiting guest runnable again. */
+void HLSchedulerResume(struct HLScheduler *scheduler, int guest);
+
+/** Blocks until no guest is runnable. */
+void HLSchedulerWait(struct HLScheduler *scheduler);
+
+void HLSchedulerGetStatistics(struct HLScheduler *scheduler,
+                              struct HLSchedulerStatistics *statistics);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
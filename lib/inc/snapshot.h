@@ -0,0 +1,69 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_SNAPSHOT_H
+#define HALLEY_SNAPSHOT_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSnapshot;
+struct HLSystem;
+struct HLMemoryAllocation;
+
+/**
+ * Captures the architectural state of every core of system, including its
+ * timer, along with its physical memory. The snapshot is independent of system afterwards, and
+ * system must not be running while this is called. Memory is copied once
+ * here, skipping zero pages, so that forks don't have to.
+ */
+bool HLSnapshotCreate(struct HLSnapshot **snapshot, struct HLSystem *system);
+void HLSnapshotDone(struct HLSnapshot **snapshot);
+
+/**
+ * Creates a system in the state snapshot was taken in. Its physical memory
+ * is a copy-on-write mapping of the snapshot's, so this costs the same
+ * for any memory size, and pages are only copied as the new system writes
+ * to them. Caches start out cold.
+ */
+bool HLSnapshotFork(struct HLSnapshot *snapshot,
+                    struct HLSystem **system,
+                    struct HLMemoryAllocation *alloc);
+
+/**
+ * Writes a full snapshot of system to path, replacing any file there only
+ * once the new one is complete. Only non-zero pages are stored.
+ */
+bool HLSnapshotWriteFile(struct HLSystem *system, const char *path);
+/**
+ * Appends the current state of system to the snapshot file at path,
+ * storing only the pages that differ from what the file already holds.
+ * Writes a full snapshot if there is no file at path yet.
+ *
+ * While system tracks dirty pages, writing a snapshot file takes them, and
+ * a checkpoint only looks at the pages that are dirty. So checkpoints have
+ * to go to the file written last, and nothing else may take dirty pages
+ * in between.
+ */
+bool HLSnapshotCheckpointFile(struct HLSystem *system, const char *path);
+/**
+ * Creates a system in the state of the latest checkpoint in the snapshot
+ * file at path. Stored pages are mapped copy-on-write rather than read,
+ * so restoring takes time in proportion to the runs of stored pages, not
+ * the size of guest memory.
+ */
+bool HLSnapshotRestoreFile(struct HLSystem **system,
+                           struct HLMemoryAllocation *alloc,
+                           const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
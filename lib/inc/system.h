@@ -7,6 +7,9 @@
 #ifndef HALLEY_CPU_H
 #define HALLEY_CPU_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,10 +17,126 @@ extern "C" {
 struct HLSystem;
 struct HLMemoryAllocation;
 
+typedef uint8_t HLExecutionEngine;
+
+enum {
+    /** decodes each instruction once and dispatches on every instruction */
+    HLExecutionEngineInterpreter,
+    /** translates straight-line runs of code into blocks, each of which
+     *  remembers the blocks that followed it
+     */
+    HLExecutionEngineBlocks,
+    /** compiles hot blocks to native code; the same as
+     *  HLExecutionEngineBlocks on hosts without a JIT
+     */
+    HLExecutionEngineJIT,
+};
+
+typedef uint8_t HLStopReason;
+
+enum {
+    /** the cycle budget given to HLSystemRun ran out */
+    HLStopBudgetExhausted,
+    /** the guest asked to stop, e.g. through int 254 or int 255 */
+    HLStopHalted,
+    /**
+     * an interrupt or fault had no handler to go to, or an instruction
+     * faulted while an interrupt was in service; IP points at the
+     * instruction that faulted
+     */
+    HLStopFault,
+    /** the guest executed int with HLInterruptBreakpoint */
+    HLStopBreakpoint,
+};
+
+/** Sets *system to NULL if the system couldn't be allocated. */
 void HLSystemInit(struct HLSystem **system, struct HLMemoryAllocation *alloc);
+void HLSystemInitWithEngine(struct HLSystem **system,
+                            struct HLMemoryAllocation *alloc,
+                            HLExecutionEngine engine);
 void HLSystemExec(struct HLSystem *system);
+/**
+ * Executes at most cycles instructions and returns why execution stopped.
+ * Execution can be resumed by calling HLSystemRun again.
+ */
+HLStopReason HLSystemRun(struct HLSystem *system, uint64_t cycles);
 void HLSystemDone(struct HLSystem **system);
 int HLSystemTestCode(struct HLSystem *system);
+/**
+ * Gives system size bytes of zeroed physical memory that it owns. Host
+ * memory is only committed for pages the guest touches, so reserving far
+ * more than the guest will use is cheap. size must be a multiple of the
+ * 16 KiB page size.
+ */
+bool HLSystemReservePhysicalMemory(struct HLSystem *system, uint64_t size);
+/**
+ * Maps the file at path copy-on-write into reserved physical memory at
+ * address, which must be page aligned. Pages of the image are read from
+ * the file as the guest touches them, and guest writes never reach it.
+ */
+bool HLSystemMapImage(struct HLSystem *system,
+                      const char *path,
+                      uint64_t address);
+/**
+ * Hands the page aligned range [address, address + size) of reserved
+ * physical memory back to the host. It reads as zero afterwards.
+ */
+bool HLSystemReleasePhysicalMemory(struct HLSystem *system,
+                                   uint64_t address,
+                                   uint64_t size);
+/**
+ * Turns dirty page tracking on or off. While it is on, every physical write
+ * marks the 16 KiB page it lands on dirty, as does replacing memory with
+ * the functions above. Tracking starts out with every page dirty, since
+ * nothing is known about what changed before. Returns false if there was
+ * no memory for the bitmap, in which case untracked pages read as dirty.
+ */
+bool HLSystemTrackDirtyPages(struct HLSystem *system, bool track);
+/**
+ * Moves the dirty bits of the first pageCount physical pages into dirty,
+ * one bit per page starting from the low bit of dirty[0], and marks those
+ * pages clean. Returns the number of dirty pages. Nothing is dirty while
+ * tracking is off.
+ */
+uint64_t HLSystemTakeDirtyPages(struct HLSystem *system,
+                                uint64_t *dirty,
+                                uint64_t pageCount);
+
+/** Why the last HLSystemRun on system returned. */
+HLStopReason HLSystemStopReason(struct HLSystem *system);
+
+/**
+ * Gives system count cores sharing its physical memory, each with its own
+ * registers, interrupt controller, TLB and execution engine caches. Cores
+ * start with zeroed registers, so they start at address 0 like core 0.
+ * Can only be called once. Returns count, or 1 if not every core could be
+ * set up, in which case the system is left with just its original core.
+ */
+uint32_t HLSystemSetCoreCount(struct HLSystem *system, uint32_t count);
+uint32_t HLSystemCoreCount(struct HLSystem *system);
+/**
+ * Returns core index of system; core 0 is system itself. Individual cores
+ * can be inspected, or run with HLSystemRun while no other core runs.
+ */
+struct HLSystem *HLSystemCore(struct HLSystem *system, uint32_t index);
+/**
+ * Runs every core in parallel, each on its own host thread, for at most
+ * cycles instructions each. Returns HLStopBudgetExhausted if every core
+ * used up its budget, otherwise why the lowest numbered core that stopped
+ * early did so.
+ *
+ * Aligned stores by one core are atomic with respect to the others, but
+ * are not ordered. Code written by one core is seen by the others from
+ * their next block, or once they read a port.
+ */
+HLStopReason HLSystemRunCores(struct HLSystem *system, uint64_t cycles);
+/**
+ * Raises interrupt on core. Safe to call from any thread, including other
+ * cores' devices, which is how inter-processor interrupts are delivered.
+ * It never blocks: a running core picks the interrupt up before its next
+ * block, and one that isn't running at its next HLSystemRun.
+ */
+void HLSystemRaiseInterrupt(struct HLSystem *core, uint8_t interrupt);
 
 #ifdef __cplusplus
 }
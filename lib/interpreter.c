@@ -0,0 +1,1057 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <stddef.h>
+
+#include "interpreter_p.h"
+#include "io_bus_p.h"
+#include "system_p.h"
+#include "thread_p.h"
+
+/*
+ * Operation handlers. There is one HLExec_<mnemonic> for every instruction
+ * in instructions.h; both dispatch engines below are generated from that
+ * list, so an instruction without a handler fails to compile.
+ */
+
+/** Faults on the instruction, which has already moved IP past itself. */
+static void HLExecFault(struct HLSystem *system, HLInterrupt interrupt)
+{
+    system->cpu.registers[HLRegIP] -= 4;
+    HLSystemFault(system, interrupt);
+}
+
+static void HLExecUnknown(struct HLSystem *system,
+                          const struct HLDecodedInstruction *instruction)
+{
+    HLExecFault(system, HLInterruptInvalidOperation);
+}
+
+/** Whether the core is in user mode, where system control is off limits. */
+#define HLUserMode(system)                                                     \
+    ((system)->cpu.registers[HLRegStatus] & HLFlag(HLFlagMode))
+
+/*
+ * Register access. Reading Status brings deferred flags into it first.
+ * Writes to RZ are dropped by zeroing it again afterwards, and writes to
+ * Status replace deferred flags but never switch modes; only usr,
+ * interrupts and iret do that.
+ */
+
+static uint64_t HLReadRegister(struct HLSystem *system, uint8_t reg)
+{
+    if (HLUnlikely(reg == HLRegStatus)) {
+        return HLSystemStatus(system);
+    }
+    return system->cpu.registers[reg];
+}
+
+static void HLWriteRegister(struct HLSystem *system, uint8_t reg, uint64_t value)
+{
+    uint64_t *registers = system->cpu.registers;
+
+    if (HLUnlikely(reg == HLRegStatus)) {
+        system->cpu.flagsKind = HLLazyFlagsNone;
+        value = (value & ~HLFlag(HLFlagMode))
+                | (registers[HLRegStatus] & HLFlag(HLFlagMode));
+    }
+    registers[reg] = value;
+    registers[HLRegRZ] = 0;
+}
+
+/*
+ * Flags. Flag-setting instructions only record their operands; the flags
+ * are worked out by HLSystemMaterializeFlags once something reads Status.
+ */
+
+/** Status bits HLLazyFlagsCompare sets; the others leave them alone. */
+#define HLCompareFlags                                                         \
+    (HLFlag(HLFlagEqual) | HLFlag(HLFlagLess) | HLFlag(HLFlagLessUnsigned)     \
+     | HLFlag(HLFlagZero))
+/** Status bits HLLazyFlagsAdd and HLLazyFlagsSubtract set. */
+#define HLArithmeticFlags                                                      \
+    (HLFlag(HLFlagSign) | HLFlag(HLFlagZero) | HLFlag(HLFlagCarryBorrow)       \
+     | HLFlag(HLFlagCarryBorrowUnsigned))
+
+void HLSystemMaterializeFlags(struct HLSystem *system)
+{
+    struct HLCPUCore *cpu = &system->cpu;
+    uint64_t a = cpu->flagsA;
+    uint64_t b = cpu->flagsB;
+    uint64_t result = cpu->flagsResult;
+    uint64_t flags = 0;
+    uint64_t defined;
+
+    switch (cpu->flagsKind) {
+    case HLLazyFlagsCompare:
+        defined = HLCompareFlags;
+        if (a == b) {
+            flags |= HLFlag(HLFlagEqual) | HLFlag(HLFlagZero);
+        }
+        if ((int64_t)a < (int64_t)b) {
+            flags |= HLFlag(HLFlagLess);
+        }
+        if (a < b) {
+            flags |= HLFlag(HLFlagLessUnsigned);
+        }
+        break;
+    case HLLazyFlagsAdd:
+    case HLLazyFlagsSubtract:
+        defined = HLArithmeticFlags;
+        if (result >> 63) {
+            flags |= HLFlag(HLFlagSign);
+        }
+        if (result == 0) {
+            flags |= HLFlag(HLFlagZero);
+        }
+        if (cpu->flagsKind == HLLazyFlagsAdd) {
+            /* overflow if both operands have the sign the result lacks */
+            if ((~(a ^ b) & (a ^ result)) >> 63) {
+                flags |= HLFlag(HLFlagCarryBorrow);
+            }
+            if (result < a) {
+                flags |= HLFlag(HLFlagCarryBorrowUnsigned);
+            }
+        } else {
+            if (((a ^ b) & (a ^ result)) >> 63) {
+                flags |= HLFlag(HLFlagCarryBorrow);
+            }
+            if (a < b) {
+                flags |= HLFlag(HLFlagCarryBorrowUnsigned);
+            }
+        }
+        break;
+    default:
+        return;
+    }
+
+    cpu->registers[HLRegStatus] =
+        (cpu->registers[HLRegStatus] & ~defined) | flags;
+    cpu->flagsKind = HLLazyFlagsNone;
+}
+
+static void HLSetFlags(struct HLSystem *system,
+                       HLLazyFlags kind,
+                       uint64_t a,
+                       uint64_t b,
+                       uint64_t result)
+{
+    struct HLCPUCore *cpu = &system->cpu;
+
+    /* bits the deferred flags set and these don't mustn't be lost */
+    if (HLUnlikely(cpu->flagsKind != HLLazyFlagsNone
+                   && (cpu->flagsKind == HLLazyFlagsCompare)
+                          != (kind == HLLazyFlagsCompare))) {
+        HLSystemMaterializeFlags(system);
+    }
+    cpu->flagsKind = kind;
+    cpu->flagsA = a;
+    cpu->flagsB = b;
+    cpu->flagsResult = result;
+}
+
+/*
+ * Memory access for loads, stores and the stack, through the MMU in user
+ * mode. In kernel mode an aligned access inside physical memory is done
+ * inline; HLCPUCore.physicalLimit folds the mode into that one bounds
+ * check. In user mode so is one whose page the translation cache has a
+ * host pointer for. A failed access faults on the instruction, so it can
+ * be retried.
+ */
+
+#define HLMemoryAccessors(size, shift)                                         \
+    static bool HLLoad##size(struct HLSystem *system,                          \
+                             uint64_t address,                                 \
+                             uint##size##_t *value)                            \
+    {                                                                          \
+        struct HLMemoryManagementUnit *mmu = &system->memory;                  \
+        HLMemoryResult result = HLMemoryResultOK;                              \
+        uint8_t *host;                                                         \
+                                                                               \
+        if (HLMemoryManagementUnitInBounds(                                    \
+                address, shift, system->cpu.physicalLimit)) {                  \
+            *value = HLMemoryManagementUnitLoad(mmu->memory, size, address);   \
+            return true;                                                       \
+        }                                                                      \
+        if (HLUserMode(system)) {                                              \
+            HLMemoryManagementUnitHostAddress(                                 \
+                mmu, address, size, HLMemoryPermissionRead, host);             \
+            if (host != NULL) {                                                \
+                *value = HLMemoryManagementUnitLoad(host, size, 0);            \
+                return true;                                                   \
+            }                                                                  \
+            *value = HLMemoryManagementUnitReadVirtualUInt##size(              \
+                mmu, address, &result);                                        \
+        } else {                                                               \
+            *value = HLMemoryManagementUnitReadPhysicalUInt##size(             \
+                mmu, address, &result);                                        \
+        }                                                                      \
+        if (HLUnlikely(result != HLMemoryResultOK)) {                          \
+            system->cpu.registers[HLRegIP] -= 4;                               \
+            HLSystemMemoryFault(system, result);                               \
+            return false;                                                      \
+        }                                                                      \
+        return true;                                                           \
+    }                                                                          \
+                                                                               \
+    static bool HLStore##size(struct HLSystem *system,                         \
+                              uint64_t address,                                \
+                              uint##size##_t value)                            \
+    {                                                                          \
+        struct HLMemoryManagementUnit *mmu = &system->memory;                  \
+        HLMemoryResult result = HLMemoryResultOK;                              \
+        uint8_t *host;                                                         \
+                                                                               \
+        if (HLMemoryManagementUnitInBounds(                                    \
+                address, shift, system->cpu.physicalLimit)) {                  \
+            HLMemoryManagementUnitStore(mmu->memory, size, address, value);    \
+            HLMemoryManagementUnitMarkDirty(mmu, address)                      \
+            HLMemoryManagementUnitNotifyCodeWrite(mmu, address, size)          \
+            return true;                                                       \
+        }                                                                      \
+        if (HLUserMode(system)) {                                              \
+            HLMemoryManagementUnitHostAddress(                                 \
+                mmu, address, size, HLMemoryPermissionWrite, host);            \
+            if (host != NULL) {                                                \
+                HLMemoryManagementUnitStore(host, size, 0, value);             \
+                address = (uint64_t)(host - mmu->memory);                      \
+                HLMemoryManagementUnitMarkDirty(mmu, address)                  \
+                HLMemoryManagementUnitNotifyCodeWrite(mmu, address, size)      \
+                return true;                                                   \
+            }                                                                  \
+            HLMemoryManagementUnitWriteVirtualUInt##size(                      \
+                mmu, address, value, &result);                                 \
+        } else {                                                               \
+            HLMemoryManagementUnitWritePhysicalUInt##size(                     \
+                mmu, address, value, &result);                                 \
+        }                                                                      \
+        if (HLUnlikely(result != HLMemoryResultOK)) {                          \
+            system->cpu.registers[HLRegIP] -= 4;                               \
+            HLSystemMemoryFault(system, result);                               \
+            return false;                                                      \
+        }                                                                      \
+        return true;                                                           \
+    }
+
+HLMemoryAccessors(8, 0)
+HLMemoryAccessors(16, 1)
+HLMemoryAccessors(32, 2)
+HLMemoryAccessors(64, 3)
+
+#undef HLMemoryAccessors
+
+/** The stack grows down, with SP pointing at the last value pushed. */
+static bool HLPush(struct HLSystem *system, uint64_t value)
+{
+    uint64_t sp = system->cpu.registers[HLRegSP] - 8;
+
+    if (!HLStore64(system, sp, value)) {
+        return false;
+    }
+    system->cpu.registers[HLRegSP] = sp;
+    return true;
+}
+
+static bool HLPop(struct HLSystem *system, uint64_t *value)
+{
+    uint64_t sp = system->cpu.registers[HLRegSP];
+
+    if (!HLLoad64(system, sp, value)) {
+        return false;
+    }
+    system->cpu.registers[HLRegSP] = sp + 8;
+    return true;
+}
+
+/* 3.1 System control instructions */
+
+static void HLExec_int(struct HLSystem *system,
+                       const struct HLDecodedInstruction *instruction)
+{
+    if ((uint16_t)instruction->imm == 255) {
+        system->testCode = 1;
+        HLSystemStop(system, HLStopHalted);
+        return;
+    }
+    if ((uint16_t)instruction->imm == 254) {
+        system->testCode = 0;
+        HLSystemStop(system, HLStopHalted);
+        return;
+    }
+    if ((uint16_t)instruction->imm == HLInterruptBreakpoint) {
+        HLSystemStop(system, HLStopBreakpoint);
+        return;
+    }
+    if ((uint16_t)instruction->imm > 255) {
+        HLExecFault(system, HLInterruptInvalidOperation);
+        return;
+    }
+    HLSystemInterrupt(system, (HLInterrupt)instruction->imm);
+}
+
+static void HLExec_iret(struct HLSystem *system,
+                        const struct HLDecodedInstruction *instruction)
+{
+    if (HLUserMode(system)) {
+        HLExecFault(system, HLInterruptInvalidOperation);
+        return;
+    }
+    HLSystemReturnFromInterrupt(system);
+}
+
+static void HLExec_ires(struct HLSystem *system,
+                        const struct HLDecodedInstruction *instruction)
+{
+    if (HLUserMode(system)) {
+        HLExecFault(system, HLInterruptInvalidOperation);
+        return;
+    }
+    HLSystemResolveInterrupt(system);
+}
+
+static void HLExec_usr(struct HLSystem *system,
+                       const struct HLDecodedInstruction *instruction)
+{
+    uint64_t target = HLReadRegister(system, instruction->rde);
+
+    if (HLUserMode(system)) {
+        HLExecFault(system, HLInterruptInvalidOperation);
+        return;
+    }
+    system->cpu.registers[HLRegStatus] |= HLFlag(HLFlagMode);
+    system->cpu.registers[HLRegIP] = target;
+    HLSystemModeChanged(system);
+}
+
+/* 3.2 IO instructions */
+
+static void HLExec_outr(struct HLSystem *system,
+                        const struct HLDecodedInstruction *instruction)
+{
+    if (HLUserMode(system)) {
+        HLExecFault(system, HLInterruptInvalidOperation);
+        return;
+    }
+    HLSystemPortWrite(system,
+                      HLReadRegister(system, instruction->rde),
+                      HLReadRegister(system, instruction->rs1));
+}
+
+static void HLExec_outi(struct HLSystem *system,
+                        const struct HLDecodedInstruction *instruction)
+{
+    if (HLUserMode(system)) {
+        HLExecFault(system, HLInterruptInvalidOperation);
+        return;
+    }
+    HLSystemPortWrite(system,
+                      (uint16_t)instruction->imm,
+                      HLReadRegister(system, instruction->rs1));
+}
+
+static void HLExec_inr(struct HLSystem *system,
+                       const struct HLDecodedInstruction *instruction)
+{
+    uint64_t value;
+
+    if (HLUserMode(system)) {
+        HLExecFault(system, HLInterruptInvalidOperation);
+        return;
+    }
+    value = HLSystemPortRead(system, HLReadRegister(system, instruction->rs1));
+    HLWriteRegister(system, instruction->rde, value);
+}
+
+static void HLExec_ini(struct HLSystem *system,
+                       const struct HLDecodedInstruction *instruction)
+{
+    uint64_t value;
+
+    if (HLUserMode(system)) {
+        HLExecFault(system, HLInterruptInvalidOperation);
+        return;
+    }
+    value = HLSystemPortRead(system, (uint16_t)instruction->imm);
+    HLWriteRegister(system, instruction->rde, value);
+}
+
+/* 3.3 Control flow instructions */
+
+static void HLExec_jal(struct HLSystem *system,
+                       const struct HLDecodedInstruction *instruction)
+{
+    uint64_t target = HLReadRegister(system, instruction->rs1)
+                      + 4 * (uint64_t)instruction->imm;
+
+    if (HLPush(system, system->cpu.registers[HLRegIP])) {
+        system->cpu.registers[HLRegIP] = target;
+    }
+}
+
+static void HLExec_jalr(struct HLSystem *system,
+                        const struct HLDecodedInstruction *instruction)
+{
+    uint64_t target = HLReadRegister(system, instruction->rs1)
+                      + 4 * (uint64_t)instruction->imm;
+
+    HLWriteRegister(system, instruction->rde, system->cpu.registers[HLRegIP]);
+    system->cpu.registers[HLRegIP] = target;
+}
+
+static void HLExec_ret(struct HLSystem *system,
+                       const struct HLDecodedInstruction *instruction)
+{
+    uint64_t target;
+
+    if (HLPop(system, &target)) {
+        system->cpu.registers[HLRegIP] = target;
+    }
+}
+
+static void HLExec_retr(struct HLSystem *system,
+                        const struct HLDecodedInstruction *instruction)
+{
+    system->cpu.registers[HLRegIP] = HLReadRegister(system, instruction->rs1);
+}
+
+/* 3.3.1 Branch instructions; each reads the flags it tests from Status */
+
+static void HLExec_bra(struct HLSystem *system,
+                       const struct HLDecodedInstruction *instruction)
+{
+    system->cpu.registers[HLRegIP] += 4 * instruction->imm;
+}
+
+#define HLBranchOperation(mnemonic, taken)                                     \
+    static void HLExec_##mnemonic(                                             \
+        struct HLSystem *system,                                               \
+        const struct HLDecodedInstruction *instruction)                        \
+    {                                                                          \
+        uint64_t status = HLSystemStatus(system);                              \
+                                                                               \
+        if (taken) {                                                           \
+            system->cpu.registers[HLRegIP] += 4 * instruction->imm;            \
+        }                                                                      \
+    }
+
+#define HLSet(flag) (status & HLFlag(flag))
+
+HLBranchOperation(beq, HLSet(HLFlagEqual))
+HLBranchOperation(bez, HLSet(HLFlagZero))
+HLBranchOperation(blt, HLSet(HLFlagLess))
+HLBranchOperation(ble, HLSet(HLFlagLess) || HLSet(HLFlagEqual))
+HLBranchOperation(bltu, HLSet(HLFlagLessUnsigned))
+HLBranchOperation(bleu, HLSet(HLFlagLessUnsigned) || HLSet(HLFlagEqual))
+HLBranchOperation(bne, !HLSet(HLFlagEqual))
+HLBranchOperation(bnz, !HLSet(HLFlagZero))
+HLBranchOperation(bge, !HLSet(HLFlagLess))
+HLBranchOperation(bgt, !HLSet(HLFlagLess) && !HLSet(HLFlagEqual))
+HLBranchOperation(bgeu, !HLSet(HLFlagLessUnsigned))
+HLBranchOperation(bgtu, !HLSet(HLFlagLessUnsigned) && !HLSet(HLFlagEqual))
+
+#undef HLSet
+#undef HLBranchOperation
+
+/* 3.4 Stack operations */
+
+static void HLExec_push(struct HLSystem *system,
+                        const struct HLDecodedInstruction *instruction)
+{
+    HLPush(system, HLReadRegister(system, instruction->rs1));
+}
+
+static void HLExec_pop(struct HLSystem *system,
+                       const struct HLDecodedInstruction *instruction)
+{
+    uint64_t value;
+
+    if (HLPop(system, &value)) {
+        HLWriteRegister(system, instruction->rde, value);
+    }
+}
+
+static void HLExec_enter(struct HLSystem *system,
+                         const struct HLDecodedInstruction *instruction)
+{
+    if (HLPush(system, system->cpu.registers[HLRegFP])) {
+        system->cpu.registers[HLRegFP] = system->cpu.registers[HLRegSP];
+    }
+}
+
+static void HLExec_leave(struct HLSystem *system,
+                         const struct HLDecodedInstruction *instruction)
+{
+    uint64_t fp = system->cpu.registers[HLRegFP];
+    uint64_t value;
+
+    if (HLLoad64(system, fp, &value)) {
+        system->cpu.registers[HLRegSP] = fp + 8;
+        system->cpu.registers[HLRegFP] = value;
+    }
+}
+
+/* 3.5 Data flow */
+
+/** Replaces the 16 bits of rde at shift with the unextended immediate. */
+#define HLLoadImmediateOperation(mnemonic, shift)                              \
+    static void HLExec_##mnemonic(                                             \
+        struct HLSystem *system,                                               \
+        const struct HLDecodedInstruction *instruction)                        \
+    {                                                                          \
+        uint64_t value = HLReadRegister(system, instruction->rde);             \
+                                                                               \
+        value &= ~((uint64_t)0xFFFF << (shift));                               \
+        value |= (uint64_t)(uint16_t)instruction->imm << (shift);              \
+        HLWriteRegister(system, instruction->rde, value);                      \
+    }
+
+/** Sets rde to the sign-extended immediate shifted left by shift. */
+#define HLLoadSignedImmediateOperation(mnemonic, shift)                        \
+    static void HLExec_##mnemonic(                                             \
+        struct HLSystem *system,                                               \
+        const struct HLDecodedInstruction *instruction)                        \
+    {                                                                          \
+        HLWriteRegister(system,                                                \
+                        instruction->rde,                                      \
+                        (uint64_t)instruction->imm << (shift));                \
+    }
+
+HLLoadImmediateOperation(lli, 0)
+HLLoadImmediateOperation(lui, 16)
+HLLoadImmediateOperation(lti, 32)
+HLLoadImmediateOperation(ltui, 48)
+HLLoadSignedImmediateOperation(llis, 0)
+HLLoadSignedImmediateOperation(luis, 16)
+HLLoadSignedImmediateOperation(ltis, 32)
+HLLoadSignedImmediateOperation(ltuis, 48)
+
+#undef HLLoadImmediateOperation
+#undef HLLoadSignedImmediateOperation
+
+/** rs1 + size * imm + (rs2 << func), with size the width in bytes */
+#define HLEffectiveAddress(system, instruction, size)                          \
+    (HLReadRegister(system, (instruction)->rs1)                                \
+     + (size) * (uint64_t)(instruction)->imm                                   \
+     + (HLReadRegister(system, (instruction)->rs2) << (instruction)->func))
+
+/** Loads into rde, zero-extended, or sign-extended if it's signed. */
+#define HLLoadOperation(mnemonic, size, extend)                                \
+    static void HLExec_##mnemonic(                                             \
+        struct HLSystem *system,                                               \
+        const struct HLDecodedInstruction *instruction)                        \
+    {                                                                          \
+        uint##size##_t value;                                                  \
+                                                                               \
+        if (HLLoad##size(system,                                               \
+                         HLEffectiveAddress(system, instruction, size / 8),    \
+                         &value)) {                                            \
+            HLWriteRegister(system, instruction->rde, extend(value, size));    \
+        }                                                                      \
+    }
+
+#define HLZeroExtend(value, bits) ((uint64_t)(value))
+#define HLSignExtend(value, bits) ((uint64_t)HLSignExtend64(value, bits))
+
+HLLoadOperation(lw, 64, HLZeroExtend)
+HLLoadOperation(lh, 32, HLZeroExtend)
+HLLoadOperation(lhs, 32, HLSignExtend)
+HLLoadOperation(lq, 16, HLZeroExtend)
+HLLoadOperation(lqs, 16, HLSignExtend)
+HLLoadOperation(lb, 8, HLZeroExtend)
+HLLoadOperation(lbs, 8, HLSignExtend)
+
+#undef HLZeroExtend
+#undef HLSignExtend
+#undef HLLoadOperation
+
+/** Stores the low size bits of rde. */
+#define HLStoreOperation(mnemonic, size)                                       \
+    static void HLExec_##mnemonic(                                             \
+        struct HLSystem *system,                                               \
+        const struct HLDecodedInstruction *instruction)                        \
+    {                                                                          \
+        HLStore##size(system,                                                  \
+                      HLEffectiveAddress(system, instruction, size / 8),       \
+                      (uint##size##_t)HLReadRegister(system,                   \
+                                                     instruction->rde));       \
+    }
+
+HLStoreOperation(sw, 64)
+HLStoreOperation(sh, 32)
+HLStoreOperation(sq, 16)
+HLStoreOperation(sb, 8)
+
+#undef HLStoreOperation
+#undef HLEffectiveAddress
+
+/* 3.6 Comparisons */
+
+/** The M format has no rs2, so rde holds the first operand. */
+static void HLExec_cmpr(struct HLSystem *system,
+                        const struct HLDecodedInstruction *instruction)
+{
+    HLSetFlags(system,
+               HLLazyFlagsCompare,
+               HLReadRegister(system, instruction->rde),
+               HLReadRegister(system, instruction->rs1),
+               0);
+}
+
+/** rde holds the function: 0 compares rs1 with imm, 1 imm with rs1. */
+static void HLExec_cmpi(struct HLSystem *system,
+                        const struct HLDecodedInstruction *instruction)
+{
+    uint64_t value = HLReadRegister(system, instruction->rs1);
+
+    switch (instruction->rde) {
+    case 0:
+        HLSetFlags(system,
+                   HLLazyFlagsCompare,
+                   value,
+                   (uint64_t)instruction->imm,
+                   0);
+        break;
+    case 1:
+        HLSetFlags(system,
+                   HLLazyFlagsCompare,
+                   (uint64_t)instruction->imm,
+                   value,
+                   0);
+        break;
+    default:
+        HLExecFault(system, HLInterruptInvalidOperation);
+        break;
+    }
+}
+
+/*
+ * 3.7 Arithmetic and 3.8 bitwise operations. Each comes in a register
+ * form, on rs1 and rs2, and an immediate form, on rs1 and imm; only
+ * addition and subtraction set flags.
+ */
+
+#define HLSecondOperand_r(system, instruction)                                 \
+    HLReadRegister(system, (instruction)->rs2)
+#define HLSecondOperand_i(system, instruction) ((uint64_t)(instruction)->imm)
+
+/** Sets rde to expression of a and b. */
+#define HLBinaryOperation(mnemonic, form, expression)                          \
+    static void HLExec_##mnemonic##form(                                       \
+        struct HLSystem *system,                                               \
+        const struct HLDecodedInstruction *instruction)                        \
+    {                                                                          \
+        uint64_t a = HLReadRegister(system, instruction->rs1);                 \
+        uint64_t b = HLSecondOperand_##form(system, instruction);              \
+                                                                               \
+        HLWriteRegister(system, instruction->rde, expression);                 \
+    }
+
+/** Sets rde to expression, which may bail out by faulting instead. */
+#define HLCheckedBinaryOperation(mnemonic, form, expression)                   \
+    static void HLExec_##mnemonic##form(                                       \
+        struct HLSystem *system,                                               \
+        const struct HLDecodedInstruction *instruction)                        \
+    {                                                                          \
+        uint64_t a = HLReadRegister(system, instruction->rs1);                 \
+        uint64_t b = HLSecondOperand_##form(system, instruction);              \
+        uint64_t result;                                                       \
+                                                                               \
+        if (expression) {                                                      \
+            HLWriteRegister(system, instruction->rde, result);                 \
+        }                                                                      \
+    }
+
+/** Sets rde to a op b and defers the flags of kind. */
+#define HLFlagBinaryOperation(mnemonic, form, op, kind)                        \
+    static void HLExec_##mnemonic##form(                                       \
+        struct HLSystem *system,                                               \
+        const struct HLDecodedInstruction *instruction)                        \
+    {                                                                          \
+        uint64_t a = HLReadRegister(system, instruction->rs1);                 \
+        uint64_t b = HLSecondOperand_##form(system, instruction);              \
+        uint64_t result = a op b;                                              \
+                                                                               \
+        HLSetFlags(system, kind, a, b, result);                                \
+        HLWriteRegister(system, instruction->rde, result);                     \
+    }
+
+/*
+ * Division faults with HLInterruptDivideByZero. INT64_MIN / -1 overflows
+ * in C, so it wraps to INT64_MIN with no remainder as two's complement
+ * hardware would.
+ */
+
+static bool HLDivide(struct HLSystem *system,
+                     uint64_t a,
+                     uint64_t b,
+                     bool isSigned,
+                     bool remainder,
+                     uint64_t *result)
+{
+    if (HLUnlikely(b == 0)) {
+        HLExecFault(system, HLInterruptDivideByZero);
+        return false;
+    }
+    if (!isSigned) {
+        *result = remainder ? a % b : a / b;
+    } else if (b == UINT64_MAX && a == (uint64_t)1 << 63) {
+        *result = remainder ? 0 : a;
+    } else if (remainder) {
+        *result = (uint64_t)((int64_t)a % (int64_t)b);
+    } else {
+        *result = (uint64_t)((int64_t)a / (int64_t)b);
+    }
+    return true;
+}
+
+/* shifts by 64 or more shift everything out */
+#define HLShiftLeft(a, b) ((b) < 64 ? (a) << (b) : 0)
+#define HLShiftRightLogical(a, b) ((b) < 64 ? (a) >> (b) : 0)
+#define HLShiftRightArithmetic(a, b)                                           \
+    ((uint64_t)((int64_t)(a) >> ((b) < 64 ? (b) : 63)))
+#define HLBit(a, b) ((b) < 64 ? ((a) >> (b)) & 1 : 0)
+
+HLFlagBinaryOperation(add, r, +, HLLazyFlagsAdd)
+HLFlagBinaryOperation(add, i, +, HLLazyFlagsAdd)
+HLFlagBinaryOperation(sub, r, -, HLLazyFlagsSubtract)
+HLFlagBinaryOperation(sub, i, -, HLLazyFlagsSubtract)
+HLBinaryOperation(imul, r, a * b)
+HLBinaryOperation(imul, i, a * b)
+HLCheckedBinaryOperation(idiv, r, HLDivide(system, a, b, true, false, &result))
+HLCheckedBinaryOperation(idiv, i, HLDivide(system, a, b, true, false, &result))
+HLBinaryOperation(umul, r, a * b)
+HLBinaryOperation(umul, i, a * b)
+HLCheckedBinaryOperation(udiv, r, HLDivide(system, a, b, false, false, &result))
+HLCheckedBinaryOperation(udiv, i, HLDivide(system, a, b, false, false, &result))
+HLCheckedBinaryOperation(rem, r, HLDivide(system, a, b, true, true, &result))
+HLCheckedBinaryOperation(rem, i, HLDivide(system, a, b, true, true, &result))
+HLCheckedBinaryOperation(mod, r, HLDivide(system, a, b, false, true, &result))
+HLCheckedBinaryOperation(mod, i, HLDivide(system, a, b, false, true, &result))
+
+HLBinaryOperation(and, r, a & b)
+HLBinaryOperation(and, i, a & b)
+HLBinaryOperation(or, r, a | b)
+HLBinaryOperation(or, i, a | b)
+HLBinaryOperation(nor, r, ~(a | b))
+HLBinaryOperation(nor, i, ~(a | b))
+HLBinaryOperation(xor, r, a ^ b)
+HLBinaryOperation(xor, i, a ^ b)
+HLBinaryOperation(shl, r, HLShiftLeft(a, b))
+HLBinaryOperation(shl, i, HLShiftLeft(a, b))
+HLBinaryOperation(asr, r, HLShiftRightArithmetic(a, b))
+HLBinaryOperation(asr, i, HLShiftRightArithmetic(a, b))
+HLBinaryOperation(lsr, r, HLShiftRightLogical(a, b))
+HLBinaryOperation(lsr, i, HLShiftRightLogical(a, b))
+HLBinaryOperation(bit, r, HLBit(a, b))
+HLBinaryOperation(bit, i, HLBit(a, b))
+
+#undef HLShiftLeft
+#undef HLShiftRightLogical
+#undef HLShiftRightArithmetic
+#undef HLBit
+#undef HLBinaryOperation
+#undef HLCheckedBinaryOperation
+#undef HLFlagBinaryOperation
+#undef HLSecondOperand_r
+#undef HLSecondOperand_i
+
+/*
+ * Fused operations. They stand for instruction->length instructions, the
+ * first of which the dispatch has already counted.
+ */
+
+/**
+ * Counts the rest of a fused operation's instructions and returns true if
+ * the core may run past the first. Otherwise runs just the first as
+ * decoded on its own, so events and interrupts due in between land where
+ * they would without fusion, and returns false.
+ */
+static bool HLExecFused(struct HLSystem *system,
+                        const struct HLDecodedInstruction *instruction)
+{
+    struct HLCPUCore *cpu = &system->cpu;
+    struct HLDecodedInstruction first;
+
+    if (HLUnlikely(cpu->cycles + instruction->length - 1 > cpu->stopCycle)) {
+        HLDecodeInstruction(instruction->raw, &first);
+        HLOperationHandlers[first.operation](system, &first);
+        /* blocks would carry on after the whole fusion; stop them here */
+        cpu->faulted = true;
+        return false;
+    }
+    cpu->cycles += instruction->length - 1;
+    cpu->registers[HLRegIP] += 4 * (instruction->length - 1);
+    return true;
+}
+
+/** Whether a conditional branch is taken after comparing a with b. */
+static bool HLBranchTaken(HLOperation operation, uint64_t a, uint64_t b)
+{
+    switch (operation) {
+    case HLOperation_beq:
+    case HLOperation_bez:
+        return a == b;
+    case HLOperation_blt:
+        return (int64_t)a < (int64_t)b;
+    case HLOperation_ble:
+        return (int64_t)a <= (int64_t)b;
+    case HLOperation_bltu:
+        return a < b;
+    case HLOperation_bleu:
+        return a <= b;
+    case HLOperation_bne:
+    case HLOperation_bnz:
+        return a != b;
+    case HLOperation_bge:
+        return (int64_t)a >= (int64_t)b;
+    case HLOperation_bgt:
+        return (int64_t)a > (int64_t)b;
+    case HLOperation_bgeu:
+        return a >= b;
+    default:
+        return a > b;
+    }
+}
+
+/** The flags still go through Status, for whoever reads them later. */
+static void HLCompareAndBranch(struct HLSystem *system,
+                               const struct HLDecodedInstruction *instruction,
+                               uint64_t a,
+                               uint64_t b)
+{
+    HLSetFlags(system, HLLazyFlagsCompare, a, b, 0);
+    if (HLBranchTaken(instruction->func, a, b)) {
+        system->cpu.registers[HLRegIP] += 4 * (int64_t)instruction->branch;
+    }
+}
+
+static void HLExecCompareBranch(struct HLSystem *system,
+                                const struct HLDecodedInstruction *instruction)
+{
+    if (HLExecFused(system, instruction)) {
+        HLCompareAndBranch(system,
+                           instruction,
+                           HLReadRegister(system, instruction->rs1),
+                           HLReadRegister(system, instruction->rs2));
+    }
+}
+
+static void
+HLExecCompareImmediateBranch(struct HLSystem *system,
+                             const struct HLDecodedInstruction *instruction)
+{
+    uint64_t value;
+
+    if (!HLExecFused(system, instruction)) {
+        return;
+    }
+    value = HLReadRegister(system, instruction->rs1);
+    if (instruction->rde == 0) {
+        HLCompareAndBranch(
+            system, instruction, value, (uint64_t)instruction->imm);
+    } else {
+        HLCompareAndBranch(
+            system, instruction, (uint64_t)instruction->imm, value);
+    }
+}
+
+static void HLExecLoadConstant(struct HLSystem *system,
+                               const struct HLDecodedInstruction *instruction)
+{
+    uint64_t keep = 0;
+    int lane;
+
+    if (!HLExecFused(system, instruction)) {
+        return;
+    }
+    for (lane = 0; lane < 4; lane++) {
+        if (instruction->func & (1 << lane)) {
+            keep |= (uint64_t)0xFFFF << (16 * lane);
+        }
+    }
+    HLWriteRegister(system,
+                    instruction->rde,
+                    (HLReadRegister(system, instruction->rde) & keep)
+                        | (uint64_t)instruction->imm);
+}
+
+/*
+ * Specialised operations. Common forms of instructions with RZ or a small
+ * immediate as an operand, which skip reading or checking what the decoder
+ * already knows.
+ */
+
+static void HLExecNop(struct HLSystem *system,
+                      const struct HLDecodedInstruction *instruction)
+{
+}
+
+static void HLExecMove(struct HLSystem *system,
+                       const struct HLDecodedInstruction *instruction)
+{
+    HLWriteRegister(system,
+                    instruction->rde,
+                    HLReadRegister(system, instruction->rs1));
+}
+
+static void HLExecMoveImmediate(struct HLSystem *system,
+                                const struct HLDecodedInstruction *instruction)
+{
+    uint64_t value = (uint64_t)instruction->imm;
+
+    if (instruction->func) {
+        HLSetFlags(system, HLLazyFlagsAdd, 0, value, value);
+    }
+    HLWriteRegister(system, instruction->rde, value);
+}
+
+static void HLExecCompareZero(struct HLSystem *system,
+                              const struct HLDecodedInstruction *instruction)
+{
+    HLSetFlags(system,
+               HLLazyFlagsCompare,
+               HLReadRegister(system, instruction->rs1),
+               0,
+               0);
+}
+
+/** Sets rde to expression of a, rs1, and n, an immediate below 64. */
+#define HLSmallImmediateOperation(name, expression)                            \
+    static void HLExec##name(struct HLSystem *system,                          \
+                             const struct HLDecodedInstruction *instruction)   \
+    {                                                                          \
+        uint64_t a = HLReadRegister(system, instruction->rs1);                 \
+        unsigned n = (unsigned)instruction->imm;                               \
+                                                                               \
+        HLWriteRegister(system, instruction->rde, expression);                 \
+    }
+
+HLSmallImmediateOperation(ShiftLeftImmediate, a << n)
+HLSmallImmediateOperation(ShiftRightArithmeticImmediate,
+                          (uint64_t)((int64_t)a >> n))
+HLSmallImmediateOperation(ShiftRightLogicalImmediate, a >> n)
+HLSmallImmediateOperation(BitImmediate, (a >> n) & 1)
+
+#undef HLSmallImmediateOperation
+
+#define HL_INSTRUCTION(mnemonic, opcode, func, format, comment)                \
+    HLExec_##mnemonic,
+const HLOperationHandler HLOperationHandlers[HLNOperation] = {
+#include "instructions.h"
+    HLExecUnknown,
+#define HL_OPERATION(name, comment) HLExec##name,
+#include "operations.h"
+#undef HL_OPERATION
+};
+#undef HL_INSTRUCTION
+
+/**
+ * Returns the decoded instruction at IP, decoding and caching it first if
+ * necessary. Returns NULL and sets result if the fetch fails. userMode is
+ * a constant in each of the loops below, so the kernel mode ones never
+ * look at the MMU.
+ */
+static const struct HLDecodedInstruction *
+HLInterpreterFetch(struct HLSystem *system,
+                   bool userMode,
+                   HLMemoryResult *result)
+{
+    struct HLMemoryManagementUnit *mmu = &system->memory;
+    uint64_t address = system->cpu.registers[HLRegIP];
+    struct HLDecodedInstruction *slot;
+    HLInstruction raw;
+
+    if (userMode) {
+        /* if user mode is set then do address translation to read the instruction */
+        address = HLMemoryManagementUnitTranslateAddress(
+            mmu, address, HLMemoryPermissionExecute, result);
+        if (*result != HLMemoryResultOK) {
+            return NULL;
+        }
+    }
+
+    slot = HLDecodeCacheSlot(&system->decodeCache, address);
+    if (slot->address == address) {
+        system->decodeCache.hits++;
+        return slot;
+    }
+    system->decodeCache.misses++;
+
+    raw = HLMemoryManagementUnitReadPhysicalInstruction(mmu, address, result);
+    if (*result != HLMemoryResultOK) {
+        return NULL;
+    }
+
+    HLDecodeInstructionAt(mmu, address, raw, slot);
+    slot->handler = HLOperationHandlers[slot->operation];
+
+    /* only cache the instruction if we'll hear about writes to it */
+    if ((address >> HLPageShift) < mmu->codePageCount) {
+        HLAtomicOr8(&mmu->codePages[address >> HLPageShift],
+                    HLCodePageDecoded);
+        slot->address = address;
+    } else {
+        slot->address = HLDecodeCacheEmpty;
+    }
+
+    return slot;
+}
+
+/*
+ * One loop per privilege mode, each checking the mode only when it starts;
+ * HLSystemModeChanged makes the running one return.
+ */
+
+#define HL_SLICE HLInterpreterRunKernelSlice
+#define HL_SLICE_USER_MODE false
+#include "interpreter_slice.h"
+#undef HL_SLICE
+#undef HL_SLICE_USER_MODE
+
+#define HL_SLICE HLInterpreterRunUserSlice
+#define HL_SLICE_USER_MODE true
+#include "interpreter_slice.h"
+#undef HL_SLICE
+#undef HL_SLICE_USER_MODE
+
+/*
+ * The interpreter has no blocks to look at the interrupt controller
+ * between, so it runs in slices of HLInterpreterSliceLength instructions
+ * instead, bringing stopCycle forward to the end of each.
+ */
+void HLInterpreterRun(struct HLSystem *system)
+{
+    struct HLCPUCore *cpu = &system->cpu;
+    uint64_t stopCycle = cpu->stopCycle;
+
+    while (cpu->cycles < stopCycle
+           && cpu->stopReason == HLStopBudgetExhausted) {
+        if (HLInterruptControllerRaised(&system->interrupts)) {
+            HLSystemTakeInterrupts(system);
+        }
+        if (HLSystemCodeChanged(system)) {
+            HLSystemFlushCodeCaches(system);
+        }
+        if (stopCycle - cpu->cycles > HLInterpreterSliceLength) {
+            cpu->stopCycle = cpu->cycles + HLInterpreterSliceLength;
+        } else {
+            cpu->stopCycle = stopCycle;
+        }
+        if (cpu->registers[HLRegStatus] & HLFlag(HLFlagMode)) {
+            HLInterpreterRunUserSlice(system);
+        } else {
+            HLInterpreterRunKernelSlice(system);
+        }
+        /* a device may have brought its next event forward */
+        if (HLEventQueueNextCycle(&system->events) < stopCycle) {
+            stopCycle = HLEventQueueNextCycle(&system->events);
+        }
+    }
+
+    if (cpu->stopReason == HLStopBudgetExhausted) {
+        cpu->stopCycle = stopCycle;
+    }
+}
@@ -0,0 +1,36 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_INTERPRETER_P_H
+#define HALLEY_INTERPRETER_P_H
+
+#include "decoder_p.h"
+
+struct HLSystem;
+
+/**
+ * Whether the interpreter dispatches with computed gotos (1) or through a
+ * table of handler functions (0). Set by the build; defaults to computed
+ * gotos on compilers that support labels as values.
+ */
+#ifndef HL_THREADED_DISPATCH
+#if defined(__GNUC__) || defined(__clang__)
+#define HL_THREADED_DISPATCH 1
+#else
+#define HL_THREADED_DISPATCH 0
+#endif
+#endif
+
+/** instructions the interpreter runs between checks for interrupts */
+#define HLInterpreterSliceLength 256
+
+/** handler of every operation, fused ones included, indexed by HLOperation */
+extern const HLOperationHandler HLOperationHandlers[HLNOperation];
+
+/** Executes instructions until system->cpu.cycles reaches stopCycle. */
+void HLInterpreterRun(struct HLSystem *system);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+/*
+ * The interpreter loop, included by interpreter.c once per privilege mode
+ * with HL_SLICE set to the name of the function to define and
+ * HL_SLICE_USER_MODE to whether it runs user mode code.
+ */
+
+#if HL_THREADED_DISPATCH
+
+/*
+ * Every handler ends in its own copy of the fetch and an indirect jump to
+ * the next handler, which gives the branch predictor one jump site per
+ * operation instead of a single shared one.
+ */
+static void HL_SLICE(struct HLSystem *system)
+{
+#define HL_INSTRUCTION(mnemonic, opcode, func, format, comment)                \
+    &&HLLabel_##mnemonic,
+    static const void *const labels[HLNOperation] = {
+#include "instructions.h"
+        &&HLLabelUnknown,
+#define HL_OPERATION(name, comment) &&HLLabel##name,
+#include "operations.h"
+#undef HL_OPERATION
+    };
+#undef HL_INSTRUCTION
+
+    const struct HLDecodedInstruction *instruction;
+    HLMemoryResult result = HLMemoryResultOK;
+
+#define HLDispatch()                                                           \
+    if (system->cpu.cycles >= system->cpu.stopCycle) {                         \
+        return;                                                                \
+    }                                                                          \
+    instruction = HLInterpreterFetch(system, HL_SLICE_USER_MODE, &result);     \
+    if (HLUnlikely(result != HLMemoryResultOK)) {                              \
+        goto fault;                                                            \
+    }                                                                          \
+    system->cpu.cycles++;                                                      \
+    system->cpu.registers[HLRegIP] += 4;                                       \
+    goto *labels[instruction->operation];
+
+    HLDispatch()
+
+#define HL_INSTRUCTION(mnemonic, opcode, func, format, comment)                \
+    HLLabel_##mnemonic : HLExec_##mnemonic(system, instruction);               \
+    HLDispatch()
+#include "instructions.h"
+#undef HL_INSTRUCTION
+
+HLLabelUnknown:
+    HLExecUnknown(system, instruction);
+    HLDispatch()
+
+#define HL_OPERATION(name, comment)                                            \
+    HLLabel##name : HLExec##name(system, instruction);                         \
+    HLDispatch()
+#include "operations.h"
+#undef HL_OPERATION
+
+fault:
+    HLSystemMemoryFault(system, result);
+    result = HLMemoryResultOK;
+    HLDispatch()
+
+#undef HLDispatch
+}
+
+#else
+
+static void HL_SLICE(struct HLSystem *system)
+{
+    const struct HLDecodedInstruction *instruction;
+    HLMemoryResult result = HLMemoryResultOK;
+
+    while (system->cpu.cycles < system->cpu.stopCycle) {
+        instruction = HLInterpreterFetch(system, HL_SLICE_USER_MODE, &result);
+
+        if (HLUnlikely(result != HLMemoryResultOK)) {
+            HLSystemMemoryFault(system, result);
+            result = HLMemoryResultOK;
+            continue;
+        }
+
+        /* only increment the instruction pointer after we've confirmed that the read succeeded */
+        system->cpu.cycles++;
+        system->cpu.registers[HLRegIP] += 4;
+
+        instruction->handler(system, instruction);
+    }
+}
+
+#endif
@@ -0,0 +1,214 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <string.h>
+
+#include "interrupt_controller_p.h"
+#include "system_p.h"
+#include "thread_p.h"
+
+void HLInterruptControllerRaise(struct HLInterruptController *controller,
+                                HLInterrupt interrupt)
+{
+    HLAtomicOr64(&controller->pending[interrupt / 64],
+                 (uint64_t)1 << (interrupt % 64));
+    HLAtomicStore64(&controller->raised, 1);
+}
+
+int HLInterruptControllerTakePending(struct HLInterruptController *controller)
+{
+    uint64_t bits;
+    int word;
+    int bit;
+
+    for (word = 0; word < 4; word++) {
+        bits = HLAtomicLoad64(&controller->pending[word]);
+        if (bits == 0) {
+            continue;
+        }
+        for (bit = 0; !(bits & ((uint64_t)1 << bit)); bit++) {
+        }
+        HLAtomicAnd64(&controller->pending[word], ~((uint64_t)1 << bit));
+        return word * 64 + bit;
+    }
+
+    return -1;
+}
+
+/**
+ * Jumps to the handler of interrupt, saving where execution was first if
+ * save is set.
+ */
+static void HLSystemEnterInterrupt(struct HLSystem *system,
+                                   HLInterrupt interrupt,
+                                   bool save)
+{
+    struct HLInterruptController *controller = &system->interrupts;
+    uint64_t *registers = system->cpu.registers;
+    HLMemoryResult result = HLMemoryResultOK;
+    uint64_t handler;
+
+    handler = HLMemoryManagementUnitReadPhysicalUInt64(
+        &system->memory,
+        controller->interruptVectorTableBaseAddress + 8 * (uint64_t)interrupt,
+        &result);
+    if (result != HLMemoryResultOK) {
+        HLSystemStop(system, HLStopFault);
+        return;
+    }
+
+    if (save) {
+        controller->returnAddress = registers[HLRegIP];
+        controller->returnStatus = HLSystemStatus(system);
+    }
+    registers[HLRegIP] = handler;
+    if (registers[HLRegStatus] & HLFlag(HLFlagMode)) {
+        registers[HLRegStatus] &= ~HLFlag(HLFlagMode);
+        HLSystemModeChanged(system);
+    }
+}
+
+void HLSystemInterrupt(struct HLSystem *system, HLInterrupt interrupt)
+{
+    struct HLInterruptController *controller = &system->interrupts;
+
+    if (controller->interruptVectorTableBaseAddress == 0) {
+        HLSystemStop(system, HLStopFault);
+        return;
+    }
+
+    if (controller->queueSize == HLInterruptQueueSize) {
+        controller->queue[HLInterruptQueueSize - 1] = HLInterruptOverflow;
+        return;
+    }
+    controller->queue[controller->queueSize++] = interrupt;
+    if (controller->queueSize == 1) {
+        HLSystemEnterInterrupt(system, interrupt, true);
+    }
+}
+
+void HLSystemFault(struct HLSystem *system, HLInterrupt interrupt)
+{
+    system->cpu.faulted = true;
+    if (system->interrupts.queueSize != 0) {
+        HLSystemStop(system, HLStopFault);
+        return;
+    }
+    HLSystemInterrupt(system, interrupt);
+}
+
+void HLSystemMemoryFault(struct HLSystem *system, HLMemoryResult result)
+{
+    if (result == HLMemoryResultUnaligned) {
+        HLSystemFault(system, HLInterruptUnalignedAccess);
+    } else {
+        HLSystemFault(system, HLInterruptAccessViolation);
+    }
+}
+
+void HLSystemTakeInterrupts(struct HLSystem *system)
+{
+    struct HLInterruptController *controller = &system->interrupts;
+    int interrupt;
+
+    /* anything raised from here on sets it again */
+    HLAtomicStore64(&controller->raised, 0);
+    if (controller->interruptVectorTableBaseAddress == 0) {
+        return;
+    }
+    while ((interrupt = HLInterruptControllerTakePending(controller)) >= 0) {
+        HLSystemInterrupt(system, (HLInterrupt)interrupt);
+    }
+}
+
+void HLSystemReturnFromInterrupt(struct HLSystem *system)
+{
+    struct HLInterruptController *controller = &system->interrupts;
+    uint64_t *registers = system->cpu.registers;
+    bool modeChanged = ((registers[HLRegStatus] ^ controller->returnStatus)
+                        & HLFlag(HLFlagMode))
+                       != 0;
+
+    registers[HLRegIP] = controller->returnAddress;
+    registers[HLRegStatus] = controller->returnStatus;
+    system->cpu.flagsKind = HLLazyFlagsNone;
+    if (modeChanged) {
+        HLSystemModeChanged(system);
+    }
+    HLSystemResolveInterrupt(system);
+}
+
+void HLSystemResolveInterrupt(struct HLSystem *system)
+{
+    struct HLInterruptController *controller = &system->interrupts;
+
+    if (controller->queueSize == 0) {
+        return;
+    }
+    controller->queueSize--;
+    memmove(controller->queue, controller->queue + 1, controller->queueSize);
+    if (controller->queueSize > 0) {
+        /* returnAddress still holds where the first one interrupted */
+        HLSystemEnterInterrupt(system, controller->queue[0], false);
+    }
+}
+
+void HLInterruptControllerPortWrite(void *userData,
+                                    struct HLSystem *core,
+                                    uint16_t port,
+                                    uint64_t value)
+{
+    struct HLInterruptController *controller = &core->interrupts;
+    struct HLSystem *target = NULL;
+
+    switch ((HLInterruptPort)(port - HLInterruptPortBase)) {
+    case HLInterruptPortVectorTable:
+        controller->interruptVectorTableBaseAddress = value;
+        /* deliver what was held back while there was no table */
+        HLAtomicStore64(&controller->raised, 1);
+        break;
+    case HLInterruptPortReturnAddress:
+        controller->returnAddress = value;
+        break;
+    case HLInterruptPortReturnStatus:
+        controller->returnStatus = value;
+        break;
+    case HLInterruptPortRaise:
+        if ((value >> 8) <= UINT32_MAX) {
+            target = HLSystemCore(core, (uint32_t)(value >> 8));
+        }
+        if (target != NULL) {
+            HLInterruptControllerRaise(&target->interrupts,
+                                       (HLInterrupt)value);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+uint64_t HLInterruptControllerPortRead(void *userData,
+                                       struct HLSystem *core,
+                                       uint16_t port)
+{
+    struct HLInterruptController *controller = &core->interrupts;
+
+    switch ((HLInterruptPort)(port - HLInterruptPortBase)) {
+    case HLInterruptPortVectorTable:
+        return controller->interruptVectorTableBaseAddress;
+    case HLInterruptPortReturnAddress:
+        return controller->returnAddress;
+    case HLInterruptPortReturnStatus:
+        return controller->returnStatus;
+    case HLInterruptPortInService:
+        if (controller->queueSize == 0) {
+            return UINT64_MAX;
+        }
+        return controller->queue[0];
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,177 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_INTERRUPT_CONTROLLER_P_H
+#define HALLEY_INTERRUPT_CONTROLLER_P_H
+
+#include <stdint.h>
+
+#include "memory_management_unit_p.h"
+#include "thread_p.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSystem;
+
+typedef uint8_t HLInterrupt;
+
+enum {
+    /**
+     * Triggers when the second argument of a div, mod, or rem instruction is
+     * zero.
+     */
+    HLInterruptDivideByZero,
+    /** Reserved for debugger breakpoints. */
+    HLInterruptBreakpoint,
+    /**
+     * Triggers when some kind of restricted or invalid operation occurs.
+     * This includes unrecognized opcode, unrecognized secondary function
+     * values, or when a restricted instruction is encountered / modification
+     * of a restricted register is attempted in user mode.
+     */
+    HLInterruptInvalidOperation,
+    /** Triggers when the stack pointer exceeds the frame pointer, which
+     *  indicates a stack underflow has occurred.
+     */
+    HLInterruptStackUnderflow,
+    /** Triggers when memory has been accessed across type width boundaries. */
+    HLInterruptUnalignedAccess,
+    /** Triggers when memory has been accessed in an invalid way.
+     *  In kernel mode, this triggers due to accesses outside physical memory
+     *  bounds.
+     *  In user mode, this triggers when unmapped/invalid memory is accessed or
+     *  when virtual memory permissions do not allow the access.
+     */
+    HLInterruptAccessViolation,
+    /** Triggers when interrupt controller has experienced an interrupt queue
+     *  overflow due to too many interrupts in a short period of time.
+     */
+    HLInterruptOverflow,
+};
+
+#define HLInterruptQueueSize 16
+
+/*
+ * Interrupt delivery
+ *
+ * The vector table holds the physical address of the handler of each of
+ * the 256 interrupts. Entering a handler saves IP and the status register
+ * to returnAddress and returnStatus and switches to kernel mode. While a
+ * handler runs, its interrupt stays at the head of the queue and further
+ * interrupts wait behind it; when the queue is full, the last one is
+ * replaced with HLInterruptOverflow so the kernel knows some were lost.
+ *
+ * iret restores IP and the status register and enters the handler of the
+ * next queued interrupt, if any. ires resolves the interrupt without
+ * returning: the next queued one is entered right away as if it had
+ * interrupted the same code, otherwise execution goes on after ires with
+ * nothing in service, so further interrupts nest.
+ *
+ * Until the guest sets up a vector table, interrupts raised from outside
+ * stay pending, and anything that would enter a handler stops the core
+ * with HLStopFault instead.
+ *
+ * Faults are entered right away with returnAddress pointing at the
+ * instruction that faulted, so iret runs it again. A fault while another
+ * interrupt is in service would have nowhere to save IP to, so it stops
+ * the core with HLStopFault too, rather than faulting forever.
+ */
+
+struct HLInterruptController {
+    uint64_t interruptVectorTableBaseAddress;
+    uint64_t returnAddress;
+    uint64_t returnStatus;
+
+    /** queue[0] is in service while queueSize is not zero */
+    HLInterrupt queue[HLInterruptQueueSize];
+    uint8_t queueSize;
+
+    /**
+     * Interrupts raised by other cores or host threads, one bit per vector.
+     * Only modified atomically; the owning core moves them into the queue.
+     */
+    uint64_t pending[4];
+    /**
+     * Set after a bit of pending is, so the owning core only has to look at
+     * one word, with a relaxed load, to know whether to check pending.
+     */
+    uint64_t raised;
+};
+
+/**
+ * ports of the interrupt controller; each core sees its own, and like every
+ * port only from kernel mode
+ */
+#define HLInterruptPortBase 0x00
+
+typedef uint8_t HLInterruptPort;
+enum {
+    /** physical address of the vector table; 0 turns delivery off */
+    HLInterruptPortVectorTable,
+    HLInterruptPortReturnAddress,
+    HLInterruptPortReturnStatus,
+    /** reads the interrupt in service, or all ones if there is none */
+    HLInterruptPortInService,
+    /**
+     * writes raise the interrupt in the low 8 bits on the core whose index
+     * is in the bits above, which is how cores interrupt each other
+     */
+    HLInterruptPortRaise,
+    HLInterruptNPorts,
+};
+
+/** Whether anything was raised on controller since the last check. */
+#define HLInterruptControllerRaised(controller)                                \
+    HLAtomicLoadRelaxed(uint64_t, &(controller)->raised)
+
+/**
+ * Marks interrupt as pending on controller. Safe to call from any thread,
+ * which is how cores interrupt one another.
+ */
+void HLInterruptControllerRaise(struct HLInterruptController *controller,
+                                HLInterrupt interrupt);
+/**
+ * Clears and returns the lowest pending interrupt, or -1 if there is none.
+ * Only the core owning controller may call this.
+ */
+int HLInterruptControllerTakePending(struct HLInterruptController *controller);
+
+/**
+ * Moves what was raised on system into its queue, entering a handler if
+ * none is in service. Only called by the core itself, between blocks.
+ */
+void HLSystemTakeInterrupts(struct HLSystem *system);
+/** Interrupts system synchronously, e.g. for int. */
+void HLSystemInterrupt(struct HLSystem *system, HLInterrupt interrupt);
+/**
+ * Enters the handler of interrupt because the instruction at IP faulted,
+ * and has the execution engine abandon the rest of its block.
+ */
+void HLSystemFault(struct HLSystem *system, HLInterrupt interrupt);
+/** HLSystemFault with the interrupt for a failed memory access. */
+void HLSystemMemoryFault(struct HLSystem *system, HLMemoryResult result);
+/** iret */
+void HLSystemReturnFromInterrupt(struct HLSystem *system);
+/** ires */
+void HLSystemResolveInterrupt(struct HLSystem *system);
+
+/* HLPortDevice handlers for the ports above */
+
+void HLInterruptControllerPortWrite(void *userData,
+                                    struct HLSystem *core,
+                                    uint16_t port,
+                                    uint64_t value);
+uint64_t HLInterruptControllerPortRead(void *userData,
+                                       struct HLSystem *core,
+                                       uint16_t port);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,201 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+#include "dma_p.h"
+#include "io_bus_p.h"
+#include "system_p.h"
+
+static uint64_t HLIOBusNoRead(void *userData,
+                              struct HLSystem *core,
+                              uint16_t port)
+{
+    return 0;
+}
+
+static void HLIOBusNoWrite(void *userData,
+                           struct HLSystem *core,
+                           uint16_t port,
+                           uint64_t value)
+{
+}
+
+static bool HLIOBusAttach(struct HLIOBus *bus,
+                          uint32_t first,
+                          uint32_t count,
+                          const struct HLPortDevice *device)
+{
+    struct HLIOBusDevice *slot = NULL;
+    uint32_t i;
+
+    if (count == 0 || first >= HLNPorts || count > HLNPorts - first) {
+        return false;
+    }
+    for (i = first; i < first + count; i++) {
+        if (bus->ports[i] != 0) {
+            return false;
+        }
+    }
+    for (i = 1; i < HLIOBusNDevices; i++) {
+        if (bus->devices[i].portCount == 0) {
+            slot = &bus->devices[i];
+            break;
+        }
+    }
+    if (slot == NULL) {
+        return false;
+    }
+
+    slot->device = *device;
+    if (slot->device.read == NULL) {
+        slot->device.read = HLIOBusNoRead;
+    }
+    if (slot->device.write == NULL) {
+        slot->device.write = HLIOBusNoWrite;
+    }
+    slot->portCount = count;
+    memset(&bus->ports[first], (int)(slot - bus->devices), count);
+    return true;
+}
+
+void HLIOBusInit(struct HLIOBus *bus, struct HLSystem *system)
+{
+    struct HLPortDevice device;
+    uint32_t i;
+
+    memset(bus->ports, 0, sizeof(bus->ports));
+    for (i = 0; i < HLIOBusNDevices; i++) {
+        bus->devices[i].device.read = HLIOBusNoRead;
+        bus->devices[i].device.write = HLIOBusNoWrite;
+        bus->devices[i].device.writeBatch = NULL;
+        bus->devices[i].device.userData = NULL;
+        bus->devices[i].portCount = 0;
+    }
+
+    device.read = HLInterruptControllerPortRead;
+    device.write = HLInterruptControllerPortWrite;
+    device.writeBatch = NULL;
+    device.userData = NULL;
+    HLIOBusAttach(bus, HLInterruptPortBase, HLInterruptNPorts, &device);
+
+    device.read = HLTimerPortRead;
+    device.write = HLTimerPortWrite;
+    HLIOBusAttach(bus, HLTimerPortBase, HLTimerNPorts, &device);
+
+    device.read = HLMemoryManagementUnitPortRead;
+    device.write = HLMemoryManagementUnitPortWrite;
+    HLIOBusAttach(bus,
+                  HLMemoryManagementUnitPortBase,
+                  HLMemoryManagementUnitNPorts,
+                  &device);
+
+    if (system->dma != NULL) {
+        device.read = HLDMAPortRead;
+        device.write = HLDMAPortWrite;
+        device.writeBatch = NULL;
+        device.userData = system->dma;
+        HLIOBusAttach(bus, HLDMAPortBase, HLDMANPorts, &device);
+    }
+}
+
+bool HLSystemAttachPortDevice(struct HLSystem *system,
+                              uint32_t first,
+                              uint32_t count,
+                              const struct HLPortDevice *device)
+{
+    return HLIOBusAttach(system->primary->bus, first, count, device);
+}
+
+void HLSystemDetachPortDevice(struct HLSystem *system,
+                              uint32_t first,
+                              uint32_t count)
+{
+    struct HLIOBus *bus = system->primary->bus;
+    uint32_t i;
+
+    /* posted writes may be headed for the device */
+    for (i = 0; i < HLSystemCoreCount(system); i++) {
+        HLSystemFlushPortWrites(HLSystemCore(system, i));
+    }
+
+    if (first >= HLNPorts) {
+        return;
+    }
+    if (count > HLNPorts - first) {
+        count = HLNPorts - first;
+    }
+    for (i = first; i < first + count; i++) {
+        if (bus->ports[i] != 0) {
+            bus->devices[bus->ports[i]].portCount--;
+            bus->ports[i] = 0;
+        }
+    }
+}
+
+void HLSystemFlushPortWrites(struct HLSystem *system)
+{
+    struct HLPortBatch *batch = &system->portBatch;
+    uint32_t count = batch->count;
+
+    if (count == 0) {
+        return;
+    }
+    batch->count = 0;
+    batch->device->writeBatch(batch->device->userData,
+                              system,
+                              batch->port,
+                              batch->values,
+                              count);
+}
+
+void HLSystemPortWrite(struct HLSystem *system, uint64_t port, uint64_t value)
+{
+    struct HLIOBus *bus = system->primary->bus;
+    struct HLPortBatch *batch = &system->portBatch;
+    const struct HLPortDevice *device;
+
+    if (batch->count > 0 && batch->port != port) {
+        HLSystemFlushPortWrites(system);
+    }
+    if (port >= HLNPorts) {
+        return;
+    }
+
+    device = &bus->devices[bus->ports[port]].device;
+    if (device->writeBatch == NULL) {
+        device->write(device->userData, system, (uint16_t)port, value);
+        return;
+    }
+
+    batch->device = device;
+    batch->port = (uint16_t)port;
+    batch->values[batch->count++] = value;
+    if (batch->count == HLPortBatchSize) {
+        HLSystemFlushPortWrites(system);
+    }
+}
+
+uint64_t HLSystemPortRead(struct HLSystem *system, uint64_t port)
+{
+    struct HLIOBus *bus = system->primary->bus;
+    const struct HLPortDevice *device;
+    uint64_t value;
+
+    HLSystemFlushPortWrites(system);
+    if (port >= HLNPorts) {
+        return 0;
+    }
+
+    device = &bus->devices[bus->ports[port]].device;
+    value = device->read(device->userData, system, (uint16_t)port);
+    /* the guest may be polling a device that just wrote code */
+    if (HLSystemCodeChanged(system)) {
+        HLSystemFlushCodeCaches(system);
+    }
+    return value;
+}
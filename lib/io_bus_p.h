@@ -0,0 +1,69 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_IO_BUS_P_H
+#define HALLEY_IO_BUS_P_H
+
+#include <stdint.h>
+
+#include "io_bus.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSystem;
+
+#define HLNPorts 0x10000
+/** including the device in slot 0, which answers to every free port */
+#define HLIOBusNDevices 256
+/** writes a core collects for a batching device before handing them over */
+#define HLPortBatchSize 64
+
+struct HLIOBusDevice {
+    /** read and write are never NULL here */
+    struct HLPortDevice device;
+    /** ports that map to this slot; the slot is free when zero */
+    uint32_t portCount;
+};
+
+/**
+ * Maps every port straight to the device answering to it, so an access is
+ * one table load and one indirect call whatever the number of devices.
+ */
+struct HLIOBus {
+    uint8_t ports[HLNPorts];
+    struct HLIOBusDevice devices[HLIOBusNDevices];
+};
+
+/** Posted writes of one core that haven't reached their device yet. */
+struct HLPortBatch {
+    /** the device in the bus slot at the time of the first write */
+    const struct HLPortDevice *device;
+    uint16_t port;
+    uint32_t count;
+    uint64_t values[HLPortBatchSize];
+};
+
+/** Leaves every port but the built-in devices' free. */
+void HLIOBusInit(struct HLIOBus *bus, struct HLSystem *system);
+
+/*
+ * Port IO from the out and in instructions. Ports no device answers to
+ * ignore writes and read as zero. Ports past the last one never have a
+ * device.
+ */
+
+void HLSystemPortWrite(struct HLSystem *system, uint64_t port, uint64_t value);
+uint64_t HLSystemPortRead(struct HLSystem *system, uint64_t port);
+/** Hands the posted writes of system, if any, to their device. */
+void HLSystemFlushPortWrites(struct HLSystem *system);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1169 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#if !defined(_WIN32)
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+#endif
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include "block_engine_p.h"
+#include "jit_p.h"
+#include "system_p.h"
+
+/*
+ * Block compiler for x86-64 hosts.
+ *
+ * Guest registers stay in system->cpu.registers, which native code reaches
+ * at fixed offsets from rbx; rbx holds the system pointer for the whole
+ * block. Moves, constant loads, arithmetic and bitwise operations with a
+ * single x86 equivalent, comparisons and branches are emitted inline,
+ * deferring flags the way the interpreter does. Loads and stores take the
+ * interpreter's kernel mode fast path inline and call their handler
+ * otherwise. Everything else, including division, shifts by a register,
+ * the stack, ports and anything naming IP or Status, is compiled to a
+ * call of its interpreter handler, so every block can be compiled and
+ * behaves exactly like its interpreted form.
+ */
+
+/* displacement of a guest register from the system pointer in rbx */
+#define HLJITRegisterOffset(reg)                                               \
+    ((uint32_t)(offsetof(struct HLSystem, cpu.registers)                       \
+                + sizeof(uint64_t) * (reg)))
+
+/** largest native form of one guest instruction, in bytes */
+#define HLJITMaxInstructionSize 256
+/** prologue, the final IP and cycle updates and epilogue, in bytes */
+#define HLJITMaxFrameSize 48
+
+/*
+ * The code buffer is never writable and executable at once: it is
+ * executable except while HLJITCompile emits into it.
+ */
+static bool HLJITProtect(struct HLJIT *jit, bool writable)
+{
+#ifdef _WIN32
+    DWORD oldProtection;
+
+    if (!VirtualProtect(jit->code,
+                        HLJITCodeSize,
+                        writable ? PAGE_READWRITE : PAGE_EXECUTE_READ,
+                        &oldProtection)) {
+        return false;
+    }
+    if (!writable) {
+        FlushInstructionCache(GetCurrentProcess(), jit->code, HLJITCodeSize);
+    }
+    return true;
+#else
+    return mprotect(jit->code,
+                    HLJITCodeSize,
+                    writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC)
+           == 0;
+#endif
+}
+
+bool HLJITInit(struct HLJIT *jit)
+{
+#ifdef _WIN32
+    jit->code = VirtualAlloc(
+        NULL, HLJITCodeSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (jit->code == NULL) {
+        return false;
+    }
+#else
+#if defined(__APPLE__) && defined(MAP_JIT)
+    /*
+     * the hardened runtime only lets MAP_JIT mappings become executable,
+     * and wants them mapped with every permission they will ever have
+     */
+    jit->code = mmap(NULL,
+                     HLJITCodeSize,
+                     PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_JIT,
+                     -1,
+                     0);
+#else
+    jit->code = mmap(NULL,
+                     HLJITCodeSize,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+#endif
+    if (jit->code == MAP_FAILED) {
+        jit->code = NULL;
+        return false;
+    }
+#endif
+    jit->used = 0;
+    jit->threshold = HLJITDefaultThreshold;
+    jit->compiledBlocks = 0;
+    jit->resets = 0;
+    if (!HLJITProtect(jit, false)) {
+        HLJITDone(jit);
+        return false;
+    }
+    return true;
+}
+
+void HLJITDone(struct HLJIT *jit)
+{
+    if (jit->code == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    VirtualFree(jit->code, 0, MEM_RELEASE);
+#else
+    munmap(jit->code, HLJITCodeSize);
+#endif
+    jit->code = NULL;
+}
+
+static void HLEmit8(uint8_t **at, uint8_t value)
+{
+    *(*at)++ = value;
+}
+
+static void HLEmit32(uint8_t **at, uint32_t value)
+{
+    HLEmit8(at, value & 0xFF);
+    HLEmit8(at, (value >> 8) & 0xFF);
+    HLEmit8(at, (value >> 16) & 0xFF);
+    HLEmit8(at, (value >> 24) & 0xFF);
+}
+
+static void HLEmit64(uint8_t **at, uint64_t value)
+{
+    HLEmit32(at, (uint32_t)value);
+    HLEmit32(at, (uint32_t)(value >> 32));
+}
+
+typedef uint8_t HLHostRegister;
+enum {
+    HLHostRAX,
+    HLHostRCX,
+    HLHostRDX,
+    HLHostRBX,
+};
+
+/* the condition nibble of jcc; flipping the low bit negates it */
+typedef uint8_t HLHostCondition;
+enum {
+    HLHostBelow = 0x2,
+    HLHostAboveOrEqual = 0x3,
+    HLHostEqual = 0x4,
+    HLHostNotEqual = 0x5,
+    HLHostBelowOrEqual = 0x6,
+    HLHostAbove = 0x7,
+    HLHostLess = 0xC,
+    HLHostGreaterOrEqual = 0xD,
+    HLHostLessOrEqual = 0xE,
+    HLHostGreater = 0xF,
+};
+
+/* opcodes of "op r/m64, r64" */
+#define HLHostAdd 0x01
+#define HLHostOr 0x09
+#define HLHostAnd 0x21
+#define HLHostSub 0x29
+#define HLHostXor 0x31
+#define HLHostCmp 0x39
+#define HLHostMov 0x89
+
+/* /digit of the C1 shift group */
+#define HLHostRor 1
+#define HLHostShl 4
+#define HLHostShr 5
+#define HLHostSar 7
+
+#define HLJITOffset(member) ((uint32_t)offsetof(struct HLSystem, member))
+
+/* add qword [rbx + offset], imm32 */
+static void HLEmitAdd(uint8_t **at, uint32_t offset, int32_t value)
+{
+    if (value == 0) {
+        return;
+    }
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0x81);
+    HLEmit8(at, 0x83);
+    HLEmit32(at, offset);
+    HLEmit32(at, (uint32_t)value);
+}
+
+static void HLEmitAddRegister(uint8_t **at, HLRegister reg, int32_t value)
+{
+    HLEmitAdd(at, HLJITRegisterOffset(reg), value);
+}
+
+static void HLEmitAddCycles(uint8_t **at, int32_t value)
+{
+    HLEmitAdd(at, HLJITOffset(cpu.cycles), value);
+}
+
+/* mov reg, [rbx + offset] */
+static void HLEmitLoad(uint8_t **at, HLHostRegister reg, uint32_t offset)
+{
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0x8B);
+    HLEmit8(at, (uint8_t)(0x83 | reg << 3));
+    HLEmit32(at, offset);
+}
+
+/* mov [rbx + offset], reg */
+static void HLEmitStore(uint8_t **at, uint32_t offset, HLHostRegister reg)
+{
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0x89);
+    HLEmit8(at, (uint8_t)(0x83 | reg << 3));
+    HLEmit32(at, offset);
+}
+
+/* cmp reg, [rbx + offset] */
+static void
+HLEmitCompareMemory(uint8_t **at, HLHostRegister reg, uint32_t offset)
+{
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0x3B);
+    HLEmit8(at, (uint8_t)(0x83 | reg << 3));
+    HLEmit32(at, offset);
+}
+
+static void HLEmitLoadRegister(uint8_t **at, HLHostRegister reg, uint8_t guest)
+{
+    HLEmitLoad(at, reg, HLJITRegisterOffset(guest));
+}
+
+/* writes to RZ are dropped, so it stays zero without being rewritten */
+static void HLEmitStoreRegister(uint8_t **at, uint8_t guest, HLHostRegister reg)
+{
+    if (guest != HLRegRZ) {
+        HLEmitStore(at, HLJITRegisterOffset(guest), reg);
+    }
+}
+
+/* mov reg, value */
+static void HLEmitLoadConstant(uint8_t **at, HLHostRegister reg, uint64_t value)
+{
+    if ((uint64_t)(int64_t)(int32_t)value == value) {
+        HLEmit8(at, 0x48);
+        HLEmit8(at, 0xC7);
+        HLEmit8(at, (uint8_t)(0xC0 | reg));
+        HLEmit32(at, (uint32_t)value);
+        return;
+    }
+    HLEmit8(at, 0x48);
+    HLEmit8(at, (uint8_t)(0xB8 | reg));
+    HLEmit64(at, value);
+}
+
+/* op destination, source */
+static void HLEmitOperate(uint8_t **at,
+                          uint8_t opcode,
+                          HLHostRegister destination,
+                          HLHostRegister source)
+{
+    HLEmit8(at, 0x48);
+    HLEmit8(at, opcode);
+    HLEmit8(at, (uint8_t)(0xC0 | source << 3 | destination));
+}
+
+/* shl/shr/sar/ror reg, count */
+static void
+HLEmitShift(uint8_t **at, uint8_t operation, HLHostRegister reg, uint8_t count)
+{
+    if (count == 0) {
+        return;
+    }
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0xC1);
+    HLEmit8(at, (uint8_t)(0xC0 | operation << 3 | reg));
+    HLEmit8(at, count);
+}
+
+/* jcc rel32; returns the displacement for HLPatchJump to fill in */
+static uint8_t *HLEmitJumpIf(uint8_t **at, HLHostCondition condition)
+{
+    HLEmit8(at, 0x0F);
+    HLEmit8(at, (uint8_t)(0x80 | condition));
+    HLEmit32(at, 0);
+    return *at - 4;
+}
+
+/* jmp rel32 */
+static uint8_t *HLEmitJump(uint8_t **at)
+{
+    HLEmit8(at, 0xE9);
+    HLEmit32(at, 0);
+    return *at - 4;
+}
+
+static void HLPatchJump(uint8_t *displacement, const uint8_t *target)
+{
+    uint8_t *at = displacement;
+
+    HLEmit32(&at, (uint32_t)(int32_t)(target - (displacement + 4)));
+}
+
+/* function(system) */
+static void HLEmitCall(uint8_t **at, uint64_t function)
+{
+#ifdef _WIN32
+    /* mov rcx, rbx */
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0x89);
+    HLEmit8(at, 0xD9);
+#else
+    /* mov rdi, rbx */
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0x89);
+    HLEmit8(at, 0xDF);
+#endif
+    /* mov rax, imm64 */
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0xB8);
+    HLEmit64(at, function);
+    /* call rax */
+    HLEmit8(at, 0xFF);
+    HLEmit8(at, 0xD0);
+}
+
+/* handler(system, instruction) */
+static void HLEmitCallHandler(uint8_t **at,
+                              const struct HLDecodedInstruction *instruction)
+{
+#ifdef _WIN32
+    /* mov rdx, imm64 */
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0xBA);
+#else
+    /* mov rsi, imm64 */
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0xBE);
+#endif
+    HLEmit64(at, (uint64_t)(uintptr_t)instruction);
+    HLEmitCall(at, (uint64_t)(uintptr_t)instruction->handler);
+}
+
+static void HLEmitPrologue(uint8_t **at)
+{
+    /* push rbx; keeps the stack 16-byte aligned for calls */
+    HLEmit8(at, 0x53);
+    /* sub rsp, 32; shadow space for Win64 callees */
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0x83);
+    HLEmit8(at, 0xEC);
+    HLEmit8(at, 0x20);
+#ifdef _WIN32
+    /* mov rbx, rcx */
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0x89);
+    HLEmit8(at, 0xCB);
+#else
+    /* mov rbx, rdi */
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0x89);
+    HLEmit8(at, 0xFB);
+#endif
+}
+
+static void HLEmitEpilogue(uint8_t **at)
+{
+    /* add rsp, 32 */
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0x83);
+    HLEmit8(at, 0xC4);
+    HLEmit8(at, 0x20);
+    /* pop rbx */
+    HLEmit8(at, 0x5B);
+    /* ret */
+    HLEmit8(at, 0xC3);
+}
+
+/*
+ * Returns from the block if the handler just called faulted, or brought
+ * stopCycle forward so that the remaining cycles of the block no longer
+ * fit, say by scheduling an event or stopping the core. The block engine
+ * then runs what is left one instruction at a time, just as it would
+ * have without the JIT.
+ */
+static void HLEmitExitCheck(uint8_t **at, uint32_t remaining)
+{
+    uint8_t *faulted;
+    uint8_t *fits;
+
+    /* cmp byte [rbx + offset], 0 */
+    HLEmit8(at, 0x80);
+    HLEmit8(at, 0xBB);
+    HLEmit32(at, HLJITOffset(cpu.faulted));
+    HLEmit8(at, 0x00);
+    faulted = HLEmitJumpIf(at, HLHostNotEqual);
+    HLEmitLoad(at, HLHostRAX, HLJITOffset(cpu.cycles));
+    if (remaining != 0) {
+        /* add rax, imm32 */
+        HLEmit8(at, 0x48);
+        HLEmit8(at, 0x81);
+        HLEmit8(at, 0xC0);
+        HLEmit32(at, remaining);
+    }
+    HLEmitCompareMemory(at, HLHostRAX, HLJITOffset(cpu.stopCycle));
+    fits = HLEmitJumpIf(at, HLHostBelowOrEqual);
+    HLPatchJump(faulted, *at);
+    HLEmitEpilogue(at);
+    HLPatchJump(fits, *at);
+}
+
+/*
+ * Lazy flags, as HLSetFlags in the interpreter keeps them. Switching
+ * between comparison and arithmetic flags works the old ones out into
+ * Status first, which is a call, so it comes before any operands are
+ * loaded. This relies on HLLazyFlagsNone and HLLazyFlagsCompare coming
+ * before the arithmetic kinds.
+ */
+static void HLEmitPrepareFlags(uint8_t **at, HLLazyFlags kind)
+{
+    uint8_t *skip;
+
+    /* cmp byte [rbx + offset], imm8 */
+    HLEmit8(at, 0x80);
+    HLEmit8(at, 0xBB);
+    HLEmit32(at, HLJITOffset(cpu.flagsKind));
+    if (kind == HLLazyFlagsCompare) {
+        HLEmit8(at, HLLazyFlagsAdd);
+        skip = HLEmitJumpIf(at, HLHostBelow);
+    } else {
+        HLEmit8(at, HLLazyFlagsCompare);
+        skip = HLEmitJumpIf(at, HLHostNotEqual);
+    }
+    HLEmitCall(at, (uint64_t)(uintptr_t)HLSystemMaterializeFlags);
+    HLPatchJump(skip, *at);
+}
+
+/* defers flags of kind with the operands in rax and rcx, result in rdx */
+static void HLEmitSetFlags(uint8_t **at, HLLazyFlags kind)
+{
+    /* mov byte [rbx + offset], imm8 */
+    HLEmit8(at, 0xC6);
+    HLEmit8(at, 0x83);
+    HLEmit32(at, HLJITOffset(cpu.flagsKind));
+    HLEmit8(at, kind);
+    HLEmitStore(at, HLJITOffset(cpu.flagsA), HLHostRAX);
+    HLEmitStore(at, HLJITOffset(cpu.flagsB), HLHostRCX);
+    HLEmitStore(at, HLJITOffset(cpu.flagsResult), HLHostRDX);
+}
+
+/**
+ * The x86 form of an arithmetic or bitwise instruction, if it has one
+ * that computes the same thing: the "op r/m64, r64" opcode, or 0xAF for
+ * imul, and whether to invert the result afterwards.
+ */
+static bool HLDescribeBinaryOperation(HLOperation operation,
+                                      uint8_t *opcode,
+                                      bool *immediate,
+                                      bool *invert)
+{
+    *immediate = false;
+    *invert = false;
+    switch (operation) {
+    case HLOperation_addi:
+        *immediate = true;
+        /* fallthrough */
+    case HLOperation_addr:
+        *opcode = HLHostAdd;
+        return true;
+    case HLOperation_subi:
+        *immediate = true;
+        /* fallthrough */
+    case HLOperation_subr:
+        *opcode = HLHostSub;
+        return true;
+    case HLOperation_imuli:
+    case HLOperation_umuli:
+        *immediate = true;
+        /* fallthrough */
+    case HLOperation_imulr:
+    case HLOperation_umulr:
+        /* the low 64 bits of a product don't depend on signedness */
+        *opcode = 0xAF;
+        return true;
+    case HLOperation_andi:
+        *immediate = true;
+        /* fallthrough */
+    case HLOperation_andr:
+        *opcode = HLHostAnd;
+        return true;
+    case HLOperation_nori:
+        *invert = true;
+        /* fallthrough */
+    case HLOperation_ori:
+        *immediate = true;
+        *opcode = HLHostOr;
+        return true;
+    case HLOperation_norr:
+        *invert = true;
+        /* fallthrough */
+    case HLOperation_orr:
+        *opcode = HLHostOr;
+        return true;
+    case HLOperation_xori:
+        *immediate = true;
+        /* fallthrough */
+    case HLOperation_xorr:
+        *opcode = HLHostXor;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * How a conditional branch decides: by condition on the operands of a
+ * comparison, or otherwise by whether any bit of mask is set in Status.
+ */
+static void HLDescribeBranch(HLOperation operation,
+                             HLHostCondition *condition,
+                             uint64_t *mask,
+                             bool *takenIfSet)
+{
+    const uint64_t equal = HLFlag(HLFlagEqual);
+    const uint64_t less = HLFlag(HLFlagLess);
+    const uint64_t lessUnsigned = HLFlag(HLFlagLessUnsigned);
+
+    *takenIfSet = true;
+    switch (operation) {
+    case HLOperation_beq:
+        *condition = HLHostEqual;
+        *mask = equal;
+        break;
+    case HLOperation_bez:
+        *condition = HLHostEqual;
+        *mask = HLFlag(HLFlagZero);
+        break;
+    case HLOperation_blt:
+        *condition = HLHostLess;
+        *mask = less;
+        break;
+    case HLOperation_ble:
+        *condition = HLHostLessOrEqual;
+        *mask = less | equal;
+        break;
+    case HLOperation_bltu:
+        *condition = HLHostBelow;
+        *mask = lessUnsigned;
+        break;
+    case HLOperation_bleu:
+        *condition = HLHostBelowOrEqual;
+        *mask = lessUnsigned | equal;
+        break;
+    case HLOperation_bne:
+        *condition = HLHostNotEqual;
+        *mask = equal;
+        *takenIfSet = false;
+        break;
+    case HLOperation_bnz:
+        *condition = HLHostNotEqual;
+        *mask = HLFlag(HLFlagZero);
+        *takenIfSet = false;
+        break;
+    case HLOperation_bge:
+        *condition = HLHostGreaterOrEqual;
+        *mask = less;
+        *takenIfSet = false;
+        break;
+    case HLOperation_bgt:
+        *condition = HLHostGreater;
+        *mask = less | equal;
+        *takenIfSet = false;
+        break;
+    case HLOperation_bgeu:
+        *condition = HLHostAboveOrEqual;
+        *mask = lessUnsigned;
+        *takenIfSet = false;
+        break;
+    default:
+        *condition = HLHostAbove;
+        *mask = lessUnsigned | equal;
+        *takenIfSet = false;
+        break;
+    }
+}
+
+/* rde = (rde & keep) | value */
+static void HLEmitInsertConstant(uint8_t **at,
+                                 uint8_t rde,
+                                 uint64_t keep,
+                                 uint64_t value)
+{
+    HLEmitLoadRegister(at, HLHostRDX, rde);
+    HLEmitLoadConstant(at, HLHostRCX, keep);
+    HLEmitOperate(at, HLHostAnd, HLHostRDX, HLHostRCX);
+    HLEmitLoadConstant(at, HLHostRCX, value);
+    HLEmitOperate(at, HLHostOr, HLHostRDX, HLHostRCX);
+    HLEmitStoreRegister(at, rde, HLHostRDX);
+}
+
+/* a comparison of rax with rcx, then a branch by offset instructions */
+static void
+HLEmitCompareBranch(uint8_t **at, HLOperation branch, int64_t offset)
+{
+    HLHostCondition condition;
+    uint64_t mask;
+    bool takenIfSet;
+    uint8_t *notTaken;
+
+    HLDescribeBranch(branch, &condition, &mask, &takenIfSet);
+    HLEmitLoadConstant(at, HLHostRDX, 0);
+    HLEmitSetFlags(at, HLLazyFlagsCompare);
+    HLEmitOperate(at, HLHostCmp, HLHostRAX, HLHostRCX);
+    notTaken = HLEmitJumpIf(at, (HLHostCondition)(condition ^ 1));
+    HLEmitAddRegister(at, HLRegIP, (int32_t)(4 * offset));
+    HLPatchJump(notTaken, *at);
+}
+
+/*
+ * A conditional branch on the flags as they are. Deferred comparison
+ * flags are tested straight from their operands; anything else is
+ * worked out into Status and tested there.
+ */
+static void HLEmitBranch(uint8_t **at, HLOperation branch, int64_t offset)
+{
+    HLHostCondition condition;
+    uint64_t mask;
+    bool takenIfSet;
+    uint8_t *notCompare;
+    uint8_t *upToDate;
+    uint8_t *taken;
+    uint8_t *done[2];
+
+    HLDescribeBranch(branch, &condition, &mask, &takenIfSet);
+
+    /* movzx eax, byte [rbx + offset]; cmp al, imm8 */
+    HLEmit8(at, 0x0F);
+    HLEmit8(at, 0xB6);
+    HLEmit8(at, 0x83);
+    HLEmit32(at, HLJITOffset(cpu.flagsKind));
+    HLEmit8(at, 0x3C);
+    HLEmit8(at, HLLazyFlagsCompare);
+    notCompare = HLEmitJumpIf(at, HLHostNotEqual);
+    HLEmitLoad(at, HLHostRAX, HLJITOffset(cpu.flagsA));
+    HLEmitCompareMemory(at, HLHostRAX, HLJITOffset(cpu.flagsB));
+    taken = HLEmitJumpIf(at, condition);
+    done[0] = HLEmitJump(at);
+
+    HLPatchJump(notCompare, *at);
+    /* test al, al */
+    HLEmit8(at, 0x84);
+    HLEmit8(at, 0xC0);
+    upToDate = HLEmitJumpIf(at, HLHostEqual);
+    HLEmitCall(at, (uint64_t)(uintptr_t)HLSystemMaterializeFlags);
+    HLPatchJump(upToDate, *at);
+    /* test qword [rbx + offset], imm32 */
+    HLEmit8(at, 0x48);
+    HLEmit8(at, 0xF7);
+    HLEmit8(at, 0x83);
+    HLEmit32(at, HLJITRegisterOffset(HLRegStatus));
+    HLEmit32(at, (uint32_t)mask);
+    done[1] = HLEmitJumpIf(at, takenIfSet ? HLHostEqual : HLHostNotEqual);
+
+    HLPatchJump(taken, *at);
+    HLEmitAddRegister(at, HLRegIP, (int32_t)(4 * offset));
+    HLPatchJump(done[0], *at);
+    HLPatchJump(done[1], *at);
+}
+
+/**
+ * Emits a native template for instruction, which doesn't touch IP or
+ * Status. Returns false if it has none and needs its handler.
+ */
+static bool HLEmitOperation(uint8_t **at,
+                            const struct HLDecodedInstruction *instruction)
+{
+    uint64_t imm = (uint64_t)instruction->imm;
+    uint64_t keep = 0;
+    uint8_t opcode;
+    bool immediate;
+    bool invert;
+    int lane;
+
+    if (HLDescribeBinaryOperation(
+            instruction->operation, &opcode, &immediate, &invert)) {
+        if (instruction->operation == HLOperation_addr
+            || instruction->operation == HLOperation_addi) {
+            HLEmitPrepareFlags(at, HLLazyFlagsAdd);
+        } else if (instruction->operation == HLOperation_subr
+                   || instruction->operation == HLOperation_subi) {
+            HLEmitPrepareFlags(at, HLLazyFlagsSubtract);
+        }
+        HLEmitLoadRegister(at, HLHostRAX, instruction->rs1);
+        if (immediate) {
+            HLEmitLoadConstant(at, HLHostRCX, imm);
+        } else {
+            HLEmitLoadRegister(at, HLHostRCX, instruction->rs2);
+        }
+        HLEmitOperate(at, HLHostMov, HLHostRDX, HLHostRAX);
+        if (opcode == 0xAF) {
+            /* imul rdx, rcx */
+            HLEmit8(at, 0x48);
+            HLEmit8(at, 0x0F);
+            HLEmit8(at, 0xAF);
+            HLEmit8(at, 0xD1);
+        } else {
+            HLEmitOperate(at, opcode, HLHostRDX, HLHostRCX);
+        }
+        if (invert) {
+            /* not rdx */
+            HLEmit8(at, 0x48);
+            HLEmit8(at, 0xF7);
+            HLEmit8(at, 0xD2);
+        }
+        if (opcode == HLHostAdd) {
+            HLEmitSetFlags(at, HLLazyFlagsAdd);
+        } else if (opcode == HLHostSub) {
+            HLEmitSetFlags(at, HLLazyFlagsSubtract);
+        }
+        HLEmitStoreRegister(at, instruction->rde, HLHostRDX);
+        return true;
+    }
+
+    switch (instruction->operation) {
+    case HLOperationNop:
+        return true;
+    case HLOperationMove:
+        HLEmitLoadRegister(at, HLHostRDX, instruction->rs1);
+        HLEmitStoreRegister(at, instruction->rde, HLHostRDX);
+        return true;
+    case HLOperationMoveImmediate:
+        if (instruction->func) {
+            HLEmitPrepareFlags(at, HLLazyFlagsAdd);
+            HLEmitLoadConstant(at, HLHostRAX, 0);
+            HLEmitLoadConstant(at, HLHostRCX, imm);
+            HLEmitLoadConstant(at, HLHostRDX, imm);
+            HLEmitSetFlags(at, HLLazyFlagsAdd);
+        } else {
+            HLEmitLoadConstant(at, HLHostRDX, imm);
+        }
+        HLEmitStoreRegister(at, instruction->rde, HLHostRDX);
+        return true;
+    case HLOperationShiftLeftImmediate:
+    case HLOperationShiftRightArithmeticImmediate:
+    case HLOperationShiftRightLogicalImmediate:
+    case HLOperationBitImmediate:
+        HLEmitLoadRegister(at, HLHostRDX, instruction->rs1);
+        if (instruction->operation == HLOperationShiftLeftImmediate) {
+            HLEmitShift(at, HLHostShl, HLHostRDX, (uint8_t)imm);
+        } else if (instruction->operation
+                   == HLOperationShiftRightArithmeticImmediate) {
+            HLEmitShift(at, HLHostSar, HLHostRDX, (uint8_t)imm);
+        } else {
+            HLEmitShift(at, HLHostShr, HLHostRDX, (uint8_t)imm);
+        }
+        if (instruction->operation == HLOperationBitImmediate) {
+            /* and edx, 1 */
+            HLEmit8(at, 0x83);
+            HLEmit8(at, 0xE2);
+            HLEmit8(at, 0x01);
+        }
+        HLEmitStoreRegister(at, instruction->rde, HLHostRDX);
+        return true;
+    case HLOperation_cmpr:
+    case HLOperation_cmpi:
+    case HLOperationCompareZero:
+        if (instruction->operation == HLOperation_cmpi
+            && instruction->rde > 1) {
+            return false;
+        }
+        HLEmitPrepareFlags(at, HLLazyFlagsCompare);
+        if (instruction->operation == HLOperation_cmpr) {
+            HLEmitLoadRegister(at, HLHostRAX, instruction->rde);
+            HLEmitLoadRegister(at, HLHostRCX, instruction->rs1);
+        } else if (instruction->operation == HLOperationCompareZero) {
+            HLEmitLoadRegister(at, HLHostRAX, instruction->rs1);
+            HLEmitLoadConstant(at, HLHostRCX, 0);
+        } else if (instruction->rde == 0) {
+            HLEmitLoadRegister(at, HLHostRAX, instruction->rs1);
+            HLEmitLoadConstant(at, HLHostRCX, imm);
+        } else {
+            HLEmitLoadConstant(at, HLHostRAX, imm);
+            HLEmitLoadRegister(at, HLHostRCX, instruction->rs1);
+        }
+        HLEmitLoadConstant(at, HLHostRDX, 0);
+        HLEmitSetFlags(at, HLLazyFlagsCompare);
+        return true;
+    case HLOperation_lli:
+        HLEmitInsertConstant(
+            at, instruction->rde, ~(uint64_t)0xFFFF, (uint16_t)imm);
+        return true;
+    case HLOperation_lui:
+        HLEmitInsertConstant(at,
+                             instruction->rde,
+                             ~((uint64_t)0xFFFF << 16),
+                             (uint64_t)(uint16_t)imm << 16);
+        return true;
+    case HLOperation_lti:
+        HLEmitInsertConstant(at,
+                             instruction->rde,
+                             ~((uint64_t)0xFFFF << 32),
+                             (uint64_t)(uint16_t)imm << 32);
+        return true;
+    case HLOperation_ltui:
+        HLEmitInsertConstant(at,
+                             instruction->rde,
+                             ~((uint64_t)0xFFFF << 48),
+                             (uint64_t)(uint16_t)imm << 48);
+        return true;
+    case HLOperation_llis:
+    case HLOperation_luis:
+    case HLOperation_ltis:
+    case HLOperation_ltuis:
+        HLEmitLoadConstant(
+            at,
+            HLHostRDX,
+            imm << (16 * (instruction->operation - HLOperation_llis)));
+        HLEmitStoreRegister(at, instruction->rde, HLHostRDX);
+        return true;
+    case HLOperationLoadConstant:
+        for (lane = 0; lane < 4; lane++) {
+            if (instruction->func & (1 << lane)) {
+                keep |= (uint64_t)0xFFFF << (16 * lane);
+            }
+        }
+        HLEmitInsertConstant(at, instruction->rde, keep, imm);
+        return true;
+    case HLOperation_beq:
+    case HLOperation_bez:
+    case HLOperation_blt:
+    case HLOperation_ble:
+    case HLOperation_bltu:
+    case HLOperation_bleu:
+    case HLOperation_bne:
+    case HLOperation_bnz:
+    case HLOperation_bge:
+    case HLOperation_bgt:
+    case HLOperation_bgeu:
+    case HLOperation_bgtu:
+        HLEmitBranch(at, instruction->operation, instruction->imm);
+        return true;
+    case HLOperationCompareBranch:
+    case HLOperationCompareImmediateBranch:
+        HLEmitPrepareFlags(at, HLLazyFlagsCompare);
+        if (instruction->operation == HLOperationCompareBranch) {
+            HLEmitLoadRegister(at, HLHostRAX, instruction->rs1);
+            HLEmitLoadRegister(at, HLHostRCX, instruction->rs2);
+        } else if (instruction->rde == 0) {
+            HLEmitLoadRegister(at, HLHostRAX, instruction->rs1);
+            HLEmitLoadConstant(at, HLHostRCX, imm);
+        } else {
+            HLEmitLoadConstant(at, HLHostRAX, imm);
+            HLEmitLoadRegister(at, HLHostRCX, instruction->rs1);
+        }
+        HLEmitCompareBranch(at, instruction->func, instruction->branch);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * The width of a load or store as a shift of one byte, whether a load
+ * sign-extends, and whether it's a store. Returns false for anything else.
+ */
+static bool HLDescribeMemoryAccess(HLOperation operation,
+                                   uint8_t *shift,
+                                   bool *isSigned,
+                                   bool *isStore)
+{
+    *isSigned = false;
+    *isStore = false;
+    switch (operation) {
+    case HLOperation_sw:
+        *isStore = true;
+        /* fallthrough */
+    case HLOperation_lw:
+        *shift = 3;
+        return true;
+    case HLOperation_sh:
+        *isStore = true;
+        /* fallthrough */
+    case HLOperation_lh:
+        *shift = 2;
+        return true;
+    case HLOperation_lhs:
+        *isSigned = true;
+        *shift = 2;
+        return true;
+    case HLOperation_sq:
+        *isStore = true;
+        /* fallthrough */
+    case HLOperation_lq:
+        *shift = 1;
+        return true;
+    case HLOperation_lqs:
+        *isSigned = true;
+        *shift = 1;
+        return true;
+    case HLOperation_sb:
+        *isStore = true;
+        /* fallthrough */
+    case HLOperation_lb:
+        *shift = 0;
+        return true;
+    case HLOperation_lbs:
+        *isSigned = true;
+        *shift = 0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * A load or store through the interpreter's kernel mode fast path: an
+ * aligned access inside physical memory goes straight to it. Stores also
+ * need dirty page tracking to be off and the page not to hold code, since
+ * those have to be reported. Anything else, including every user mode
+ * access, calls the handler, which can fault.
+ */
+static void HLEmitMemoryAccess(uint8_t **at,
+                               const struct HLDecodedInstruction *instruction,
+                               uint32_t remaining)
+{
+    uint8_t shift;
+    bool isSigned;
+    bool isStore;
+    uint8_t *slow[3];
+    int slowCount = 0;
+    uint8_t *notCode;
+    uint8_t *done;
+    int i;
+
+    HLDescribeMemoryAccess(instruction->operation, &shift, &isSigned, &isStore);
+
+    /* rax = rs1 + size * imm + (rs2 << func) */
+    HLEmitLoadRegister(at, HLHostRAX, instruction->rs1);
+    if (instruction->imm != 0) {
+        HLEmitLoadConstant(at, HLHostRCX, (uint64_t)instruction->imm << shift);
+        HLEmitOperate(at, HLHostAdd, HLHostRAX, HLHostRCX);
+    }
+    if (instruction->rs2 != HLRegRZ) {
+        HLEmitLoadRegister(at, HLHostRCX, instruction->rs2);
+        HLEmitShift(at, HLHostShl, HLHostRCX, instruction->func);
+        HLEmitOperate(at, HLHostAdd, HLHostRAX, HLHostRCX);
+    }
+
+    /* HLMemoryManagementUnitInBounds(rax, shift, physicalLimit) */
+    HLEmitOperate(at, HLHostMov, HLHostRCX, HLHostRAX);
+    HLEmitShift(at, HLHostRor, HLHostRCX, shift);
+    HLEmitLoad(at, HLHostRDX, HLJITOffset(cpu.physicalLimit));
+    HLEmitShift(at, HLHostShr, HLHostRDX, shift);
+    HLEmitOperate(at, HLHostCmp, HLHostRCX, HLHostRDX);
+    slow[slowCount++] = HLEmitJumpIf(at, HLHostAboveOrEqual);
+
+    if (isStore) {
+        /* cmp qword [rbx + offset], 0 */
+        HLEmit8(at, 0x48);
+        HLEmit8(at, 0x83);
+        HLEmit8(at, 0xBB);
+        HLEmit32(at, HLJITOffset(memory.dirtyPageCount));
+        HLEmit8(at, 0x00);
+        slow[slowCount++] = HLEmitJumpIf(at, HLHostNotEqual);
+
+        HLEmitOperate(at, HLHostMov, HLHostRCX, HLHostRAX);
+        HLEmitShift(at, HLHostShr, HLHostRCX, HLPageShift);
+        HLEmitCompareMemory(at, HLHostRCX, HLJITOffset(memory.codePageCount));
+        notCode = HLEmitJumpIf(at, HLHostAboveOrEqual);
+        HLEmitLoad(at, HLHostRDX, HLJITOffset(memory.codePages));
+        /* cmp byte [rdx + rcx], 0 */
+        HLEmit8(at, 0x80);
+        HLEmit8(at, 0x3C);
+        HLEmit8(at, 0x0A);
+        HLEmit8(at, 0x00);
+        slow[slowCount++] = HLEmitJumpIf(at, HLHostNotEqual);
+        HLPatchJump(notCode, *at);
+
+        HLEmitLoadRegister(at, HLHostRDX, instruction->rde);
+    }
+
+    /* rcx + rax addresses the access; rdx holds the value */
+    HLEmitLoad(at, HLHostRCX, HLJITOffset(memory.memory));
+    if (isStore) {
+        switch (shift) {
+        case 3:
+            HLEmit8(at, 0x48);
+            HLEmit8(at, 0x89);
+            break;
+        case 2:
+            HLEmit8(at, 0x89);
+            break;
+        case 1:
+            HLEmit8(at, 0x66);
+            HLEmit8(at, 0x89);
+            break;
+        default:
+            HLEmit8(at, 0x88);
+            break;
+        }
+    } else {
+        switch (shift) {
+        case 3:
+            HLEmit8(at, 0x48);
+            HLEmit8(at, 0x8B);
+            break;
+        case 2:
+            if (isSigned) {
+                /* movsxd */
+                HLEmit8(at, 0x48);
+                HLEmit8(at, 0x63);
+            } else {
+                HLEmit8(at, 0x8B);
+            }
+            break;
+        default:
+            /* movzx or movsx from a word or byte */
+            if (isSigned) {
+                HLEmit8(at, 0x48);
+            }
+            HLEmit8(at, 0x0F);
+            HLEmit8(at, (uint8_t)((shift == 1 ? 0xB7 : 0xB6) | isSigned << 3));
+            break;
+        }
+    }
+    HLEmit8(at, 0x14);
+    HLEmit8(at, 0x01);
+    if (!isStore) {
+        HLEmitStoreRegister(at, instruction->rde, HLHostRDX);
+    }
+    done = HLEmitJump(at);
+
+    for (i = 0; i < slowCount; i++) {
+        HLPatchJump(slow[i], *at);
+    }
+    HLEmitCallHandler(at, instruction);
+    HLEmitExitCheck(at, remaining);
+    HLPatchJump(done, *at);
+}
+
+/** Whether instruction names IP or Status, which only handlers deal with. */
+static bool
+HLUsesControlRegisters(const struct HLDecodedInstruction *instruction)
+{
+    return instruction->rde == HLRegIP || instruction->rde == HLRegStatus
+           || instruction->rs1 == HLRegIP || instruction->rs1 == HLRegStatus
+           || instruction->rs2 == HLRegIP || instruction->rs2 == HLRegStatus;
+}
+
+/** Drops every native block so the code buffer can be reused. */
+static void HLJITReset(struct HLSystem *system)
+{
+    size_t i;
+
+    for (i = 0; i < HLBlockCacheSize; i++) {
+        system->blockCache->blocks[i].native = NULL;
+    }
+    system->jit->used = 0;
+    system->jit->resets++;
+}
+
+bool HLJITCompile(struct HLSystem *system, struct HLBlock *block)
+{
+    struct HLJIT *jit = system->jit;
+    const struct HLDecodedInstruction *instruction;
+    uint8_t *start;
+    uint8_t *at;
+    /* guest IP advance not yet written back to the register file */
+    int64_t pendingIP = 0;
+    /* likewise for the cycle count */
+    int32_t pendingCycles = 0;
+    /* cycles the instructions after the current one count */
+    uint32_t remaining = block->cycles;
+    uint8_t shift;
+    bool isSigned;
+    bool isStore;
+    int i;
+
+    if (HLJITCodeSize - jit->used
+        < HLJITMaxFrameSize + HLJITMaxInstructionSize * block->length) {
+        HLJITReset(system);
+    }
+
+    if (!HLJITProtect(jit, true)) {
+        return false;
+    }
+    start = jit->code + jit->used;
+    at = start;
+
+    HLEmitPrologue(&at);
+
+    for (i = 0; i < block->length; i++) {
+        instruction = &block->instructions[i];
+        remaining -= instruction->length;
+        pendingIP += 4;
+        pendingCycles++;
+
+        if (instruction->operation == HLOperation_bra) {
+            pendingIP += 4 * instruction->imm;
+            continue;
+        }
+        if (!HLUsesControlRegisters(instruction)) {
+            if (HLDescribeMemoryAccess(
+                    instruction->operation, &shift, &isSigned, &isStore)) {
+                /* the slow path's handler may fault, so IP has to be right */
+                HLEmitAddRegister(&at, HLRegIP, (int32_t)pendingIP);
+                pendingIP = 0;
+                HLEmitAddCycles(&at, pendingCycles);
+                pendingCycles = 0;
+                HLEmitMemoryAccess(&at, instruction, remaining);
+                continue;
+            }
+            /*
+             * the block engine only enters native code with the whole
+             * block in budget, and the exit checks leave it as soon as
+             * the rest doesn't fit, so fused operations never have to be
+             * split the way HLExecFused does
+             */
+            if (HLEmitOperation(&at, instruction)) {
+                pendingIP += 4 * (instruction->length - 1);
+                pendingCycles += instruction->length - 1;
+                continue;
+            }
+        }
+
+        /*
+         * handlers see IP pointing past their instruction and the cycle
+         * count including it, as usual
+         */
+        HLEmitAddRegister(&at, HLRegIP, (int32_t)pendingIP);
+        pendingIP = 0;
+        HLEmitAddCycles(&at, pendingCycles);
+        pendingCycles = 0;
+        HLEmitCallHandler(&at, instruction);
+        HLEmitExitCheck(&at, remaining);
+    }
+
+    HLEmitAddRegister(&at, HLRegIP, (int32_t)pendingIP);
+    HLEmitAddCycles(&at, pendingCycles);
+    HLEmitEpilogue(&at);
+
+    if (!HLJITProtect(jit, false)) {
+        /* none of the buffer can run any more */
+        HLJITReset(system);
+        return false;
+    }
+    jit->used += at - start;
+    jit->compiledBlocks++;
+    block->native = (HLNativeBlock)(void *)start;
+    return true;
+}
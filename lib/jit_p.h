@@ -0,0 +1,63 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_JIT_P_H
+#define HALLEY_JIT_P_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Whether the x86-64 JIT is built. Set by the build; without it
+ * HLExecutionEngineJIT behaves like HLExecutionEngineBlocks.
+ */
+#ifndef HL_JIT
+#define HL_JIT 0
+#endif
+
+struct HLSystem;
+struct HLBlock;
+
+/** size of the executable buffer native blocks are emitted into */
+#define HLJITCodeSize (1024 * 1024)
+/** executions of a block before it is compiled */
+#define HLJITDefaultThreshold 16
+
+/**
+ * Native code for a block. It performs exactly what interpreting the
+ * block's instructions in order would, including updating IP.
+ */
+typedef void (*HLNativeBlock)(struct HLSystem *system);
+
+struct HLJIT {
+    uint8_t *code;
+    size_t used;
+    uint32_t threshold;
+
+    uint64_t compiledBlocks;
+    /** times the code buffer filled up and every native block was dropped */
+    uint64_t resets;
+};
+
+bool HLJITInit(struct HLJIT *jit);
+void HLJITDone(struct HLJIT *jit);
+
+/**
+ * Emits native code for block and stores it in block->native.
+ * Returns false if the block was left to the interpreter.
+ */
+bool HLJITCompile(struct HLSystem *system, struct HLBlock *block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
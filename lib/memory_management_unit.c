@@ -6,8 +6,11 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "memory_management_unit_p.h"
+#include "system_p.h"
+#include "thread_p.h"
 
 #define HLPDEValid(pde) (pde & 0b1)
 #define HLPDEOverride(pde) ((pde >> 1) & 0b1)
@@ -61,7 +64,7 @@
     }                                                                          \
     next = HLPDENext(this);
 
-uint64_t HLMemoryManagementUnitTranslateAddress(
+static uint64_t HLMemoryManagementUnitWalkPageTables(
     struct HLMemoryManagementUnit *mmu,
     uint64_t address,
     HLMemoryPermission requiredPermissions,
@@ -133,6 +136,113 @@ uint64_t HLMemoryManagementUnitTranslateAddress(
     #undef physicalIndex
 }
 
+static void HLMemoryManagementUnitFillTranslationCache(
+    struct HLMemoryManagementUnit *mmu,
+    uint64_t page,
+    uint64_t physicalPage,
+    HLMemoryPermission permissions)
+{
+    struct HLTranslationCacheEntry *set = HLTranslationCacheSet(mmu, page);
+    uint8_t *victim =
+        &mmu->translationCache.nextVictim[page & (HLTranslationCacheSets - 1)];
+    uint8_t *host = NULL;
+    int way;
+
+    if (physicalPage < mmu->memoryLimit
+        && mmu->memoryLimit - physicalPage >= HLPageSize) {
+        host = mmu->memory + physicalPage;
+    }
+
+    /* a walk for another permission may already have cached this page */
+    for (way = 0; way < HLTranslationCacheWays; way++) {
+        if (set[way].permissions != HLMemoryPermissionNone
+            && set[way].virtualPage == page) {
+            set[way].physicalPage = physicalPage;
+            set[way].host = host;
+            set[way].permissions |= permissions;
+            return;
+        }
+    }
+
+    way = *victim;
+    *victim = (way + 1) % HLTranslationCacheWays;
+
+    set[way].virtualPage = page;
+    set[way].physicalPage = physicalPage;
+    set[way].host = host;
+    set[way].permissions = permissions;
+}
+
+uint64_t HLMemoryManagementUnitTranslateAddress(
+    struct HLMemoryManagementUnit *mmu,
+    uint64_t address,
+    HLMemoryPermission requiredPermissions,
+    HLMemoryResult *code)
+{
+    uint64_t page = address >> HLPageShift;
+    struct HLTranslationCacheEntry *set = HLTranslationCacheSet(mmu, page);
+    uint64_t physical;
+    int way;
+
+    for (way = 0; way < HLTranslationCacheWays; way++) {
+        if (set[way].virtualPage == page
+            && set[way].permissions != HLMemoryPermissionNone
+            && (set[way].permissions & requiredPermissions)
+                   == requiredPermissions) {
+            mmu->translationCache.hits++;
+            return set[way].physicalPage + (address & HLPageOffsetMask);
+        }
+    }
+
+    mmu->translationCache.misses++;
+
+    physical = HLMemoryManagementUnitWalkPageTables(mmu,
+                                                   address,
+                                                   requiredPermissions,
+                                                   code);
+    if (*code != HLMemoryResultOK) {
+        return physical;
+    }
+
+    HLMemoryManagementUnitFillTranslationCache(mmu,
+                                               page,
+                                               physical & ~HLPageOffsetMask,
+                                               requiredPermissions);
+    return physical;
+}
+
+void HLMemoryManagementUnitFlushTranslationCache(
+    struct HLMemoryManagementUnit *mmu)
+{
+    memset(mmu->translationCache.entries,
+           0,
+           sizeof(mmu->translationCache.entries));
+    memset(mmu->translationCache.nextVictim,
+           0,
+           sizeof(mmu->translationCache.nextVictim));
+    if (mmu->translationObserver != NULL) {
+        mmu->translationObserver(mmu->translationObserverData, 0, true);
+    }
+}
+
+void HLMemoryManagementUnitInvalidateTranslationCachePage(
+    struct HLMemoryManagementUnit *mmu,
+    uint64_t address)
+{
+    uint64_t page = address >> HLPageShift;
+    struct HLTranslationCacheEntry *set = HLTranslationCacheSet(mmu, page);
+    int way;
+
+    for (way = 0; way < HLTranslationCacheWays; way++) {
+        if (set[way].virtualPage == page) {
+            set[way].permissions = HLMemoryPermissionNone;
+        }
+    }
+    if (mmu->translationObserver != NULL) {
+        mmu->translationObserver(mmu->translationObserverData, address, false);
+    }
+}
+
 static bool HLMemoryManagementUnitDoTranslateAddress(
     struct HLMemoryManagementUnit *mmu,
     uint64_t *address,
@@ -176,6 +286,13 @@ uint8_t HLMemoryManagementUnitReadVirtualUInt8(
     uint64_t address,
     HLMemoryResult *code)
 {
+    uint8_t *host;
+
+    HLMemoryManagementUnitHostAddress(
+        mmu, address, 8, HLMemoryPermissionRead, host);
+    if (host != NULL) {
+        return HLMemoryManagementUnitLoad(host, 8, 0);
+    }
     if (!HLMemoryManagementUnitDoTranslateAddress(mmu,
                                                   &address,
                                                   HLMemoryPermissionRead,
@@ -189,6 +306,13 @@ uint16_t HLMemoryManagementUnitReadVirtualUInt16(
     uint64_t address,
     HLMemoryResult *code)
 {
+    uint8_t *host;
+
+    HLMemoryManagementUnitHostAddress(
+        mmu, address, 16, HLMemoryPermissionRead, host);
+    if (host != NULL) {
+        return HLMemoryManagementUnitLoad(host, 16, 0);
+    }
     if (!HLMemoryManagementUnitDoTranslateAddress(mmu,
                                                   &address,
                                                   HLMemoryPermissionRead,
@@ -202,6 +326,13 @@ uint32_t HLMemoryManagementUnitReadVirtualUInt32(
     uint64_t address,
     HLMemoryResult *code)
 {
+    uint8_t *host;
+
+    HLMemoryManagementUnitHostAddress(
+        mmu, address, 32, HLMemoryPermissionRead, host);
+    if (host != NULL) {
+        return HLMemoryManagementUnitLoad(host, 32, 0);
+    }
     if (!HLMemoryManagementUnitDoTranslateAddress(mmu,
                                                   &address,
                                                   HLMemoryPermissionRead,
@@ -215,6 +346,13 @@ uint64_t HLMemoryManagementUnitReadVirtualUInt64(
     uint64_t address,
     HLMemoryResult *code)
 {
+    uint8_t *host;
+
+    HLMemoryManagementUnitHostAddress(
+        mmu, address, 64, HLMemoryPermissionRead, host);
+    if (host != NULL) {
+        return HLMemoryManagementUnitLoad(host, 64, 0);
+    }
     if (!HLMemoryManagementUnitDoTranslateAddress(mmu,
                                                   &address,
                                                   HLMemoryPermissionRead,
@@ -230,6 +368,17 @@ void HLMemoryManagementUnitWriteVirtualUInt8(
     uint8_t value,
     HLMemoryResult *code)
 {
+    uint8_t *host;
+
+    HLMemoryManagementUnitHostAddress(
+        mmu, address, 8, HLMemoryPermissionWrite, host);
+    if (host != NULL) {
+        HLMemoryManagementUnitStore(host, 8, 0, value);
+        address = (uint64_t)(host - mmu->memory);
+        HLMemoryManagementUnitMarkDirty(mmu, address)
+        HLMemoryManagementUnitNotifyCodeWrite(mmu, address, 8)
+        return;
+    }
     if (!HLMemoryManagementUnitDoTranslateAddress(mmu,
                                                   &address,
                                                   HLMemoryPermissionWrite,
@@ -244,6 +393,17 @@ void HLMemoryManagementUnitWriteVirtualUInt16(
     uint16_t value,
     HLMemoryResult *code)
 {
+    uint8_t *host;
+
+    HLMemoryManagementUnitHostAddress(
+        mmu, address, 16, HLMemoryPermissionWrite, host);
+    if (host != NULL) {
+        HLMemoryManagementUnitStore(host, 16, 0, value);
+        address = (uint64_t)(host - mmu->memory);
+        HLMemoryManagementUnitMarkDirty(mmu, address)
+        HLMemoryManagementUnitNotifyCodeWrite(mmu, address, 16)
+        return;
+    }
     if (!HLMemoryManagementUnitDoTranslateAddress(mmu,
                                                   &address,
                                                   HLMemoryPermissionWrite,
@@ -258,6 +418,17 @@ void HLMemoryManagementUnitWriteVirtualUInt32(
     uint32_t value,
     HLMemoryResult *code)
 {
+    uint8_t *host;
+
+    HLMemoryManagementUnitHostAddress(
+        mmu, address, 32, HLMemoryPermissionWrite, host);
+    if (host != NULL) {
+        HLMemoryManagementUnitStore(host, 32, 0, value);
+        address = (uint64_t)(host - mmu->memory);
+        HLMemoryManagementUnitMarkDirty(mmu, address)
+        HLMemoryManagementUnitNotifyCodeWrite(mmu, address, 32)
+        return;
+    }
     if (!HLMemoryManagementUnitDoTranslateAddress(mmu,
                                                   &address,
                                                   HLMemoryPermissionWrite,
@@ -272,6 +443,17 @@ void HLMemoryManagementUnitWriteVirtualUInt64(
     uint64_t value,
     HLMemoryResult *code)
 {
+    uint8_t *host;
+
+    HLMemoryManagementUnitHostAddress(
+        mmu, address, 64, HLMemoryPermissionWrite, host);
+    if (host != NULL) {
+        HLMemoryManagementUnitStore(host, 64, 0, value);
+        address = (uint64_t)(host - mmu->memory);
+        HLMemoryManagementUnitMarkDirty(mmu, address)
+        HLMemoryManagementUnitNotifyCodeWrite(mmu, address, 64)
+        return;
+    }
     if (!HLMemoryManagementUnitDoTranslateAddress(mmu,
                                                   &address,
                                                   HLMemoryPermissionWrite,
@@ -296,9 +478,6 @@ void HLMemoryManagementUnitWriteVirtualUInt64(
 #define HLMemoryManagementUnitCheckVoid(mmu, address, size)                    \
     HLMemoryManagementUnitCheckDetail(mmu, address, size, )
 
-#define HLMemoryManagementUnitIndex(base, size, address)                       \
-    ((uint##size##_t *)(base))[address / sizeof(uint##size##_t)]
-
 void HLMemoryManagementUnitWritePhysicalUInt8(
     struct HLMemoryManagementUnit *mmu,
     uint64_t address,
@@ -306,7 +485,9 @@ void HLMemoryManagementUnitWritePhysicalUInt8(
     HLMemoryResult *code)
 {
     HLMemoryManagementUnitCheckVoid(mmu, address, 8)
-    HLMemoryManagementUnitIndex(mmu->memory, 8, address) = value;
+    HLMemoryManagementUnitStore(mmu->memory, 8, address, value);
+    HLMemoryManagementUnitMarkDirty(mmu, address)
+    HLMemoryManagementUnitNotifyCodeWrite(mmu, address, 8)
 }
 void HLMemoryManagementUnitWritePhysicalUInt16(
     struct HLMemoryManagementUnit *mmu,
@@ -315,7 +496,9 @@ void HLMemoryManagementUnitWritePhysicalUInt16(
     HLMemoryResult *code)
 {
     HLMemoryManagementUnitCheckVoid(mmu, address, 16)
-    HLMemoryManagementUnitIndex(mmu->memory, 16, address) = value;
+    HLMemoryManagementUnitStore(mmu->memory, 16, address, value);
+    HLMemoryManagementUnitMarkDirty(mmu, address)
+    HLMemoryManagementUnitNotifyCodeWrite(mmu, address, 16)
 }
 void HLMemoryManagementUnitWritePhysicalUInt32(
     struct HLMemoryManagementUnit *mmu,
@@ -324,7 +507,9 @@ void HLMemoryManagementUnitWritePhysicalUInt32(
     HLMemoryResult *code)
 {
     HLMemoryManagementUnitCheckVoid(mmu, address, 32)
-    HLMemoryManagementUnitIndex(mmu->memory, 32, address) = value;
+    HLMemoryManagementUnitStore(mmu->memory, 32, address, value);
+    HLMemoryManagementUnitMarkDirty(mmu, address)
+    HLMemoryManagementUnitNotifyCodeWrite(mmu, address, 32)
 }
 void HLMemoryManagementUnitWritePhysicalUInt64(
     struct HLMemoryManagementUnit *mmu,
@@ -333,7 +518,9 @@ void HLMemoryManagementUnitWritePhysicalUInt64(
     HLMemoryResult *code)
 {
     HLMemoryManagementUnitCheckVoid(mmu, address, 64)
-    HLMemoryManagementUnitIndex(mmu->memory, 64, address) = value;
+    HLMemoryManagementUnitStore(mmu->memory, 64, address, value);
+    HLMemoryManagementUnitMarkDirty(mmu, address)
+    HLMemoryManagementUnitNotifyCodeWrite(mmu, address, 64)
 }
 
 uint8_t HLMemoryManagementUnitReadPhysicalUInt8(
@@ -342,7 +529,7 @@ uint8_t HLMemoryManagementUnitReadPhysicalUInt8(
     HLMemoryResult *code)
 {
     HLMemoryManagementUnitCheck(mmu, address, 8)
-    return HLMemoryManagementUnitIndex(mmu->memory, 8, address);
+    return HLMemoryManagementUnitLoad(mmu->memory, 8, address);
 }
 uint16_t HLMemoryManagementUnitReadPhysicalUInt16(
     struct HLMemoryManagementUnit *mmu,
@@ -350,7 +537,7 @@ uint16_t HLMemoryManagementUnitReadPhysicalUInt16(
     HLMemoryResult *code)
 {
     HLMemoryManagementUnitCheck(mmu, address, 16)
-    return HLMemoryManagementUnitIndex(mmu->memory, 16, address);
+    return HLMemoryManagementUnitLoad(mmu->memory, 16, address);
 }
 uint32_t HLMemoryManagementUnitReadPhysicalUInt32(
     struct HLMemoryManagementUnit *mmu,
@@ -358,7 +545,7 @@ uint32_t HLMemoryManagementUnitReadPhysicalUInt32(
     HLMemoryResult *code)
 {
     HLMemoryManagementUnitCheck(mmu, address, 32)
-    return HLMemoryManagementUnitIndex(mmu->memory, 32, address);
+    return HLMemoryManagementUnitLoad(mmu->memory, 32, address);
 }
 uint64_t HLMemoryManagementUnitReadPhysicalUInt64(
     struct HLMemoryManagementUnit *mmu,
@@ -366,5 +553,239 @@ uint64_t HLMemoryManagementUnitReadPhysicalUInt64(
     HLMemoryResult *code)
 {
     HLMemoryManagementUnitCheck(mmu, address, 64)
-    return HLMemoryManagementUnitIndex(mmu->memory, 64, address);
+    return HLMemoryManagementUnitLoad(mmu->memory, 64, address);
+}
+
+typedef uint8_t HLMemoryBulkOperation;
+enum {
+    HLMemoryBulkRead,
+    HLMemoryBulkWrite,
+    HLMemoryBulkFill,
+};
+
+/** Marks [address, address + size) dirty and reports code writes in it. */
+void HLMemoryManagementUnitWritten(struct HLMemoryManagementUnit *mmu,
+                                   uint64_t address,
+                                   uint64_t size)
+{
+    uint64_t end = address + size;
+    uint64_t chunk;
+
+    for (; address < end; address += chunk) {
+        chunk = HLPageSize - (address & HLPageOffsetMask);
+        if (chunk > end - address) {
+            chunk = end - address;
+        }
+        HLMemoryManagementUnitMarkDirty(mmu, address)
+        if ((address >> HLPageShift) < mmu->codePageCount
+            && HLAtomicLoadRelaxed(uint8_t,
+                                   &mmu->codePages[address >> HLPageShift])) {
+            mmu->codeWriteObserver(mmu->codeWriteObserverData,
+                                   address,
+                                   chunk);
+        }
+    }
+}
+
+/**
+ * Does operation on [address, address + size) a page at a time, checking
+ * and, for virtual ranges, translating each page once. Returns the number
+ * of bytes done before the first page that can't be accessed.
+ */
+static uint64_t HLMemoryManagementUnitBulk(struct HLMemoryManagementUnit *mmu,
+                                           uint64_t address,
+                                           uint64_t size,
+                                           bool virtual,
+                                           HLMemoryBulkOperation operation,
+                                           uint8_t *data,
+                                           uint8_t value,
+                                           HLMemoryResult *code)
+{
+    uint64_t done = 0;
+    uint64_t physical;
+    uint64_t chunk;
+    bool fault;
+
+    while (done < size) {
+        physical = address + done;
+        chunk = HLPageSize - (physical & HLPageOffsetMask);
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+
+        if (virtual
+            && !HLMemoryManagementUnitDoTranslateAddress(
+                mmu,
+                &physical,
+                operation == HLMemoryBulkRead ? HLMemoryPermissionRead
+                                              : HLMemoryPermissionWrite,
+                code)) {
+            return done;
+        }
+
+        /* the part of the page below memoryLimit still happens */
+        fault = physical >= mmu->memoryLimit
+                || chunk > mmu->memoryLimit - physical;
+        if (fault) {
+            chunk = physical < mmu->memoryLimit ? mmu->memoryLimit - physical
+                                                : 0;
+        }
+
+        if (chunk > 0 && operation == HLMemoryBulkRead) {
+            memcpy(data + done, mmu->memory + physical, (size_t)chunk);
+        } else if (chunk > 0) {
+            if (operation == HLMemoryBulkWrite) {
+                memcpy(mmu->memory + physical, data + done, (size_t)chunk);
+            } else {
+                memset(mmu->memory + physical, value, (size_t)chunk);
+            }
+
+            HLMemoryManagementUnitWritten(mmu, physical, chunk);
+        }
+
+        done += chunk;
+        if (fault) {
+            *code = HLMemoryResultBus;
+            return done;
+        }
+    }
+
+    return done;
+}
+
+uint64_t HLMemoryManagementUnitReadPhysical(struct HLMemoryManagementUnit *mmu,
+                                            uint64_t address,
+                                            void *data,
+                                            uint64_t size,
+                                            HLMemoryResult *code)
+{
+    return HLMemoryManagementUnitBulk(
+        mmu, address, size, false, HLMemoryBulkRead, data, 0, code);
+}
+uint64_t HLMemoryManagementUnitWritePhysical(
+    struct HLMemoryManagementUnit *mmu,
+    uint64_t address,
+    const void *data,
+    uint64_t size,
+    HLMemoryResult *code)
+{
+    return HLMemoryManagementUnitBulk(mmu,
+                                      address,
+                                      size,
+                                      false,
+                                      HLMemoryBulkWrite,
+                                      (uint8_t *)data,
+                                      0,
+                                      code);
+}
+uint64_t HLMemoryManagementUnitFillPhysical(struct HLMemoryManagementUnit *mmu,
+                                            uint64_t address,
+                                            uint8_t value,
+                                            uint64_t size,
+                                            HLMemoryResult *code)
+{
+    return HLMemoryManagementUnitBulk(
+        mmu, address, size, false, HLMemoryBulkFill, NULL, value, code);
+}
+
+uint64_t HLMemoryManagementUnitCopyPhysical(
+    struct HLMemoryManagementUnit *mmu,
+    uint64_t destination,
+    uint64_t source,
+    uint64_t size,
+    HLMemoryResult *code)
+{
+    /* physical memory is contiguous, so only its end can cut this short */
+    uint64_t done = size;
+
+    if (source >= mmu->memoryLimit || destination >= mmu->memoryLimit) {
+        done = 0;
+    } else {
+        if (done > mmu->memoryLimit - source) {
+            done = mmu->memoryLimit - source;
+        }
+        if (done > mmu->memoryLimit - destination) {
+            done = mmu->memoryLimit - destination;
+        }
+    }
+
+    if (done > 0) {
+        memmove(mmu->memory + destination,
+                mmu->memory + source,
+                (size_t)done);
+        HLMemoryManagementUnitWritten(mmu, destination, done);
+    }
+    if (done < size) {
+        *code = HLMemoryResultBus;
+    }
+    return done;
+}
+
+uint64_t HLMemoryManagementUnitReadVirtual(struct HLMemoryManagementUnit *mmu,
+                                           uint64_t address,
+                                           void *data,
+                                           uint64_t size,
+                                           HLMemoryResult *code)
+{
+    return HLMemoryManagementUnitBulk(
+        mmu, address, size, true, HLMemoryBulkRead, data, 0, code);
+}
+uint64_t HLMemoryManagementUnitWriteVirtual(struct HLMemoryManagementUnit *mmu,
+                                            uint64_t address,
+                                            const void *data,
+                                            uint64_t size,
+                                            HLMemoryResult *code)
+{
+    return HLMemoryManagementUnitBulk(mmu,
+                                      address,
+                                      size,
+                                      true,
+                                      HLMemoryBulkWrite,
+                                      (uint8_t *)data,
+                                      0,
+                                      code);
+}
+uint64_t HLMemoryManagementUnitFillVirtual(struct HLMemoryManagementUnit *mmu,
+                                           uint64_t address,
+                                           uint8_t value,
+                                           uint64_t size,
+                                           HLMemoryResult *code)
+{
+    return HLMemoryManagementUnitBulk(
+        mmu, address, size, true, HLMemoryBulkFill, NULL, value, code);
+}
+
+void HLMemoryManagementUnitPortWrite(void *userData,
+                                     struct HLSystem *core,
+                                     uint16_t port,
+                                     uint64_t value)
+{
+    struct HLMemoryManagementUnit *mmu = &core->memory;
+
+    switch ((HLMemoryManagementUnitPort)(port
+                                         - HLMemoryManagementUnitPortBase)) {
+    case HLMemoryManagementUnitPortPageTableBase:
+        mmu->pageTableBase = value;
+        HLMemoryManagementUnitFlushTranslationCache(mmu);
+        break;
+    case HLMemoryManagementUnitPortInvalidatePage:
+        HLMemoryManagementUnitInvalidateTranslationCachePage(mmu, value);
+        break;
+    case HLMemoryManagementUnitPortFlush:
+        HLMemoryManagementUnitFlushTranslationCache(mmu);
+        break;
+    default:
+        break;
+    }
+}
+
+uint64_t HLMemoryManagementUnitPortRead(void *userData,
+                                        struct HLSystem *core,
+                                        uint16_t port)
+{
+    if (port - HLMemoryManagementUnitPortBase
+        == HLMemoryManagementUnitPortPageTableBase) {
+        return core->memory.pageTableBase;
+    }
+    return 0;
 }
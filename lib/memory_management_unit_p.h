@@ -7,8 +7,11 @@
 #ifndef HALLEY_MEMORY_MANAGEMENT_UNIT_P_H
 #define HALLEY_MEMORY_MANAGEMENT_UNIT_P_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "thread_p.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -36,12 +39,167 @@ enum {
     HLMemoryResultUnaligned,
 };
 
+/** the low 14 bits of a virtual address are the offset into a 16 KiB page */
+#define HLPageShift 14
+#define HLPageSize (1ull << HLPageShift)
+#define HLPageOffsetMask (HLPageSize - 1)
+
+#define HLTranslationCacheSets 64
+#define HLTranslationCacheWays 4
+
+struct HLTranslationCacheEntry {
+    /** virtual address shifted right by HLPageShift */
+    uint64_t virtualPage;
+    /** physical address of the first byte of the page */
+    uint64_t physicalPage;
+    /**
+     * where the page starts in memory, or NULL if it isn't wholly inside
+     * physical memory
+     */
+    uint8_t *host;
+    /** permissions a page table walk has granted for this page;
+     *  HLMemoryPermissionNone marks an empty entry
+     */
+    HLMemoryPermission permissions;
+};
+
+/**
+ * Set-associative cache of successful page table walks.
+ *
+ * Entries are not kept coherent with the page tables: whoever modifies
+ * a page table entry or pageTableBase is responsible for calling
+ * HLMemoryManagementUnitInvalidateTranslationCachePage or
+ * HLMemoryManagementUnitFlushTranslationCache afterwards, as is whoever
+ * replaces memory, since entries point into it. Both tell
+ * translationObserver, so anything else caching translations can drop them
+ * too.
+ */
+struct HLTranslationCache {
+    struct HLTranslationCacheEntry entries[HLTranslationCacheSets]
+                                          [HLTranslationCacheWays];
+    uint8_t nextVictim[HLTranslationCacheSets];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/** Called after a physical write of size bytes lands on a code page. */
+typedef void (*HLMemoryWriteObserver)(void *userData,
+                                      uint64_t address,
+                                      uint64_t size);
+
+/**
+ * Called after cached translations for the virtual page containing address,
+ * or for every page if all is set, have been dropped.
+ */
+typedef void (*HLTranslationObserver)(void *userData,
+                                      uint64_t address,
+                                      bool all);
+
 struct HLMemoryManagementUnit {
     uint8_t *memory;
     uint64_t memoryLimit;
     uint64_t pageTableBase;
+    struct HLTranslationCache translationCache;
+
+    /** one byte per physical page, non-zero when writes to the page have
+     *  to be reported to codeWriteObserver
+     */
+    uint8_t *codePages;
+    uint64_t codePageCount;
+    HLMemoryWriteObserver codeWriteObserver;
+    void *codeWriteObserverData;
+    /** may be NULL */
+    HLTranslationObserver translationObserver;
+    void *translationObserverData;
+
+    /** one bit per physical page, set by every physical write to the page;
+     *  dirtyPageCount is 0 while dirty page tracking is off
+     */
+    uint64_t *dirtyPages;
+    uint64_t dirtyPageCount;
 };
 
+/*
+ * Physical memory access without the checks, for the accessors below and
+ * the interpreter's inline fast paths. Stores have to be followed by
+ * HLMemoryManagementUnitMarkDirty and HLMemoryManagementUnitNotifyCodeWrite.
+ */
+
+#define HLMemoryManagementUnitIndex(base, size, address)                       \
+    ((uint##size##_t *)(base))[address / sizeof(uint##size##_t)]
+
+/* accesses are aligned by now, so other cores never see them torn */
+#define HLMemoryManagementUnitLoad(base, size, address)                        \
+    HLAtomicLoadRelaxed(uint##size##_t,                                        \
+                        &HLMemoryManagementUnitIndex(base, size, address))
+#define HLMemoryManagementUnitStore(base, size, address, value)                \
+    HLAtomicStoreRelaxed(uint##size##_t,                                       \
+                         &HLMemoryManagementUnitIndex(base, size, address),    \
+                         value)
+
+#define HLMemoryManagementUnitNotifyCodeWrite(mmu, address, size)              \
+    if ((address >> HLPageShift) < mmu->codePageCount                          \
+        && HLAtomicLoadRelaxed(uint8_t,                                        \
+                               &mmu->codePages[address >> HLPageShift])) {     \
+        mmu->codeWriteObserver(mmu->codeWriteObserverData,                     \
+                               address,                                        \
+                               sizeof(uint##size##_t));                        \
+    }
+
+/* test before setting, so repeated writes to a page stay plain loads */
+#define HLMemoryManagementUnitMarkDirty(mmu, address)                          \
+    if ((address >> HLPageShift) < mmu->dirtyPageCount) {                      \
+        uint64_t *dirtyWord = &mmu->dirtyPages[address >> (HLPageShift + 6)];  \
+        uint64_t dirtyBit = (uint64_t)1 << ((address >> HLPageShift) & 63);    \
+        if (!(HLAtomicLoadRelaxed(uint64_t, dirtyWord) & dirtyBit)) {          \
+            HLAtomicOr64(dirtyWord, dirtyBit);                                 \
+        }                                                                      \
+    }
+
+#define HLTranslationCacheSet(mmu, page)                                       \
+    ((mmu)->translationCache.entries[(page) & (HLTranslationCacheSets - 1)])
+
+/**
+ * Sets host to where an access of size bits at virtual address lands in
+ * memory if it is aligned and the translation cache has its page with the
+ * required permissions, and to NULL otherwise. Never walks the page
+ * tables, so it is cheap enough to try before the accessors below.
+ */
+#define HLMemoryManagementUnitHostAddress(mmu,                                 \
+                                          address,                             \
+                                          size,                                \
+                                          required,                            \
+                                          host)                                \
+    do {                                                                       \
+        struct HLTranslationCacheEntry *hostSet =                              \
+            HLTranslationCacheSet(mmu, (address) >> HLPageShift);              \
+        int hostWay;                                                           \
+                                                                               \
+        host = NULL;                                                           \
+        if ((address) % sizeof(uint##size##_t) == 0) {                         \
+            for (hostWay = 0; hostWay < HLTranslationCacheWays; hostWay++) {   \
+                if (hostSet[hostWay].virtualPage == (address) >> HLPageShift   \
+                    && (hostSet[hostWay].permissions & (required))             \
+                           == (required)                                       \
+                    && hostSet[hostWay].host != NULL) {                        \
+                    (mmu)->translationCache.hits++;                            \
+                    host = hostSet[hostWay].host                               \
+                           + ((address) & HLPageOffsetMask);                   \
+                    break;                                                     \
+                }                                                              \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+/**
+ * Whether an access of 1 << shift bytes at physical address is aligned and
+ * ends at or below limit, with a single comparison: rotating the address
+ * right by shift moves any misaligned low bits to the top.
+ */
+#define HLMemoryManagementUnitInBounds(address, shift, limit)                  \
+    ((((address) >> (shift)) | ((address) << ((64 - (shift)) & 63)))           \
+     < ((limit) >> (shift)))
+
 HLInstruction HLMemoryManagementUnitReadVirtualInstruction(
     struct HLMemoryManagementUnit *mmu,
     uint64_t address,
@@ -89,6 +247,12 @@ void HLMemoryManagementUnitWriteVirtualUInt64(
     uint64_t value,
     HLMemoryResult *code);
 
+/*
+ * Physical accesses must be naturally aligned, and each one is single-copy
+ * atomic: a core running in parallel sees either all or none of a store.
+ * No ordering is implied between accesses to different addresses.
+ */
+
 uint8_t HLMemoryManagementUnitReadPhysicalUInt8(
     struct HLMemoryManagementUnit *mmu,
     uint64_t address,
@@ -127,12 +291,109 @@ void HLMemoryManagementUnitWritePhysicalUInt64(
     uint64_t value,
     HLMemoryResult *code);
 
+/*
+ * Bulk accesses work on any byte range, aligned or not, checking and
+ * translating it once per page and copying the rest with memcpy/memset.
+ * They are not single-copy atomic. Each returns the number of bytes done,
+ * which is all of size unless an access fails: then *code says why and
+ * address plus the return value is the address that faulted. Everything
+ * before it has been done.
+ */
+
+uint64_t HLMemoryManagementUnitReadPhysical(struct HLMemoryManagementUnit *mmu,
+                                            uint64_t address,
+                                            void *data,
+                                            uint64_t size,
+                                            HLMemoryResult *code);
+uint64_t HLMemoryManagementUnitWritePhysical(
+    struct HLMemoryManagementUnit *mmu,
+    uint64_t address,
+    const void *data,
+    uint64_t size,
+    HLMemoryResult *code);
+uint64_t HLMemoryManagementUnitFillPhysical(struct HLMemoryManagementUnit *mmu,
+                                            uint64_t address,
+                                            uint8_t value,
+                                            uint64_t size,
+                                            HLMemoryResult *code);
+
+/** Copies as if with memmove, so the ranges may overlap. */
+uint64_t HLMemoryManagementUnitCopyPhysical(
+    struct HLMemoryManagementUnit *mmu,
+    uint64_t destination,
+    uint64_t source,
+    uint64_t size,
+    HLMemoryResult *code);
+
+/**
+ * Marks [address, address + size) of physical memory dirty and tells the
+ * code write observer about it, for when it was written through a host
+ * pointer rather than the functions above.
+ */
+void HLMemoryManagementUnitWritten(struct HLMemoryManagementUnit *mmu,
+                                   uint64_t address,
+                                   uint64_t size);
+
+uint64_t HLMemoryManagementUnitReadVirtual(struct HLMemoryManagementUnit *mmu,
+                                           uint64_t address,
+                                           void *data,
+                                           uint64_t size,
+                                           HLMemoryResult *code);
+uint64_t HLMemoryManagementUnitWriteVirtual(struct HLMemoryManagementUnit *mmu,
+                                            uint64_t address,
+                                            const void *data,
+                                            uint64_t size,
+                                            HLMemoryResult *code);
+uint64_t HLMemoryManagementUnitFillVirtual(struct HLMemoryManagementUnit *mmu,
+                                           uint64_t address,
+                                           uint8_t value,
+                                           uint64_t size,
+                                           HLMemoryResult *code);
+
 uint64_t HLMemoryManagementUnitTranslateAddress(
     struct HLMemoryManagementUnit *mmu,
     uint64_t address,
     HLMemoryPermission requiredPermissions,
     HLMemoryResult *code);
 
+/** Drops every cached translation. */
+void HLMemoryManagementUnitFlushTranslationCache(
+    struct HLMemoryManagementUnit *mmu);
+/** Drops any cached translation for the page containing address. */
+void HLMemoryManagementUnitInvalidateTranslationCachePage(
+    struct HLMemoryManagementUnit *mmu,
+    uint64_t address);
+
+/**
+ * Ports through which the guest manages its core's MMU. Nothing keeps the
+ * translation cache coherent with the page tables, so a guest that edits
+ * an entry has to invalidate the page, or flush, before relying on it.
+ */
+#define HLMemoryManagementUnitPortBase 0x18
+
+typedef uint8_t HLMemoryManagementUnitPort;
+enum {
+    /** physical address of the top level table; writes flush */
+    HLMemoryManagementUnitPortPageTableBase,
+    /** writes drop cached translations for the page containing the value */
+    HLMemoryManagementUnitPortInvalidatePage,
+    /** writes drop every cached translation */
+    HLMemoryManagementUnitPortFlush,
+    HLMemoryManagementUnitNPorts,
+};
+
+struct HLSystem;
+
+/* HLPortDevice handlers; userData is unused, since each core has an MMU */
+
+void HLMemoryManagementUnitPortWrite(void *userData,
+                                     struct HLSystem *core,
+                                     uint16_t port,
+                                     uint64_t value);
+uint64_t HLMemoryManagementUnitPortRead(void *userData,
+                                        struct HLSystem *core,
+                                        uint16_t port);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,23 @@
+#ifndef HL_OPERATION
+#define HL_OPERATION(name,comment)
+#endif
+
+/*
+ * Operations the decoder turns instructions into beyond the ones in
+ * instructions.h. Each has an HLOperation<name> and an HLExec<name>.
+ */
+
+/* Idioms HLDecodeFuse turns into one operation */
+HL_OPERATION(CompareBranch, cmpr followed by a conditional branch. Compares rs1 with rs2; and func holds the branch operation)
+HL_OPERATION(CompareImmediateBranch, cmpi followed by a conditional branch. Compares rs1 with imm; or imm with rs1 if rde is 1; and func holds the branch operation)
+HL_OPERATION(LoadConstant, A load immediate followed by up to three lli; lui; lti and ltui into the same register. Sets rde to imm; keeping the 16 bit lanes of its old value whose bits are set in func)
+
+/* Common forms HLDecodeSpecialize gives their own operation */
+HL_OPERATION(Nop, An instruction whose only effect is to write RZ)
+HL_OPERATION(Move, Sets rde to rs1)
+HL_OPERATION(MoveImmediate, Sets rde to imm; and if func is 1 sets the flags of adding imm to zero)
+HL_OPERATION(CompareZero, Compares rs1 with zero)
+HL_OPERATION(ShiftLeftImmediate, shli with imm from 1 to 63)
+HL_OPERATION(ShiftRightArithmeticImmediate, asri with imm from 1 to 63)
+HL_OPERATION(ShiftRightLogicalImmediate, lsri with imm from 1 to 63)
+HL_OPERATION(BitImmediate, biti with imm from 0 to 63)
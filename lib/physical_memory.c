@@ -0,0 +1,358 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#if !defined(_WIN32)
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#endif
+
+#include "memory_management_unit_p.h"
+#include "physical_memory_p.h"
+
+/*
+ * On POSIX hosts the reservation is a private anonymous mapping, which the
+ * kernel fills with zero pages on first touch; images are private file
+ * mappings laid over it, so they share the page cache until written.
+ *
+ * On Windows the range is committed up front, which costs commit charge
+ * but still no physical pages until they are touched. Images are read in
+ * rather than mapped, since a view can't be placed inside a reservation
+ * without giving up the rest of it.
+ *
+ * Captured images live in an anonymous file (a memfd where there is one)
+ * or a pagefile-backed section, and forks map them privately, so the host
+ * shares their pages until someone writes to them.
+ */
+
+static bool HLPhysicalMemoryAligned(uint64_t value)
+{
+    return (value & HLPageOffsetMask) == 0;
+}
+
+bool HLPhysicalMemoryReserve(struct HLPhysicalMemory *memory, uint64_t size)
+{
+    void *base;
+
+    if (size == 0 || !HLPhysicalMemoryAligned(size) || size > (size_t)-1) {
+        return false;
+    }
+
+#ifdef _WIN32
+    base = VirtualAlloc(NULL,
+                        (SIZE_T)size,
+                        MEM_COMMIT | MEM_RESERVE,
+                        PAGE_READWRITE);
+    if (base == NULL) {
+        return false;
+    }
+#else
+    base = mmap(NULL,
+                (size_t)size,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                -1,
+                0);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+#endif
+
+    memory->base = base;
+    memory->size = size;
+    memory->view = false;
+    return true;
+}
+
+void HLPhysicalMemoryDone(struct HLPhysicalMemory *memory)
+{
+    if (memory->base == NULL) {
+        return;
+    }
+#ifdef _WIN32
+    if (memory->view) {
+        UnmapViewOfFile(memory->base);
+    } else {
+        VirtualFree(memory->base, 0, MEM_RELEASE);
+    }
+#else
+    munmap(memory->base, (size_t)memory->size);
+#endif
+    memory->base = NULL;
+    memory->size = 0;
+}
+
+bool HLPhysicalMemoryMapImage(struct HLPhysicalMemory *memory,
+                              const char *path,
+                              uint64_t address,
+                              uint64_t *imageSize)
+{
+#ifdef _WIN32
+    FILE *file;
+    long size;
+    bool ok;
+
+    if (memory->base == NULL || !HLPhysicalMemoryAligned(address)) {
+        return false;
+    }
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    ok = fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0
+         && address <= memory->size
+         && (uint64_t)size <= memory->size - address
+         && fseek(file, 0, SEEK_SET) == 0
+         && fread(memory->base + address, 1, (size_t)size, file)
+                == (size_t)size;
+    fclose(file);
+    if (ok) {
+        *imageSize = (uint64_t)size;
+    }
+    return ok;
+#else
+    struct stat status;
+    void *mapped;
+    int fd;
+
+    if (memory->base == NULL || !HLPhysicalMemoryAligned(address)) {
+        return false;
+    }
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &status) != 0 || address > memory->size
+        || (uint64_t)status.st_size > memory->size - address) {
+        close(fd);
+        return false;
+    }
+
+    mapped = MAP_FAILED;
+    if (status.st_size > 0) {
+        mapped = mmap(memory->base + address,
+                      (size_t)status.st_size,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_FIXED,
+                      fd,
+                      0);
+    }
+    /* the mapping keeps its own reference to the file */
+    close(fd);
+    if (status.st_size > 0 && mapped == MAP_FAILED) {
+        return false;
+    }
+
+    *imageSize = (uint64_t)status.st_size;
+    return true;
+#endif
+}
+
+bool HLPhysicalMemoryRelease(struct HLPhysicalMemory *memory,
+                             uint64_t address,
+                             uint64_t size)
+{
+    if (memory->base == NULL || !HLPhysicalMemoryAligned(address)
+        || !HLPhysicalMemoryAligned(size) || address > memory->size
+        || size > memory->size - address) {
+        return false;
+    }
+    if (size == 0) {
+        return true;
+    }
+
+#ifdef _WIN32
+    if (memory->view) {
+        /* sections can't be decommitted piecemeal */
+        memset(memory->base + address, 0, (size_t)size);
+        return true;
+    }
+    return VirtualFree(memory->base + address, (SIZE_T)size, MEM_DECOMMIT)
+           && VirtualAlloc(memory->base + address,
+                           (SIZE_T)size,
+                           MEM_COMMIT,
+                           PAGE_READWRITE)
+                  != NULL;
+#else
+    /* mapping fresh zero pages over the range also drops image pages,
+     * which madvise would only revert to the file contents
+     */
+    return mmap(memory->base + address,
+                (size_t)size,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                -1,
+                0)
+           != MAP_FAILED;
+#endif
+}
+
+static bool HLPhysicalMemoryIsZero(const uint8_t *memory, size_t size)
+{
+    return memory[0] == 0 && memcmp(memory, memory + 1, size - 1) == 0;
+}
+
+bool HLPhysicalMemoryImageCapture(struct HLPhysicalMemoryImage *image,
+                                  const uint8_t *memory,
+                                  uint64_t size)
+{
+    uint64_t imageSize = (size + HLPageOffsetMask) & ~HLPageOffsetMask;
+    uint64_t offset;
+    size_t length;
+#ifdef _WIN32
+    HANDLE mapping;
+    uint8_t *view;
+
+    if (imageSize == 0 || imageSize > (size_t)-1) {
+        return false;
+    }
+
+    mapping = CreateFileMappingW(INVALID_HANDLE_VALUE,
+                                 NULL,
+                                 PAGE_READWRITE,
+                                 (DWORD)(imageSize >> 32),
+                                 (DWORD)imageSize,
+                                 NULL);
+    if (mapping == NULL) {
+        return false;
+    }
+    view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)imageSize);
+    if (view == NULL) {
+        CloseHandle(mapping);
+        return false;
+    }
+
+    for (offset = 0; offset < size; offset += HLPageSize) {
+        length = (size_t)(size - offset < HLPageSize ? size - offset
+                                                     : HLPageSize);
+        if (!HLPhysicalMemoryIsZero(memory + offset, length)) {
+            memcpy(view + offset, memory + offset, length);
+        }
+    }
+    UnmapViewOfFile(view);
+
+    image->mapping = mapping;
+#else
+    const uint8_t *source;
+    ssize_t written;
+    int fd;
+
+    if (imageSize == 0 || imageSize > (size_t)-1) {
+        return false;
+    }
+
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    fd = memfd_create("halley-image", MFD_CLOEXEC);
+#else
+    {
+        FILE *file = tmpfile();
+
+        fd = -1;
+        if (file != NULL) {
+            fd = dup(fileno(file));
+            fclose(file);
+        }
+    }
+#endif
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, (off_t)imageSize) != 0) {
+        close(fd);
+        return false;
+    }
+
+    /* the file starts out as one big hole, so zero pages cost nothing */
+    for (offset = 0; offset < size; offset += HLPageSize) {
+        length = (size_t)(size - offset < HLPageSize ? size - offset
+                                                     : HLPageSize);
+        source = memory + offset;
+        if (HLPhysicalMemoryIsZero(source, length)) {
+            continue;
+        }
+        while (length > 0) {
+            written = pwrite(fd,
+                             source,
+                             length,
+                             (off_t)(source - memory));
+            if (written <= 0) {
+                close(fd);
+                return false;
+            }
+            source += written;
+            length -= (size_t)written;
+        }
+    }
+
+    image->fd = fd;
+#endif
+
+    image->size = imageSize;
+    return true;
+}
+
+void HLPhysicalMemoryImageDone(struct HLPhysicalMemoryImage *image)
+{
+#ifdef _WIN32
+    CloseHandle(image->mapping);
+#else
+    close(image->fd);
+#endif
+    image->size = 0;
+}
+
+bool HLPhysicalMemoryMapCopy(struct HLPhysicalMemory *memory,
+                             const struct HLPhysicalMemoryImage *image)
+{
+    void *base;
+
+#ifdef _WIN32
+    base = MapViewOfFile(image->mapping,
+                         FILE_MAP_COPY,
+                         0,
+                         0,
+                         (SIZE_T)image->size);
+    if (base == NULL) {
+        return false;
+    }
+#else
+    base = mmap(NULL,
+                (size_t)image->size,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE,
+                image->fd,
+                0);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+#endif
+
+    memory->base = base;
+    memory->size = image->size;
+    memory->view = true;
+    return true;
+}
@@ -0,0 +1,89 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_PHYSICAL_MEMORY_P_H
+#define HALLEY_PHYSICAL_MEMORY_P_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Guest physical memory backed by host virtual memory. The whole range is
+ * reserved up front, but the host only commits a page once the guest
+ * touches it, so the size costs nothing by itself.
+ */
+struct HLPhysicalMemory {
+    /** NULL until reserved */
+    uint8_t *base;
+    uint64_t size;
+    /** base is a copy-on-write view of an HLPhysicalMemoryImage */
+    bool view;
+};
+
+/**
+ * A frozen copy of physical memory held by the host outside of any
+ * address space, which any number of HLPhysicalMemory can map
+ * copy-on-write. Zero pages are left as holes.
+ */
+struct HLPhysicalMemoryImage {
+#ifdef _WIN32
+    void *mapping;
+#else
+    int fd;
+#endif
+    uint64_t size;
+};
+
+/**
+ * Reserves size bytes of zeroed memory. size must be a multiple of
+ * HLPageSize.
+ */
+bool HLPhysicalMemoryReserve(struct HLPhysicalMemory *memory, uint64_t size);
+void HLPhysicalMemoryDone(struct HLPhysicalMemory *memory);
+
+/**
+ * Maps the file at path copy-on-write at address, which must be page
+ * aligned, and stores its length in imageSize. Guest writes to the image
+ * never reach the file. Returns false if the file can't be read or
+ * doesn't fit.
+ */
+bool HLPhysicalMemoryMapImage(struct HLPhysicalMemory *memory,
+                              const char *path,
+                              uint64_t address,
+                              uint64_t *imageSize);
+/**
+ * Gives the pages in [address, address + size) back to the host; they
+ * read as zero afterwards. Both must be page aligned.
+ */
+bool HLPhysicalMemoryRelease(struct HLPhysicalMemory *memory,
+                             uint64_t address,
+                             uint64_t size);
+
+/**
+ * Copies size bytes at memory into a new image. size is rounded up to a
+ * whole number of pages, which read as zero past the end of memory.
+ */
+bool HLPhysicalMemoryImageCapture(struct HLPhysicalMemoryImage *image,
+                                  const uint8_t *memory,
+                                  uint64_t size);
+void HLPhysicalMemoryImageDone(struct HLPhysicalMemoryImage *image);
+/**
+ * Makes memory a private copy-on-write view of image. Pages are shared
+ * with the image until written, so this takes the same time regardless
+ * of the image's size.
+ */
+bool HLPhysicalMemoryMapCopy(struct HLPhysicalMemory *memory,
+                             const struct HLPhysicalMemoryImage *image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
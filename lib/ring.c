@@ -0,0 +1,292 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <stddef.h>
+
+#include "io_bus_p.h"
+#include "ring_p.h"
+#include "system_p.h"
+#include "thread_p.h"
+
+/* see HLDMACodeWritten */
+static void HLRingCodeWritten(void *userData, uint64_t address, uint64_t size)
+{
+    struct HLSystem *system = userData;
+
+    HLAtomicAdd64(&system->codeGeneration, 1);
+}
+
+/** Hands buffer index to the handler and writes its completion. */
+static void HLRingComplete(struct HLRing *ring,
+                           uint64_t descriptors,
+                           uint64_t completions,
+                           uint64_t size,
+                           uint64_t index)
+{
+    struct HLMemoryManagementUnit *mmu = &ring->memory;
+    uint64_t entry = (index & (size - 1)) * HLRingEntrySize;
+    HLMemoryResult result = HLMemoryResultOK;
+    HLRingStatus status = HLRingStatusFault;
+    struct HLRingBuffer buffer;
+    uint64_t value = 0;
+
+    buffer.address =
+        HLMemoryManagementUnitReadPhysicalUInt64(mmu, descriptors + entry,
+                                                 &result);
+    buffer.length = HLMemoryManagementUnitReadPhysicalUInt32(
+        mmu, descriptors + entry + 8, &result);
+    buffer.flags = HLMemoryManagementUnitReadPhysicalUInt32(
+        mmu, descriptors + entry + 12, &result);
+
+    if (result == HLMemoryResultOK && buffer.address <= mmu->memoryLimit
+        && buffer.length <= mmu->memoryLimit - buffer.address) {
+        buffer.data = mmu->memory + buffer.address;
+        value = ring->handler(ring->userData, ring->system, &buffer);
+        if (buffer.flags & HLRingDescriptorHostWrites) {
+            HLMemoryManagementUnitWritten(mmu, buffer.address, buffer.length);
+        }
+        status = HLRingStatusOK;
+    }
+
+    result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysicalUInt32(mmu,
+                                              completions + entry,
+                                              (uint32_t)index,
+                                              &result);
+    HLMemoryManagementUnitWritePhysicalUInt32(mmu,
+                                              completions + entry + 4,
+                                              status,
+                                              &result);
+    HLMemoryManagementUnitWritePhysicalUInt64(mmu,
+                                              completions + entry + 8,
+                                              value,
+                                              &result);
+}
+
+/** Completes every descriptor published so far. Called with the lock held. */
+static void HLRingDrain(struct HLRing *ring)
+{
+    uint64_t descriptors;
+    uint64_t completions;
+    uint64_t size;
+    uint64_t index;
+    uint64_t end;
+
+    while (ring->used != ring->available) {
+        descriptors = ring->descriptors;
+        completions = ring->completions;
+        size = ring->size;
+        index = ring->used;
+        end = ring->available;
+
+        HLMutexUnlock(&ring->lock);
+        for (; index != end; index++) {
+            HLRingComplete(ring, descriptors, completions, size, index);
+        }
+        HLMutexLock(&ring->lock);
+
+        ring->used = end;
+        if (ring->vector <= 255) {
+            HLInterruptControllerRaise(ring->interrupts,
+                                       (HLInterrupt)ring->vector);
+        }
+    }
+
+    ring->busy = false;
+    HLConditionBroadcast(&ring->completed);
+}
+
+static void HLRingThreadMain(void *argument)
+{
+    struct HLRing *ring = argument;
+
+    HLMutexLock(&ring->lock);
+    while (!ring->stopping) {
+        if (!ring->busy) {
+            HLConditionWait(&ring->requested, &ring->lock);
+            continue;
+        }
+        HLRingDrain(ring);
+    }
+    HLMutexUnlock(&ring->lock);
+}
+
+/** Called with the lock held. */
+static void HLRingRing(struct HLRing *ring,
+                       struct HLSystem *core,
+                       uint64_t available)
+{
+    struct HLSystem *system = ring->system;
+
+    /* nothing new, or more than a table's worth ahead of the host */
+    if (ring->size == 0 || available == ring->available
+        || available - ring->used > ring->size) {
+        return;
+    }
+    ring->available = available;
+    ring->interrupts = &core->interrupts;
+    if (ring->busy) {
+        return;
+    }
+
+    ring->memory = system->memory;
+    ring->memory.codeWriteObserver = HLRingCodeWritten;
+    ring->memory.codeWriteObserverData = system;
+    ring->busy = true;
+
+    if (!ring->threadStarted) {
+        ring->threadStarted =
+            HLThreadStart(&ring->thread, HLRingThreadMain, ring);
+    }
+    if (ring->threadStarted) {
+        HLConditionSignal(&ring->requested);
+        return;
+    }
+
+    /* without a thread, the batch is over before the guest goes on */
+    HLRingDrain(ring);
+}
+
+static void HLRingPortWrite(void *userData,
+                            struct HLSystem *core,
+                            uint16_t port,
+                            uint64_t value)
+{
+    struct HLRing *ring = userData;
+    HLRingPort offset = (HLRingPort)(port - ring->port);
+
+    HLMutexLock(&ring->lock);
+    if (offset == HLRingPortDoorbell) {
+        HLRingRing(ring, core, value);
+    } else if (!ring->busy) {
+        switch (offset) {
+        case HLRingPortDescriptors:
+            ring->descriptors = value;
+            break;
+        case HLRingPortCompletions:
+            ring->completions = value;
+            break;
+        case HLRingPortSize:
+            if (value > HLRingMaxSize || (value & (value - 1)) != 0) {
+                value = 0;
+            }
+            ring->size = value;
+            break;
+        case HLRingPortVector:
+            ring->vector = value <= 255 ? value : HLRingNoInterrupt;
+            break;
+        default:
+            break;
+        }
+    }
+    HLMutexUnlock(&ring->lock);
+}
+
+static uint64_t HLRingPortRead(void *userData,
+                               struct HLSystem *core,
+                               uint16_t port)
+{
+    struct HLRing *ring = userData;
+    uint64_t value = 0;
+
+    HLMutexLock(&ring->lock);
+    switch ((HLRingPort)(port - ring->port)) {
+    case HLRingPortDescriptors:
+        value = ring->descriptors;
+        break;
+    case HLRingPortCompletions:
+        value = ring->completions;
+        break;
+    case HLRingPortSize:
+        value = ring->size;
+        break;
+    case HLRingPortVector:
+        value = ring->vector;
+        break;
+    case HLRingPortDoorbell:
+        value = ring->available;
+        break;
+    case HLRingPortUsed:
+        value = ring->used;
+        break;
+    default:
+        break;
+    }
+    HLMutexUnlock(&ring->lock);
+    return value;
+}
+
+bool HLSystemAttachRing(struct HLSystem *system,
+                        uint32_t port,
+                        HLRingHandler handler,
+                        void *userData)
+{
+    struct HLMemoryAllocation *alloc = system->allocator;
+    struct HLPortDevice device;
+    struct HLRing *ring;
+
+    system = system->primary;
+    ring = alloc->alloc(alloc, sizeof(struct HLRing));
+    if (ring == NULL) {
+        return false;
+    }
+
+    ring->system = system;
+    ring->port = port;
+    ring->handler = handler;
+    ring->userData = userData;
+    HLMutexInit(&ring->lock);
+    HLConditionInit(&ring->requested);
+    HLConditionInit(&ring->completed);
+    ring->threadStarted = false;
+    ring->stopping = false;
+    ring->descriptors = 0;
+    ring->completions = 0;
+    ring->size = 0;
+    ring->vector = HLRingNoInterrupt;
+    ring->available = 0;
+    ring->used = 0;
+    ring->interrupts = NULL;
+    ring->busy = false;
+
+    device.read = HLRingPortRead;
+    device.write = HLRingPortWrite;
+    device.writeBatch = NULL;
+    device.userData = ring;
+    if (!HLSystemAttachPortDevice(system, port, HLRingNPorts, &device)) {
+        HLRingDone(ring);
+        alloc->free(alloc, ring);
+        return false;
+    }
+
+    ring->next = system->rings;
+    system->rings = ring;
+    return true;
+}
+
+void HLRingDone(struct HLRing *ring)
+{
+    HLRingWait(ring);
+    if (ring->threadStarted) {
+        HLMutexLock(&ring->lock);
+        ring->stopping = true;
+        HLConditionSignal(&ring->requested);
+        HLMutexUnlock(&ring->lock);
+        HLThreadJoin(&ring->thread);
+    }
+    HLConditionDone(&ring->completed);
+    HLConditionDone(&ring->requested);
+    HLMutexDone(&ring->lock);
+}
+
+void HLRingWait(struct HLRing *ring)
+{
+    HLMutexLock(&ring->lock);
+    while (ring->busy) {
+        HLConditionWait(&ring->completed, &ring->lock);
+    }
+    HLMutexUnlock(&ring->lock);
+}
@@ -0,0 +1,77 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_RING_P_H
+#define HALLEY_RING_P_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "interrupt_controller_p.h"
+#include "memory_management_unit_p.h"
+#include "ring.h"
+#include "thread_p.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSystem;
+
+/** bytes of an HLRingDescriptor or HLRingCompletion in guest memory */
+#define HLRingEntrySize 16
+#define HLRingMaxSize 0x10000
+#define HLRingNoInterrupt ((uint64_t)-1)
+
+/**
+ * A ring device attached to core 0. Like the DMA controller, it works on
+ * a copy of core 0's MMU taken when a batch starts, so code it writes is
+ * only seen from a core's next block or port read.
+ */
+struct HLRing {
+    struct HLSystem *system;
+    /** the next ring attached to the same system */
+    struct HLRing *next;
+    uint32_t port;
+    HLRingHandler handler;
+    void *userData;
+
+    HLMutex lock;
+    /** signalled when the doorbell rings or stopping is set */
+    HLCondition requested;
+    /** broadcast when busy is cleared */
+    HLCondition completed;
+    /** started with the first batch */
+    struct HLThread thread;
+    bool threadStarted;
+    bool stopping;
+
+    /* the ports, guarded by lock */
+    uint64_t descriptors;
+    uint64_t completions;
+    uint64_t size;
+    uint64_t vector;
+    uint64_t available;
+    uint64_t used;
+    /** of the core that last rang the doorbell */
+    struct HLInterruptController *interrupts;
+
+    /** set while used is behind available */
+    bool busy;
+    /** core 0's view of physical memory when the batch started */
+    struct HLMemoryManagementUnit memory;
+};
+
+/** Waits for the running batch, if any, and stops the thread. */
+void HLRingDone(struct HLRing *ring);
+/** Returns once the host has completed every published descriptor. */
+void HLRingWait(struct HLRing *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,462 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "memory_allocation.h"
+#include "scheduler.h"
+#include "system_p.h"
+#include "thread_p.h"
+
+struct HLSchedulerGuest {
+    struct HLSystem *system;
+    HLStopReason stopReason;
+    HLGuestState state;
+    bool suspendRequested;
+};
+
+/**
+ * A worker's run queue. The owner takes guests from the head and requeues
+ * them at the tail, so its guests share the worker round-robin; idle
+ * workers steal from the tail, taking the guest the owner would get to
+ * last.
+ */
+struct HLSchedulerQueue {
+    HLMutex lock;
+    int *guests;
+    int head;
+    int count;
+};
+
+struct HLSchedulerWorker {
+    struct HLThread thread;
+    struct HLScheduler *scheduler;
+    struct HLSchedulerQueue queue;
+    int index;
+
+    uint64_t cycles;
+    uint64_t slices;
+    uint64_t steals;
+};
+
+struct HLScheduler {
+    struct HLMemoryAllocation *allocator;
+
+    /** protects guest states, active, sleepers and the conditions below */
+    HLMutex lock;
+    /** signalled when a guest is queued while a worker sleeps */
+    HLCondition workAvailable;
+    /** broadcast when active drops to zero */
+    HLCondition idle;
+
+    struct HLSchedulerWorker *workers;
+    int workerCount;
+    struct HLSchedulerGuest *guests;
+    int guestCount;
+    int maxGuests;
+    uint64_t sliceCycles;
+
+    /** guests sitting in a queue; read by workers without the lock */
+    uint64_t queued;
+    uint64_t stopping;
+    /** runnable guests, queued or running */
+    int active;
+    int sleepers;
+    int nextWorker;
+};
+
+static void HLSchedulerQueuePush(struct HLScheduler *scheduler,
+                                 struct HLSchedulerQueue *queue,
+                                 int guest)
+{
+    HLMutexLock(&queue->lock);
+    assert(queue->count < scheduler->maxGuests);
+    queue->guests[(queue->head + queue->count) % scheduler->maxGuests] = guest;
+    queue->count++;
+    HLMutexUnlock(&queue->lock);
+
+    HLAtomicAdd64(&scheduler->queued, 1);
+}
+
+static int HLSchedulerQueuePopHead(struct HLScheduler *scheduler,
+                                   struct HLSchedulerQueue *queue)
+{
+    int guest = -1;
+
+    HLMutexLock(&queue->lock);
+    if (queue->count > 0) {
+        guest = queue->guests[queue->head];
+        queue->head = (queue->head + 1) % scheduler->maxGuests;
+        queue->count--;
+    }
+    HLMutexUnlock(&queue->lock);
+
+    return guest;
+}
+
+static int HLSchedulerQueuePopTail(struct HLScheduler *scheduler,
+                                   struct HLSchedulerQueue *queue)
+{
+    int guest = -1;
+
+    HLMutexLock(&queue->lock);
+    if (queue->count > 0) {
+        queue->count--;
+        guest = queue->guests[(queue->head + queue->count)
+                              % scheduler->maxGuests];
+    }
+    HLMutexUnlock(&queue->lock);
+
+    return guest;
+}
+
+/** Queues a guest on the next worker in turn. Called with the lock held. */
+static void HLSchedulerEnqueue(struct HLScheduler *scheduler, int guest)
+{
+    struct HLSchedulerWorker *worker =
+        &scheduler->workers[scheduler->nextWorker];
+
+    scheduler->nextWorker =
+        (scheduler->nextWorker + 1) % scheduler->workerCount;
+    HLSchedulerQueuePush(scheduler, &worker->queue, guest);
+    if (scheduler->sleepers > 0) {
+        HLConditionSignal(&scheduler->workAvailable);
+    }
+}
+
+/** Takes a guest from worker's own queue, or failing that, steals one. */
+static int HLSchedulerTake(struct HLSchedulerWorker *worker)
+{
+    struct HLScheduler *scheduler = worker->scheduler;
+    int guest;
+    int i;
+
+    if (HLAtomicLoad64(&scheduler->queued) == 0) {
+        return -1;
+    }
+
+    guest = HLSchedulerQueuePopHead(scheduler, &worker->queue);
+    for (i = 1; guest < 0 && i < scheduler->workerCount; i++) {
+        guest = HLSchedulerQueuePopTail(
+            scheduler,
+            &scheduler->workers[(worker->index + i) % scheduler->workerCount]
+                 .queue);
+        if (guest >= 0) {
+            HLAtomicAdd64(&worker->steals, 1);
+        }
+    }
+    if (guest >= 0) {
+        HLAtomicAdd64(&scheduler->queued, (uint64_t)-1);
+    }
+
+    return guest;
+}
+
+/** Decides what happens to a guest after a slice. Called with the lock held. */
+static void HLSchedulerSliceEnded(struct HLSchedulerWorker *worker,
+                                  int index,
+                                  HLStopReason reason)
+{
+    struct HLScheduler *scheduler = worker->scheduler;
+    struct HLSchedulerGuest *guest = &scheduler->guests[index];
+
+    guest->stopReason = reason;
+    switch (reason) {
+    case HLStopBudgetExhausted:
+        if (!guest->suspendRequested) {
+            HLSchedulerQueuePush(scheduler, &worker->queue, index);
+            if (scheduler->sleepers > 0) {
+                HLConditionSignal(&scheduler->workAvailable);
+            }
+            return;
+        }
+        guest->state = HLGuestWaiting;
+        break;
+    case HLStopBreakpoint:
+        guest->state = HLGuestWaiting;
+        break;
+    default:
+        guest->state = HLGuestHalted;
+        break;
+    }
+
+    guest->suspendRequested = false;
+    if (--scheduler->active == 0) {
+        HLConditionBroadcast(&scheduler->idle);
+    }
+}
+
+/** Instructions executed so far by all of system's cores. */
+static uint64_t HLSchedulerGuestCycles(struct HLSystem *system)
+{
+    uint64_t cycles = 0;
+    uint32_t i;
+
+    for (i = 0; i < HLSystemCoreCount(system); i++) {
+        cycles += HLSystemCore(system, i)->cpu.cycles;
+    }
+    return cycles;
+}
+
+static void HLSchedulerWorkerMain(void *argument)
+{
+    struct HLSchedulerWorker *worker = argument;
+    struct HLScheduler *scheduler = worker->scheduler;
+    struct HLSystem *system;
+    uint64_t cycles;
+    HLStopReason reason;
+    int guest;
+
+    while (!HLAtomicLoad64(&scheduler->stopping)) {
+        guest = HLSchedulerTake(worker);
+        if (guest < 0) {
+            HLMutexLock(&scheduler->lock);
+            if (HLAtomicLoad64(&scheduler->queued) == 0
+                && !HLAtomicLoad64(&scheduler->stopping)) {
+                scheduler->sleepers++;
+                HLConditionWait(&scheduler->workAvailable, &scheduler->lock);
+                scheduler->sleepers--;
+            }
+            HLMutexUnlock(&scheduler->lock);
+            continue;
+        }
+
+        /* only this worker touches the system until it is queued again */
+        system = scheduler->guests[guest].system;
+        cycles = HLSchedulerGuestCycles(system);
+        reason = HLSystemRunCores(system, scheduler->sliceCycles);
+        HLAtomicAdd64(&worker->cycles,
+                      HLSchedulerGuestCycles(system) - cycles);
+        HLAtomicAdd64(&worker->slices, 1);
+
+        HLMutexLock(&scheduler->lock);
+        HLSchedulerSliceEnded(worker, guest, reason);
+        HLMutexUnlock(&scheduler->lock);
+    }
+}
+
+/**
+ * Stops and joins the first started workers, then frees everything the
+ * scheduler owns. workerCount counts the queues that were set up, which
+ * may be more than the threads that were started.
+ */
+static void HLSchedulerFree(struct HLScheduler *scheduler, int started)
+{
+    struct HLMemoryAllocation *alloc = scheduler->allocator;
+    struct HLSchedulerWorker *worker;
+    int i;
+
+    HLMutexLock(&scheduler->lock);
+    HLAtomicStore64(&scheduler->stopping, 1);
+    HLConditionBroadcast(&scheduler->workAvailable);
+    HLMutexUnlock(&scheduler->lock);
+
+    /* workers steal from each other's queues until they have all exited */
+    for (i = 0; i < started; i++) {
+        HLThreadJoin(&scheduler->workers[i].thread);
+    }
+    for (i = 0; i < scheduler->workerCount; i++) {
+        worker = &scheduler->workers[i];
+        HLMutexDone(&worker->queue.lock);
+        alloc->free(alloc, worker->queue.guests);
+    }
+    for (i = 0; i < scheduler->guestCount; i++) {
+        HLSystemDone(&scheduler->guests[i].system);
+    }
+
+    HLConditionDone(&scheduler->idle);
+    HLConditionDone(&scheduler->workAvailable);
+    HLMutexDone(&scheduler->lock);
+    if (scheduler->workers != NULL) {
+        alloc->free(alloc, scheduler->workers);
+    }
+    if (scheduler->guests != NULL) {
+        alloc->free(alloc, scheduler->guests);
+    }
+    alloc->free(alloc, scheduler);
+}
+
+bool HLSchedulerInit(struct HLScheduler **scheduler,
+                     struct HLMemoryAllocation *alloc,
+                     int threadCount,
+                     int maxGuests,
+                     uint64_t sliceCycles)
+{
+    struct HLScheduler *newScheduler =
+        alloc->alloc(alloc, sizeof(struct HLScheduler));
+    struct HLSchedulerWorker *worker;
+    int i;
+    int started = 0;
+
+    *scheduler = NULL;
+    if (newScheduler == NULL) {
+        return false;
+    }
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    if (maxGuests < 1) {
+        maxGuests = 1;
+    }
+
+    newScheduler->allocator = alloc;
+    HLMutexInit(&newScheduler->lock);
+    HLConditionInit(&newScheduler->workAvailable);
+    HLConditionInit(&newScheduler->idle);
+    newScheduler->workerCount = 0;
+    newScheduler->guests = alloc->alloc(
+        alloc, (long)(maxGuests * sizeof(struct HLSchedulerGuest)));
+    newScheduler->guestCount = 0;
+    newScheduler->maxGuests = maxGuests;
+    newScheduler->sliceCycles = sliceCycles;
+    newScheduler->queued = 0;
+    newScheduler->stopping = 0;
+    newScheduler->active = 0;
+    newScheduler->sleepers = 0;
+    newScheduler->nextWorker = 0;
+
+    newScheduler->workers = alloc->alloc(
+        alloc, (long)(threadCount * sizeof(struct HLSchedulerWorker)));
+    if (newScheduler->guests == NULL || newScheduler->workers == NULL) {
+        HLSchedulerFree(newScheduler, 0);
+        return false;
+    }
+    for (i = 0; i < threadCount; i++) {
+        worker = &newScheduler->workers[i];
+        worker->scheduler = newScheduler;
+        worker->index = i;
+        worker->cycles = 0;
+        worker->slices = 0;
+        worker->steals = 0;
+        worker->queue.guests =
+            alloc->alloc(alloc, (long)(maxGuests * sizeof(int)));
+        if (worker->queue.guests == NULL) {
+            break;
+        }
+        HLMutexInit(&worker->queue.lock);
+        worker->queue.head = 0;
+        worker->queue.count = 0;
+        newScheduler->workerCount++;
+    }
+
+    /* every queue has to exist before any worker can try to steal from it */
+    if (newScheduler->workerCount == threadCount) {
+        for (started = 0; started < threadCount; started++) {
+            worker = &newScheduler->workers[started];
+            if (!HLThreadStart(
+                    &worker->thread, HLSchedulerWorkerMain, worker)) {
+                break;
+            }
+        }
+    }
+    if (started != threadCount) {
+        HLSchedulerFree(newScheduler, started);
+        return false;
+    }
+
+    *scheduler = newScheduler;
+    return true;
+}
+
+void HLSchedulerDone(struct HLScheduler **scheduler)
+{
+    HLSchedulerFree(*scheduler, (*scheduler)->workerCount);
+    *scheduler = 0;
+}
+
+int HLSchedulerAdd(struct HLScheduler *scheduler, struct HLSystem *system)
+{
+    struct HLSchedulerGuest *guest;
+    int index = -1;
+
+    HLMutexLock(&scheduler->lock);
+    if (scheduler->guestCount < scheduler->maxGuests) {
+        index = scheduler->guestCount++;
+        guest = &scheduler->guests[index];
+        guest->system = system;
+        guest->stopReason = HLStopBudgetExhausted;
+        guest->state = HLGuestRunnable;
+        guest->suspendRequested = false;
+        scheduler->active++;
+        HLSchedulerEnqueue(scheduler, index);
+    }
+    HLMutexUnlock(&scheduler->lock);
+
+    return index;
+}
+
+HLGuestState HLSchedulerGuestState(struct HLScheduler *scheduler, int guest)
+{
+    HLGuestState state;
+
+    HLMutexLock(&scheduler->lock);
+    state = scheduler->guests[guest].state;
+    HLMutexUnlock(&scheduler->lock);
+
+    return state;
+}
+
+HLStopReason HLSchedulerGuestStopReason(struct HLScheduler *scheduler,
+                                        int guest)
+{
+    HLStopReason reason;
+
+    HLMutexLock(&scheduler->lock);
+    reason = scheduler->guests[guest].stopReason;
+    HLMutexUnlock(&scheduler->lock);
+
+    return reason;
+}
+
+void HLSchedulerSuspend(struct HLScheduler *scheduler, int guest)
+{
+    HLMutexLock(&scheduler->lock);
+    if (scheduler->guests[guest].state == HLGuestRunnable) {
+        scheduler->guests[guest].suspendRequested = true;
+    }
+    HLMutexUnlock(&scheduler->lock);
+}
+
+void HLSchedulerResume(struct HLScheduler *scheduler, int guest)
+{
+    struct HLSchedulerGuest *ptrGuest = &scheduler->guests[guest];
+
+    HLMutexLock(&scheduler->lock);
+    ptrGuest->suspendRequested = false;
+    if (ptrGuest->state == HLGuestWaiting) {
+        ptrGuest->state = HLGuestRunnable;
+        scheduler->active++;
+        HLSchedulerEnqueue(scheduler, guest);
+    }
+    HLMutexUnlock(&scheduler->lock);
+}
+
+void HLSchedulerWait(struct HLScheduler *scheduler)
+{
+    HLMutexLock(&scheduler->lock);
+    while (scheduler->active > 0) {
+        HLConditionWait(&scheduler->idle, &scheduler->lock);
+    }
+    HLMutexUnlock(&scheduler->lock);
+}
+
+void HLSchedulerGetStatistics(struct HLScheduler *scheduler,
+                              struct HLSchedulerStatistics *statistics)
+{
+    struct HLSchedulerWorker *worker;
+    int i;
+
+    statistics->cycles = 0;
+    statistics->slices = 0;
+    statistics->steals = 0;
+    for (i = 0; i < scheduler->workerCount; i++) {
+        worker = &scheduler->workers[i];
+        statistics->cycles += HLAtomicLoad64(&worker->cycles);
+        statistics->slices += HLAtomicLoad64(&worker->slices);
+        statistics->steals += HLAtomicLoad64(&worker->steals);
+    }
+}
@@ -0,0 +1,113 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <stddef.h>
+
+#include "memory_allocation.h"
+#include "snapshot_p.h"
+#include "system_p.h"
+
+bool HLSnapshotCreate(struct HLSnapshot **snapshot, struct HLSystem *system)
+{
+    struct HLMemoryAllocation *alloc = system->allocator;
+    struct HLSnapshot *newSnapshot;
+    struct HLSnapshotCore *state;
+    struct HLSystem *core;
+    uint32_t i;
+
+    system = system->primary;
+    HLSystemWaitForDevices(system);
+    newSnapshot = alloc->alloc(alloc, sizeof(struct HLSnapshot));
+    if (newSnapshot == NULL) {
+        return false;
+    }
+    newSnapshot->cores = alloc->alloc(
+        alloc, (long)(system->coreCount * sizeof(struct HLSnapshotCore)));
+    if (newSnapshot->cores == NULL) {
+        alloc->free(alloc, newSnapshot);
+        return false;
+    }
+
+    newSnapshot->memory.size = 0;
+    if (system->memory.memoryLimit > 0
+        && !HLPhysicalMemoryImageCapture(&newSnapshot->memory,
+                                         system->memory.memory,
+                                         system->memory.memoryLimit)) {
+        alloc->free(alloc, newSnapshot->cores);
+        alloc->free(alloc, newSnapshot);
+        return false;
+    }
+
+    newSnapshot->allocator = alloc;
+    newSnapshot->engine = system->engine;
+    newSnapshot->coreCount = system->coreCount;
+    newSnapshot->memoryLimit = system->memory.memoryLimit;
+    for (i = 0; i < system->coreCount; i++) {
+        core = HLSystemCore(system, i);
+        state = &newSnapshot->cores[i];
+        state->cpu = core->cpu;
+        state->interrupts = core->interrupts;
+        HLTimerSave(&core->timer, &state->timer);
+        state->pageTableBase = core->memory.pageTableBase;
+        state->testCode = core->testCode;
+    }
+
+    *snapshot = newSnapshot;
+    return true;
+}
+
+void HLSnapshotDone(struct HLSnapshot **snapshot)
+{
+    struct HLSnapshot *ptrSnapshot = *snapshot;
+    struct HLMemoryAllocation *alloc = ptrSnapshot->allocator;
+
+    if (ptrSnapshot->memory.size > 0) {
+        HLPhysicalMemoryImageDone(&ptrSnapshot->memory);
+    }
+    alloc->free(alloc, ptrSnapshot->cores);
+    alloc->free(alloc, ptrSnapshot);
+    *snapshot = 0;
+}
+
+bool HLSnapshotFork(struct HLSnapshot *snapshot,
+                    struct HLSystem **system,
+                    struct HLMemoryAllocation *alloc)
+{
+    struct HLSystem *newSystem;
+    struct HLSnapshotCore *state;
+    struct HLSystem *core;
+    uint32_t i;
+
+    HLSystemInitWithEngine(&newSystem, alloc, snapshot->engine);
+    if (HLSystemSetCoreCount(newSystem, snapshot->coreCount)
+        != snapshot->coreCount) {
+        HLSystemDone(&newSystem);
+        return false;
+    }
+
+    if (snapshot->memory.size > 0) {
+        if (!HLPhysicalMemoryMapCopy(&newSystem->physicalMemory,
+                                     &snapshot->memory)) {
+            HLSystemDone(&newSystem);
+            return false;
+        }
+        newSystem->memory.memory = newSystem->physicalMemory.base;
+        newSystem->memory.memoryLimit = snapshot->memoryLimit;
+    }
+
+    for (i = 0; i < snapshot->coreCount; i++) {
+        core = HLSystemCore(newSystem, i);
+        state = &snapshot->cores[i];
+        core->cpu = state->cpu;
+        core->interrupts = state->interrupts;
+        core->memory.pageTableBase = state->pageTableBase;
+        core->testCode = state->testCode;
+        HLTimerRestore(&core->timer, &state->timer);
+    }
+
+    *system = newSystem;
+    return true;
+}
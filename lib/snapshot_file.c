@@ -0,0 +1,727 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#if !defined(_WIN32)
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#define HLFileSeek(file, offset)                                               \
+    (_fseeki64((file), (__int64)(offset), SEEK_SET) == 0)
+#define HLFileSeekEnd(file) (_fseeki64((file), 0, SEEK_END) == 0)
+#define HLFileTell(file) ((uint64_t)_ftelli64(file))
+#define HLFileTruncate(file, size)                                             \
+    (fflush(file) == 0 && _chsize_s(_fileno(file), (__int64)(size)) == 0)
+#define HLFileSync(file) (fflush(file) == 0 && _commit(_fileno(file)) == 0)
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define HLFileSeek(file, offset)                                               \
+    (fseeko((file), (off_t)(offset), SEEK_SET) == 0)
+#define HLFileSeekEnd(file) (fseeko((file), 0, SEEK_END) == 0)
+#define HLFileTell(file) ((uint64_t)ftello(file))
+#define HLFileTruncate(file, size)                                             \
+    (fflush(file) == 0 && ftruncate(fileno(file), (off_t)(size)) == 0)
+#define HLFileSync(file) (fflush(file) == 0 && fsync(fileno(file)) == 0)
+#endif
+
+#include "memory_allocation.h"
+#include "physical_memory_p.h"
+#include "snapshot_p.h"
+#include "system_p.h"
+
+/** The latest version of one page according to a snapshot file. */
+struct HLSnapshotFilePage {
+    uint64_t page;
+    /** where the page's data is in the file; 0 if the page is zero */
+    uint64_t offset;
+    /** order the record was read in, so that later records win */
+    uint64_t sequence;
+};
+
+/** What a snapshot file describes once all of its segments are applied. */
+struct HLSnapshotFileView {
+    /** header of the latest segment */
+    struct HLSnapshotFileHeader header;
+    struct HLSnapshotFileCore *cores;
+    /** sorted by page, at most one per page */
+    struct HLSnapshotFilePage *pages;
+    uint64_t pageCount;
+    /** end of the last complete segment, where a checkpoint goes */
+    uint64_t end;
+};
+
+static bool HLSnapshotFileRead(FILE *file,
+                               uint64_t offset,
+                               void *data,
+                               size_t size)
+{
+    return HLFileSeek(file, offset) && fread(data, 1, size, file) == size;
+}
+
+static bool HLSnapshotFileWrite(FILE *file,
+                                uint64_t offset,
+                                const void *data,
+                                size_t size)
+{
+    return HLFileSeek(file, offset) && fwrite(data, 1, size, file) == size;
+}
+
+static uint64_t HLSnapshotFilePageCount(uint64_t memoryLimit)
+{
+    return (memoryLimit + HLPageOffsetMask) >> HLPageShift;
+}
+
+/** Bytes of page that lie below memoryLimit. */
+static size_t HLSnapshotFilePageLength(uint64_t memoryLimit, uint64_t page)
+{
+    uint64_t remaining = memoryLimit - (page << HLPageShift);
+
+    return (size_t)(remaining < HLPageSize ? remaining : HLPageSize);
+}
+
+static bool HLSnapshotFileIsZero(const uint8_t *data, size_t size)
+{
+    return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
+
+static void HLSnapshotFileSaveCore(struct HLSnapshotFileCore *record,
+                                   struct HLSystem *core)
+{
+    struct HLTimerState timer;
+
+    memset(record, 0, sizeof(*record));
+    memcpy(record->registers,
+           core->cpu.registers,
+           sizeof(record->registers));
+    record->cycles = core->cpu.cycles;
+    record->pageTableBase = core->memory.pageTableBase;
+    record->interruptVectorTableBaseAddress =
+        core->interrupts.interruptVectorTableBaseAddress;
+    record->returnAddress = core->interrupts.returnAddress;
+    record->returnStatus = core->interrupts.returnStatus;
+    memcpy(record->pendingInterrupts,
+           core->interrupts.pending,
+           sizeof(record->pendingInterrupts));
+    record->testCode = core->testCode;
+    memcpy(record->interruptQueue,
+           core->interrupts.queue,
+           sizeof(record->interruptQueue));
+    record->interruptQueueSize = core->interrupts.queueSize;
+    HLTimerSave(&core->timer, &timer);
+    record->timerControl = timer.control;
+    record->timerVector = timer.vector;
+    record->timerPeriod = timer.period;
+    record->timerRemaining = timer.remaining;
+}
+
+static void HLSnapshotFileRestoreCore(struct HLSystem *core,
+                                      const struct HLSnapshotFileCore *record)
+{
+    struct HLTimerState timer;
+
+    memcpy(core->cpu.registers,
+           record->registers,
+           sizeof(core->cpu.registers));
+    core->cpu.cycles = record->cycles;
+    core->memory.pageTableBase = record->pageTableBase;
+    core->interrupts.interruptVectorTableBaseAddress =
+        record->interruptVectorTableBaseAddress;
+    core->interrupts.returnAddress = record->returnAddress;
+    core->interrupts.returnStatus = record->returnStatus;
+    memcpy(core->interrupts.pending,
+           record->pendingInterrupts,
+           sizeof(core->interrupts.pending));
+    core->testCode = (int)record->testCode;
+    memcpy(core->interrupts.queue,
+           record->interruptQueue,
+           sizeof(core->interrupts.queue));
+    core->interrupts.queueSize = record->interruptQueueSize;
+    core->interrupts.raised = 1;
+    timer.control = record->timerControl;
+    timer.vector = record->timerVector;
+    timer.period = record->timerPeriod;
+    timer.remaining = record->timerRemaining;
+    HLTimerRestore(&core->timer, &timer);
+}
+
+static void HLSnapshotFileViewDone(struct HLSnapshotFileView *view,
+                                   struct HLMemoryAllocation *alloc)
+{
+    if (view->cores != NULL) {
+        alloc->free(alloc, view->cores);
+    }
+    if (view->pages != NULL) {
+        alloc->free(alloc, view->pages);
+    }
+}
+
+static int HLSnapshotFilePageCompare(const void *left, const void *right)
+{
+    const struct HLSnapshotFilePage *a = left;
+    const struct HLSnapshotFilePage *b = right;
+
+    if (a->page != b->page) {
+        return a->page < b->page ? -1 : 1;
+    }
+    if (a->sequence != b->sequence) {
+        return a->sequence < b->sequence ? -1 : 1;
+    }
+    return 0;
+}
+
+/** Whether header starts a complete segment at offset in a file of size. */
+static bool HLSnapshotFileHeaderValid(const struct HLSnapshotFileHeader *header,
+                                      uint64_t offset,
+                                      uint64_t size)
+{
+    uint64_t metadata;
+
+    if (memcmp(header->magic, HLSnapshotFileMagic, sizeof(header->magic))
+            != 0
+        || header->version != HLSnapshotFileVersion
+        || header->pageShift != HLPageShift
+        || (header->segmentSize & HLPageOffsetMask) != 0
+        || header->segmentSize > size - offset
+        || (header->pageDataOffset & HLPageOffsetMask) != 0) {
+        return false;
+    }
+
+    metadata = sizeof(struct HLSnapshotFileHeader)
+               + (uint64_t)header->coreCount
+                     * sizeof(struct HLSnapshotFileCore)
+               + header->pageCount * sizeof(uint64_t);
+    return header->coreCount > 0 && header->pageCount <= (size >> 3)
+           && metadata <= header->pageDataOffset
+           && header->pageDataOffset <= header->segmentSize;
+}
+
+/** Reads every segment of file and works out the latest state it holds. */
+static bool HLSnapshotFileViewLoad(struct HLSnapshotFileView *view,
+                                   FILE *file,
+                                   struct HLMemoryAllocation *alloc)
+{
+    struct HLSnapshotFileHeader header;
+    struct HLSnapshotFilePage *pages;
+    struct HLSnapshotFileCore *cores;
+    uint64_t capacity = 0;
+    uint64_t count = 0;
+    uint64_t offset = 0;
+    uint64_t size;
+    uint64_t data;
+    uint64_t record;
+    uint64_t i;
+    uint64_t j;
+    bool ok;
+
+    view->cores = NULL;
+    view->pages = NULL;
+    view->pageCount = 0;
+
+    if (!HLFileSeekEnd(file)) {
+        return false;
+    }
+    size = HLFileTell(file);
+
+    while (size - offset >= sizeof(header)) {
+        if (!HLSnapshotFileRead(file, offset, &header, sizeof(header))
+            || !HLSnapshotFileHeaderValid(&header, offset, size)) {
+            break;
+        }
+
+        cores = alloc->alloc(
+            alloc,
+            (long)(header.coreCount * sizeof(struct HLSnapshotFileCore)));
+        if (cores == NULL) {
+            break;
+        }
+        if (!HLSnapshotFileRead(file,
+                                offset + sizeof(header),
+                                cores,
+                                header.coreCount
+                                    * sizeof(struct HLSnapshotFileCore))) {
+            alloc->free(alloc, cores);
+            break;
+        }
+
+        if (count + header.pageCount > capacity) {
+            capacity = (count + header.pageCount) * 2;
+            pages = view->pages == NULL
+                        ? alloc->alloc(alloc,
+                                       (long)(capacity * sizeof(*pages)))
+                        : alloc->realloc(alloc,
+                                         (long)(count * sizeof(*pages)),
+                                         (long)(capacity * sizeof(*pages)),
+                                         view->pages);
+            if (pages == NULL) {
+                alloc->free(alloc, cores);
+                break;
+            }
+            view->pages = pages;
+        }
+
+        ok = HLFileSeek(file,
+                        offset + sizeof(header)
+                            + header.coreCount
+                                  * sizeof(struct HLSnapshotFileCore));
+        data = offset + header.pageDataOffset;
+        for (i = 0; ok && i < header.pageCount; i++) {
+            ok = fread(&record, sizeof(record), 1, file) == 1;
+            view->pages[count + i].page = record & ~HLSnapshotZeroPage;
+            view->pages[count + i].sequence = count + i;
+            if (record & HLSnapshotZeroPage) {
+                view->pages[count + i].offset = 0;
+            } else {
+                view->pages[count + i].offset = data;
+                data += HLPageSize;
+            }
+        }
+        /* the data for the records has to fit in the segment */
+        if (!ok || data > offset + header.segmentSize) {
+            alloc->free(alloc, cores);
+            break;
+        }
+
+        count += header.pageCount;
+        if (view->cores != NULL) {
+            alloc->free(alloc, view->cores);
+        }
+        view->cores = cores;
+        view->header = header;
+        offset += header.segmentSize;
+    }
+
+    if (view->cores == NULL) {
+        HLSnapshotFileViewDone(view, alloc);
+        return false;
+    }
+
+    /* keep only the latest record for each page */
+    if (count > 0) {
+        qsort(view->pages,
+              (size_t)count,
+              sizeof(*view->pages),
+              HLSnapshotFilePageCompare);
+    }
+    for (i = 0, j = 0; i < count; i++) {
+        if (i + 1 < count && view->pages[i + 1].page == view->pages[i].page) {
+            continue;
+        }
+        view->pages[j++] = view->pages[i];
+    }
+
+    view->pageCount = j;
+    view->end = offset;
+    return true;
+}
+
+/**
+ * Writes a segment holding system at offset start of file, with only the
+ * pages that differ from base, which is what the file held so far. base
+ * is NULL for a new file. If dirty isn't NULL, pages without a bit in it
+ * are known to match base.
+ */
+static bool HLSnapshotFileWriteSegment(FILE *file,
+                                       uint64_t start,
+                                       struct HLSystem *system,
+                                       const struct HLSnapshotFileView *base,
+                                       const uint64_t *dirty)
+{
+    struct HLMemoryAllocation *alloc = system->allocator;
+    struct HLSnapshotFileHeader header;
+    struct HLSnapshotFileCore core;
+    uint64_t memoryLimit = system->memory.memoryLimit;
+    uint64_t pageTotal = HLSnapshotFilePageCount(memoryLimit);
+    uint64_t *records = NULL;
+    uint64_t *grown;
+    uint64_t capacity = 0;
+    uint64_t count = 0;
+    uint64_t dataPages = 0;
+    uint64_t stored;
+    uint64_t offset;
+    uint64_t page;
+    uint64_t i = 0;
+    const uint8_t *data;
+    uint8_t *buffer;
+    size_t length;
+    bool zero;
+    bool ok = true;
+
+    buffer = alloc->alloc(alloc, (long)HLPageSize);
+    if (buffer == NULL) {
+        return false;
+    }
+
+    /* work out which pages have to go into this segment */
+    for (page = 0; ok && page < pageTotal; page++) {
+        if (dirty != NULL && !((dirty[page >> 6] >> (page & 63)) & 1)) {
+            continue;
+        }
+        length = HLSnapshotFilePageLength(memoryLimit, page);
+        data = system->memory.memory + (page << HLPageShift);
+        zero = HLSnapshotFileIsZero(data, length);
+
+        stored = 0;
+        if (base != NULL) {
+            while (i < base->pageCount && base->pages[i].page < page) {
+                i++;
+            }
+            if (i < base->pageCount && base->pages[i].page == page) {
+                stored = base->pages[i].offset;
+            }
+        }
+
+        if (stored == 0 && zero) {
+            continue;
+        }
+        if (stored != 0 && !zero) {
+            ok = HLSnapshotFileRead(file, stored, buffer, HLPageSize);
+            if (ok && memcmp(buffer, data, length) == 0
+                && (length == HLPageSize
+                    || HLSnapshotFileIsZero(buffer + length,
+                                            HLPageSize - length))) {
+                continue;
+            }
+        }
+
+        if (count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            grown = records == NULL
+                        ? alloc->alloc(alloc,
+                                       (long)(capacity * sizeof(*records)))
+                        : alloc->realloc(alloc,
+                                         (long)(count * sizeof(*records)),
+                                         (long)(capacity * sizeof(*records)),
+                                         records);
+            if (grown == NULL) {
+                ok = false;
+                break;
+            }
+            records = grown;
+        }
+        records[count++] = zero ? page | HLSnapshotZeroPage : page;
+        if (!zero) {
+            dataPages++;
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HLSnapshotFileMagic, sizeof(header.magic));
+    header.version = HLSnapshotFileVersion;
+    header.pageShift = HLPageShift;
+    header.memoryLimit = memoryLimit;
+    header.engine = system->engine;
+    header.coreCount = system->coreCount;
+    header.pageCount = count;
+    header.pageDataOffset =
+        (sizeof(header) + header.coreCount * sizeof(core)
+         + count * sizeof(*records) + HLPageOffsetMask)
+        & ~HLPageOffsetMask;
+    header.segmentSize = header.pageDataOffset + dataPages * HLPageSize;
+
+    /* everything but the header, so a torn segment is never picked up */
+    offset = start + sizeof(header);
+    for (i = 0; ok && i < header.coreCount; i++) {
+        HLSnapshotFileSaveCore(&core, HLSystemCore(system, (uint32_t)i));
+        ok = HLSnapshotFileWrite(file, offset, &core, sizeof(core));
+        offset += sizeof(core);
+    }
+    if (ok && count > 0) {
+        ok = HLSnapshotFileWrite(file,
+                                 offset,
+                                 records,
+                                 (size_t)(count * sizeof(*records)));
+    }
+
+    offset = start + header.pageDataOffset;
+    for (i = 0; ok && i < count; i++) {
+        if (records[i] & HLSnapshotZeroPage) {
+            continue;
+        }
+        page = records[i];
+        length = HLSnapshotFilePageLength(memoryLimit, page);
+        data = system->memory.memory + (page << HLPageShift);
+        if (length < HLPageSize) {
+            memcpy(buffer, data, length);
+            memset(buffer + length, 0, HLPageSize - length);
+            data = buffer;
+        }
+        ok = HLSnapshotFileWrite(file, offset, data, HLPageSize);
+        offset += HLPageSize;
+    }
+
+    /*
+     * also drops whatever a torn segment left past the end; the rest of
+     * the segment has to be on disk before the header that makes it valid
+     */
+    ok = ok && HLFileTruncate(file, start + header.segmentSize)
+         && HLFileSync(file)
+         && HLSnapshotFileWrite(file, start, &header, sizeof(header))
+         && HLFileSync(file);
+
+    if (records != NULL) {
+        alloc->free(alloc, records);
+    }
+    alloc->free(alloc, buffer);
+    return ok;
+}
+
+/**
+ * Takes the dirty page bits of system, since the file about to be written
+ * becomes what they are relative to. Returns NULL if system isn't
+ * tracking them.
+ */
+static uint64_t *HLSnapshotFileTakeDirtyPages(struct HLSystem *system)
+{
+    struct HLMemoryAllocation *alloc = system->allocator;
+    uint64_t pageCount = HLSnapshotFilePageCount(system->memory.memoryLimit);
+    uint64_t *dirty;
+
+    if (!system->trackDirtyPages || pageCount == 0) {
+        return NULL;
+    }
+    dirty = alloc->alloc(alloc, (long)(((pageCount + 63) >> 6) * 8));
+    if (dirty != NULL) {
+        HLSystemTakeDirtyPages(system, dirty, pageCount);
+    }
+    return dirty;
+}
+
+/** Frees dirty, first handing its bits back if the file wasn't written. */
+static void HLSnapshotFileDoneDirtyPages(struct HLSystem *system,
+                                         uint64_t *dirty,
+                                         bool written)
+{
+    uint64_t pageCount = HLSnapshotFilePageCount(system->memory.memoryLimit);
+    uint64_t page;
+
+    if (dirty == NULL) {
+        return;
+    }
+    for (page = 0; !written && page < pageCount; page++) {
+        if ((dirty[page >> 6] >> (page & 63)) & 1) {
+            HLSystemMarkDirtyPages(system, page << HLPageShift, HLPageSize);
+        }
+    }
+    system->allocator->free(system->allocator, dirty);
+}
+
+/**
+ * Makes the rename of a file to path durable. Windows has no way to sync
+ * a directory; its rename is made durable with MOVEFILE_WRITE_THROUGH.
+ */
+static bool HLSnapshotFileSyncDirectory(const char *path,
+                                        struct HLMemoryAllocation *alloc)
+{
+#ifdef _WIN32
+    return true;
+#else
+    const char *slash = strrchr(path, '/');
+    char *directory;
+    size_t length;
+    int descriptor;
+    bool ok;
+
+    if (slash == NULL) {
+        descriptor = open(".", O_RDONLY);
+    } else {
+        length = slash == path ? 1 : (size_t)(slash - path);
+        directory = alloc->alloc(alloc, (long)(length + 1));
+        if (directory == NULL) {
+            return false;
+        }
+        memcpy(directory, path, length);
+        directory[length] = '\0';
+        descriptor = open(directory, O_RDONLY);
+        alloc->free(alloc, directory);
+    }
+    if (descriptor < 0) {
+        return false;
+    }
+    ok = fsync(descriptor) == 0;
+    return close(descriptor) == 0 && ok;
+#endif
+}
+
+bool HLSnapshotWriteFile(struct HLSystem *system, const char *path)
+{
+    struct HLMemoryAllocation *alloc = system->allocator;
+    size_t pathLength = strlen(path);
+    char *temporaryPath;
+    uint64_t *dirty;
+    FILE *file;
+    bool ok;
+
+    system = system->primary;
+    HLSystemWaitForDevices(system);
+    temporaryPath = alloc->alloc(alloc, (long)(pathLength + 5));
+    if (temporaryPath == NULL) {
+        return false;
+    }
+    memcpy(temporaryPath, path, pathLength);
+    memcpy(temporaryPath + pathLength, ".tmp", 5);
+
+    file = fopen(temporaryPath, "w+b");
+    if (file == NULL) {
+        alloc->free(alloc, temporaryPath);
+        return false;
+    }
+    dirty = HLSnapshotFileTakeDirtyPages(system);
+    ok = HLSnapshotFileWriteSegment(file, 0, system, NULL, NULL);
+    ok = fclose(file) == 0 && ok;
+
+    /* systems restored from the old file keep their mappings of it */
+#ifdef _WIN32
+    if (ok) {
+        remove(path);
+    }
+    ok = ok
+         && MoveFileExA(temporaryPath, path, MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    ok = ok && rename(temporaryPath, path) == 0;
+#endif
+    if (!ok) {
+        remove(temporaryPath);
+    }
+    /* the rename only survives a crash once the directory is synced */
+    ok = ok && HLSnapshotFileSyncDirectory(path, alloc);
+
+    HLSnapshotFileDoneDirtyPages(system, dirty, ok);
+    alloc->free(alloc, temporaryPath);
+    return ok;
+}
+
+bool HLSnapshotCheckpointFile(struct HLSystem *system, const char *path)
+{
+    struct HLSnapshotFileView view;
+    uint64_t *dirty;
+    FILE *file;
+    bool ok;
+
+    system = system->primary;
+    HLSystemWaitForDevices(system);
+    file = fopen(path, "r+b");
+    if (file == NULL) {
+        return HLSnapshotWriteFile(system, path);
+    }
+
+    ok = HLSnapshotFileViewLoad(&view, file, system->allocator);
+    if (ok) {
+        dirty = HLSnapshotFileTakeDirtyPages(system);
+        ok = HLSnapshotFileWriteSegment(file, view.end, system, &view, dirty);
+        HLSnapshotFileDoneDirtyPages(system, dirty, ok);
+        HLSnapshotFileViewDone(&view, system->allocator);
+    }
+
+    return fclose(file) == 0 && ok;
+}
+
+/**
+ * Puts size bytes of file at offset into memory, mapping them where the
+ * host allows it.
+ */
+static bool HLSnapshotFileMapPages(FILE *file,
+                                   uint64_t offset,
+                                   uint8_t *memory,
+                                   uint64_t size)
+{
+#ifndef _WIN32
+    if (mmap(memory,
+             (size_t)size,
+             PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED,
+             fileno(file),
+             (off_t)offset)
+        != MAP_FAILED) {
+        return true;
+    }
+#endif
+    /* e.g. the host's pages are bigger than ours */
+    return HLSnapshotFileRead(file, offset, memory, (size_t)size);
+}
+
+bool HLSnapshotRestoreFile(struct HLSystem **system,
+                           struct HLMemoryAllocation *alloc,
+                           const char *path)
+{
+    struct HLSnapshotFileView view;
+    struct HLSnapshotFilePage *pages;
+    struct HLSystem *newSystem;
+    uint64_t pageTotal;
+    uint64_t run;
+    uint64_t i;
+    FILE *file;
+    bool ok;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    if (!HLSnapshotFileViewLoad(&view, file, alloc)) {
+        fclose(file);
+        return false;
+    }
+
+    HLSystemInitWithEngine(
+        &newSystem, alloc, (HLExecutionEngine)view.header.engine);
+    ok = HLSystemSetCoreCount(newSystem, view.header.coreCount)
+         == view.header.coreCount;
+
+    pageTotal = HLSnapshotFilePageCount(view.header.memoryLimit);
+    if (ok && pageTotal > 0) {
+        ok = HLPhysicalMemoryReserve(&newSystem->physicalMemory,
+                                     pageTotal << HLPageShift);
+        newSystem->memory.memory = newSystem->physicalMemory.base;
+        newSystem->memory.memoryLimit = view.header.memoryLimit;
+    }
+
+    /* map runs of pages that are contiguous in both memory and the file */
+    pages = view.pages;
+    for (i = 0; ok && i < view.pageCount; i += run) {
+        run = 1;
+        if (pages[i].offset == 0 || pages[i].page >= pageTotal) {
+            continue;
+        }
+        while (i + run < view.pageCount
+               && pages[i + run].page == pages[i].page + run
+               && pages[i + run].page < pageTotal
+               && pages[i + run].offset
+                      == pages[i].offset + (run << HLPageShift)) {
+            run++;
+        }
+        ok = HLSnapshotFileMapPages(
+            file,
+            pages[i].offset,
+            newSystem->memory.memory + (pages[i].page << HLPageShift),
+            run << HLPageShift);
+    }
+
+    for (i = 0; ok && i < view.header.coreCount; i++) {
+        HLSnapshotFileRestoreCore(HLSystemCore(newSystem, (uint32_t)i),
+                                  &view.cores[i]);
+    }
+
+    HLSnapshotFileViewDone(&view, alloc);
+    /* the mappings keep the file alive */
+    fclose(file);
+
+    if (!ok) {
+        HLSystemDone(&newSystem);
+        return false;
+    }
+    *system = newSystem;
+    return true;
+}
@@ -0,0 +1,106 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_SNAPSHOT_P_H
+#define HALLEY_SNAPSHOT_P_H
+
+#include <stdint.h>
+
+#include "physical_memory_p.h"
+#include "snapshot.h"
+#include "system_p.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Everything about one core that isn't a cache. */
+struct HLSnapshotCore {
+    struct HLCPUCore cpu;
+    struct HLInterruptController interrupts;
+    struct HLTimerState timer;
+    uint64_t pageTableBase;
+    int testCode;
+};
+
+struct HLSnapshot {
+    struct HLMemoryAllocation *allocator;
+    HLExecutionEngine engine;
+    uint32_t coreCount;
+    struct HLSnapshotCore *cores;
+    /** memory.memoryLimit of the snapshotted system */
+    uint64_t memoryLimit;
+    struct HLPhysicalMemoryImage memory;
+};
+
+/*
+ * Snapshot files
+ *
+ * A file is a sequence of segments, each starting on a HLPageSize
+ * boundary: the first is a full snapshot, and each checkpoint appends one
+ * holding the machine state plus only the pages that changed since the
+ * file was last written. A segment is laid out as
+ *
+ *     struct HLSnapshotFileHeader
+ *     struct HLSnapshotFileCore[coreCount]
+ *     uint64_t records[pageCount]
+ *     padding up to the next HLPageSize boundary
+ *     HLPageSize bytes of data for every record without HLSnapshotZeroPage
+ *
+ * where each record is a physical page number, with HLSnapshotZeroPage set
+ * if the page went back to zero. A page missing from every segment is
+ * zero. The latest segment's state and the latest record for each page
+ * win. Page data sits at page aligned offsets, so it can be mapped
+ * straight into guest memory. Everything is little endian, the same as
+ * guest memory.
+ *
+ * The header is written last, so a segment cut short by a crash is
+ * ignored and overwritten by the next checkpoint.
+ */
+
+#define HLSnapshotFileMagic "HLSNAPSH"
+#define HLSnapshotFileVersion 2
+#define HLSnapshotZeroPage ((uint64_t)1 << 63)
+
+struct HLSnapshotFileHeader {
+    char magic[8];
+    uint32_t version;
+    /** always HLPageShift */
+    uint32_t pageShift;
+    /** bytes from the start of this segment to the start of the next */
+    uint64_t segmentSize;
+    uint64_t memoryLimit;
+    uint32_t engine;
+    uint32_t coreCount;
+    uint64_t pageCount;
+    /** where the page data starts, relative to the segment */
+    uint64_t pageDataOffset;
+};
+
+struct HLSnapshotFileCore {
+    uint64_t registers[HLNReg];
+    uint64_t cycles;
+    uint64_t pageTableBase;
+    uint64_t interruptVectorTableBaseAddress;
+    uint64_t returnAddress;
+    uint64_t returnStatus;
+    uint64_t pendingInterrupts[4];
+    int64_t testCode;
+    uint8_t interruptQueue[16];
+    uint8_t interruptQueueSize;
+    uint8_t timerControl;
+    uint8_t timerVector;
+    uint8_t reserved[5];
+    uint64_t timerPeriod;
+    /** see HLTimerState.remaining */
+    uint64_t timerRemaining;
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,134 +7,581 @@
 #include <assert.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <string.h>
 #include "system.h"
+#include "dma_p.h"
+#include "interpreter_p.h"
 #include "memory_allocation.h"
+#include "ring_p.h"
 #include "system_p.h"
+#include "thread_p.h"
+
+static void HLSystemCodeWritten(void *userData, uint64_t address, uint64_t size)
+{
+    struct HLSystem *system = userData;
+    uint8_t *codePage = &system->memory.codePages[address >> HLPageShift];
+
+    struct HLSystem *primary = system->primary;
+
+    HLDecodeCacheInvalidate(&system->decodeCache, address, size);
+
+    if (primary->coreCount > 1) {
+        /* the other cores pick this up before their next block; the bits
+         * stay set since we can't tell which cores still cache the page
+         */
+        if (HLAtomicAdd64(&primary->codeGeneration, 1)
+            == system->seenCodeGeneration) {
+            system->seenCodeGeneration++;
+        }
+        if (*codePage & HLCodePageBlocks) {
+            HLBlockCacheInvalidatePage(system->blockCache, address);
+            system->cpu.faulted = true;
+        }
+        return;
+    }
+
+    if (*codePage & HLCodePageBlocks) {
+        HLBlockCacheInvalidatePage(system->blockCache, address);
+        *codePage &= ~HLCodePageBlocks;
+        /* the running block may be one of them; don't run the rest of it */
+        system->cpu.faulted = true;
+    }
+}
+
+static void
+HLSystemTranslationsDropped(void *userData, uint64_t address, bool all)
+{
+    struct HLSystem *system = userData;
+
+    if (system->blockCache != NULL) {
+        HLBlockCacheInvalidateTranslations(system->blockCache, address, all);
+        system->cpu.faulted = true;
+    }
+}
 
 void HLSystemInit(struct HLSystem **system, struct HLMemoryAllocation *alloc)
+{
+    HLSystemInitWithEngine(system, alloc, HLExecutionEngineInterpreter);
+}
+
+/** Sets up everything a core has of its own; NULL if out of memory. */
+static struct HLSystem *HLSystemCreate(struct HLMemoryAllocation *alloc,
+                                       HLExecutionEngine engine)
 {
     struct HLSystem *newSystem = alloc->alloc(alloc, sizeof(struct HLSystem));
 
-    /* TODO: check allocation */
+    if (newSystem == NULL) {
+        return NULL;
+    }
     newSystem->allocator = alloc;
+    memset(&newSystem->cpu, 0, sizeof(newSystem->cpu));
+    memset(&newSystem->interrupts, 0, sizeof(newSystem->interrupts));
+    newSystem->memory.memory = NULL;
+    newSystem->memory.memoryLimit = 0;
+    newSystem->memory.pageTableBase = 0;
+    newSystem->physicalMemory.base = NULL;
+    newSystem->physicalMemory.size = 0;
+    memset(&newSystem->memory.translationCache,
+           0,
+           sizeof(newSystem->memory.translationCache));
+    newSystem->memory.codePages = NULL;
+    newSystem->memory.codePageCount = 0;
+    newSystem->memory.codeWriteObserver = HLSystemCodeWritten;
+    newSystem->memory.codeWriteObserverData = newSystem;
+    newSystem->memory.translationObserver = HLSystemTranslationsDropped;
+    newSystem->memory.translationObserverData = newSystem;
+    newSystem->memory.dirtyPages = NULL;
+    newSystem->memory.dirtyPageCount = 0;
+    newSystem->trackDirtyPages = false;
+    newSystem->dma = NULL;
+    newSystem->rings = NULL;
+    HLEventQueueInit(&newSystem->events);
+    HLTimerInit(&newSystem->timer, newSystem);
+    newSystem->bus = NULL;
+    newSystem->portBatch.count = 0;
+
+    HLDecodeCacheFlush(&newSystem->decodeCache);
+    newSystem->decodeCache.hits = 0;
+    newSystem->decodeCache.misses = 0;
+
+    newSystem->engine = HLExecutionEngineInterpreter;
+    newSystem->blockCache = NULL;
+    newSystem->jit = NULL;
+    if (engine == HLExecutionEngineBlocks || engine == HLExecutionEngineJIT) {
+        newSystem->blockCache =
+            alloc->alloc(alloc, sizeof(struct HLBlockCache));
+    }
+    if (newSystem->blockCache != NULL) {
+        HLBlockCacheFlush(newSystem->blockCache);
+        newSystem->blockCache->pageTableBase = 0;
+        newSystem->blockCache->translations = 0;
+        newSystem->blockCache->chainedTransfers = 0;
+        newSystem->blockCache->lookups = 0;
+        newSystem->engine = HLExecutionEngineBlocks;
+    }
+#if HL_JIT
+    if (engine == HLExecutionEngineJIT && newSystem->blockCache != NULL) {
+        newSystem->jit = alloc->alloc(alloc, sizeof(struct HLJIT));
+        if (newSystem->jit != NULL && !HLJITInit(newSystem->jit)) {
+            alloc->free(alloc, newSystem->jit);
+            newSystem->jit = NULL;
+        }
+        if (newSystem->jit != NULL) {
+            newSystem->engine = HLExecutionEngineJIT;
+        }
+    }
+#endif
+
+    newSystem->primary = newSystem;
+    newSystem->coreIndex = 0;
+    newSystem->coreCount = 1;
+    newSystem->cores = NULL;
+    newSystem->coreThreads = NULL;
+    newSystem->codeGeneration = 0;
+    newSystem->seenCodeGeneration = 0;
+
+    newSystem->testCode = 0;
+
+    return newSystem;
+}
+
+void HLSystemInitWithEngine(struct HLSystem **system,
+                            struct HLMemoryAllocation *alloc,
+                            HLExecutionEngine engine)
+{
+    struct HLSystem *newSystem = HLSystemCreate(alloc, engine);
+
+    *system = NULL;
+    if (newSystem == NULL) {
+        return;
+    }
+    newSystem->bus = alloc->alloc(alloc, sizeof(struct HLIOBus));
+    if (newSystem->bus == NULL) {
+        HLSystemDone(&newSystem);
+        return;
+    }
+    newSystem->dma = alloc->alloc(alloc, sizeof(struct HLDMA));
+    if (newSystem->dma != NULL) {
+        HLDMAInit(newSystem->dma, newSystem);
+    }
+    HLIOBusInit(newSystem->bus, newSystem);
 
     *system = newSystem;
 }
 
-#define HL_INSTRUCTION(mnemonic, opcode, func, format, comment)\
-/** comment */\
-enum { HLOpcode_ ## mnemonic = opcode };\
-/** comment */\
-enum { HLFunc_ ## mnemonic = func };
-#include "instructions.h"
+void HLSystemInitCore(struct HLSystem **core,
+                      struct HLSystem *primary,
+                      uint32_t coreIndex)
+{
+    *core = HLSystemCreate(primary->allocator, primary->engine);
+    if (*core != NULL) {
+        (*core)->primary = primary;
+        (*core)->coreIndex = coreIndex;
+    }
+}
 
 void HLSystemDone(struct HLSystem **system)
 {
     struct HLSystem *ptrSystem = *system;
+    struct HLRing *ring;
+
+    HLTimerDone(&ptrSystem->timer);
+    /* transfers and batches may raise an interrupt on any core */
+    if (ptrSystem->dma != NULL) {
+        HLDMADone(ptrSystem->dma);
+        ptrSystem->allocator->free(ptrSystem->allocator, ptrSystem->dma);
+    }
+    while (ptrSystem->rings != NULL) {
+        ring = ptrSystem->rings;
+        ptrSystem->rings = ring->next;
+        HLRingDone(ring);
+        ptrSystem->allocator->free(ptrSystem->allocator, ring);
+    }
+    if (ptrSystem->cores != NULL) {
+        HLSystemDoneCores(ptrSystem);
+    }
+#if HL_JIT
+    if (ptrSystem->jit != NULL) {
+        HLJITDone(ptrSystem->jit);
+        ptrSystem->allocator->free(ptrSystem->allocator, ptrSystem->jit);
+    }
+#endif
+    if (ptrSystem->blockCache != NULL) {
+        ptrSystem->allocator->free(ptrSystem->allocator,
+                                   ptrSystem->blockCache);
+    }
+    if (ptrSystem->bus != NULL) {
+        ptrSystem->allocator->free(ptrSystem->allocator, ptrSystem->bus);
+    }
+    if (ptrSystem->primary == ptrSystem
+        && ptrSystem->memory.codePages != NULL) {
+        ptrSystem->allocator->free(ptrSystem->allocator,
+                                   ptrSystem->memory.codePages);
+    }
+    if (ptrSystem->primary == ptrSystem
+        && ptrSystem->memory.dirtyPages != NULL) {
+        ptrSystem->allocator->free(ptrSystem->allocator,
+                                   ptrSystem->memory.dirtyPages);
+    }
+    HLPhysicalMemoryDone(&ptrSystem->physicalMemory);
     ptrSystem->allocator->free(ptrSystem->allocator, ptrSystem);
     *system = 0;
 }
 
-#define U1 (uint64_t)(1)
-#define U19 (uint64_t)(19)
-#define HLSignExtend64By20(value) ((int64_t)((((value) ^ (U1 << (U19))) - (U1 << (U19)))))
+/**
+ * Makes sure every page of physical memory has a slot in the code page map,
+ * so that writes to decoded instructions can be caught.
+ */
+void HLSystemPrepareCodePages(struct HLSystem *system)
+{
+    struct HLMemoryManagementUnit *mmu = &system->memory;
+    struct HLMemoryAllocation *alloc = system->allocator;
+    uint64_t pageCount = (mmu->memoryLimit + HLPageSize - 1) >> HLPageShift;
+    uint8_t *codePages;
+
+    if (pageCount <= mmu->codePageCount) {
+        return;
+    }
+    HLSystemWaitForDevices(system);
+
+    if (mmu->codePages == NULL) {
+        codePages = alloc->alloc(alloc, (long)pageCount);
+    } else {
+        codePages = alloc->realloc(alloc,
+                                   (long)mmu->codePageCount,
+                                   (long)pageCount,
+                                   mmu->codePages);
+    }
+    if (codePages == NULL) {
+        /* the decode cache stays limited to the pages we already track */
+        return;
+    }
+
+    memset(codePages + mmu->codePageCount,
+           0,
+           pageCount - mmu->codePageCount);
+    mmu->codePages = codePages;
+    mmu->codePageCount = pageCount;
+}
+
+/**
+ * Makes sure every page of physical memory has a bit in the dirty page
+ * bitmap while tracking is on. Pages that gain a bit start out dirty.
+ */
+void HLSystemPrepareDirtyPages(struct HLSystem *system)
+{
+    struct HLMemoryManagementUnit *mmu = &system->memory;
+    struct HLMemoryAllocation *alloc = system->allocator;
+    uint64_t pageCount = (mmu->memoryLimit + HLPageSize - 1) >> HLPageShift;
+    uint64_t wordCount = (pageCount + 63) >> 6;
+    uint64_t oldWordCount = (mmu->dirtyPageCount + 63) >> 6;
+    uint64_t oldPageCount;
+    uint64_t *dirtyPages;
+
+    if (!system->trackDirtyPages || pageCount <= mmu->dirtyPageCount) {
+        return;
+    }
+
+    if (wordCount > oldWordCount) {
+        HLSystemWaitForDevices(system);
+        if (mmu->dirtyPages == NULL) {
+            dirtyPages = alloc->alloc(alloc, (long)(wordCount * 8));
+        } else {
+            dirtyPages = alloc->realloc(alloc,
+                                        (long)(oldWordCount * 8),
+                                        (long)(wordCount * 8),
+                                        mmu->dirtyPages);
+        }
+        if (dirtyPages == NULL) {
+            /* HLSystemTakeDirtyPages reports untracked pages as dirty */
+            return;
+        }
+        memset(dirtyPages + oldWordCount,
+               0,
+               (size_t)((wordCount - oldWordCount) * 8));
+        mmu->dirtyPages = dirtyPages;
+    }
+
+    oldPageCount = mmu->dirtyPageCount;
+    mmu->dirtyPageCount = pageCount;
+    HLSystemMarkDirtyPages(system,
+                           oldPageCount << HLPageShift,
+                           (pageCount - oldPageCount) << HLPageShift);
+}
+
+void HLSystemMarkDirtyPages(struct HLSystem *system,
+                            uint64_t address,
+                            uint64_t size)
+{
+    struct HLMemoryManagementUnit *mmu = &system->memory;
+    uint64_t page = address >> HLPageShift;
+    uint64_t end = (address + size + HLPageOffsetMask) >> HLPageShift;
+
+    for (; page < end && page < mmu->dirtyPageCount; page++) {
+        HLAtomicOr64(&mmu->dirtyPages[page >> 6], (uint64_t)1 << (page & 63));
+    }
+}
+
+bool HLSystemTrackDirtyPages(struct HLSystem *system, bool track)
+{
+    struct HLMemoryManagementUnit *mmu = &system->primary->memory;
+
+    system = system->primary;
+    if (track == system->trackDirtyPages) {
+        return true;
+    }
+
+    system->trackDirtyPages = track;
+    if (!track) {
+        mmu->dirtyPageCount = 0;
+        if (mmu->dirtyPages != NULL) {
+            system->allocator->free(system->allocator, mmu->dirtyPages);
+            mmu->dirtyPages = NULL;
+        }
+        return true;
+    }
+
+    HLSystemPrepareDirtyPages(system);
+    return mmu->dirtyPageCount
+           == (mmu->memoryLimit + HLPageSize - 1) >> HLPageShift;
+}
+
+uint64_t HLSystemTakeDirtyPages(struct HLSystem *system,
+                                uint64_t *dirty,
+                                uint64_t pageCount)
+{
+    struct HLMemoryManagementUnit *mmu = &system->primary->memory;
+    uint64_t tracked = mmu->dirtyPageCount;
+    uint64_t wordCount = (pageCount + 63) >> 6;
+    uint64_t dirtyCount = 0;
+    uint64_t first;
+    uint64_t mask;
+    uint64_t word;
+    uint64_t i;
+
+    for (i = 0; i < wordCount; i++) {
+        first = i << 6;
+        mask = ~(uint64_t)0;
+        if (pageCount - first < 64) {
+            mask = ((uint64_t)1 << (pageCount - first)) - 1;
+        }
+
+        word = 0;
+        if (first < tracked
+            && (HLAtomicLoadRelaxed(uint64_t, &mmu->dirtyPages[i]) & mask)
+                   != 0) {
+            word = HLAtomicAnd64(&mmu->dirtyPages[i], ~mask) & mask;
+        }
+        /* pages we couldn't grow the bitmap for may have changed */
+        if (system->primary->trackDirtyPages && first + 64 > tracked) {
+            word |= first >= tracked ? mask
+                                     : mask & ~(((uint64_t)1
+                                                 << (tracked - first))
+                                                - 1);
+        }
+
+        dirty[i] = word;
+        for (; word != 0; word &= word - 1) {
+            dirtyCount++;
+        }
+    }
+
+    return dirtyCount;
+}
+
+/**
+ * Drops whatever the execution engines cached from physical memory in
+ * [address, address + size), which has just changed behind their back.
+ */
+static void HLSystemPhysicalMemoryReplaced(struct HLSystem *system,
+                                           uint64_t address,
+                                           uint64_t size)
+{
+    struct HLMemoryManagementUnit *mmu = &system->memory;
+    uint64_t page = address >> HLPageShift;
+    uint64_t end = (address + size) >> HLPageShift;
+
+    HLSystemMarkDirtyPages(system, address, size);
+    for (; page < end && page < mmu->codePageCount; page++) {
+        if (mmu->codePages[page]) {
+            mmu->codeWriteObserver(mmu->codeWriteObserverData,
+                                   page << HLPageShift,
+                                   HLPageSize);
+        }
+    }
+}
+
+bool HLSystemScheduleEvent(struct HLSystem *core,
+                           struct HLEvent *event,
+                           uint64_t cycle)
+{
+    if (!HLEventQueueSchedule(&core->events, event, cycle)) {
+        return false;
+    }
+    if (core->cpu.stopCycle > cycle) {
+        core->cpu.stopCycle = cycle;
+    }
+    return true;
+}
+
+void HLSystemWaitForDevices(struct HLSystem *system)
+{
+    struct HLRing *ring;
+
+    if (system->primary->dma != NULL) {
+        HLDMAWait(system->primary->dma);
+    }
+    for (ring = system->primary->rings; ring != NULL; ring = ring->next) {
+        HLRingWait(ring);
+    }
+}
+
+bool HLSystemReservePhysicalMemory(struct HLSystem *system, uint64_t size)
+{
+    struct HLPhysicalMemory physicalMemory;
+
+    system = system->primary;
+    HLSystemWaitForDevices(system);
+    if (!HLPhysicalMemoryReserve(&physicalMemory, size)) {
+        return false;
+    }
+
+    HLSystemPhysicalMemoryReplaced(system, 0, system->memory.memoryLimit);
+    HLPhysicalMemoryDone(&system->physicalMemory);
+    system->physicalMemory = physicalMemory;
+    system->memory.memory = physicalMemory.base;
+    system->memory.memoryLimit = physicalMemory.size;
+    HLMemoryManagementUnitFlushTranslationCache(&system->memory);
+    HLSystemUpdatePhysicalLimit(system);
+    HLSystemPrepareDirtyPages(system);
+    return true;
+}
+
+bool HLSystemMapImage(struct HLSystem *system,
+                      const char *path,
+                      uint64_t address)
+{
+    uint64_t size;
+
+    system = system->primary;
+    HLSystemWaitForDevices(system);
+    if (!HLPhysicalMemoryMapImage(&system->physicalMemory,
+                                  path,
+                                  address,
+                                  &size)) {
+        return false;
+    }
+
+    HLSystemPhysicalMemoryReplaced(system, address, size + HLPageOffsetMask);
+    return true;
+}
+
+bool HLSystemReleasePhysicalMemory(struct HLSystem *system,
+                                   uint64_t address,
+                                   uint64_t size)
+{
+    system = system->primary;
+    HLSystemWaitForDevices(system);
+    if (!HLPhysicalMemoryRelease(&system->physicalMemory, address, size)) {
+        return false;
+    }
+
+    HLSystemPhysicalMemoryReplaced(system, address, size);
+    return true;
+}
+
+void HLSystemFlushCodeCaches(struct HLSystem *system)
+{
+    /* read first, so writes after it bump it again */
+    system->seenCodeGeneration =
+        HLAtomicLoad64(&system->primary->codeGeneration);
+    HLDecodeCacheFlush(&system->decodeCache);
+    if (system->blockCache != NULL) {
+        HLBlockCacheFlush(system->blockCache);
+    }
+    system->cpu.faulted = true;
+}
 
 void HLSystemExec(struct HLSystem *system)
 {
-    HLInstruction instruction;
-    HLMemoryResult result = HLMemoryResultOK;
+    while (HLSystemRunCores(system, UINT64_MAX) == HLStopBudgetExhausted) {
+    }
+}
+
+HLStopReason HLSystemRun(struct HLSystem *system, uint64_t cycles)
+{
+    struct HLCPUCore *cpu = &system->cpu;
+    struct HLSystem *primary = system->primary;
+    uint64_t endCycle;
+    uint64_t eventCycle;
+    struct HLEvent *event;
+
+    if (primary == system) {
+        HLSystemPrepareCodePages(system);
+        HLSystemPrepareDirtyPages(system);
+    } else {
+        /* core 0 may have been given new memory since we last ran */
+        if (system->memory.memory != primary->memory.memory
+            || system->memory.memoryLimit != primary->memory.memoryLimit) {
+            /* its translations point into the old memory */
+            HLMemoryManagementUnitFlushTranslationCache(&system->memory);
+        }
+        system->memory.memory = primary->memory.memory;
+        system->memory.memoryLimit = primary->memory.memoryLimit;
+        system->memory.codePages = primary->memory.codePages;
+        system->memory.codePageCount = primary->memory.codePageCount;
+        system->memory.dirtyPages = primary->memory.dirtyPages;
+        system->memory.dirtyPageCount = primary->memory.dirtyPageCount;
+    }
+    /* the embedder may have changed Status or memory since the last run */
+    HLSystemUpdatePhysicalLimit(system);
+
+    if (HLSystemCodeChanged(system)) {
+        HLSystemFlushCodeCaches(system);
+    }
+
+    cpu->stopReason = HLStopBudgetExhausted;
+    if (cycles > UINT64_MAX - cpu->cycles) {
+        endCycle = UINT64_MAX;
+    } else {
+        endCycle = cpu->cycles + cycles;
+    }
+
+    /* run up to each device event in turn */
     while (1) {
-        if (system->cpu.registers[HLRegStatus] & HLFlagMode) {
-            /* if user mode is set then do address translation to read the instruction */
-            instruction = HLMemoryManagementUnitReadVirtualInstruction(&system->memory, system->cpu.registers[HLRegIP], &result);
-        } else {
-            /* otherwise read w/o address translation */
-            instruction = HLMemoryManagementUnitReadPhysicalInstruction(&system->memory, system->cpu.registers[HLRegIP], &result);
-        }
-
-        if (result != HLMemoryResultOK) {
-            /* TODO: queue up an interrupt */
-            assert(0 && "TODO: queue interrupt");
-            continue;
-        }
-
-        /* only increment the instruction pointer after we've confirmed that the read succeeded */
-        system->cpu.registers[HLRegIP] += 4;
-
-        switch (HLOpcode(instruction)) {
-        case 0x01: /* the system control instructions */
-            switch (HLFunc_F(instruction)) {
-            case HLFunc_int:
-                if (HLImm_F(instruction) == 255) {
-                    system->testCode = 1;
-                    return;
-                }
-                if (HLImm_F(instruction) == 254) {
-                    system->testCode = 0;
-                    return;
-                }
-                assert(0 && "Unimplemented opcode int");
-                break;
-            case HLFunc_iret:
-                assert(0 && "Unimplemented opcode iret");
-                break;
-            case HLFunc_ires:
-                assert(0 && "Unimplemented opcode ires");
-                break;
-            case HLFunc_usr:
-                assert(0 && "Unimplemented opcode usr");
-                break;
-            }
+        while ((event = HLEventQueuePopDue(&system->events, cpu->cycles))
+               != NULL) {
+            event->handler(event->userData, system);
+        }
+        if (cpu->cycles >= endCycle) {
             break;
-        case 0xA: /* the branching instructions */
-            switch (HLFunc_B(instruction)) {
-            case HLFunc_bra:
-                system->cpu.registers[HLRegIP] += 4 * HLSignExtend64By20(HLImm_B(instruction));
-                break;
-            case HLFunc_beq:
-                assert(0 && "Unimplemented opcode beq");
-                break;
-            case HLFunc_bez:
-                assert(0 && "Unimplemented opcode bez");
-                break;
-            case HLFunc_blt:
-                assert(0 && "Unimplemented opcode blt");
-                break;
-            case HLFunc_ble:
-                assert(0 && "Unimplemented opcode ble");
-                break;
-            case HLFunc_bltu:
-                assert(0 && "Unimplemented opcode ltu");
-                break;
-            case HLFunc_bleu:
-                assert(0 && "Unimplemented opcode leu");
-                break;
-            case HLFunc_bne:
-                assert(0 && "Unimplemented opcode bne");
-                break;
-            case HLFunc_bnz:
-                assert(0 && "Unimplemented opcode bnz");
-                break;
-            case HLFunc_bge:
-                assert(0 && "Unimplemented opcode bge");
-                break;
-            case HLFunc_bgt:
-                assert(0 && "Unimplemented opcode bgt");
-                break;
-            case HLFunc_bgeu:
-                assert(0 && "Unimplemented opcode geu");
-                break;
-            case HLFunc_bgtu:
-                assert(0 && "Unimplemented opcode gtu");
-                break;
-            }
+        }
+        eventCycle = HLEventQueueNextCycle(&system->events);
+        cpu->stopCycle = eventCycle < endCycle ? eventCycle : endCycle;
+
+        switch (system->engine) {
+        case HLExecutionEngineBlocks:
+        case HLExecutionEngineJIT:
+            HLBlockEngineRun(system);
             break;
         default:
-            /* TODO: raise interrupt */
-            assert(0 && "Unknown opcode");
+            HLInterpreterRun(system);
+            break;
+        }
+        if (cpu->stopReason != HLStopBudgetExhausted) {
             break;
         }
     }
+    HLSystemFlushPortWrites(system);
+    /* the embedder reads Status straight out of the registers */
+    HLSystemMaterializeFlags(system);
+
+    return cpu->stopReason;
+}
+
+HLStopReason HLSystemStopReason(struct HLSystem *system)
+{
+    return system->cpu.stopReason;
 }
 
 int HLSystemTestCode(struct HLSystem *system)
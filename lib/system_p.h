@@ -10,8 +10,17 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "block_engine_p.h"
+#include "decoder_p.h"
+#include "event_queue_p.h"
+#include "interrupt_controller_p.h"
+#include "io_bus_p.h"
+#include "jit_p.h"
 #include "memory_allocation.h"
 #include "memory_management_unit_p.h"
+#include "physical_memory_p.h"
+#include "system.h"
+#include "timer_p.h"
 
 /**
  * little endian
@@ -104,58 +113,148 @@ enum {
     HLFlagExtensionF = 31,
 };
 
-typedef uint8_t HLInterrupt;
+#define HLFlag(flag) ((uint64_t)1 << (flag))
+
+/**
+ * Which flags are still to be worked out from HLCPUCore.flagsA, flagsB and
+ * flagsResult. Comparisons set Equal, Less, LessUnsigned and Zero;
+ * additions and subtractions set Sign, Zero, CarryBorrow and
+ * CarryBorrowUnsigned. The other Status bits are always up to date.
+ */
+typedef uint8_t HLLazyFlags;
 
 enum {
-    /**
-     * Triggers when the second argument of a div, mod, or rem instruction is
-     * zero.
-     */
-    HLInterruptDivideByZero,
-    /** Reserved for debugger breakpoints. */
-    HLInterruptBreakpoint,
-    /**
-     * Triggers when some kind of restricted or invalid operation occurs.
-     * This includes unrecognized opcode, unrecognized secondary function
-     * values, or when a restricted instruction is encountered / modification
-     * of a restricted register is attempted in user mode.
-     */
-    HLInterruptInvalidOperation,
-    /** Triggers when the stack pointer exceeds the frame pointer, which
-     *  indicates a stack underflow has occurred.
-     */
-    HLInterruptStackUnderflow,
-    /** Triggers when memory has been accessed across type width boundaries. */
-    HLInterruptUnalignedAccess,
-    /** Triggers when memory has been accessed in an invalid way.
-     *  In kernel mode, this triggers due to accesses outside physical memory
-     *  bounds.
-     *  In user mode, this triggers when unmapped/invalid memory is accessed or
-     *  when virtual memory permissions do not allow the access.
-     */
-    HLInterruptAccessViolation,
-    /** Triggers when interrupt controller has experienced an interrupt queue
-     *  overflow due to too many interrupts in a short period of time.
-     */
-    HLInterruptOverflow,
+    HLLazyFlagsNone,
+    HLLazyFlagsCompare,
+    HLLazyFlagsAdd,
+    HLLazyFlagsSubtract,
 };
 
 struct HLCPUCore {
+    /** Status is only up to date while flagsKind is HLLazyFlagsNone */
     uint64_t registers[HLNReg];
+    /** instructions executed so far */
     uint64_t cycles;
+    /** execution engines return once cycles reaches this */
+    uint64_t stopCycle;
+    /**
+     * memory.memoryLimit in kernel mode and 0 in user mode, so one
+     * comparison tells whether an access can go straight to physical
+     * memory. Kept up by HLSystemModeChanged.
+     */
+    uint64_t physicalLimit;
     HLInstruction currentInstruction;
-    bool running;
+    HLStopReason stopReason;
+    /**
+     * Set by HLSystemFault, and whenever the running block may have just
+     * been invalidated; the block engine drops the rest of the block and
+     * clears it.
+     */
+    bool faulted;
+    /** operands and result of the last flag-setting instruction */
+    HLLazyFlags flagsKind;
+    uint64_t flagsA;
+    uint64_t flagsB;
+    uint64_t flagsResult;
 };
 
-struct HLInterruptController {
-    uint64_t interruptVectorTableBaseAddress;
-    uint64_t returnAddress;
-    uint64_t returnStatus;
+/** Makes the execution engine return after the current instruction. */
+#define HLSystemStop(system, reason)                                           \
+    ((system)->cpu.stopReason = (reason), (system)->cpu.stopCycle = 0)
+
+/** Works out HLCPUCore.physicalLimit from the Mode flag and memoryLimit. */
+#define HLSystemUpdatePhysicalLimit(system)                                    \
+    ((system)->cpu.physicalLimit =                                             \
+         (system)->cpu.registers[HLRegStatus] & HLFlag(HLFlagMode)             \
+             ? 0                                                               \
+             : (system)->memory.memoryLimit)
+
+/**
+ * Called whenever the Mode flag changes. The interpreter has a loop per
+ * mode, so this also makes the execution engine return after the current
+ * instruction to have the loop for the new mode picked.
+ */
+#define HLSystemModeChanged(system)                                            \
+    (HLSystemUpdatePhysicalLimit(system),                                      \
+     (system)->cpu.stopCycle = (system)->cpu.cycles)
+
+/** Tells the compiler cond is almost never true, e.g. on fault paths. */
+#if defined(__GNUC__) || defined(__clang__)
+#define HLUnlikely(cond) __builtin_expect(!!(cond), 0)
+#else
+#define HLUnlikely(cond) (cond)
+#endif
+
+/** Brings the flags the last flag-setting instruction deferred into Status. */
+void HLSystemMaterializeFlags(struct HLSystem *system);
+
+/** The Status register with every flag up to date. */
+#define HLSystemStatus(system)                                                 \
+    ((system)->cpu.flagsKind != HLLazyFlagsNone                                \
+         ? HLSystemMaterializeFlags(system)                                    \
+         : (void)0,                                                            \
+     (system)->cpu.registers[HLRegStatus])
 
-    HLInterrupt queue[16];
-    uint8_t queueSize;
+void HLSystemPrepareCodePages(struct HLSystem *system);
+void HLSystemPrepareDirtyPages(struct HLSystem *system);
+/**
+ * Returns once neither the DMA controller nor any ring is working on
+ * physical memory, so it can be replaced or captured.
+ */
+void HLSystemWaitForDevices(struct HLSystem *system);
+/**
+ * Schedules event on core for cycle, cutting the engine's current run
+ * short if it would go past it. Returns false if the queue is full.
+ */
+bool HLSystemScheduleEvent(struct HLSystem *core,
+                           struct HLEvent *event,
+                           uint64_t cycle);
+/** Marks the pages overlapping [address, address + size) dirty. */
+void HLSystemMarkDirtyPages(struct HLSystem *system,
+                            uint64_t address,
+                            uint64_t size);
+/**
+ * Whether a device or another core wrote to code since system's caches
+ * were last brought up to date; cheap enough to look at between blocks.
+ */
+#define HLSystemCodeChanged(system)                                            \
+    (HLAtomicLoadRelaxed(uint64_t, &(system)->primary->codeGeneration)         \
+     != (system)->seenCodeGeneration)
+/**
+ * Drops everything system decoded or translated, so that instruction
+ * fetch sees what devices and other cores wrote, and ends the running
+ * block.
+ */
+void HLSystemFlushCodeCaches(struct HLSystem *system);
+/**
+ * Creates core coreIndex of primary's system with the same engine. It
+ * gets registers, caches and a timer of its own, but no DMA controller or
+ * port bus, which every core shares through core 0.
+ */
+void HLSystemInitCore(struct HLSystem **core,
+                      struct HLSystem *primary,
+                      uint32_t coreIndex);
+/** Stops the threads running a multi-core system and frees cores 1 and up. */
+void HLSystemDoneCores(struct HLSystem *system);
+
+/* bits of HLMemoryManagementUnit.codePages entries */
+enum {
+    /** the decode cache holds instructions from the page */
+    HLCodePageDecoded = 0x1,
+    /** the block cache holds blocks translated from the page */
+    HLCodePageBlocks = 0x2,
 };
 
+struct HLCoreThreads;
+struct HLDMA;
+struct HLRing;
+
+/**
+ * One core of an emulated machine. Core 0 is the system the embedder
+ * created; it owns physical memory and the code page map, which the other
+ * cores share. Everything else, including the TLB and the execution
+ * engine caches, is per core.
+ */
 struct HLSystem {
     /* host system stuff */
     struct HLMemoryAllocation *allocator;
@@ -164,6 +263,50 @@ struct HLSystem {
     struct HLCPUCore cpu;
     struct HLInterruptController interrupts;
     struct HLMemoryManagementUnit memory;
+    /** backs memory.memory if the system was asked to reserve it */
+    struct HLPhysicalMemory physicalMemory;
+    /** whether memory.dirtyPages is kept up; only meaningful on core 0 */
+    bool trackDirtyPages;
+    /** only on core 0, and NULL there if it couldn't be allocated */
+    struct HLDMA *dma;
+    /** attached with HLSystemAttachRing; only meaningful on core 0 */
+    struct HLRing *rings;
+    /** per core; HLSystemRun stops the execution engine at each */
+    struct HLEventQueue events;
+    /** per core */
+    struct HLTimer timer;
+    /** only on core 0; NULL on the other cores */
+    struct HLIOBus *bus;
+    /** per core: writes to a batching device not handed over yet */
+    struct HLPortBatch portBatch;
+
+    /* execution engine stuff */
+    HLExecutionEngine engine;
+    struct HLDecodeCache decodeCache;
+    /** only allocated for HLExecutionEngineBlocks */
+    struct HLBlockCache *blockCache;
+    /** only allocated for HLExecutionEngineJIT */
+    struct HLJIT *jit;
+
+    /* multi-core stuff */
+    /** core 0; points back at itself on core 0 */
+    struct HLSystem *primary;
+    uint32_t coreIndex;
+    /** the following are only meaningful on core 0 */
+    uint32_t coreCount;
+    /** every core, including core 0; NULL while there is only one */
+    struct HLSystem **cores;
+    struct HLCoreThreads *coreThreads;
+    /**
+     * Bumped whenever a device or any core of a multi-core system writes
+     * to a code page. Each core flushes its caches once this has moved
+     * past seenCodeGeneration, looking between blocks, or slices of the
+     * interpreter, and after port reads, which is how the guest waits for
+     * a device.
+     */
+    uint64_t codeGeneration;
+    /** per core: the codeGeneration this core's caches are valid for */
+    uint64_t seenCodeGeneration;
 
     /* testing stuff */
     int testCode;
@@ -0,0 +1,185 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#define _DEFAULT_SOURCE
+
+#include "thread_p.h"
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#ifdef _WIN32
+
+static DWORD WINAPI HLThreadMain(LPVOID parameter)
+{
+    struct HLThread *thread = parameter;
+    thread->entry(thread->argument);
+    return 0;
+}
+
+#else
+
+static void *HLThreadMain(void *parameter)
+{
+    struct HLThread *thread = parameter;
+    thread->entry(thread->argument);
+    return NULL;
+}
+
+#endif
+
+bool HLThreadStart(struct HLThread *thread,
+                   HLThreadEntry entry,
+                   void *argument)
+{
+    thread->entry = entry;
+    thread->argument = argument;
+
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, HLThreadMain, thread, 0, NULL);
+    return thread->handle != NULL;
+#else
+    return pthread_create(&thread->handle, NULL, HLThreadMain, thread) == 0;
+#endif
+}
+
+void HLThreadJoin(struct HLThread *thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+}
+
+void HLMutexInit(HLMutex *mutex)
+{
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void HLMutexDone(HLMutex *mutex)
+{
+#ifdef _WIN32
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void HLMutexLock(HLMutex *mutex)
+{
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void HLMutexUnlock(HLMutex *mutex)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void HLConditionInit(HLCondition *condition)
+{
+#ifdef _WIN32
+    InitializeConditionVariable(condition);
+#else
+    pthread_cond_init(condition, NULL);
+#endif
+}
+
+void HLConditionDone(HLCondition *condition)
+{
+#ifdef _WIN32
+    (void)condition;
+#else
+    pthread_cond_destroy(condition);
+#endif
+}
+
+void HLConditionWait(HLCondition *condition, HLMutex *mutex)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(condition, mutex, INFINITE);
+#else
+    pthread_cond_wait(condition, mutex);
+#endif
+}
+
+void HLConditionWaitFor(HLCondition *condition,
+                        HLMutex *mutex,
+                        uint64_t nanoseconds)
+{
+#ifdef _WIN32
+    uint64_t milliseconds = nanoseconds / 1000000 + 1;
+
+    if (milliseconds >= INFINITE) {
+        milliseconds = INFINITE - 1;
+    }
+    SleepConditionVariableCS(condition, mutex, (DWORD)milliseconds);
+#else
+    struct timespec deadline;
+
+    /* condition variables wait on the realtime clock by default */
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (nanoseconds > (uint64_t)365 * 24 * 3600 * 1000000000) {
+        nanoseconds = (uint64_t)365 * 24 * 3600 * 1000000000;
+    }
+    nanoseconds += (uint64_t)deadline.tv_nsec;
+    deadline.tv_sec += (time_t)(nanoseconds / 1000000000);
+    deadline.tv_nsec = (long)(nanoseconds % 1000000000);
+    pthread_cond_timedwait(condition, mutex, &deadline);
+#endif
+}
+
+void HLConditionSignal(HLCondition *condition)
+{
+#ifdef _WIN32
+    WakeConditionVariable(condition);
+#else
+    pthread_cond_signal(condition);
+#endif
+}
+
+void HLConditionBroadcast(HLCondition *condition)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(condition);
+#else
+    pthread_cond_broadcast(condition);
+#endif
+}
+
+uint64_t HLClockNanoseconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)counter.QuadPart / (uint64_t)frequency.QuadPart
+               * 1000000000
+           + (uint64_t)counter.QuadPart % (uint64_t)frequency.QuadPart
+                 * 1000000000 / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+#endif
+}
@@ -0,0 +1,122 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_THREAD_P_H
+#define HALLEY_THREAD_P_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Host threads and synchronisation */
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION HLMutex;
+typedef CONDITION_VARIABLE HLCondition;
+#else
+typedef pthread_mutex_t HLMutex;
+typedef pthread_cond_t HLCondition;
+#endif
+
+typedef void (*HLThreadEntry)(void *argument);
+
+/** must stay alive until HLThreadJoin returns */
+struct HLThread {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    HLThreadEntry entry;
+    void *argument;
+};
+
+bool HLThreadStart(struct HLThread *thread,
+                   HLThreadEntry entry,
+                   void *argument);
+void HLThreadJoin(struct HLThread *thread);
+
+void HLMutexInit(HLMutex *mutex);
+void HLMutexDone(HLMutex *mutex);
+void HLMutexLock(HLMutex *mutex);
+void HLMutexUnlock(HLMutex *mutex);
+
+void HLConditionInit(HLCondition *condition);
+void HLConditionDone(HLCondition *condition);
+void HLConditionWait(HLCondition *condition, HLMutex *mutex);
+/** Like HLConditionWait, but also returns once nanoseconds have passed. */
+void HLConditionWaitFor(HLCondition *condition,
+                        HLMutex *mutex,
+                        uint64_t nanoseconds);
+void HLConditionSignal(HLCondition *condition);
+void HLConditionBroadcast(HLCondition *condition);
+
+/** Reads a host clock that only goes forward, in nanoseconds. */
+uint64_t HLClockNanoseconds(void);
+
+/* Sequentially consistent atomics on 64-bit values */
+
+#ifdef _MSC_VER
+#define HLAtomicLoad64(pointer)                                                \
+    ((uint64_t)InterlockedCompareExchange64(                                   \
+        (volatile LONG64 *)(pointer), 0, 0))
+#define HLAtomicStore64(pointer, value)                                        \
+    ((void)InterlockedExchange64((volatile LONG64 *)(pointer),                 \
+                                 (LONG64)(value)))
+#define HLAtomicAdd64(pointer, value)                                          \
+    ((uint64_t)InterlockedExchangeAdd64((volatile LONG64 *)(pointer),          \
+                                        (LONG64)(value)))
+#define HLAtomicOr64(pointer, value)                                           \
+    ((uint64_t)InterlockedOr64((volatile LONG64 *)(pointer), (LONG64)(value)))
+#define HLAtomicAnd64(pointer, value)                                          \
+    ((uint64_t)InterlockedAnd64((volatile LONG64 *)(pointer), (LONG64)(value)))
+#define HLAtomicOr8(pointer, value)                                            \
+    ((uint8_t)_InterlockedOr8((volatile char *)(pointer), (char)(value)))
+#else
+#define HLAtomicLoad64(pointer) __atomic_load_n((pointer), __ATOMIC_SEQ_CST)
+#define HLAtomicStore64(pointer, value)                                        \
+    __atomic_store_n((pointer), (value), __ATOMIC_SEQ_CST)
+#define HLAtomicAdd64(pointer, value)                                          \
+    __atomic_fetch_add((pointer), (value), __ATOMIC_SEQ_CST)
+#define HLAtomicOr64(pointer, value)                                           \
+    __atomic_fetch_or((pointer), (value), __ATOMIC_SEQ_CST)
+#define HLAtomicAnd64(pointer, value)                                          \
+    __atomic_fetch_and((pointer), (value), __ATOMIC_SEQ_CST)
+#define HLAtomicOr8(pointer, value)                                            \
+    __atomic_fetch_or((pointer), (value), __ATOMIC_SEQ_CST)
+#endif
+
+/*
+ * Single-copy atomic accesses with no ordering, for naturally aligned guest
+ * memory. These compile to plain loads and stores on the hosts we support;
+ * they only stop the compiler from tearing or merging them.
+ */
+
+#ifdef _MSC_VER
+#define HLAtomicLoadRelaxed(type, pointer) (*(volatile type *)(pointer))
+#define HLAtomicStoreRelaxed(type, pointer, value)                             \
+    (*(volatile type *)(pointer) = (value))
+#else
+#define HLAtomicLoadRelaxed(type, pointer)                                     \
+    __atomic_load_n((type *)(pointer), __ATOMIC_RELAXED)
+#define HLAtomicStoreRelaxed(type, pointer, value)                             \
+    __atomic_store_n((type *)(pointer), (value), __ATOMIC_RELAXED)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,244 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#include <stddef.h>
+
+#include "interrupt_controller_p.h"
+#include "system_p.h"
+#include "timer_p.h"
+
+/** Called with the lock held. */
+static bool HLTimerArmed(struct HLTimer *timer)
+{
+    return (timer->control & HLTimerEnabled) && timer->period != 0;
+}
+
+/** Called with the lock held. */
+static uint64_t HLTimerNow(struct HLTimer *timer)
+{
+    if (timer->control & HLTimerWallClock) {
+        return HLClockNanoseconds();
+    }
+    return timer->core->cpu.cycles;
+}
+
+/** The cycle the timer is due at. Called with the lock held. */
+static uint64_t HLTimerDueCycle(struct HLTimer *timer)
+{
+    if (!HLTimerArmed(timer) || (timer->control & HLTimerWallClock)) {
+        return UINT64_MAX;
+    }
+    return timer->deadline;
+}
+
+/** Raises the interrupt and works out when to fire next. */
+static void HLTimerFire(struct HLTimer *timer, uint64_t now)
+{
+    HLInterruptControllerRaise(&timer->core->interrupts, timer->vector);
+    if (!(timer->control & HLTimerPeriodic)) {
+        timer->control &= ~HLTimerEnabled;
+        return;
+    }
+    timer->deadline += timer->period;
+    if (timer->deadline <= now) {
+        /* the host fell behind; drop the ticks it missed */
+        timer->deadline = now + timer->period;
+    }
+}
+
+static void HLTimerThreadMain(void *argument)
+{
+    struct HLTimer *timer = argument;
+    uint64_t now;
+
+    HLMutexLock(&timer->lock);
+    while (!timer->stopping) {
+        if (!HLTimerArmed(timer) || !(timer->control & HLTimerWallClock)) {
+            HLConditionWait(&timer->changed, &timer->lock);
+            continue;
+        }
+        now = HLClockNanoseconds();
+        if (now < timer->deadline) {
+            HLConditionWaitFor(&timer->changed,
+                               &timer->lock,
+                               timer->deadline - now);
+            continue;
+        }
+        HLTimerFire(timer, now);
+    }
+    HLMutexUnlock(&timer->lock);
+}
+
+/**
+ * Moves the expiry event to wherever the timer is due now. If the event
+ * queue is full, turns the timer off instead of leaving it armed without
+ * ever firing.
+ */
+static void HLTimerSchedule(struct HLTimer *timer, uint64_t due)
+{
+    if (due == UINT64_MAX) {
+        HLEventQueueCancel(&timer->core->events, &timer->expiry);
+    } else if (!HLSystemScheduleEvent(timer->core, &timer->expiry, due)) {
+        HLMutexLock(&timer->lock);
+        timer->control &= ~HLTimerEnabled;
+        HLMutexUnlock(&timer->lock);
+    }
+}
+
+static void HLTimerExpired(void *userData, struct HLSystem *core)
+{
+    struct HLTimer *timer = userData;
+    uint64_t cycles = core->cpu.cycles;
+    uint64_t due;
+
+    HLMutexLock(&timer->lock);
+    if (HLTimerDueCycle(timer) <= cycles) {
+        HLTimerFire(timer, cycles);
+    }
+    due = HLTimerDueCycle(timer);
+    HLMutexUnlock(&timer->lock);
+
+    HLTimerSchedule(timer, due);
+}
+
+void HLTimerInit(struct HLTimer *timer, struct HLSystem *core)
+{
+    timer->core = core;
+    HLMutexInit(&timer->lock);
+    HLConditionInit(&timer->changed);
+    timer->threadStarted = false;
+    timer->stopping = false;
+    timer->control = 0;
+    timer->period = 0;
+    timer->vector = 0;
+    timer->deadline = 0;
+    HLEventInit(&timer->expiry, HLTimerExpired, timer);
+}
+
+void HLTimerDone(struct HLTimer *timer)
+{
+    if (timer->threadStarted) {
+        HLMutexLock(&timer->lock);
+        timer->stopping = true;
+        HLConditionSignal(&timer->changed);
+        HLMutexUnlock(&timer->lock);
+        HLThreadJoin(&timer->thread);
+    }
+    HLConditionDone(&timer->changed);
+    HLMutexDone(&timer->lock);
+}
+
+/** Called with the lock held. */
+static void HLTimerArmIn(struct HLTimer *timer, uint64_t ticks)
+{
+    uint64_t now;
+
+    if (!HLTimerArmed(timer)) {
+        return;
+    }
+    now = HLTimerNow(timer);
+    timer->deadline = ticks > UINT64_MAX - now ? UINT64_MAX : now + ticks;
+
+    if (timer->control & HLTimerWallClock) {
+        if (!timer->threadStarted) {
+            timer->threadStarted =
+                HLThreadStart(&timer->thread, HLTimerThreadMain, timer);
+        }
+        HLConditionSignal(&timer->changed);
+    }
+}
+
+void HLTimerPortWrite(void *userData,
+                      struct HLSystem *core,
+                      uint16_t port,
+                      uint64_t value)
+{
+    struct HLTimer *timer = &core->timer;
+    uint64_t due;
+
+    HLMutexLock(&timer->lock);
+    switch ((HLTimerPort)(port - HLTimerPortBase)) {
+    case HLTimerPortControl:
+        timer->control = (HLTimerControl)(value
+                                          & (HLTimerEnabled | HLTimerPeriodic
+                                             | HLTimerWallClock));
+        HLTimerArmIn(timer, timer->period);
+        break;
+    case HLTimerPortPeriod:
+        timer->period = value;
+        break;
+    case HLTimerPortVector:
+        timer->vector = (uint8_t)value;
+        break;
+    default:
+        break;
+    }
+    due = HLTimerDueCycle(timer);
+    HLMutexUnlock(&timer->lock);
+
+    HLTimerSchedule(timer, due);
+}
+
+void HLTimerSave(struct HLTimer *timer, struct HLTimerState *state)
+{
+    uint64_t now;
+
+    HLMutexLock(&timer->lock);
+    state->control = timer->control;
+    state->vector = timer->vector;
+    state->period = timer->period;
+    state->remaining = 0;
+    now = HLTimerNow(timer);
+    if (HLTimerArmed(timer) && timer->deadline > now) {
+        state->remaining = timer->deadline - now;
+    }
+    HLMutexUnlock(&timer->lock);
+}
+
+void HLTimerRestore(struct HLTimer *timer, const struct HLTimerState *state)
+{
+    uint64_t due;
+
+    HLMutexLock(&timer->lock);
+    timer->control = state->control;
+    timer->vector = state->vector;
+    timer->period = state->period;
+    HLTimerArmIn(timer, state->remaining);
+    due = HLTimerDueCycle(timer);
+    HLMutexUnlock(&timer->lock);
+
+    HLTimerSchedule(timer, due);
+}
+
+uint64_t HLTimerPortRead(void *userData, struct HLSystem *core, uint16_t port)
+{
+    struct HLTimer *timer = &core->timer;
+    uint64_t value = 0;
+    uint64_t now;
+
+    HLMutexLock(&timer->lock);
+    switch ((HLTimerPort)(port - HLTimerPortBase)) {
+    case HLTimerPortControl:
+        value = timer->control;
+        break;
+    case HLTimerPortPeriod:
+        value = timer->period;
+        break;
+    case HLTimerPortVector:
+        value = timer->vector;
+        break;
+    case HLTimerPortCounter:
+        now = HLTimerNow(timer);
+        if (HLTimerArmed(timer) && timer->deadline > now) {
+            value = timer->deadline - now;
+        }
+        break;
+    default:
+        break;
+    }
+    HLMutexUnlock(&timer->lock);
+    return value;
+}
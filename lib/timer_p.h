@@ -0,0 +1,117 @@
+/*
+    SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+
+    SPDX-License-Identifier: MIT
+*/
+
+#ifndef HALLEY_TIMER_P_H
+#define HALLEY_TIMER_P_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event_queue_p.h"
+#include "thread_p.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct HLSystem;
+
+/*
+ * Timer
+ *
+ * Every core has a timer of its own that raises an interrupt on it when
+ * period ticks have passed since it was armed. Ticks are instructions
+ * executed by the core, so a guest sees the same timer interrupts at the
+ * same points on every run, whatever the host is doing. In wall clock
+ * mode, ticks are host nanoseconds instead, counted by a host thread.
+ *
+ * The core doesn't poll the timer: arming it schedules an event for the
+ * cycle it is due at. Every execution engine stops right after the
+ * instruction that brought stopCycle forward, even in the middle of a
+ * block, so the timer fires at the same cycle whichever engine runs. If
+ * the core's event queue is full, arming fails and the timer turns itself
+ * off, which the guest can see in the control port.
+ */
+
+/** first of the timer's HLTimerNPorts ports */
+#define HLTimerPortBase 0x08
+
+typedef uint8_t HLTimerPort;
+enum {
+    /** HLTimerControl bits; writes arm the timer if it is enabled */
+    HLTimerPortControl,
+    /** ticks between arming and firing; 0 never fires */
+    HLTimerPortPeriod,
+    /** interrupt raised when the timer fires */
+    HLTimerPortVector,
+    /** reads the ticks left until the timer fires, or 0 if it is off */
+    HLTimerPortCounter,
+    HLTimerNPorts,
+};
+
+typedef uint8_t HLTimerControl;
+enum {
+    HLTimerEnabled = 0x1,
+    /** re-arms itself every time it fires instead of turning off */
+    HLTimerPeriodic = 0x2,
+    /** ticks are host nanoseconds rather than instructions */
+    HLTimerWallClock = 0x4,
+};
+
+struct HLTimer {
+    struct HLSystem *core;
+    /** guards everything below; only contended in wall clock mode */
+    HLMutex lock;
+    /** signalled when the timer is rearmed or stopping is set */
+    HLCondition changed;
+    /** started when wall clock mode is first armed */
+    struct HLThread thread;
+    bool threadStarted;
+    bool stopping;
+
+    HLTimerControl control;
+    uint64_t period;
+    uint8_t vector;
+    /** when the timer fires next, in ticks; meaningful while armed */
+    uint64_t deadline;
+    /** scheduled for deadline while armed to count cycles */
+    struct HLEvent expiry;
+};
+
+/** What snapshots keep of a timer. */
+struct HLTimerState {
+    HLTimerControl control;
+    uint8_t vector;
+    uint64_t period;
+    /**
+     * ticks left until the timer fires while it is armed; a wall clock
+     * deadline means nothing to another process
+     */
+    uint64_t remaining;
+};
+
+void HLTimerInit(struct HLTimer *timer, struct HLSystem *core);
+void HLTimerDone(struct HLTimer *timer);
+void HLTimerSave(struct HLTimer *timer, struct HLTimerState *state);
+/**
+ * Puts timer back the way state describes and re-arms it. The core's
+ * cycle count has to be restored first.
+ */
+void HLTimerRestore(struct HLTimer *timer, const struct HLTimerState *state);
+
+/* HLPortDevice handlers; userData is unused, since each core has a timer */
+
+void HLTimerPortWrite(void *userData,
+                      struct HLSystem *core,
+                      uint16_t port,
+                      uint64_t value);
+uint64_t HLTimerPortRead(void *userData, struct HLSystem *core, uint16_t port);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
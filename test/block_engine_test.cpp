@@ -0,0 +1,188 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+
+#include "system.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+TEST(BlockEngineTest, InstructionBraForwardAndBackwards) {
+    HLSystem* system;
+    HLSystemInitWithEngine(&system, &alloc, HLExecutionEngineBlocks);
+    ASSERT_EQ(system->engine, HLExecutionEngineBlocks);
+    system->memory.memory = new uint8_t[] {
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(4)),
+        ASM(0xAA),
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+        ASM(0xAA),
+        ASM(0xAA),
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-4)),
+    };
+    system->memory.memoryLimit = 4 * 6;
+
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+    EXPECT_EQ(system->blockCache->translations, 3);
+
+    delete[] system->memory.memory;
+    HLSystemDone(&system);
+}
+
+TEST(BlockEngineTest, BlocksAreChained) {
+    HLSystem* system;
+    HLSystemInitWithEngine(&system, &alloc, HLExecutionEngineBlocks);
+    system->memory.memory = new uint8_t[] {
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(1)),
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-2)),
+    };
+    system->memory.memoryLimit = 4 * 3;
+
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+    EXPECT_EQ(system->blockCache->translations, 3);
+    EXPECT_EQ(system->blockCache->chainedTransfers, 0);
+
+    // links made during the first run are followed by later ones
+
+    system->cpu.registers[HLRegIP] = 8;
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+    EXPECT_EQ(system->blockCache->translations, 3);
+    EXPECT_EQ(system->blockCache->chainedTransfers, 1);
+
+    system->cpu.registers[HLRegIP] = 0;
+    HLSystemExec(system);
+    EXPECT_EQ(system->blockCache->translations, 3);
+    EXPECT_EQ(system->blockCache->chainedTransfers, 3);
+
+    delete[] system->memory.memory;
+    HLSystemDone(&system);
+}
+
+TEST(BlockEngineTest, WritesInvalidateBlocks) {
+    HLSystem* system;
+    HLSystemInitWithEngine(&system, &alloc, HLExecutionEngineBlocks);
+    system->memory.memory = new uint8_t[] {
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+    };
+    system->memory.memoryLimit = 4;
+
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0, ASMOpcode_int | ASMImm_F(254), &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+
+    system->cpu.registers[HLRegIP] = 0;
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 0);
+    EXPECT_EQ(system->blockCache->translations, 2);
+
+    delete[] system->memory.memory;
+    HLSystemDone(&system);
+}
+
+TEST(BlockEngineTest, PageTableChangesFlushBlocks) {
+    HLSystem* system;
+    HLSystemInitWithEngine(&system, &alloc, HLExecutionEngineBlocks);
+    system->memory.memory = new uint8_t[] {
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+    };
+    system->memory.memoryLimit = 4;
+
+    HLSystemExec(system);
+    system->memory.pageTableBase = 4;
+    system->cpu.registers[HLRegIP] = 0;
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+    EXPECT_EQ(system->blockCache->translations, 2);
+
+    delete[] system->memory.memory;
+    HLSystemDone(&system);
+}
+
+TEST(BlockEngineTest, StoresIntoTheRunningBlockTakeEffect) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        SCOPED_TRACE((int)engine);
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+        if (system->jit != nullptr) {
+            system->jit->threshold = 0;
+        }
+
+        // the store replaces the int 254 two instructions further on
+        const uint8_t program[] = {
+            ASM(ASMOpcode_sw | ASMRde_E(HLRegRA) | ASMRs1_E(HLRegRB) | ASMImm_E(0) | ASMRs2_E(HLRegRZ) | ASMFunc_E(0)),
+            ASM(ASMOpcode_addi | ASMRde_M(HLRegRC) | ASMRs1_M(HLRegRC) | ASMImm_M(1)),
+            ASM(ASMOpcode_int | ASMImm_F(254)),
+            ASM(ASMOpcode_int | ASMImm_F(254)),
+        };
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0, program, sizeof(program), &result);
+        system->cpu.registers[HLRegRA] = ASMOpcode_int | ASMImm_F(255);
+        system->cpu.registers[HLRegRB] = 8;
+
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 1);
+        EXPECT_EQ(system->cpu.registers[HLRegRC], 1);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(BlockEngineTest, TranslationInvalidationDropsUserBlocks) {
+    // kernel code in page 0 enters user mode in virtual page 1, which the
+    // tables in page 1 map to physical page 2 and then to physical page 3;
+    // the user code is off the start of the page so its block doesn't share
+    // a slot with the kernel's
+    const uint64_t tables = HLPageSize;
+    const uint64_t pde = 0x1D; // valid, readable, writable, executable
+
+    for (bool flush : { false, true }) {
+        for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+            SCOPED_TRACE((int)engine);
+            SCOPED_TRACE(flush);
+            HLSystem* system;
+            HLSystemInitWithEngine(&system, &alloc, engine);
+            ASSERT_TRUE(HLSystemReservePhysicalMemory(system, 4 * HLPageSize));
+            if (system->jit != nullptr) {
+                system->jit->threshold = 0;
+            }
+
+            HLMemoryResult result = HLMemoryResultOK;
+            HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0, ASMOpcode_usr | ASMFunc_F(ASMFunc_usr) | ASMRde_F(HLRegRB), &result);
+            HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 2 * HLPageSize + 4, ASMOpcode_int | ASMImm_F(255), &result);
+            HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 3 * HLPageSize + 4, ASMOpcode_int | ASMImm_F(254), &result);
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables, tables | pde, &result);
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables + 8, 2 * HLPageSize | pde, &result);
+            ASSERT_EQ(result, HLMemoryResultOK);
+            system->memory.pageTableBase = tables;
+            system->cpu.registers[HLRegRB] = HLPageSize + 4;
+
+            HLSystemExec(system);
+            EXPECT_EQ(system->testCode, 1);
+
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables + 8, 3 * HLPageSize | pde, &result);
+            if (flush) {
+                HLMemoryManagementUnitFlushTranslationCache(&system->memory);
+            } else {
+                HLMemoryManagementUnitInvalidateTranslationCachePage(&system->memory, HLPageSize);
+            }
+            system->cpu.registers[HLRegIP] = 0;
+            system->cpu.registers[HLRegStatus] = 0;
+
+            HLSystemExec(system);
+            EXPECT_EQ(system->testCode, 0);
+
+            HLSystemDone(&system);
+        }
+    }
+}
@@ -4,6 +4,8 @@
 
 #include <gtest/gtest.h>
 
+#include <vector>
+
 #include "system.h"
 #include "memory_allocation.h"
 #include "system_p.h"
@@ -16,61 +18,142 @@ HLMemoryAllocation alloc {
     [](HLMemoryAllocation* self, long oldSize, long newSize, void* block) -> void* { return realloc(block, newSize); },
 };
 
-TEST(CPUTest, Interrupt255Exits) {
+// fails every allocation once allocationBudget successful ones have been made
+int allocationBudget;
+HLMemoryAllocation failingAlloc {
+    nullptr,
+    [](HLMemoryAllocation* self, long size) -> void* { return allocationBudget-- > 0 ? calloc(1, size) : nullptr; },
+    [](HLMemoryAllocation* self, void* block) { return free(block);  },
+    [](HLMemoryAllocation* self, long oldSize, long newSize, void* block) -> void* { return allocationBudget-- > 0 ? realloc(block, newSize) : nullptr; },
+};
+
+// jit_test.cpp runs these on the JIT too and compares it with the interpreter
+extern const std::vector<std::vector<uint8_t>> cpuTestPrograms {
+    { ASM(ASMOpcode_int | ASMImm_F(255)) },
+    { ASM(ASMOpcode_int | ASMImm_F(254)) },
+    {
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(1)),
+        ASM(0xAA),
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+    },
+    {
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(4)),
+        ASM(0xAA),
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+        ASM(0xAA),
+        ASM(0xAA),
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-4)),
+    },
+};
+
+namespace {
+
+void expectTestCode(std::vector<uint8_t> program, int testCode)
+{
     HLSystem* system;
     HLSystemInit(&system, &alloc);
-    system->memory.memory = new uint8_t[] { ASM(ASMOpcode_int | ASMImm_F(255)) };
-    system->memory.memoryLimit = 4;
+    system->memory.memory = program.data();
+    system->memory.memoryLimit = program.size();
 
     HLSystemExec(system);
-    EXPECT_EQ(system->testCode, 1);
+    EXPECT_EQ(system->testCode, testCode);
 
     HLSystemDone(&system);
 }
 
-TEST(CPUTest, Interrupt254Exits) {
-    HLSystem* system;
-    HLSystemInit(&system, &alloc);
-    system->memory.memory = new uint8_t[] { ASM(ASMOpcode_int | ASMImm_F(254)) };
-    system->memory.memoryLimit = 4;
+}
 
-    HLSystemExec(system);
-    EXPECT_EQ(system->testCode, 0);
+TEST(CPUTest, Interrupt255Exits) {
+    expectTestCode(cpuTestPrograms[0], 1);
+}
 
-    HLSystemDone(&system);
+TEST(CPUTest, Interrupt254Exits) {
+    expectTestCode(cpuTestPrograms[1], 0);
 }
 
 TEST(CPUTest, InstructionBraForwardOne) {
-    HLSystem* system;
-    HLSystemInit(&system, &alloc);
-    system->memory.memory = new uint8_t[] {
-        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(1)),
-        ASM(0xAA),
-        ASM(ASMOpcode_int | ASMImm_F(255)),
-    };
-    system->memory.memoryLimit = 4 * 3;
+    expectTestCode(cpuTestPrograms[2], 1);
+}
 
-    HLSystemExec(system);
-    EXPECT_EQ(system->testCode, 1);
+TEST(CPUTest, InstructionBraForwardAndBackwards) {
+    expectTestCode(cpuTestPrograms[3], 1);
+}
 
-    HLSystemDone(&system);
+TEST(CPUTest, RunStopsWhenBudgetIsExhausted) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        system->memory.memory = new uint8_t[] {
+            ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-1)),
+        };
+        system->memory.memoryLimit = 4;
+
+        EXPECT_EQ(HLSystemRun(system, 10), HLStopBudgetExhausted);
+        EXPECT_EQ(system->cpu.cycles, 10);
+        EXPECT_EQ(HLSystemRun(system, 5), HLStopBudgetExhausted);
+        EXPECT_EQ(system->cpu.cycles, 15);
+        EXPECT_EQ(HLSystemRun(system, 0), HLStopBudgetExhausted);
+        EXPECT_EQ(system->cpu.cycles, 15);
+
+        delete[] system->memory.memory;
+        HLSystemDone(&system);
+    }
 }
 
-TEST(CPUTest, InstructionBraForwardAndBackwards) {
-    HLSystem* system;
-    HLSystemInit(&system, &alloc);
-    system->memory.memory = new uint8_t[] {
-        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(4)),
-        ASM(0xAA),
-        ASM(ASMOpcode_int | ASMImm_F(255)),
-        ASM(0xAA),
-        ASM(0xAA),
-        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-4)),
+TEST(CPUTest, RunReportsStopReasons) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        system->memory.memory = new uint8_t[] {
+            ASM(ASMOpcode_int | ASMImm_F(HLInterruptBreakpoint)),
+            ASM(ASMOpcode_int | ASMImm_F(254)),
+            ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(100)),
+        };
+        system->memory.memoryLimit = 4 * 3;
+
+        EXPECT_EQ(HLSystemRun(system, 100), HLStopBreakpoint);
+        EXPECT_EQ(system->cpu.registers[HLRegIP], 4);
+        EXPECT_EQ(HLSystemRun(system, 100), HLStopHalted);
+        EXPECT_EQ(system->cpu.registers[HLRegIP], 8);
+        EXPECT_EQ(HLSystemRun(system, 100), HLStopFault);
+        EXPECT_EQ(system->cpu.registers[HLRegIP], 12 + 4 * 100);
+        EXPECT_EQ(system->cpu.cycles, 3);
+
+        delete[] system->memory.memory;
+        HLSystemDone(&system);
+    }
+}
+
+TEST(CPUTest, SystemsStartZeroedWhateverTheAllocatorReturns) {
+    // hands out memory full of garbage, like malloc may
+    HLMemoryAllocation garbageAlloc {
+        nullptr,
+        [](HLMemoryAllocation* self, long size) -> void* { void* block = malloc(size); return block != nullptr ? memset(block, 0xAB, size) : nullptr; },
+        [](HLMemoryAllocation* self, void* block) { return free(block);  },
+        [](HLMemoryAllocation* self, long oldSize, long newSize, void* block) -> void* { return realloc(block, newSize); },
     };
-    system->memory.memoryLimit = 4 * 6;
 
-    HLSystemExec(system);
-    EXPECT_EQ(system->testCode, 1);
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        SCOPED_TRACE((int)engine);
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &garbageAlloc, engine);
+        ASSERT_NE(system, nullptr);
+        for (int reg = 0; reg < HLNReg; reg++) {
+            EXPECT_EQ(system->cpu.registers[reg], 0);
+        }
+        EXPECT_EQ(system->cpu.cycles, 0);
+        EXPECT_EQ(system->memory.memory, nullptr);
+        EXPECT_EQ(system->memory.memoryLimit, 0);
+        EXPECT_EQ(system->memory.pageTableBase, 0);
+        EXPECT_EQ(system->testCode, 0);
 
-    HLSystemDone(&system);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0, ASMOpcode_int | ASMImm_F(254), &result);
+        EXPECT_EQ(HLSystemRun(system, 100), HLStopHalted);
+        EXPECT_EQ(system->cpu.cycles, 1);
+        EXPECT_EQ(system->testCode, 0);
+
+        HLSystemDone(&system);
+    }
 }
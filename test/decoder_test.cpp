@@ -0,0 +1,295 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+
+#include "system.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+TEST(DecoderTest, Fields) {
+    HLDecodedInstruction decoded;
+
+    HLDecodeInstruction(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-300), &decoded);
+    EXPECT_EQ(decoded.operation, HLOperation_bra);
+    EXPECT_EQ(decoded.imm, -300);
+
+    HLDecodeInstruction(ASMOpcode_bne | ASMFunc_B(ASMFunc_bne) | ASMImm_B(5), &decoded);
+    EXPECT_EQ(decoded.operation, HLOperation_bne);
+    EXPECT_EQ(decoded.imm, 5);
+
+    HLDecodeInstruction(ASMOpcode_ltuis | ASMFunc_F(ASMFunc_ltuis) | ASMRde_F(HLRegRC) | ASMImm_F(0xFFFF), &decoded);
+    EXPECT_EQ(decoded.operation, HLOperation_ltuis);
+    EXPECT_EQ(decoded.rde, HLRegRC);
+    EXPECT_EQ(decoded.imm, -1);
+
+    HLDecodeInstruction(ASMOpcode_addr | ASMRde_R(HLRegRA) | ASMRs1_R(HLRegRB) | ASMRs2_R(HLRegSP), &decoded);
+    EXPECT_EQ(decoded.operation, HLOperation_addr);
+    EXPECT_EQ(decoded.rde, HLRegRA);
+    EXPECT_EQ(decoded.rs1, HLRegRB);
+    EXPECT_EQ(decoded.rs2, HLRegSP);
+
+    HLDecodeInstruction(ASMOpcode_lw | ASMRde_E(HLRegRK) | ASMRs1_E(HLRegFP) | ASMRs2_E(HLRegRA) | ASMFunc_E(3) | ASMImm_E(-2), &decoded);
+    EXPECT_EQ(decoded.operation, HLOperation_lw);
+    EXPECT_EQ(decoded.rde, HLRegRK);
+    EXPECT_EQ(decoded.rs1, HLRegFP);
+    EXPECT_EQ(decoded.rs2, HLRegRA);
+    EXPECT_EQ(decoded.func, 3);
+    EXPECT_EQ(decoded.imm, -2);
+
+    HLDecodeInstruction(ASMOpcode_bra | ASMFunc_B(0x7), &decoded);
+    EXPECT_EQ(decoded.operation, HLOperationUnknown);
+
+    HLDecodeInstruction(0xFF, &decoded);
+    EXPECT_EQ(decoded.operation, HLOperationUnknown);
+}
+
+TEST(DecoderTest, CacheHitsInLoops) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    system->memory.memory = new uint8_t[] {
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(1)),
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-2)),
+    };
+    system->memory.memoryLimit = 4 * 3;
+
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+    EXPECT_EQ(system->decodeCache.misses, 3);
+
+    system->cpu.registers[HLRegIP] = 0;
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+    EXPECT_EQ(system->decodeCache.misses, 3);
+    EXPECT_EQ(system->decodeCache.hits, 3);
+
+    delete[] system->memory.memory;
+    HLSystemDone(&system);
+}
+
+TEST(DecoderTest, WritesInvalidateCachedInstructions) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    system->memory.memory = new uint8_t[] {
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+    };
+    system->memory.memoryLimit = 4;
+
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0, ASMOpcode_int | ASMImm_F(254), &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+
+    system->cpu.registers[HLRegIP] = 0;
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 0);
+    EXPECT_EQ(system->decodeCache.misses, 2);
+
+    delete[] system->memory.memory;
+    HLSystemDone(&system);
+}
+
+#define LOAD(op, reg, imm) (ASMOpcode_##op | ASMFunc_F(ASMFunc_##op) | ASMImm_F(imm) | ASMRde_F(reg))
+#define BRANCH(op, offset) (ASMOpcode_##op | ASMFunc_B(ASMFunc_##op) | ASMImm_B(offset))
+
+TEST(DecoderTest, FusesComparesWithBranches) {
+    HLDecodedInstruction decoded;
+
+    HLDecodeInstruction(ASMOpcode_cmpr | ASMRde_M(HLRegRA) | ASMRs1_M(HLRegRB), &decoded);
+    EXPECT_TRUE(HLDecodeFuse(&decoded, BRANCH(bltu, -5)));
+    EXPECT_EQ(decoded.operation, HLOperationCompareBranch);
+    EXPECT_EQ(decoded.rs1, HLRegRA);
+    EXPECT_EQ(decoded.rs2, HLRegRB);
+    EXPECT_EQ(decoded.func, HLOperation_bltu);
+    EXPECT_EQ(decoded.branch, -5);
+    EXPECT_EQ(decoded.length, 2);
+    EXPECT_FALSE(HLDecodeFuse(&decoded, BRANCH(bne, 1)));
+
+    HLDecodeInstruction(ASMOpcode_cmpi | ASMRde_M(1) | ASMRs1_M(HLRegRC) | ASMImm_M(-7), &decoded);
+    EXPECT_TRUE(HLDecodeFuse(&decoded, BRANCH(bgt, 3)));
+    EXPECT_EQ(decoded.operation, HLOperationCompareImmediateBranch);
+    EXPECT_EQ(decoded.rde, 1);
+    EXPECT_EQ(decoded.rs1, HLRegRC);
+    EXPECT_EQ(decoded.imm, -7);
+    EXPECT_EQ(decoded.func, HLOperation_bgt);
+    EXPECT_EQ(decoded.branch, 3);
+
+    // unconditional branches and invalid compares are left alone
+    HLDecodeInstruction(ASMOpcode_cmpi | ASMRs1_M(HLRegRC), &decoded);
+    EXPECT_FALSE(HLDecodeFuse(&decoded, BRANCH(bra, 3)));
+    EXPECT_EQ(decoded.operation, HLOperation_cmpi);
+    HLDecodeInstruction(ASMOpcode_cmpi | ASMRde_M(2) | ASMRs1_M(HLRegRC), &decoded);
+    EXPECT_FALSE(HLDecodeFuse(&decoded, BRANCH(beq, 3)));
+    EXPECT_EQ(decoded.length, 1);
+}
+
+TEST(DecoderTest, FusesConstantLoads) {
+    HLDecodedInstruction decoded;
+
+    HLDecodeInstruction(LOAD(lli, HLRegRA, 0xCDEF), &decoded);
+    EXPECT_TRUE(HLDecodeFuse(&decoded, LOAD(lti, HLRegRA, 0x5678)));
+    EXPECT_EQ(decoded.operation, HLOperationLoadConstant);
+    // lanes 1 and 3 are still the register's own
+    EXPECT_EQ(decoded.func, 0xA);
+    EXPECT_EQ(decoded.imm, 0x000056780000CDEF);
+    EXPECT_TRUE(HLDecodeFuse(&decoded, LOAD(lui, HLRegRA, 0x90AB)));
+    EXPECT_TRUE(HLDecodeFuse(&decoded, LOAD(ltui, HLRegRA, 0x1234)));
+    EXPECT_EQ(decoded.func, 0);
+    EXPECT_EQ(decoded.imm, 0x1234567890ABCDEF);
+    EXPECT_EQ(decoded.length, HLDecodeMaxFusedLength);
+    EXPECT_FALSE(HLDecodeFuse(&decoded, LOAD(lli, HLRegRA, 0)));
+
+    HLDecodeInstruction(LOAD(llis, HLRegRB, -2), &decoded);
+    EXPECT_TRUE(HLDecodeFuse(&decoded, LOAD(lli, HLRegRB, 0x1234)));
+    EXPECT_EQ(decoded.func, 0);
+    EXPECT_EQ(decoded.imm, (int64_t)0xFFFFFFFFFFFF1234);
+
+    // only loads into the same register are fused
+    HLDecodeInstruction(LOAD(llis, HLRegRB, -2), &decoded);
+    EXPECT_FALSE(HLDecodeFuse(&decoded, LOAD(lui, HLRegRC, 1)));
+    EXPECT_FALSE(HLDecodeFuse(&decoded, LOAD(luis, HLRegRB, 1)));
+    EXPECT_EQ(decoded.operation, HLOperation_llis);
+    EXPECT_EQ(decoded.imm, -2);
+}
+
+TEST(DecoderTest, ConstantLoadsIntoIPAreNotFused) {
+    // a load into IP is a jump, so the loads after it never run
+    HLDecodedInstruction decoded;
+    HLDecodeInstruction(LOAD(lli, HLRegIP, 16), &decoded);
+    EXPECT_FALSE(HLDecodeFuse(&decoded, LOAD(lui, HLRegIP, 0)));
+    HLDecodeInstruction(LOAD(llis, HLRegIP, 16), &decoded);
+    EXPECT_FALSE(HLDecodeFuse(&decoded, LOAD(lui, HLRegIP, 0)));
+    EXPECT_EQ(decoded.operation, HLOperation_llis);
+    EXPECT_EQ(decoded.length, 1);
+
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        SCOPED_TRACE((int)engine);
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        const uint8_t program[] = {
+            ASM(LOAD(lli, HLRegIP, 16)),
+            ASM(LOAD(lui, HLRegIP, 1)),
+            ASM(ASMOpcode_int | ASMImm_F(254)),
+            ASM(ASMOpcode_int | ASMImm_F(254)),
+            ASM(ASMOpcode_int | ASMImm_F(255)),
+        };
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0, program, sizeof(program), &result);
+
+        EXPECT_EQ(HLSystemRun(system, 10), HLStopHalted);
+        EXPECT_EQ(system->testCode, 1);
+        EXPECT_EQ(system->cpu.cycles, 2);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(DecoderTest, FusedPairsSplitWhereTheBudgetRunsOut) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        const uint8_t program[] = {
+            ASM(ASMOpcode_cmpr | ASMRde_M(HLRegRA) | ASMRs1_M(HLRegRB)),
+            ASM(BRANCH(beq, 1)),
+            ASM(ASMOpcode_int | ASMImm_F(254)),
+            ASM(ASMOpcode_int | ASMImm_F(255)),
+        };
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0, program, sizeof(program), &result);
+
+        // the comparison is visible between the two
+        EXPECT_EQ(HLSystemRun(system, 1), HLStopBudgetExhausted);
+        EXPECT_EQ(system->cpu.registers[HLRegIP], 4);
+        EXPECT_EQ(system->cpu.cycles, 1);
+        EXPECT_TRUE(system->cpu.registers[HLRegStatus] & HLFlag(HLFlagEqual));
+
+        EXPECT_EQ(HLSystemRun(system, 10), HLStopHalted);
+        EXPECT_EQ(system->testCode, 1);
+        EXPECT_EQ(system->cpu.cycles, 3);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(DecoderTest, WritesInvalidateFusedInstructions) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    system->memory.memory = new uint8_t[] {
+        ASM(ASMOpcode_cmpr | ASMRde_M(HLRegRA) | ASMRs1_M(HLRegRB)),
+        ASM(BRANCH(beq, 1)),
+        ASM(ASMOpcode_int | ASMImm_F(254)),
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+    };
+    system->memory.memoryLimit = 4 * 4;
+
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+
+    // only the branch changes, but the compare fused it
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 4, BRANCH(bne, 1), &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+
+    system->cpu.registers[HLRegIP] = 0;
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 0);
+
+    delete[] system->memory.memory;
+    HLSystemDone(&system);
+}
+
+TEST(DecoderTest, SpecialisesCommonForms) {
+    HLDecodedInstruction decoded;
+
+    HLDecodeInstruction(ASMOpcode_addi | ASMRde_M(HLRegRA) | ASMRs1_M(HLRegRZ) | ASMImm_M(-3), &decoded);
+    HLDecodeSpecialize(&decoded);
+    EXPECT_EQ(decoded.operation, HLOperationMoveImmediate);
+    EXPECT_EQ(decoded.imm, -3);
+    EXPECT_EQ(decoded.func, 1);
+
+    HLDecodeInstruction(ASMOpcode_nori | ASMRde_M(HLRegRA) | ASMRs1_M(HLRegRZ) | ASMImm_M(0), &decoded);
+    HLDecodeSpecialize(&decoded);
+    EXPECT_EQ(decoded.operation, HLOperationMoveImmediate);
+    EXPECT_EQ(decoded.imm, -1);
+    EXPECT_EQ(decoded.func, 0);
+
+    HLDecodeInstruction(ASMOpcode_xorr | ASMRde_R(HLRegRA) | ASMRs1_R(HLRegRZ) | ASMRs2_R(HLRegSP), &decoded);
+    HLDecodeSpecialize(&decoded);
+    EXPECT_EQ(decoded.operation, HLOperationMove);
+    EXPECT_EQ(decoded.rs1, HLRegSP);
+
+    HLDecodeInstruction(ASMOpcode_shlr | ASMRde_R(HLRegRZ) | ASMRs1_R(HLRegRA) | ASMRs2_R(HLRegRB), &decoded);
+    HLDecodeSpecialize(&decoded);
+    EXPECT_EQ(decoded.operation, HLOperationNop);
+
+    HLDecodeInstruction(ASMOpcode_cmpr | ASMRde_M(HLRegRC) | ASMRs1_M(HLRegRZ), &decoded);
+    HLDecodeSpecialize(&decoded);
+    EXPECT_EQ(decoded.operation, HLOperationCompareZero);
+    EXPECT_EQ(decoded.rs1, HLRegRC);
+
+    HLDecodeInstruction(ASMOpcode_asri | ASMRde_M(HLRegRA) | ASMRs1_M(HLRegRB) | ASMImm_M(7), &decoded);
+    HLDecodeSpecialize(&decoded);
+    EXPECT_EQ(decoded.operation, HLOperationShiftRightArithmeticImmediate);
+
+    // forms with side effects are left alone
+    HLDecodeInstruction(ASMOpcode_addr | ASMRde_R(HLRegRZ) | ASMRs1_R(HLRegRA) | ASMRs2_R(HLRegRB), &decoded);
+    HLDecodeSpecialize(&decoded);
+    EXPECT_EQ(decoded.operation, HLOperation_addr);
+    HLDecodeInstruction(ASMOpcode_udivr | ASMRde_R(HLRegRZ) | ASMRs1_R(HLRegRA) | ASMRs2_R(HLRegRZ), &decoded);
+    HLDecodeSpecialize(&decoded);
+    EXPECT_EQ(decoded.operation, HLOperation_udivr);
+    HLDecodeInstruction(ASMOpcode_asri | ASMRde_M(HLRegRA) | ASMRs1_M(HLRegRB) | ASMImm_M(70), &decoded);
+    HLDecodeSpecialize(&decoded);
+    EXPECT_EQ(decoded.operation, HLOperation_asri);
+}
@@ -0,0 +1,191 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+
+#include "system.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "dma_p.h"
+#include "io_bus_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+#define OUTI(reg, port) ASM(ASMOpcode_outi | ASMImm_M(HLDMAPortBase + port) | ASMRs1_M(reg))
+
+// starts a DMA transfer with the parameters in RA to RE, then halts
+static const uint8_t dmaProgram[] = {
+    OUTI(HLRegRA, HLDMAPortSource),
+    OUTI(HLRegRB, HLDMAPortDestination),
+    OUTI(HLRegRC, HLDMAPortLength),
+    OUTI(HLRegRE, HLDMAPortVector),
+    OUTI(HLRegRD, HLDMAPortCommand),
+    ASM(ASMOpcode_int | ASMImm_F(255)),
+};
+
+static void StartTransfer(HLSystem* system, uint64_t program, uint64_t source, uint64_t destination, uint64_t length, HLDMACommand command, uint64_t vector) {
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysical(&system->memory, program, dmaProgram, sizeof(dmaProgram), &result);
+    ASSERT_EQ(result, HLMemoryResultOK);
+
+    system->cpu.registers[HLRegIP] = program;
+    system->cpu.registers[HLRegRA] = source;
+    system->cpu.registers[HLRegRB] = destination;
+    system->cpu.registers[HLRegRC] = length;
+    system->cpu.registers[HLRegRD] = command;
+    system->cpu.registers[HLRegRE] = vector;
+    HLSystemExec(system);
+    ASSERT_EQ(system->testCode, 1);
+}
+
+TEST(DMATest, CopiesAndFillsInTheBackground) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, 64 * HLPageSize));
+
+    HLMemoryResult result = HLMemoryResultOK;
+    std::vector<uint8_t> data(5 * HLPageSize + 3);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = uint8_t(i * 13);
+    }
+    HLMemoryManagementUnitWritePhysical(&system->memory, 8 * HLPageSize + 1, data.data(), data.size(), &result);
+
+    StartTransfer(system, 0, 8 * HLPageSize + 1, 32 * HLPageSize + 7, data.size(), HLDMACommandCopy, 40);
+    HLDMAWait(system->dma);
+    EXPECT_EQ(HLSystemPortRead(system, HLDMAPortBase + HLDMAPortCommand), HLDMAStatusIdle);
+    EXPECT_EQ(HLSystemPortRead(system, HLDMAPortBase + HLDMAPortResult), data.size());
+    EXPECT_EQ(memcmp(system->memory.memory + 32 * HLPageSize + 7, data.data(), data.size()), 0);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), 40);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), -1);
+
+    // no interrupt this time
+    StartTransfer(system, 0, 0, 9 * HLPageSize, 2 * HLPageSize, HLDMACommandFill, 256);
+    HLDMAWait(system->dma);
+    EXPECT_EQ(system->memory.memory[9 * HLPageSize - 1], data[HLPageSize - 2]);
+    EXPECT_EQ(system->memory.memory[9 * HLPageSize], 0);
+    EXPECT_EQ(system->memory.memory[11 * HLPageSize - 1], 0);
+    EXPECT_EQ(system->memory.memory[11 * HLPageSize], data[3 * HLPageSize - 1]);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), -1);
+
+    HLSystemDone(&system);
+}
+
+TEST(DMATest, TransfersStopAtTheEndOfMemory) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, 4 * HLPageSize));
+
+    HLSystemPortWrite(system, HLDMAPortBase + HLDMAPortValue, 0x1FF);
+    EXPECT_EQ(HLSystemPortRead(system, HLDMAPortBase + HLDMAPortValue), 0xFF);
+    StartTransfer(system, 0, 0, 4 * HLPageSize - 10, 100, HLDMACommandFill, 3);
+    HLDMAWait(system->dma);
+    EXPECT_EQ(HLSystemPortRead(system, HLDMAPortBase + HLDMAPortCommand), HLDMAStatusFault);
+    EXPECT_EQ(HLSystemPortRead(system, HLDMAPortBase + HLDMAPortResult), 10);
+    EXPECT_EQ(system->memory.memory[4 * HLPageSize - 1], 0xFF);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), 3);
+
+    // unknown commands and ports do nothing
+    HLSystemPortWrite(system, HLDMAPortBase + HLDMAPortCommand, 0x101);
+    EXPECT_EQ(HLSystemPortRead(system, HLDMAPortBase + HLDMAPortCommand), HLDMAStatusFault);
+    HLSystemPortWrite(system, 0xFFFF, 1);
+    EXPECT_EQ(HLSystemPortRead(system, 0xFFFF), 0);
+
+    HLSystemDone(&system);
+}
+
+TEST(DMATest, CopiedCodeIsExecuted) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0x200, ASMOpcode_int | ASMImm_F(254), &result);
+        HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0x300, ASMOpcode_int | ASMImm_F(255), &result);
+        system->cpu.registers[HLRegIP] = 0x200;
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 0);
+
+        StartTransfer(system, 0, 0x300, 0x200, 4, HLDMACommandCopy, 256);
+        HLDMAWait(system->dma);
+        system->cpu.registers[HLRegIP] = 0x200;
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 1);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(DMATest, CodeCopiedWhileRunningIsExecuted) {
+    // the guest copies int 255 over a bra it already ran, waits for the
+    // copy and runs it again, all in one HLSystemRun
+    const uint8_t program[] = {
+        ASM(ASMOpcode_bra | ASMFunc_B(ASMFunc_bra) | ASMImm_B(9)),
+        // 1
+        ASM(ASMOpcode_addi | ASMRde_M(HLRegRG) | ASMRs1_M(HLRegRG) | ASMImm_M(1)),
+        OUTI(HLRegRA, HLDMAPortSource),
+        OUTI(HLRegRB, HLDMAPortDestination),
+        OUTI(HLRegRC, HLDMAPortLength),
+        OUTI(HLRegRE, HLDMAPortVector),
+        OUTI(HLRegRD, HLDMAPortCommand),
+        // 7: waits for the copy
+        ASM(ASMOpcode_ini | ASMImm_M(HLDMAPortBase + HLDMAPortCommand) | ASMRde_M(HLRegRF)),
+        ASM(ASMOpcode_cmpi | ASMRs1_M(HLRegRF) | ASMImm_M(HLDMAStatusIdle)),
+        ASM(ASMOpcode_bne | ASMFunc_B(ASMFunc_bne) | ASMImm_B(-3)),
+        // 10: copied over
+        ASM(ASMOpcode_bra | ASMFunc_B(ASMFunc_bra) | ASMImm_B(-10)),
+    };
+
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        SCOPED_TRACE((int)engine);
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+        if (system->jit != nullptr) {
+            system->jit->threshold = 0;
+        }
+
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0, program, sizeof(program), &result);
+        HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0x300, ASMOpcode_int | ASMImm_F(255), &result);
+        ASSERT_EQ(result, HLMemoryResultOK);
+        system->cpu.registers[HLRegRA] = 0x300;
+        system->cpu.registers[HLRegRB] = 40;
+        system->cpu.registers[HLRegRC] = 4;
+        system->cpu.registers[HLRegRD] = HLDMACommandCopy;
+        system->cpu.registers[HLRegRE] = 256;
+
+        // stale code would start the copy over and over until the budget
+        // runs out
+        EXPECT_EQ(HLSystemRun(system, UINT64_C(1) << 24), HLStopHalted);
+        EXPECT_EQ(system->testCode, 1);
+        EXPECT_EQ(system->cpu.registers[HLRegRG], 1);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(DMATest, InterruptsGoToTheCoreThatStartedTheTransfer) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+    ASSERT_EQ(HLSystemSetCoreCount(system, 2), 2);
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysical(&system->memory, 0x100, dmaProgram, sizeof(dmaProgram), &result);
+    HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0, ASMOpcode_int | ASMImm_F(255), &result);
+    HLSystem* core = HLSystemCore(system, 1);
+    core->cpu.registers[HLRegIP] = 0x100;
+    core->cpu.registers[HLRegRB] = 0x800;
+    core->cpu.registers[HLRegRC] = 8;
+    core->cpu.registers[HLRegRD] = HLDMACommandFill;
+    core->cpu.registers[HLRegRE] = 9;
+    HLSystemExec(system);
+    HLDMAWait(system->dma);
+
+    EXPECT_EQ(HLInterruptControllerTakePending(&core->interrupts), 9);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), -1);
+    HLSystemDone(&system);
+}
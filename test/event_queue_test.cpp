@@ -0,0 +1,130 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "system.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "event_queue_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+static void Ignore(void* userData, HLSystem* core) {
+}
+
+TEST(EventQueueTest, EventsComeOutInCycleOrder) {
+    HLEventQueue queue;
+    HLEventQueueInit(&queue);
+
+    std::vector<HLEvent> events(HLEventQueueSize);
+    std::vector<uint64_t> scheduled(HLEventQueueSize, UINT64_MAX);
+    for (HLEvent& event : events) {
+        HLEventInit(&event, Ignore, nullptr);
+    }
+
+    // schedule, move and cancel at random, then drain
+    std::mt19937 random(1234);
+    for (int i = 0; i < 10000; i++) {
+        size_t index = random() % events.size();
+        if (random() % 4 == 0) {
+            HLEventQueueCancel(&queue, &events[index]);
+            scheduled[index] = UINT64_MAX;
+        } else {
+            uint64_t cycle = 1 + random() % 1000;
+            ASSERT_TRUE(HLEventQueueSchedule(&queue, &events[index], cycle));
+            scheduled[index] = cycle;
+        }
+        uint64_t earliest = *std::min_element(scheduled.begin(), scheduled.end());
+        ASSERT_EQ(HLEventQueueNextCycle(&queue), earliest);
+    }
+
+    std::vector<uint64_t> expected;
+    for (uint64_t cycle : scheduled) {
+        if (cycle != UINT64_MAX) {
+            expected.push_back(cycle);
+        }
+    }
+    std::sort(expected.begin(), expected.end());
+
+    ASSERT_FALSE(expected.empty());
+    EXPECT_EQ(HLEventQueuePopDue(&queue, expected[0] - 1), nullptr);
+
+    std::vector<uint64_t> popped;
+    HLEvent* event;
+    while ((event = HLEventQueuePopDue(&queue, UINT64_MAX - 1)) != nullptr) {
+        EXPECT_EQ(event->index, -1);
+        popped.push_back(event->cycle);
+    }
+    EXPECT_EQ(popped, expected);
+    EXPECT_EQ(HLEventQueueNextCycle(&queue), UINT64_MAX);
+}
+
+TEST(EventQueueTest, FullQueuesRefuseEvents) {
+    HLEventQueue queue;
+    HLEventQueueInit(&queue);
+
+    std::vector<HLEvent> events(HLEventQueueSize + 1);
+    for (size_t i = 0; i < HLEventQueueSize; i++) {
+        HLEventInit(&events[i], Ignore, nullptr);
+        ASSERT_TRUE(HLEventQueueSchedule(&queue, &events[i], i));
+    }
+    HLEventInit(&events[HLEventQueueSize], Ignore, nullptr);
+    EXPECT_FALSE(HLEventQueueSchedule(&queue, &events[HLEventQueueSize], 0));
+    EXPECT_EQ(events[HLEventQueueSize].index, -1);
+
+    // moving an event already on the queue still works
+    EXPECT_TRUE(HLEventQueueSchedule(&queue, &events[5], 0));
+    HLEvent* first = HLEventQueuePopDue(&queue, 0);
+    HLEvent* second = HLEventQueuePopDue(&queue, 0);
+    EXPECT_TRUE((first == &events[0] && second == &events[5]) || (first == &events[5] && second == &events[0]));
+    EXPECT_EQ(HLEventQueuePopDue(&queue, 0), nullptr);
+}
+
+struct Recorder {
+    HLEvent event;
+    std::vector<uint64_t> cycles;
+    uint64_t period = 0;
+};
+
+static void Record(void* userData, HLSystem* core) {
+    Recorder* recorder = static_cast<Recorder*>(userData);
+    recorder->cycles.push_back(core->cpu.cycles);
+    if (recorder->period != 0) {
+        HLEventQueueSchedule(&core->events, &recorder->event, core->cpu.cycles + recorder->period);
+    }
+}
+
+TEST(EventQueueTest, EventsRunAtTheirCycleOnEveryEngine) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        const uint8_t program[] = {
+            ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-1)),
+        };
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0, program, sizeof(program), &result);
+
+        Recorder once;
+        Recorder periodic;
+        periodic.period = 300;
+        HLEventInit(&once.event, Record, &once);
+        HLEventInit(&periodic.event, Record, &periodic);
+        ASSERT_TRUE(HLEventQueueSchedule(&system->events, &once.event, 1000));
+        ASSERT_TRUE(HLEventQueueSchedule(&system->events, &periodic.event, 250));
+
+        EXPECT_EQ(HLSystemRun(system, 1200), HLStopBudgetExhausted);
+        EXPECT_EQ(system->cpu.cycles, 1200);
+        EXPECT_EQ(once.cycles, std::vector<uint64_t>({ 1000 }));
+        EXPECT_EQ(periodic.cycles, std::vector<uint64_t>({ 250, 550, 850, 1150 }));
+
+        HLSystemDone(&system);
+    }
+}
@@ -0,0 +1,585 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+#include <functional>
+#include <vector>
+
+#include "system.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "interrupt_controller_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+#define EXIT ASM(ASMOpcode_int | ASMImm_F(255))
+#define LOAD(op, reg, imm) ASM(ASMOpcode_##op | ASMFunc_F(ASMFunc_##op) | ASMImm_F(imm) | ASMRde_F(reg))
+#define OPR(op, rde, rs1, rs2) ASM(ASMOpcode_##op | ASMRde_R(rde) | ASMRs1_R(rs1) | ASMRs2_R(rs2))
+#define OPI(op, rde, rs1, imm) ASM(ASMOpcode_##op | ASMRde_M(rde) | ASMRs1_M(rs1) | ASMImm_M(imm))
+#define MEM(op, rde, rs1, imm, rs2, shift) ASM(ASMOpcode_##op | ASMRde_E(rde) | ASMRs1_E(rs1) | ASMImm_E(imm) | ASMRs2_E(rs2) | ASMFunc_E(shift))
+#define BRANCH(op, offset) ASM(ASMOpcode_##op | ASMFunc_B(ASMFunc_##op) | ASMImm_B(offset))
+
+// runs program from address 0 until it exits, once on every engine
+static void RunOnEveryEngine(const std::vector<uint8_t>& program,
+                             const std::function<void(HLSystem*)>& check,
+                             const std::function<void(HLSystem*)>& setup = nullptr,
+                             uint64_t memorySize = HLPageSize) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        SCOPED_TRACE((int)engine);
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, memorySize));
+
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0, program.data(), program.size(), &result);
+        ASSERT_EQ(result, HLMemoryResultOK);
+        if (setup) {
+            setup(system);
+        }
+
+        EXPECT_EQ(HLSystemRun(system, 100000), HLStopHalted);
+        EXPECT_EQ(system->testCode, 1);
+        check(system);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(InstructionTest, Arithmetic) {
+    RunOnEveryEngine({
+        LOAD(llis, HLRegRA, 7),
+        LOAD(llis, HLRegRB, -3),
+        OPR(addr, HLRegRC, HLRegRA, HLRegRB),
+        OPI(subi, HLRegRD, HLRegRA, 10),
+        OPR(imulr, HLRegRE, HLRegRA, HLRegRB),
+        OPR(idivr, HLRegRF, HLRegRE, HLRegRA),
+        OPI(remi, HLRegRG, HLRegRE, 4),
+        OPI(udivi, HLRegRH, HLRegRA, 2),
+        OPI(modi, HLRegRI, HLRegRA, 4),
+        OPI(umuli, HLRegRJ, HLRegRA, 6),
+        OPI(addi, HLRegRZ, HLRegRA, 1),
+        EXIT,
+    }, [](HLSystem* system) {
+        uint64_t* registers = system->cpu.registers;
+        EXPECT_EQ(registers[HLRegRC], 4);
+        EXPECT_EQ((int64_t)registers[HLRegRD], -3);
+        EXPECT_EQ((int64_t)registers[HLRegRE], -21);
+        EXPECT_EQ((int64_t)registers[HLRegRF], -3);
+        EXPECT_EQ((int64_t)registers[HLRegRG], -1);
+        EXPECT_EQ(registers[HLRegRH], 3);
+        EXPECT_EQ(registers[HLRegRI], 3);
+        EXPECT_EQ(registers[HLRegRJ], 42);
+        EXPECT_EQ(registers[HLRegRZ], 0);
+    });
+}
+
+TEST(InstructionTest, DivisionEdgeCases) {
+    RunOnEveryEngine({
+        OPI(idivi, HLRegRC, HLRegRA, -1),
+        OPI(remi, HLRegRD, HLRegRA, -1),
+        OPR(udivr, HLRegRE, HLRegRB, HLRegRA),
+        EXIT,
+    }, [](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegRC], (uint64_t)INT64_MIN);
+        EXPECT_EQ(system->cpu.registers[HLRegRD], 0);
+        EXPECT_EQ(system->cpu.registers[HLRegRE], 1);
+    }, [](HLSystem* system) {
+        system->cpu.registers[HLRegRA] = (uint64_t)INT64_MIN;
+        system->cpu.registers[HLRegRB] = UINT64_MAX;
+    });
+}
+
+TEST(InstructionTest, BitwiseOperations) {
+    RunOnEveryEngine({
+        OPI(andi, HLRegRC, HLRegRA, 0x0FF0),
+        OPI(ori, HLRegRD, HLRegRA, 0x000F),
+        OPR(norr, HLRegRE, HLRegRA, HLRegRZ),
+        OPR(xorr, HLRegRF, HLRegRA, HLRegRA),
+        OPI(shli, HLRegRG, HLRegRA, 4),
+        OPI(asri, HLRegRH, HLRegRB, 4),
+        OPI(lsri, HLRegRI, HLRegRB, 60),
+        OPI(biti, HLRegRJ, HLRegRA, 5),
+        EXIT,
+    }, [](HLSystem* system) {
+        uint64_t* registers = system->cpu.registers;
+        EXPECT_EQ(registers[HLRegRC], 0x0230);
+        EXPECT_EQ(registers[HLRegRD], 0x123F);
+        EXPECT_EQ(registers[HLRegRE], ~(uint64_t)0x1234);
+        EXPECT_EQ(registers[HLRegRF], 0);
+        EXPECT_EQ(registers[HLRegRG], 0x12340);
+        EXPECT_EQ(registers[HLRegRH], 0xFF00000000000000);
+        EXPECT_EQ(registers[HLRegRI], 0xF);
+        EXPECT_EQ(registers[HLRegRJ], 1);
+    }, [](HLSystem* system) {
+        system->cpu.registers[HLRegRA] = 0x1234;
+        system->cpu.registers[HLRegRB] = 0xF000000000000000;
+    });
+
+    // shifting by 64 or more shifts everything out
+    RunOnEveryEngine({
+        OPR(shlr, HLRegRC, HLRegRA, HLRegRK),
+        OPR(lsrr, HLRegRD, HLRegRA, HLRegRK),
+        OPR(asrr, HLRegRE, HLRegRB, HLRegRK),
+        OPR(bitr, HLRegRF, HLRegRB, HLRegRK),
+        EXIT,
+    }, [](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegRC], 0);
+        EXPECT_EQ(system->cpu.registers[HLRegRD], 0);
+        EXPECT_EQ(system->cpu.registers[HLRegRE], UINT64_MAX);
+        EXPECT_EQ(system->cpu.registers[HLRegRF], 0);
+    }, [](HLSystem* system) {
+        system->cpu.registers[HLRegRA] = 0x1234;
+        system->cpu.registers[HLRegRB] = 0xF000000000000000;
+        system->cpu.registers[HLRegRK] = 64;
+    });
+}
+
+TEST(InstructionTest, ConstantLoads) {
+    RunOnEveryEngine({
+        LOAD(lli, HLRegRA, 0xCDEF),
+        LOAD(lui, HLRegRA, 0x90AB),
+        LOAD(lti, HLRegRA, 0x5678),
+        LOAD(ltui, HLRegRA, 0x1234),
+        LOAD(lli, HLRegRB, 0xFFFF),
+        LOAD(llis, HLRegRC, -2),
+        LOAD(luis, HLRegRD, 0x8000),
+        LOAD(ltis, HLRegRE, 1),
+        LOAD(ltuis, HLRegRF, -1),
+        EXIT,
+    }, [](HLSystem* system) {
+        uint64_t* registers = system->cpu.registers;
+        EXPECT_EQ(registers[HLRegRA], 0x1234567890ABCDEF);
+        // lli only replaces the low 16 bits
+        EXPECT_EQ(registers[HLRegRB], 0xAAAAAAAAAAAAFFFF);
+        EXPECT_EQ(registers[HLRegRC], (uint64_t)-2);
+        EXPECT_EQ(registers[HLRegRD], 0xFFFFFFFF80000000);
+        EXPECT_EQ(registers[HLRegRE], 0x100000000);
+        EXPECT_EQ(registers[HLRegRF], 0xFFFF000000000000);
+    }, [](HLSystem* system) {
+        system->cpu.registers[HLRegRB] = 0xAAAAAAAAAAAAAAAA;
+    });
+}
+
+struct BranchCase {
+    uint8_t func;
+    std::function<bool(uint64_t, uint64_t)> taken;
+};
+
+TEST(InstructionTest, BranchesFollowComparisons) {
+    const BranchCase cases[] = {
+        { ASMFunc_beq, [](uint64_t a, uint64_t b) { return a == b; } },
+        { ASMFunc_bez, [](uint64_t a, uint64_t b) { return a == b; } },
+        { ASMFunc_blt, [](uint64_t a, uint64_t b) { return (int64_t)a < (int64_t)b; } },
+        { ASMFunc_ble, [](uint64_t a, uint64_t b) { return (int64_t)a <= (int64_t)b; } },
+        { ASMFunc_bltu, [](uint64_t a, uint64_t b) { return a < b; } },
+        { ASMFunc_bleu, [](uint64_t a, uint64_t b) { return a <= b; } },
+        { ASMFunc_bne, [](uint64_t a, uint64_t b) { return a != b; } },
+        { ASMFunc_bnz, [](uint64_t a, uint64_t b) { return a != b; } },
+        { ASMFunc_bge, [](uint64_t a, uint64_t b) { return (int64_t)a >= (int64_t)b; } },
+        { ASMFunc_bgt, [](uint64_t a, uint64_t b) { return (int64_t)a > (int64_t)b; } },
+        { ASMFunc_bgeu, [](uint64_t a, uint64_t b) { return a >= b; } },
+        { ASMFunc_bgtu, [](uint64_t a, uint64_t b) { return a > b; } },
+    };
+    const uint64_t operands[][2] = {
+        { 1, 1 },
+        { 1, 2 },
+        { 2, 1 },
+        { (uint64_t)-1, 1 },
+        { 1, (uint64_t)-1 },
+    };
+
+    for (const BranchCase& branch : cases) {
+        for (const auto& pair : operands) {
+            SCOPED_TRACE(testing::Message() << "func " << (int)branch.func << ", " << pair[0] << " vs " << pair[1]);
+            bool taken = branch.taken(pair[0], pair[1]);
+            // RC ends up 1 if the branch was taken
+            std::vector<uint8_t> program = {
+                OPI(cmpr, HLRegRA, HLRegRB, 0),
+                BRANCH(bra, 3),
+                LOAD(llis, HLRegRC, 0),
+                EXIT,
+                ASM(0xAA),
+                LOAD(llis, HLRegRC, 1),
+                EXIT,
+            };
+            // the function is the top nibble of the branch
+            program[7] |= branch.func << 4;
+            RunOnEveryEngine(program, [&](HLSystem* system) {
+                EXPECT_EQ(system->cpu.registers[HLRegRC], taken ? 1 : 0);
+            }, [&](HLSystem* system) {
+                system->cpu.registers[HLRegRA] = pair[0];
+                system->cpu.registers[HLRegRB] = pair[1];
+            });
+        }
+    }
+}
+
+TEST(InstructionTest, ImmediateComparisonsCanBeReversed) {
+    RunOnEveryEngine({
+        OPI(cmpi, 0, HLRegRA, 5),
+        BRANCH(bge, 3),
+        OPI(cmpi, 1, HLRegRA, 5),
+        BRANCH(blt, 1),
+        OPI(addi, HLRegRB, HLRegRZ, 1),
+        EXIT,
+    }, [](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegRB], 1);
+    }, [](HLSystem* system) {
+        system->cpu.registers[HLRegRA] = 3;
+    });
+}
+
+TEST(InstructionTest, ArithmeticSetsFlags) {
+    const uint64_t arithmeticFlags = HLFlag(HLFlagSign) | HLFlag(HLFlagZero) | HLFlag(HLFlagCarryBorrow) | HLFlag(HLFlagCarryBorrowUnsigned);
+
+    // signed overflow
+    RunOnEveryEngine({
+        OPI(addi, HLRegRB, HLRegRA, 1),
+        EXIT,
+    }, [&](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegStatus] & arithmeticFlags, HLFlag(HLFlagSign) | HLFlag(HLFlagCarryBorrow));
+    }, [](HLSystem* system) {
+        system->cpu.registers[HLRegRA] = INT64_MAX;
+    });
+
+    // unsigned carry out to zero
+    RunOnEveryEngine({
+        OPI(addi, HLRegRB, HLRegRA, 1),
+        EXIT,
+    }, [&](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegStatus] & arithmeticFlags, HLFlag(HLFlagZero) | HLFlag(HLFlagCarryBorrowUnsigned));
+    }, [](HLSystem* system) {
+        system->cpu.registers[HLRegRA] = UINT64_MAX;
+    });
+
+    // borrow; the comparison's flags outlive the subtraction's
+    RunOnEveryEngine({
+        OPI(cmpr, HLRegRA, HLRegRA, 0),
+        OPR(subr, HLRegRB, HLRegRZ, HLRegRA),
+        EXIT,
+    }, [&](HLSystem* system) {
+        uint64_t status = system->cpu.registers[HLRegStatus];
+        EXPECT_EQ(status & arithmeticFlags, HLFlag(HLFlagSign) | HLFlag(HLFlagCarryBorrowUnsigned));
+        EXPECT_TRUE(status & HLFlag(HLFlagEqual));
+        EXPECT_FALSE(status & HLFlag(HLFlagLess));
+    }, [](HLSystem* system) {
+        system->cpu.registers[HLRegRA] = 1;
+    });
+}
+
+TEST(InstructionTest, StatusCanBeReadAndWritten) {
+    RunOnEveryEngine({
+        OPI(cmpr, HLRegRA, HLRegRB, 0),
+        OPR(addr, HLRegRC, HLRegStatus, HLRegRZ),
+        // neither the flags it just set nor the mode survive a write
+        OPI(ori, HLRegStatus, HLRegRZ, HLFlag(HLFlagSign) | HLFlag(HLFlagMode)),
+        EXIT,
+    }, [](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegRC], HLFlag(HLFlagLess) | HLFlag(HLFlagLessUnsigned));
+        EXPECT_EQ(system->cpu.registers[HLRegStatus], HLFlag(HLFlagSign));
+    }, [](HLSystem* system) {
+        system->cpu.registers[HLRegRA] = 1;
+        system->cpu.registers[HLRegRB] = 2;
+    });
+}
+
+TEST(InstructionTest, LoadsAndStores) {
+    RunOnEveryEngine({
+        LOAD(llis, HLRegRA, 0x100),
+        LOAD(llis, HLRegRB, -2),
+        LOAD(llis, HLRegRF, 1),
+        MEM(sw, HLRegRB, HLRegRA, 1, HLRegRZ, 0),
+        MEM(lw, HLRegRC, HLRegRA, 1, HLRegRZ, 0),
+        MEM(lh, HLRegRD, HLRegRA, 2, HLRegRZ, 0),
+        MEM(lhs, HLRegRE, HLRegRA, 2, HLRegRZ, 0),
+        MEM(lq, HLRegRG, HLRegRA, 0, HLRegRF, 3),
+        MEM(lqs, HLRegRH, HLRegRA, 4, HLRegRZ, 0),
+        MEM(lb, HLRegRI, HLRegRA, 8, HLRegRZ, 0),
+        MEM(lbs, HLRegRJ, HLRegRA, 0, HLRegRF, 3),
+        MEM(sb, HLRegRF, HLRegRA, 9, HLRegRZ, 0),
+        MEM(sq, HLRegRF, HLRegRA, 5, HLRegRZ, 0),
+        MEM(sh, HLRegRF, HLRegRA, 3, HLRegRZ, 0),
+        EXIT,
+    }, [](HLSystem* system) {
+        uint64_t* registers = system->cpu.registers;
+        EXPECT_EQ(registers[HLRegRC], (uint64_t)-2);
+        EXPECT_EQ(registers[HLRegRD], 0xFFFFFFFE);
+        EXPECT_EQ(registers[HLRegRE], (uint64_t)-2);
+        EXPECT_EQ(registers[HLRegRG], 0xFFFE);
+        EXPECT_EQ(registers[HLRegRH], (uint64_t)-2);
+        EXPECT_EQ(registers[HLRegRI], 0xFE);
+        EXPECT_EQ(registers[HLRegRJ], (uint64_t)-2);
+
+        HLMemoryResult result = HLMemoryResultOK;
+        EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt8(&system->memory, 0x108, &result), 0xFE);
+        EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt8(&system->memory, 0x109, &result), 1);
+        EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt16(&system->memory, 0x10A, &result), 1);
+        EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt32(&system->memory, 0x10C, &result), 1);
+    });
+}
+
+TEST(InstructionTest, CallsAndTheStack) {
+    RunOnEveryEngine({
+        LOAD(llis, HLRegSP, 0x200),
+        LOAD(llis, HLRegRA, 42),
+        OPI(jal, HLRegRZ, HLRegRZ, 6),
+        OPI(jalr, HLRegRK, HLRegRZ, 12),
+        EXIT,
+        ASM(0xAA),
+        // 6: a function with a frame
+        OPI(enter, 0, 0, 0),
+        OPI(push, 0, HLRegRA, 0),
+        OPI(pop, HLRegRB, 0, 0),
+        OPR(addr, HLRegRC, HLRegFP, HLRegRZ),
+        OPI(leave, 0, 0, 0),
+        OPI(ret, 0, 0, 0),
+        // 12: a leaf function
+        OPI(addi, HLRegRD, HLRegRZ, 1),
+        OPI(retr, 0, HLRegRK, 0),
+    }, [](HLSystem* system) {
+        uint64_t* registers = system->cpu.registers;
+        EXPECT_EQ(registers[HLRegRB], 42);
+        EXPECT_EQ(registers[HLRegRC], 0x200 - 16);
+        EXPECT_EQ(registers[HLRegRD], 1);
+        EXPECT_EQ(registers[HLRegRK], 16);
+        EXPECT_EQ(registers[HLRegSP], 0x200);
+        EXPECT_EQ(registers[HLRegFP], 0);
+    });
+}
+
+TEST(InstructionTest, LoopsRunLongEnoughToCompile) {
+    // adds up 1 to 100
+    RunOnEveryEngine({
+        LOAD(llis, HLRegRA, 100),
+        OPR(addr, HLRegRB, HLRegRB, HLRegRA),
+        OPI(subi, HLRegRA, HLRegRA, 1),
+        BRANCH(bnz, -3),
+        EXIT,
+    }, [](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegRB], 5050);
+        EXPECT_EQ(system->cpu.cycles, 1 + 3 * 100 + 1);
+    });
+}
+
+TEST(InstructionTest, FaultingInstructionsCanBeRetried) {
+    // the handler fixes RB up and returns to the division
+    RunOnEveryEngine({
+        OPI(outi, 0, HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+        OPR(idivr, HLRegRC, HLRegRA, HLRegRB),
+        EXIT,
+        ASM(0xAA),
+        // 4: the handler
+        OPI(ini, HLRegRD, 0, HLInterruptPortBase + HLInterruptPortInService),
+        OPI(addi, HLRegRB, HLRegRZ, 2),
+        LOAD(iret, 0, 0),
+    }, [](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegRC], 0x400);
+        EXPECT_EQ(system->cpu.registers[HLRegRD], HLInterruptDivideByZero);
+    }, [](HLSystem* system) {
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0x800 + 8 * HLInterruptDivideByZero, 16, &result);
+        system->cpu.registers[HLRegRA] = 0x800;
+    });
+}
+
+TEST(InstructionTest, UnalignedAccessesFault) {
+    RunOnEveryEngine({
+        OPI(outi, 0, HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+        MEM(lw, HLRegRC, HLRegRB, 0, HLRegRZ, 0),
+        ASM(0xAA),
+        // 3: the handler
+        OPI(ini, HLRegRD, 0, HLInterruptPortBase + HLInterruptPortReturnAddress),
+        EXIT,
+    }, [](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegRC], 0);
+        EXPECT_EQ(system->cpu.registers[HLRegRD], 4);
+    }, [](HLSystem* system) {
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0x800 + 8 * HLInterruptUnalignedAccess, 12, &result);
+        system->cpu.registers[HLRegRA] = 0x800;
+        system->cpu.registers[HLRegRB] = 0x101;
+    });
+}
+
+TEST(InstructionTest, ZeroRegisterAndSmallImmediateForms) {
+    RunOnEveryEngine({
+        OPI(addi, HLRegRA, HLRegRZ, -1),
+        OPI(ori, HLRegRB, HLRegRZ, 0x1234),
+        OPI(nori, HLRegRC, HLRegRZ, 0),
+        OPI(xori, HLRegRD, HLRegRA, 0),
+        OPR(orr, HLRegRE, HLRegRZ, HLRegRB),
+        OPI(andi, HLRegRF, HLRegRA, 0),
+        OPI(shli, HLRegRG, HLRegRB, 64),
+        OPI(lsri, HLRegRH, HLRegRA, -1),
+        OPI(asri, HLRegRI, HLRegRA, 100),
+        OPI(biti, HLRegRJ, HLRegRB, 2),
+        OPR(andr, HLRegRK, HLRegRA, HLRegRZ),
+        LOAD(lli, HLRegRZ, 5),
+        OPI(cmpr, HLRegRB, HLRegRZ, 0),
+        EXIT,
+    }, [](HLSystem* system) {
+        uint64_t* registers = system->cpu.registers;
+        EXPECT_EQ(registers[HLRegRA], UINT64_MAX);
+        EXPECT_EQ(registers[HLRegRB], 0x1234);
+        EXPECT_EQ(registers[HLRegRC], UINT64_MAX);
+        EXPECT_EQ(registers[HLRegRD], UINT64_MAX);
+        EXPECT_EQ(registers[HLRegRE], 0x1234);
+        EXPECT_EQ(registers[HLRegRF], 0);
+        EXPECT_EQ(registers[HLRegRG], 0);
+        EXPECT_EQ(registers[HLRegRH], 0);
+        EXPECT_EQ(registers[HLRegRI], UINT64_MAX);
+        EXPECT_EQ(registers[HLRegRJ], 1);
+        EXPECT_EQ(registers[HLRegRK], 0);
+        EXPECT_EQ(registers[HLRegRZ], 0);
+        // the move immediate still sets the flags of an addition, and the
+        // comparison with zero finds RB greater
+        EXPECT_EQ(registers[HLRegStatus], HLFlag(HLFlagSign));
+    }, [](HLSystem* system) {
+        for (int reg = HLRegRA; reg <= HLRegRK; reg++) {
+            system->cpu.registers[reg] = 0xAAAA;
+        }
+    });
+
+    RunOnEveryEngine({
+        OPI(cmpi, 0, HLRegRA, 0),
+        EXIT,
+    }, [](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegStatus], HLFlag(HLFlagEqual) | HLFlag(HLFlagZero));
+    });
+}
+
+TEST(InstructionTest, UserModeGoesThroughTheMMU) {
+    // kernel code in page 0, page tables in page 1, and virtual page 1
+    // mapped to physical page 2; the user code makes a system call that
+    // works on its memory through the physical address
+    const uint64_t tables = HLPageSize;
+    const uint64_t user = 2 * HLPageSize;
+    const uint64_t pde = 0x1D; // valid, readable, writable, executable
+
+    RunOnEveryEngine({
+        OPI(outi, 0, HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+        LOAD(usr, HLRegRB, 0),
+        ASM(0xAA),
+        // 3: the system call
+        MEM(lw, HLRegRD, HLRegRC, 0, HLRegRZ, 0),
+        OPI(addi, HLRegRD, HLRegRD, 1),
+        MEM(sw, HLRegRD, HLRegRC, 0, HLRegRZ, 0),
+        LOAD(iret, 0, 0),
+    }, [&](HLSystem* system) {
+        EXPECT_EQ(system->cpu.registers[HLRegRG], 42);
+        EXPECT_TRUE(system->cpu.registers[HLRegStatus] & HLFlag(HLFlagMode));
+        HLMemoryResult result = HLMemoryResultOK;
+        EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&system->memory, user + 0x100, &result), 42);
+    }, [&](HLSystem* system) {
+        std::vector<uint8_t> program = {
+            LOAD(llis, HLRegRE, 41),
+            MEM(sw, HLRegRE, HLRegRF, 0, HLRegRZ, 0),
+            ASM(ASMOpcode_int | ASMImm_F(0x40)),
+            MEM(lw, HLRegRG, HLRegRF, 0, HLRegRZ, 0),
+            EXIT,
+        };
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, user, program.data(), program.size(), &result);
+        // the first four levels all use the table at index 0
+        HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables, tables | pde, &result);
+        HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables + 8, user | pde, &result);
+        HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0x800 + 8 * 0x40, 12, &result);
+        ASSERT_EQ(result, HLMemoryResultOK);
+        system->memory.pageTableBase = tables;
+        system->cpu.registers[HLRegRA] = 0x800;
+        system->cpu.registers[HLRegRB] = HLPageSize;
+        system->cpu.registers[HLRegRC] = user + 0x100;
+        system->cpu.registers[HLRegRF] = HLPageSize + 0x100;
+    }, 3 * HLPageSize);
+}
+
+TEST(InstructionTest, UserModeCannotUsePorts) {
+    // user code at virtual page 1 tries to clear the page table base, or
+    // read it, and faults into the kernel handler at 12 instead
+    const uint64_t tables = HLPageSize;
+    const uint64_t user = 2 * HLPageSize;
+    const uint64_t pde = 0x1D; // valid, readable, writable, executable
+    const uint32_t port = HLMemoryManagementUnitPortBase + HLMemoryManagementUnitPortPageTableBase;
+
+    for (uint32_t instruction : {
+             (uint32_t)(ASMOpcode_outi | ASMImm_M(port) | ASMRs1_M(HLRegRZ)),
+             (uint32_t)(ASMOpcode_outr | ASMRde_M(HLRegRC) | ASMRs1_M(HLRegRZ)),
+             (uint32_t)(ASMOpcode_ini | ASMImm_M(port) | ASMRde_M(HLRegRE)),
+             (uint32_t)(ASMOpcode_inr | ASMRs1_M(HLRegRC) | ASMRde_M(HLRegRE)),
+         }) {
+        SCOPED_TRACE(instruction);
+        RunOnEveryEngine({
+            OPI(outi, 0, HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+            LOAD(usr, HLRegRB, 0),
+            ASM(0xAA),
+            // 3: the invalid operation handler
+            EXIT,
+        }, [&](HLSystem* system) {
+            EXPECT_EQ(system->memory.pageTableBase, tables);
+            EXPECT_EQ(system->cpu.registers[HLRegRE], 0x77);
+            EXPECT_FALSE(system->cpu.registers[HLRegStatus] & HLFlag(HLFlagMode));
+            EXPECT_EQ(HLSystemPortRead(system, HLInterruptPortBase + HLInterruptPortReturnAddress), HLPageSize);
+        }, [&](HLSystem* system) {
+            HLMemoryResult result = HLMemoryResultOK;
+            HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, user, instruction, &result);
+            HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, user + 4, ASMOpcode_int | ASMImm_F(255), &result);
+            // the first four levels all use the table at index 0
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables, tables | pde, &result);
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables + 8, user | pde, &result);
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0x800 + 8 * HLInterruptInvalidOperation, 12, &result);
+            ASSERT_EQ(result, HLMemoryResultOK);
+            system->memory.pageTableBase = tables;
+            system->cpu.registers[HLRegRA] = 0x800;
+            system->cpu.registers[HLRegRB] = HLPageSize;
+            system->cpu.registers[HLRegRC] = port;
+            system->cpu.registers[HLRegRE] = 0x77;
+        }, 3 * HLPageSize);
+    }
+}
+
+TEST(InstructionTest, GuestsManageTheirTranslations) {
+    // like above, but the kernel loads the page tables itself and its
+    // system call remaps the user page to physical page 3 and restarts the
+    // call, which only halts once the remapping is seen
+    const uint64_t tables = HLPageSize;
+    const uint64_t pde = 0x1D; // valid, readable, writable, executable
+
+    for (HLMemoryManagementUnitPort port : { HLMemoryManagementUnitPortInvalidatePage, HLMemoryManagementUnitPortFlush }) {
+        SCOPED_TRACE((int)port);
+        RunOnEveryEngine({
+            OPI(outi, 0, HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+            OPI(outi, 0, HLRegRH, HLMemoryManagementUnitPortBase + HLMemoryManagementUnitPortPageTableBase),
+            LOAD(usr, HLRegRB, 0),
+            // 3: the system call
+            MEM(sw, HLRegRD, HLRegRC, 0, HLRegRZ, 0),
+            // 4: tells the MMU through port, written by the setup
+            ASM(ASMOpcode_int | ASMImm_F(254)),
+            OPI(outi, 0, HLRegRB, HLInterruptPortBase + HLInterruptPortReturnAddress),
+            LOAD(iret, 0, 0),
+        }, [&](HLSystem* system) {
+            EXPECT_EQ(system->memory.pageTableBase, tables);
+            EXPECT_EQ(HLSystemPortRead(system, HLMemoryManagementUnitPortBase + HLMemoryManagementUnitPortPageTableBase), tables);
+        }, [&](HLSystem* system) {
+            if (system->jit != nullptr) {
+                system->jit->threshold = 0;
+            }
+            HLMemoryResult result = HLMemoryResultOK;
+            HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 16, ASMOpcode_outi | ASMImm_M(HLMemoryManagementUnitPortBase + port) | ASMRs1_M(HLRegRB), &result);
+            HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 2 * HLPageSize + 4, ASMOpcode_int | ASMImm_F(0x40), &result);
+            HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 3 * HLPageSize + 4, ASMOpcode_int | ASMImm_F(255), &result);
+            // the first four levels all use the table at index 0
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables, tables | pde, &result);
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables + 8, 2 * HLPageSize | pde, &result);
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0x800 + 8 * 0x40, 12, &result);
+            ASSERT_EQ(result, HLMemoryResultOK);
+            system->cpu.registers[HLRegRA] = 0x800;
+            // off the start of the page, so the user block has its own slot
+            system->cpu.registers[HLRegRB] = HLPageSize + 4;
+            system->cpu.registers[HLRegRC] = tables + 8;
+            system->cpu.registers[HLRegRD] = 3 * HLPageSize | pde;
+            system->cpu.registers[HLRegRH] = tables;
+        }, 4 * HLPageSize);
+    }
+}
@@ -0,0 +1,335 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+
+#include "system.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "interrupt_controller_p.h"
+#include "io_bus_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+#define VECTOR_TABLE 0x800
+#define OUTI(reg, port) ASM(ASMOpcode_outi | ASMImm_M(HLInterruptPortBase + port) | ASMRs1_M(reg))
+#define INI(reg, port) ASM(ASMOpcode_ini | ASMImm_M(HLInterruptPortBase + port) | ASMRde_M(reg))
+#define INT(vector) ASM(ASMOpcode_int | ASMFunc_F(ASMFunc_int) | ASMImm_F(vector))
+#define IRET ASM(ASMOpcode_iret | ASMFunc_F(ASMFunc_iret))
+#define IRES ASM(ASMOpcode_ires | ASMFunc_F(ASMFunc_ires))
+
+static const HLExecutionEngine engines[] = { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT };
+
+static void Load(HLSystem* system, uint64_t address, const uint8_t* code, size_t size) {
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysical(&system->memory, address, code, size, &result);
+    ASSERT_EQ(result, HLMemoryResultOK);
+}
+
+static void SetHandler(HLSystem* system, HLInterrupt interrupt, uint64_t handler) {
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, VECTOR_TABLE + 8 * interrupt, handler, &result);
+    ASSERT_EQ(result, HLMemoryResultOK);
+}
+
+TEST(InterruptControllerTest, SoftwareInterruptsReturnWhereTheyCameFrom) {
+    for (HLExecutionEngine engine : engines) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        const uint8_t program[] = {
+            OUTI(HLRegRA, HLInterruptPortVectorTable),
+            INT(5),
+            INT(255),
+        };
+        const uint8_t handler[] = {
+            INI(HLRegRB, HLInterruptPortInService),
+            INI(HLRegRC, HLInterruptPortReturnAddress),
+            IRET,
+        };
+        Load(system, 0, program, sizeof(program));
+        Load(system, 0x400, handler, sizeof(handler));
+        SetHandler(system, 5, 0x400);
+        system->cpu.registers[HLRegRA] = VECTOR_TABLE;
+        system->cpu.registers[HLRegStatus] = HLFlag(HLFlagZero);
+
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 1);
+        EXPECT_EQ(system->cpu.registers[HLRegRB], 5);
+        EXPECT_EQ(system->cpu.registers[HLRegRC], 8);
+        EXPECT_EQ(system->cpu.registers[HLRegStatus], HLFlag(HLFlagZero));
+        EXPECT_EQ(system->interrupts.queueSize, 0);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(InterruptControllerTest, InterruptsWithoutAVectorTableFault) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+    const uint8_t program[] = {
+        INT(5),
+        INT(255),
+    };
+    Load(system, 0, program, sizeof(program));
+    HLSystemRaiseInterrupt(system, 9);
+    EXPECT_EQ(HLSystemRun(system, 10), HLStopFault);
+
+    // raised interrupts wait for a table
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), 9);
+
+    HLSystemDone(&system);
+}
+
+TEST(InterruptControllerTest, RaisedInterruptsAreTakenBetweenBlocks) {
+    for (HLExecutionEngine engine : engines) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        // raises 9 on itself, then spins until it arrives
+        const uint8_t program[] = {
+            OUTI(HLRegRA, HLInterruptPortVectorTable),
+            OUTI(HLRegRC, HLInterruptPortRaise),
+            ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-1)),
+        };
+        const uint8_t handler[] = {
+            INI(HLRegRB, HLInterruptPortInService),
+            INT(255),
+        };
+        Load(system, 0, program, sizeof(program));
+        Load(system, 0x400, handler, sizeof(handler));
+        SetHandler(system, 9, 0x400);
+        system->cpu.registers[HLRegRA] = VECTOR_TABLE;
+        system->cpu.registers[HLRegRC] = 9;
+
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 1);
+        EXPECT_EQ(system->cpu.registers[HLRegRB], 9);
+        EXPECT_EQ(system->interrupts.returnAddress, 8);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(InterruptControllerTest, QueuedInterruptsAreChained) {
+    for (HLExecutionEngine engine : engines) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        const uint8_t program[] = {
+            INT(255),
+        };
+        const uint8_t first[] = {
+            INI(HLRegRB, HLInterruptPortInService),
+            IRES,
+        };
+        const uint8_t second[] = {
+            INI(HLRegRC, HLInterruptPortInService),
+            IRET,
+        };
+        Load(system, 0, program, sizeof(program));
+        Load(system, 0x400, first, sizeof(first));
+        Load(system, 0x500, second, sizeof(second));
+        SetHandler(system, 10, 0x400);
+        SetHandler(system, 11, 0x500);
+        HLSystemPortWrite(system, HLInterruptPortBase + HLInterruptPortVectorTable, VECTOR_TABLE);
+        HLSystemRaiseInterrupt(system, 11);
+        HLSystemRaiseInterrupt(system, 10);
+
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 1);
+        EXPECT_EQ(system->cpu.registers[HLRegRB], 10);
+        EXPECT_EQ(system->cpu.registers[HLRegRC], 11);
+        EXPECT_EQ(system->interrupts.queueSize, 0);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(InterruptControllerTest, FullQueuesOverflow) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+    const uint8_t handler[] = {
+        INI(HLRegRB, HLInterruptPortInService),
+        INT(255),
+    };
+    Load(system, 0x400, handler, sizeof(handler));
+    for (int i = 0; i < 256; i++) {
+        SetHandler(system, i, 0x400);
+    }
+    HLSystemPortWrite(system, HLInterruptPortBase + HLInterruptPortVectorTable, VECTOR_TABLE);
+    for (int i = 0; i < 20; i++) {
+        HLSystemRaiseInterrupt(system, 30 + i);
+    }
+
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+    EXPECT_EQ(system->cpu.registers[HLRegRB], 30);
+    ASSERT_EQ(system->interrupts.queueSize, HLInterruptQueueSize);
+    EXPECT_EQ(system->interrupts.queue[1], 31);
+    EXPECT_EQ(system->interrupts.queue[HLInterruptQueueSize - 2], 30 + HLInterruptQueueSize - 2);
+    EXPECT_EQ(system->interrupts.queue[HLInterruptQueueSize - 1], HLInterruptOverflow);
+
+    HLSystemDone(&system);
+}
+
+TEST(InterruptControllerTest, InvalidOpcodesFaultWithoutRunningTheRestOfTheBlock) {
+    for (HLExecutionEngine engine : engines) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        const uint8_t program[] = {
+            ASM(0xAA),
+            INI(HLRegRD, HLInterruptPortVectorTable),
+        };
+        // resolves the fault and starts over, enough times to get compiled
+        const uint8_t handler[] = {
+            INI(HLRegRB, HLInterruptPortInService),
+            INI(HLRegRC, HLInterruptPortReturnAddress),
+            IRES,
+            ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-0x410 / 4)),
+        };
+        Load(system, 0, program, sizeof(program));
+        Load(system, 0x400, handler, sizeof(handler));
+        SetHandler(system, HLInterruptInvalidOperation, 0x400);
+        HLSystemPortWrite(system, HLInterruptPortBase + HLInterruptPortVectorTable, VECTOR_TABLE);
+        system->cpu.registers[HLRegRC] = 1234;
+
+        EXPECT_EQ(HLSystemRun(system, 1000), HLStopBudgetExhausted);
+        EXPECT_EQ(system->cpu.registers[HLRegRB], HLInterruptInvalidOperation);
+        EXPECT_EQ(system->cpu.registers[HLRegRC], 0);
+        EXPECT_EQ(system->cpu.registers[HLRegRD], 0);
+        // NULL if the JIT isn't built
+        if (system->jit != nullptr) {
+            EXPECT_GT(system->jit->compiledBlocks, 0);
+        }
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(InterruptControllerTest, BadFetchesAreAccessViolations) {
+    for (HLExecutionEngine engine : engines) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        const uint8_t program[] = {
+            OUTI(HLRegRA, HLInterruptPortVectorTable),
+            ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(0x10000 / 4)),
+        };
+        const uint8_t handler[] = {
+            INI(HLRegRB, HLInterruptPortInService),
+            INI(HLRegRC, HLInterruptPortReturnAddress),
+            INT(255),
+        };
+        Load(system, 0, program, sizeof(program));
+        Load(system, 0x400, handler, sizeof(handler));
+        SetHandler(system, HLInterruptAccessViolation, 0x400);
+        system->cpu.registers[HLRegRA] = VECTOR_TABLE;
+
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 1);
+        EXPECT_EQ(system->cpu.registers[HLRegRB], HLInterruptAccessViolation);
+        EXPECT_EQ(system->cpu.registers[HLRegRC], 8 + 0x10000);
+        EXPECT_EQ(system->cpu.cycles, 5);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(InterruptControllerTest, FaultsInHandlersStopTheCore) {
+    for (HLExecutionEngine engine : engines) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        const uint8_t program[] = {
+            INT(5),
+        };
+        const uint8_t handler[] = {
+            ASM(0xAA),
+        };
+        Load(system, 0, program, sizeof(program));
+        Load(system, 0x400, handler, sizeof(handler));
+        SetHandler(system, 5, 0x400);
+        SetHandler(system, HLInterruptInvalidOperation, 0x400);
+        HLSystemPortWrite(system, HLInterruptPortBase + HLInterruptPortVectorTable, VECTOR_TABLE);
+
+        EXPECT_EQ(HLSystemRun(system, 100), HLStopFault);
+        EXPECT_EQ(system->cpu.registers[HLRegIP], 0x400);
+        EXPECT_EQ(system->interrupts.queue[0], 5);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(InterruptControllerTest, UserCodeCannotProgramTheController) {
+    // user code at virtual page 1 points a controller port at its own
+    // handler and raises an interrupt to get into kernel mode with it; the
+    // write faults into the kernel's handler at 0x400 instead
+    const uint64_t tables = HLPageSize;
+    const uint64_t user = 2 * HLPageSize;
+    const uint64_t pde = 0x1D; // valid, readable, writable, executable
+
+    for (HLInterruptPort port : { HLInterruptPortVectorTable, HLInterruptPortReturnAddress, HLInterruptPortReturnStatus, HLInterruptPortRaise }) {
+        for (HLExecutionEngine engine : engines) {
+            SCOPED_TRACE((int)port);
+            SCOPED_TRACE((int)engine);
+            HLSystem* system;
+            HLSystemInitWithEngine(&system, &alloc, engine);
+            ASSERT_TRUE(HLSystemReservePhysicalMemory(system, 3 * HLPageSize));
+
+            const uint8_t program[] = {
+                OUTI(HLRegRA, HLInterruptPortVectorTable),
+                ASM(ASMOpcode_usr | ASMFunc_F(ASMFunc_usr) | ASMRde_F(HLRegRB)),
+            };
+            const uint8_t handler[] = {
+                INI(HLRegRB, HLInterruptPortInService),
+                INI(HLRegRC, HLInterruptPortReturnAddress),
+                INI(HLRegRD, HLInterruptPortVectorTable),
+                INT(255),
+            };
+            const uint8_t userProgram[] = {
+                INT(5),
+                INT(255),
+            };
+            Load(system, 0, program, sizeof(program));
+            Load(system, 0x400, handler, sizeof(handler));
+            Load(system, user + 4, userProgram, sizeof(userProgram));
+            SetHandler(system, HLInterruptInvalidOperation, 0x400);
+            HLMemoryResult result = HLMemoryResultOK;
+            HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, user, ASMOpcode_outi | ASMImm_M(HLInterruptPortBase + port) | ASMRs1_M(HLRegRE), &result);
+            // the first four levels all use the table at index 0
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables, tables | pde, &result);
+            HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, tables + 8, user | pde, &result);
+            ASSERT_EQ(result, HLMemoryResultOK);
+            system->memory.pageTableBase = tables;
+            system->cpu.registers[HLRegRA] = VECTOR_TABLE;
+            system->cpu.registers[HLRegRB] = HLPageSize;
+            // a vector table, return address or vector of the user's choosing
+            system->cpu.registers[HLRegRE] = 5;
+
+            EXPECT_EQ(HLSystemRun(system, 1000), HLStopHalted);
+            EXPECT_EQ(system->testCode, 1);
+            EXPECT_EQ(system->cpu.registers[HLRegRB], HLInterruptInvalidOperation);
+            EXPECT_EQ(system->cpu.registers[HLRegRC], HLPageSize);
+            EXPECT_EQ(system->cpu.registers[HLRegRD], VECTOR_TABLE);
+            EXPECT_FALSE(system->cpu.registers[HLRegStatus] & HLFlag(HLFlagMode));
+            // only the fault, and nothing raised from user mode
+            EXPECT_EQ(system->interrupts.queueSize, 1);
+
+            HLSystemDone(&system);
+        }
+    }
+}
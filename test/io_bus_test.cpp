@@ -0,0 +1,138 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+#include <vector>
+
+#include "system.h"
+#include "io_bus.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "io_bus_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+struct PortAccess {
+    uint16_t port;
+    std::vector<uint64_t> values;
+};
+
+struct TestDevice {
+    std::vector<PortAccess> writes;
+    std::vector<uint16_t> reads;
+};
+
+static uint64_t TestDeviceRead(void* userData, HLSystem* core, uint16_t port) {
+    static_cast<TestDevice*>(userData)->reads.push_back(port);
+    return port * 2;
+}
+
+static void TestDeviceWrite(void* userData, HLSystem* core, uint16_t port, uint64_t value) {
+    static_cast<TestDevice*>(userData)->writes.push_back({ port, { value } });
+}
+
+static void TestDeviceWriteBatch(void* userData, HLSystem* core, uint16_t port, const uint64_t* values, uint32_t count) {
+    static_cast<TestDevice*>(userData)->writes.push_back({ port, std::vector<uint64_t>(values, values + count) });
+}
+
+TEST(IOBusTest, DevicesAnswerToTheirPorts) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        TestDevice state;
+        HLPortDevice device = { TestDeviceRead, TestDeviceWrite, nullptr, &state };
+        ASSERT_TRUE(HLSystemAttachPortDevice(system, 0x100, 0x100, &device));
+        EXPECT_FALSE(HLSystemAttachPortDevice(system, 0x1FF, 2, &device));
+        EXPECT_FALSE(HLSystemAttachPortDevice(system, 0xFFFF, 2, &device));
+
+        const uint8_t program[] = {
+            ASM(ASMOpcode_outi | ASMImm_M(0x100) | ASMRs1_M(HLRegRA)),
+            ASM(ASMOpcode_outr | ASMRde_M(HLRegRB) | ASMRs1_M(HLRegRA)),
+            ASM(ASMOpcode_ini | ASMImm_M(0x1FF) | ASMRde_M(HLRegRC)),
+            ASM(ASMOpcode_inr | ASMRs1_M(HLRegRB) | ASMRde_M(HLRegRD)),
+            ASM(ASMOpcode_outi | ASMImm_M(0x200) | ASMRs1_M(HLRegRA)),
+            ASM(ASMOpcode_ini | ASMImm_M(0x200) | ASMRde_M(HLRegRE)),
+            ASM(ASMOpcode_int | ASMImm_F(255)),
+        };
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0, program, sizeof(program), &result);
+        system->cpu.registers[HLRegRA] = 7;
+        system->cpu.registers[HLRegRB] = 0x123;
+        HLSystemExec(system);
+        ASSERT_EQ(system->testCode, 1);
+
+        ASSERT_EQ(state.writes.size(), 2);
+        EXPECT_EQ(state.writes[0].port, 0x100);
+        EXPECT_EQ(state.writes[0].values, std::vector<uint64_t>({ 7 }));
+        EXPECT_EQ(state.writes[1].port, 0x123);
+        EXPECT_EQ(state.writes[1].values, std::vector<uint64_t>({ 7 }));
+        EXPECT_EQ(state.reads, std::vector<uint16_t>({ 0x1FF, 0x123 }));
+        EXPECT_EQ(system->cpu.registers[HLRegRC], 0x3FE);
+        EXPECT_EQ(system->cpu.registers[HLRegRD], 0x246);
+        EXPECT_EQ(system->cpu.registers[HLRegRE], 0);
+
+        // the ports are free again afterwards
+        HLSystemDetachPortDevice(system, 0x100, 0x100);
+        EXPECT_EQ(HLSystemPortRead(system, 0x100), 0);
+        EXPECT_EQ(state.reads.size(), 2);
+        EXPECT_TRUE(HLSystemAttachPortDevice(system, 0x1FF, 2, &device));
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(IOBusTest, ConsecutiveWritesAreBatched) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        TestDevice state;
+        HLPortDevice device = { TestDeviceRead, TestDeviceWrite, TestDeviceWriteBatch, &state };
+        ASSERT_TRUE(HLSystemAttachPortDevice(system, 0x40, 2, &device));
+
+        const uint8_t program[] = {
+            ASM(ASMOpcode_outi | ASMImm_M(0x40) | ASMRs1_M(HLRegRA)),
+            ASM(ASMOpcode_outi | ASMImm_M(0x40) | ASMRs1_M(HLRegRB)),
+            ASM(ASMOpcode_outi | ASMImm_M(0x40) | ASMRs1_M(HLRegRC)),
+            ASM(ASMOpcode_outi | ASMImm_M(0x41) | ASMRs1_M(HLRegRA)),
+            ASM(ASMOpcode_outi | ASMImm_M(0x41) | ASMRs1_M(HLRegRB)),
+            ASM(ASMOpcode_ini | ASMImm_M(0x40) | ASMRde_M(HLRegRD)),
+            ASM(ASMOpcode_outi | ASMImm_M(0x40) | ASMRs1_M(HLRegRC)),
+            ASM(ASMOpcode_int | ASMImm_F(255)),
+        };
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0, program, sizeof(program), &result);
+        system->cpu.registers[HLRegRA] = 1;
+        system->cpu.registers[HLRegRB] = 2;
+        system->cpu.registers[HLRegRC] = 3;
+        HLSystemExec(system);
+        ASSERT_EQ(system->testCode, 1);
+
+        // the last write is handed over when the run ends
+        ASSERT_EQ(state.writes.size(), 3);
+        EXPECT_EQ(state.writes[0].port, 0x40);
+        EXPECT_EQ(state.writes[0].values, std::vector<uint64_t>({ 1, 2, 3 }));
+        EXPECT_EQ(state.writes[1].port, 0x41);
+        EXPECT_EQ(state.writes[1].values, std::vector<uint64_t>({ 1, 2 }));
+        EXPECT_EQ(state.writes[2].port, 0x40);
+        EXPECT_EQ(state.writes[2].values, std::vector<uint64_t>({ 3 }));
+        EXPECT_EQ(state.reads, std::vector<uint16_t>({ 0x40 }));
+
+        // long runs are split up
+        for (uint64_t i = 0; i < HLPortBatchSize + 1; i++) {
+            HLSystemPortWrite(system, 0x41, i);
+        }
+        ASSERT_EQ(state.writes.size(), 4);
+        EXPECT_EQ(state.writes[3].values.size(), HLPortBatchSize);
+        HLSystemDetachPortDevice(system, 0x40, 2);
+        ASSERT_EQ(state.writes.size(), 5);
+        EXPECT_EQ(state.writes[4].values, std::vector<uint64_t>({ HLPortBatchSize }));
+
+        HLSystemDone(&system);
+    }
+}
@@ -0,0 +1,452 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "system.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "interrupt_controller_p.h"
+#include "timer_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+extern const std::vector<std::vector<uint8_t>> cpuTestPrograms;
+
+#define EXIT ASM(ASMOpcode_int | ASMImm_F(255))
+#define LOAD(op, reg, imm) ASM(ASMOpcode_##op | ASMFunc_F(ASMFunc_##op) | ASMImm_F(imm) | ASMRde_F(reg))
+#define OPR(op, rde, rs1, rs2) ASM(ASMOpcode_##op | ASMRde_R(rde) | ASMRs1_R(rs1) | ASMRs2_R(rs2))
+#define OPI(op, rde, rs1, imm) ASM(ASMOpcode_##op | ASMRde_M(rde) | ASMRs1_M(rs1) | ASMImm_M(imm))
+#define MEM(op, rde, rs1, imm, rs2, shift) ASM(ASMOpcode_##op | ASMRde_E(rde) | ASMRs1_E(rs1) | ASMImm_E(imm) | ASMRs2_E(rs2) | ASMFunc_E(shift))
+#define BRANCH(op, offset) ASM(ASMOpcode_##op | ASMFunc_B(ASMFunc_##op) | ASMImm_B(offset))
+#define OUTI(reg, port) ASM(ASMOpcode_outi | ASMImm_M(port) | ASMRs1_M(reg))
+#define INI(reg, port) ASM(ASMOpcode_ini | ASMImm_M(port) | ASMRde_M(reg))
+
+namespace {
+
+struct Outcome {
+    uint64_t registers[HLNReg];
+    uint64_t cycles;
+    int testCode;
+    std::vector<uint8_t> memory;
+    uint64_t dirtyPages;
+};
+
+// programs get a page of code and vector table, then a page of data
+const uint64_t data = HLPageSize;
+
+Outcome run(HLExecutionEngine engine, const std::vector<uint8_t>& program, int repeats, bool trackDirtyPages)
+{
+    HLSystem* system;
+    HLSystemInitWithEngine(&system, &alloc, engine);
+    if (system->jit != nullptr) {
+        system->jit->threshold = 0;
+    }
+    EXPECT_TRUE(HLSystemReservePhysicalMemory(system, 2 * HLPageSize));
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysical(&system->memory, 0, program.data(), program.size(), &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+
+    Outcome outcome;
+    if (trackDirtyPages) {
+        EXPECT_TRUE(HLSystemTrackDirtyPages(system, true));
+        HLSystemTakeDirtyPages(system, &outcome.dirtyPages, 2);
+    }
+
+    for (int i = 0; i < repeats; i++) {
+        system->cpu.registers[HLRegIP] = 0;
+        HLSystemExec(system);
+    }
+
+    std::memcpy(outcome.registers, system->cpu.registers, sizeof(outcome.registers));
+    outcome.cycles = system->cpu.cycles;
+    outcome.testCode = system->testCode;
+    outcome.memory.assign(system->memory.memory, system->memory.memory + system->memory.memoryLimit);
+    outcome.dirtyPages = 0;
+    HLSystemTakeDirtyPages(system, &outcome.dirtyPages, 2);
+
+    if (system->jit != nullptr) {
+        EXPECT_GT(system->jit->compiledBlocks, 0);
+    }
+
+    HLSystemDone(&system);
+    return outcome;
+}
+
+void expectSameOutcome(const std::vector<uint8_t>& program, bool trackDirtyPages = false)
+{
+    for (int repeats : { 1, 3 }) {
+        SCOPED_TRACE(testing::Message() << repeats << " runs");
+        Outcome expected = run(HLExecutionEngineInterpreter, program, repeats, trackDirtyPages);
+        Outcome actual = run(HLExecutionEngineJIT, program, repeats, trackDirtyPages);
+
+        EXPECT_EQ(actual.testCode, expected.testCode);
+        EXPECT_EQ(actual.cycles, expected.cycles);
+        for (int reg = 0; reg < HLNReg; reg++) {
+            EXPECT_EQ(actual.registers[reg], expected.registers[reg]) << "register " << reg;
+        }
+        EXPECT_TRUE(actual.memory == expected.memory);
+        EXPECT_EQ(actual.dirtyPages, expected.dirtyPages);
+    }
+}
+
+}
+
+TEST(JITTest, MatchesInterpreter) {
+    for (const auto& program : cpuTestPrograms) {
+        expectSameOutcome(program);
+    }
+}
+
+// the programs from instruction_test.cpp, setting up their own registers
+
+TEST(JITTest, ArithmeticMatchesInterpreter) {
+    expectSameOutcome({
+        LOAD(llis, HLRegRA, 7),
+        LOAD(llis, HLRegRB, -3),
+        OPR(addr, HLRegRC, HLRegRA, HLRegRB),
+        OPI(subi, HLRegRD, HLRegRA, 10),
+        OPR(imulr, HLRegRE, HLRegRA, HLRegRB),
+        OPR(idivr, HLRegRF, HLRegRE, HLRegRA),
+        OPI(remi, HLRegRG, HLRegRE, 4),
+        OPI(udivi, HLRegRH, HLRegRA, 2),
+        OPI(modi, HLRegRI, HLRegRA, 4),
+        OPI(umuli, HLRegRJ, HLRegRA, 6),
+        OPI(addi, HLRegRZ, HLRegRA, 1),
+        // the flags of the last addition, worked out by a handler
+        OPR(addr, HLRegRK, HLRegStatus, HLRegRZ),
+        // and of a subtraction that borrows after a comparison
+        OPI(cmpr, HLRegRA, HLRegRB, 0),
+        OPR(subr, HLRegRA, HLRegRZ, HLRegRA),
+        OPI(addi, HLRegRB, HLRegRB, 3),
+        EXIT,
+    });
+}
+
+TEST(JITTest, BitwiseOperationsMatchInterpreter) {
+    expectSameOutcome({
+        LOAD(llis, HLRegRA, 0x1234),
+        LOAD(lli, HLRegRB, 0),
+        LOAD(ltuis, HLRegRB, -4096),
+        LOAD(llis, HLRegRK, 64),
+        OPI(andi, HLRegRC, HLRegRA, 0x0FF0),
+        OPI(ori, HLRegRD, HLRegRA, 0x000F),
+        OPR(norr, HLRegRE, HLRegRA, HLRegRB),
+        OPI(nori, HLRegRE, HLRegRE, 0x0F0F),
+        OPR(xorr, HLRegRF, HLRegRA, HLRegRB),
+        OPI(xori, HLRegRF, HLRegRF, -1),
+        OPI(shli, HLRegRG, HLRegRA, 4),
+        OPI(asri, HLRegRH, HLRegRB, 4),
+        OPI(lsri, HLRegRI, HLRegRB, 60),
+        OPI(biti, HLRegRJ, HLRegRA, 5),
+        OPR(orr, HLRegRA, HLRegRA, HLRegRJ),
+        OPR(andr, HLRegRC, HLRegRC, HLRegRA),
+        // shifting by 64 or more shifts everything out
+        OPR(shlr, HLRegRD, HLRegRA, HLRegRK),
+        OPR(lsrr, HLRegRG, HLRegRA, HLRegRK),
+        OPR(asrr, HLRegRH, HLRegRB, HLRegRK),
+        OPR(bitr, HLRegRI, HLRegRB, HLRegRK),
+        EXIT,
+    });
+}
+
+TEST(JITTest, ConstantLoadsMatchInterpreter) {
+    expectSameOutcome({
+        LOAD(lli, HLRegRA, 0xCDEF),
+        LOAD(lui, HLRegRA, 0x90AB),
+        LOAD(lti, HLRegRA, 0x5678),
+        LOAD(ltui, HLRegRA, 0x1234),
+        LOAD(llis, HLRegRB, -1),
+        OPI(addi, HLRegRC, HLRegRZ, 0),
+        LOAD(lli, HLRegRB, 0x1234),
+        LOAD(lui, HLRegRB, 0x5678),
+        LOAD(llis, HLRegRC, -2),
+        LOAD(luis, HLRegRD, 0x8000),
+        LOAD(ltis, HLRegRE, 1),
+        LOAD(ltuis, HLRegRF, -1),
+        LOAD(lti, HLRegRF, 0xABCD),
+        LOAD(lli, HLRegRZ, 5),
+        OPI(addi, HLRegRG, HLRegRZ, -1),
+        OPI(ori, HLRegRH, HLRegRZ, 0x1234),
+        OPI(nori, HLRegRI, HLRegRZ, 0),
+        OPI(xori, HLRegRJ, HLRegRA, 0),
+        OPI(andi, HLRegRK, HLRegRA, 0),
+        OPI(cmpr, HLRegRB, HLRegRZ, 0),
+        EXIT,
+    });
+}
+
+TEST(JITTest, BranchesMatchInterpreter) {
+    const uint8_t funcs[] = {
+        ASMFunc_beq, ASMFunc_bez, ASMFunc_blt, ASMFunc_ble, ASMFunc_bltu, ASMFunc_bleu,
+        ASMFunc_bne, ASMFunc_bnz, ASMFunc_bge, ASMFunc_bgt, ASMFunc_bgeu, ASMFunc_bgtu,
+    };
+    const int16_t operands[][2] = {
+        { 1, 1 },
+        { 1, 2 },
+        { 2, 1 },
+        { -1, 1 },
+        { 1, -1 },
+    };
+    // what sets the flags the branch tests: a comparison it fuses with,
+    // one it doesn't, comparisons with an immediate both ways round, a
+    // subtraction, and a write to Status
+    const std::vector<std::vector<uint8_t>> setups {
+        { OPI(cmpr, HLRegRA, HLRegRB, 0) },
+        { OPI(cmpr, HLRegRA, HLRegRB, 0), OPR(orr, HLRegRD, HLRegRA, HLRegRZ) },
+        { OPI(cmpi, 0, HLRegRA, 1) },
+        { OPI(cmpi, 1, HLRegRB, 1) },
+        { OPR(subr, HLRegRD, HLRegRA, HLRegRB) },
+        { OPR(orr, HLRegStatus, HLRegRA, HLRegRZ) },
+    };
+
+    for (uint8_t func : funcs) {
+        for (const auto& pair : operands) {
+            for (const auto& setup : setups) {
+                SCOPED_TRACE(testing::Message() << "func " << (int)func << ", " << pair[0] << " vs " << pair[1]
+                                                << ", setup " << (&setup - setups.data()));
+                // RC ends up 1 if the branch was taken
+                std::vector<uint8_t> program = {
+                    LOAD(llis, HLRegRA, 0),
+                    LOAD(llis, HLRegRB, 0),
+                };
+                program[1] = (uint8_t)pair[0];
+                program[2] = (uint8_t)(pair[0] >> 8);
+                program[5] = (uint8_t)pair[1];
+                program[6] = (uint8_t)(pair[1] >> 8);
+                program.insert(program.end(), setup.begin(), setup.end());
+                const std::vector<uint8_t> rest = {
+                    BRANCH(bra, 3),
+                    LOAD(llis, HLRegRC, 0),
+                    EXIT,
+                    ASM(0xAA),
+                    LOAD(llis, HLRegRC, 1),
+                    EXIT,
+                };
+                size_t branch = program.size();
+                program.insert(program.end(), rest.begin(), rest.end());
+                // the function is the top nibble of the branch
+                program[branch + 3] |= func << 4;
+                expectSameOutcome(program);
+            }
+        }
+    }
+}
+
+TEST(JITTest, LoadsAndStoresMatchInterpreter) {
+    expectSameOutcome({
+        LOAD(llis, HLRegRA, data + 0x100),
+        LOAD(llis, HLRegRB, -2),
+        LOAD(llis, HLRegRF, 1),
+        MEM(sw, HLRegRB, HLRegRA, 1, HLRegRZ, 0),
+        MEM(lw, HLRegRC, HLRegRA, 1, HLRegRZ, 0),
+        MEM(lh, HLRegRD, HLRegRA, 2, HLRegRZ, 0),
+        MEM(lhs, HLRegRE, HLRegRA, 2, HLRegRZ, 0),
+        MEM(lq, HLRegRG, HLRegRA, 0, HLRegRF, 3),
+        MEM(lqs, HLRegRH, HLRegRA, 4, HLRegRZ, 0),
+        MEM(lb, HLRegRI, HLRegRA, 8, HLRegRZ, 0),
+        MEM(lbs, HLRegRJ, HLRegRA, 0, HLRegRF, 3),
+        MEM(sb, HLRegRF, HLRegRA, 9, HLRegRZ, 0),
+        MEM(sq, HLRegRF, HLRegRA, 5, HLRegRZ, 0),
+        MEM(sh, HLRegRF, HLRegRA, 3, HLRegRZ, 0),
+        MEM(lw, HLRegRK, HLRegRA, -1, HLRegRF, 3),
+        // sign extension has to ignore what's past the value
+        LOAD(luis, HLRegRB, 0x8000),
+        MEM(sh, HLRegRB, HLRegRA, 8, HLRegRZ, 0),
+        MEM(sq, HLRegRB, HLRegRA, 18, HLRegRZ, 0),
+        MEM(sb, HLRegRB, HLRegRA, 38, HLRegRZ, 0),
+        LOAD(lli, HLRegRB, 0x80),
+        MEM(sb, HLRegRB, HLRegRA, 40, HLRegRZ, 0),
+        MEM(lhs, HLRegRC, HLRegRA, 8, HLRegRZ, 0),
+        MEM(lqs, HLRegRD, HLRegRA, 16, HLRegRZ, 0),
+        MEM(lbs, HLRegRE, HLRegRA, 40, HLRegRZ, 0),
+        MEM(lh, HLRegRG, HLRegRA, 8, HLRegRZ, 0),
+        // into the code page, which the handlers have to see to
+        MEM(sw, HLRegRB, HLRegRZ, 100, HLRegRZ, 0),
+        MEM(lw, HLRegRZ, HLRegRZ, 100, HLRegRZ, 0),
+        EXIT,
+    });
+
+    // adds up 1 to 100, keeping the sum in memory
+    expectSameOutcome({
+        LOAD(llis, HLRegRA, 100),
+        LOAD(llis, HLRegRC, data),
+        MEM(sw, HLRegRZ, HLRegRC, 0, HLRegRZ, 0),
+        MEM(lw, HLRegRB, HLRegRC, 0, HLRegRZ, 0),
+        OPR(addr, HLRegRB, HLRegRB, HLRegRA),
+        MEM(sw, HLRegRB, HLRegRC, 0, HLRegRZ, 0),
+        OPI(subi, HLRegRA, HLRegRA, 1),
+        BRANCH(bnz, -5),
+        EXIT,
+    }, true);
+
+    // rewrites an instruction further on in its own block
+    const uint32_t patch = ASMOpcode_addi | ASMRde_M(HLRegRB) | ASMRs1_M(HLRegRB) | ASMImm_M(1);
+    expectSameOutcome({
+        LOAD(llis, HLRegRA, patch & 0xFFFF),
+        LOAD(lui, HLRegRA, patch >> 16),
+        MEM(sh, HLRegRA, HLRegRZ, 5, HLRegRZ, 0),
+        OPR(orr, HLRegRC, HLRegRB, HLRegRZ),
+        OPR(orr, HLRegRC, HLRegRB, HLRegRZ),
+        OPI(addi, HLRegRB, HLRegRB, 100),
+        EXIT,
+    });
+}
+
+TEST(JITTest, FaultsMatchInterpreter) {
+    // the handler fixes RB up and returns to the division
+    expectSameOutcome({
+        LOAD(llis, HLRegRA, 0x800),
+        LOAD(llis, HLRegRB, 0),
+        LOAD(llis, HLRegRG, 28),
+        MEM(sw, HLRegRG, HLRegRA, HLInterruptDivideByZero, HLRegRZ, 0),
+        OUTI(HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+        OPR(idivr, HLRegRC, HLRegRA, HLRegRB),
+        EXIT,
+        // 7: the handler
+        INI(HLRegRD, HLInterruptPortBase + HLInterruptPortInService),
+        OPI(addi, HLRegRB, HLRegRZ, 2),
+        LOAD(iret, 0, 0),
+    });
+
+    // unaligned and out of bounds accesses; the handler notes where
+    const std::vector<uint8_t> accesses[] = {
+        { MEM(lw, HLRegRC, HLRegRB, 0, HLRegRZ, 0) },
+        { MEM(lhs, HLRegRC, HLRegRB, 0, HLRegRZ, 0) },
+        { MEM(lq, HLRegRC, HLRegRB, 0, HLRegRZ, 0) },
+        { MEM(sw, HLRegRA, HLRegRB, 0, HLRegRZ, 0) },
+        { MEM(sh, HLRegRA, HLRegRB, 0, HLRegRZ, 0) },
+        { MEM(sq, HLRegRA, HLRegRB, 0, HLRegRZ, 0) },
+        { MEM(lb, HLRegRC, HLRegRE, 0, HLRegRZ, 0) },
+        { MEM(sb, HLRegRA, HLRegRE, 0, HLRegRZ, 0) },
+    };
+    for (const auto& access : accesses) {
+        std::vector<uint8_t> program = {
+            LOAD(llis, HLRegRA, 0x800),
+            LOAD(llis, HLRegRB, data + 1),
+            LOAD(luis, HLRegRE, 1),
+            LOAD(llis, HLRegRG, 40),
+            MEM(sw, HLRegRG, HLRegRA, HLInterruptUnalignedAccess, HLRegRZ, 0),
+            MEM(sw, HLRegRG, HLRegRA, HLInterruptAccessViolation, HLRegRZ, 0),
+            OUTI(HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+            OPI(addi, HLRegRF, HLRegRF, 1),
+        };
+        program.insert(program.end(), access.begin(), access.end());
+        const std::vector<uint8_t> handler = {
+            // never reached
+            OPI(addi, HLRegRF, HLRegRF, 1),
+            // 10: the handler
+            INI(HLRegRD, HLInterruptPortBase + HLInterruptPortReturnAddress),
+            LOAD(ires, 0, 0),
+            EXIT,
+        };
+        program.insert(program.end(), handler.begin(), handler.end());
+        expectSameOutcome(program);
+    }
+}
+
+TEST(JITTest, TimersMatchInterpreter) {
+    // armed inside a block, due one instruction later, like the timer test
+    expectSameOutcome({
+        LOAD(llis, HLRegRA, 0x800),
+        LOAD(llis, HLRegRG, 64),
+        MEM(sw, HLRegRG, HLRegRA, 7, HLRegRZ, 0),
+        LOAD(llis, HLRegRB, 1),
+        LOAD(llis, HLRegRC, 7),
+        LOAD(llis, HLRegRD, HLTimerEnabled),
+        LOAD(llis, HLRegRE, 0),
+        OUTI(HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+        OUTI(HLRegRB, HLTimerPortBase + HLTimerPortPeriod),
+        OUTI(HLRegRC, HLTimerPortBase + HLTimerPortVector),
+        OUTI(HLRegRD, HLTimerPortBase + HLTimerPortControl),
+        OPI(addi, HLRegRE, HLRegRE, 1),
+        OPI(addi, HLRegRE, HLRegRE, 1),
+        OPI(addi, HLRegRE, HLRegRE, 1),
+        BRANCH(bra, -1),
+        ASM(0xAA),
+        // 16: the handler
+        INI(HLRegRF, HLInterruptPortBase + HLInterruptPortReturnAddress),
+        LOAD(ires, 0, 0),
+        EXIT,
+    });
+
+    // a periodic timer interrupting a compiled loop at every point in it
+    expectSameOutcome({
+        LOAD(llis, HLRegRA, 0x800),
+        LOAD(llis, HLRegRG, 76),
+        MEM(sw, HLRegRG, HLRegRA, 7, HLRegRZ, 0),
+        LOAD(llis, HLRegRB, 5),
+        LOAD(llis, HLRegRC, 7),
+        LOAD(llis, HLRegRD, HLTimerEnabled | HLTimerPeriodic),
+        LOAD(llis, HLRegRE, 100),
+        LOAD(llis, HLRegRJ, data),
+        OUTI(HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+        OUTI(HLRegRB, HLTimerPortBase + HLTimerPortPeriod),
+        OUTI(HLRegRC, HLTimerPortBase + HLTimerPortVector),
+        OUTI(HLRegRD, HLTimerPortBase + HLTimerPortControl),
+        MEM(lw, HLRegRI, HLRegRJ, 0, HLRegRZ, 0),
+        OPI(addi, HLRegRI, HLRegRI, 3),
+        MEM(sw, HLRegRI, HLRegRJ, 0, HLRegRZ, 0),
+        OPI(subi, HLRegRE, HLRegRE, 1),
+        BRANCH(bnz, -5),
+        OUTI(HLRegRZ, HLTimerPortBase + HLTimerPortControl),
+        EXIT,
+        // 19: the handler, which clobbers the flags the loop tests
+        OPI(addi, HLRegRH, HLRegRH, 1),
+        LOAD(iret, 0, 0),
+    });
+}
+
+#ifdef __linux__
+// the protection of the mapping holding address, e.g. "r-xp"
+static std::string protectionOf(const void* address)
+{
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+        uintptr_t start, end;
+        char protection[5] = {};
+        if (sscanf(line.c_str(), "%" SCNxPTR "-%" SCNxPTR " %4s", &start, &end, protection) == 3
+            && start <= (uintptr_t)address && (uintptr_t)address < end) {
+            return protection;
+        }
+    }
+    return "";
+}
+
+TEST(JITTest, CodeBufferIsNeverWritableAndExecutable) {
+    HLSystem* system;
+    HLSystemInitWithEngine(&system, &alloc, HLExecutionEngineJIT);
+    if (system->jit == nullptr) {
+        HLSystemDone(&system);
+        return;
+    }
+    system->jit->threshold = 0;
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+    EXPECT_EQ(protectionOf(system->jit->code), "r-xp");
+
+    const uint8_t program[] = {
+        LOAD(llis, HLRegRA, 3),
+        OPI(subi, HLRegRA, HLRegRA, 1),
+        BRANCH(bnz, -2),
+        EXIT,
+    };
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysical(&system->memory, 0, program, sizeof(program), &result);
+    ASSERT_EQ(result, HLMemoryResultOK);
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+    EXPECT_GT(system->jit->compiledBlocks, 0);
+    EXPECT_EQ(protectionOf(system->jit->code), "r-xp");
+
+    HLSystemDone(&system);
+}
+#endif
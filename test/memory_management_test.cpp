@@ -4,11 +4,14 @@
 
 #include <gtest/gtest.h>
 
+#include <cstring>
+#include <vector>
+
 #include "memory_management_unit_p.h"
 
 TEST(MemoryTest, OutOfBounds)
 {
-    HLMemoryManagementUnit mmu;
+    HLMemoryManagementUnit mmu{};
     mmu.memory = new uint8_t[1];
     mmu.memoryLimit = 1;
     mmu.pageTableBase = 0;
@@ -26,7 +29,7 @@ TEST(MemoryTest, OutOfBounds)
 
 TEST(MemoryTest, Alignment)
 {
-    HLMemoryManagementUnit mmu;
+    HLMemoryManagementUnit mmu{};
     mmu.memory = new uint8_t[16];
     mmu.memoryLimit = 16;
     mmu.pageTableBase = 0;
@@ -67,7 +70,7 @@ TEST(MemoryTest, Alignment)
 TEST(MemoryTest, BasicPermissionChecks)
 {
     HLMemoryResult result;
-    HLMemoryManagementUnit mmu;
+    HLMemoryManagementUnit mmu{};
     mmu.memory = new uint8_t[8 * 64]{0};
     mmu.memoryLimit = 8 * 64;
     mmu.pageTableBase = 0;
@@ -79,12 +82,14 @@ TEST(MemoryTest, BasicPermissionChecks)
     // one trip with the UInt8
 
     mmu.memory[0] = 0b1;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitReadVirtualUInt8(&mmu, 0, &result);
     EXPECT_EQ(result, HLMemoryResultAccessViolation);
 
     mmu.memory[0] = 0b101;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitReadVirtualUInt8(&mmu, 0, &result);
@@ -93,12 +98,14 @@ TEST(MemoryTest, BasicPermissionChecks)
     // one trip with the UInt16
 
     mmu.memory[0] = 0b1;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitReadVirtualUInt16(&mmu, 0, &result);
     EXPECT_EQ(result, HLMemoryResultAccessViolation);
 
     mmu.memory[0] = 0b101;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitReadVirtualUInt16(&mmu, 0, &result);
@@ -107,12 +114,14 @@ TEST(MemoryTest, BasicPermissionChecks)
     // one trip with the UInt32
 
     mmu.memory[0] = 0b1;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitReadVirtualUInt32(&mmu, 0, &result);
     EXPECT_EQ(result, HLMemoryResultAccessViolation);
 
     mmu.memory[0] = 0b101;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitReadVirtualUInt32(&mmu, 0, &result);
@@ -121,12 +130,14 @@ TEST(MemoryTest, BasicPermissionChecks)
     // one trip with the UInt64
 
     mmu.memory[0] = 0b1;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitReadVirtualUInt64(&mmu, 0, &result);
     EXPECT_EQ(result, HLMemoryResultAccessViolation);
 
     mmu.memory[0] = 0b101;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitReadVirtualUInt64(&mmu, 0, &result);
@@ -139,12 +150,14 @@ TEST(MemoryTest, BasicPermissionChecks)
     // one trip with the UInt8
 
     mmu.memory[0] = 0b1;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitWriteVirtualUInt8(&mmu, 0, 0, &result);
     EXPECT_EQ(result, HLMemoryResultAccessViolation);
 
     mmu.memory[0] = 0b1001;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitWriteVirtualUInt8(&mmu, 0, 0, &result);
@@ -153,12 +166,14 @@ TEST(MemoryTest, BasicPermissionChecks)
     // one trip with the UInt16
 
     mmu.memory[0] = 0b1;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitWriteVirtualUInt16(&mmu, 0, 0, &result);
     EXPECT_EQ(result, HLMemoryResultAccessViolation);
 
     mmu.memory[0] = 0b1001;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitWriteVirtualUInt16(&mmu, 0, 0, &result);
@@ -167,12 +182,14 @@ TEST(MemoryTest, BasicPermissionChecks)
     // one trip with the UInt32
 
     mmu.memory[0] = 0b1;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitWriteVirtualUInt32(&mmu, 0, 0, &result);
     EXPECT_EQ(result, HLMemoryResultAccessViolation);
 
     mmu.memory[0] = 0b1001;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitWriteVirtualUInt32(&mmu, 0, 0, &result);
@@ -181,12 +198,14 @@ TEST(MemoryTest, BasicPermissionChecks)
     // one trip with the UInt64
 
     mmu.memory[0] = 0b1;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitWriteVirtualUInt64(&mmu, 0, 0, &result);
     EXPECT_EQ(result, HLMemoryResultAccessViolation);
 
     mmu.memory[0] = 0b1001;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitWriteVirtualUInt64(&mmu, 0, 0, &result);
@@ -195,12 +214,14 @@ TEST(MemoryTest, BasicPermissionChecks)
     // read instruction
 
     mmu.memory[0] = 0b1;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitReadVirtualInstruction(&mmu, 0, &result);
     EXPECT_EQ(result, HLMemoryResultAccessViolation);
 
     mmu.memory[0] = 0b10001;
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
 
     result = HLMemoryResultOK;
     HLMemoryManagementUnitReadVirtualInstruction(&mmu, 0, &result);
@@ -208,3 +229,225 @@ TEST(MemoryTest, BasicPermissionChecks)
 
     delete[] mmu.memory;
 }
+
+TEST(MemoryTest, TranslationCache)
+{
+    HLMemoryResult result;
+    HLMemoryManagementUnit mmu{};
+    mmu.memory = new uint8_t[8 * 64]{0};
+    mmu.memoryLimit = 8 * 64;
+    mmu.pageTableBase = 0;
+
+    mmu.memory[0] = 0b1101;
+
+    // first access walks the page tables, the second one hits the cache
+
+    result = HLMemoryResultOK;
+    HLMemoryManagementUnitReadVirtualUInt8(&mmu, 8, &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+    EXPECT_EQ(mmu.translationCache.hits, 0);
+    EXPECT_EQ(mmu.translationCache.misses, 1);
+
+    result = HLMemoryResultOK;
+    HLMemoryManagementUnitReadVirtualUInt64(&mmu, 16, &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+    EXPECT_EQ(mmu.translationCache.hits, 1);
+    EXPECT_EQ(mmu.translationCache.misses, 1);
+
+    // a different permission needs its own walk
+
+    result = HLMemoryResultOK;
+    HLMemoryManagementUnitWriteVirtualUInt8(&mmu, 24, 0, &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+    EXPECT_EQ(mmu.translationCache.hits, 1);
+    EXPECT_EQ(mmu.translationCache.misses, 2);
+
+    // stale translations survive until invalidated
+
+    mmu.memory[0] = 0b1;
+
+    result = HLMemoryResultOK;
+    HLMemoryManagementUnitReadVirtualUInt8(&mmu, 8, &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+
+    HLMemoryManagementUnitInvalidateTranslationCachePage(&mmu, 8);
+
+    result = HLMemoryResultOK;
+    HLMemoryManagementUnitReadVirtualUInt8(&mmu, 8, &result);
+    EXPECT_EQ(result, HLMemoryResultAccessViolation);
+
+    // failed walks are not cached
+
+    mmu.memory[0] = 0b101;
+
+    result = HLMemoryResultOK;
+    HLMemoryManagementUnitReadVirtualUInt8(&mmu, 8, &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+
+    delete[] mmu.memory;
+}
+
+static void CountCodeWrite(void* userData, uint64_t address, uint64_t size)
+{
+    (*static_cast<int*>(userData))++;
+}
+
+TEST(MemoryTest, TranslationCacheHostPointers)
+{
+    HLMemoryManagementUnit mmu{};
+    mmu.memory = new uint8_t[3 * HLPageSize]{0};
+    mmu.memoryLimit = 3 * HLPageSize;
+    mmu.pageTableBase = 0;
+
+    // virtual page 1 maps to physical page 2, and virtual page 2 to a page
+    // past the end of memory
+    uint64_t pde = 0b1101;
+    memcpy(mmu.memory, &pde, sizeof(pde));
+    pde = (2 * HLPageSize) | 0b1101;
+    memcpy(mmu.memory + 8, &pde, sizeof(pde));
+    pde = (4 * HLPageSize) | 0b1101;
+    memcpy(mmu.memory + 16, &pde, sizeof(pde));
+
+    uint64_t dirtyPages = 0;
+    mmu.dirtyPages = &dirtyPages;
+    mmu.dirtyPageCount = 3;
+    uint8_t codePages[3] = { 0, 0, 1 };
+    int codeWrites = 0;
+    mmu.codePages = codePages;
+    mmu.codePageCount = 3;
+    mmu.codeWriteObserver = CountCodeWrite;
+    mmu.codeWriteObserverData = &codeWrites;
+
+    // the first access walks the page tables and caches where the page is
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWriteVirtualUInt64(&mmu, HLPageSize + 8, 0x1122334455667788, &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+    EXPECT_EQ(mmu.translationCache.misses, 1);
+
+    uint8_t* host;
+    HLMemoryManagementUnitHostAddress(&mmu, HLPageSize + 16, 32, HLMemoryPermissionWrite, host);
+    EXPECT_EQ(host, mmu.memory + 2 * HLPageSize + 16);
+    HLMemoryManagementUnitHostAddress(&mmu, HLPageSize + 16, 32, HLMemoryPermissionRead, host);
+    EXPECT_EQ(host, nullptr);
+    HLMemoryManagementUnitHostAddress(&mmu, HLPageSize + 17, 32, HLMemoryPermissionWrite, host);
+    EXPECT_EQ(host, nullptr);
+
+    // later ones go straight to it, and still do the bookkeeping
+    dirtyPages = 0;
+    codeWrites = 0;
+    HLMemoryManagementUnitWriteVirtualUInt32(&mmu, HLPageSize + 16, 0xAABBCCDD, &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+    EXPECT_EQ(mmu.translationCache.misses, 1);
+    EXPECT_EQ(dirtyPages, 0b100);
+    EXPECT_EQ(codeWrites, 1);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt32(&mmu, 2 * HLPageSize + 16, &result), 0xAABBCCDD);
+
+    EXPECT_EQ(HLMemoryManagementUnitReadVirtualUInt64(&mmu, HLPageSize + 8, &result), 0x1122334455667788);
+    EXPECT_EQ(HLMemoryManagementUnitReadVirtualUInt16(&mmu, HLPageSize + 16, &result), 0xCCDD);
+    EXPECT_EQ(result, HLMemoryResultOK);
+    EXPECT_EQ(mmu.translationCache.misses, 2);
+
+    // unaligned accesses still fault
+    HLMemoryManagementUnitReadVirtualUInt16(&mmu, HLPageSize + 17, &result);
+    EXPECT_EQ(result, HLMemoryResultUnaligned);
+
+    // pages outside of memory get no host pointer
+    result = HLMemoryResultOK;
+    HLMemoryManagementUnitReadVirtualUInt8(&mmu, 2 * HLPageSize, &result);
+    EXPECT_EQ(result, HLMemoryResultBus);
+    result = HLMemoryResultOK;
+    HLMemoryManagementUnitReadVirtualUInt8(&mmu, 2 * HLPageSize, &result);
+    EXPECT_EQ(result, HLMemoryResultBus);
+
+    // invalidating the page drops its host pointer along with it
+    HLMemoryManagementUnitInvalidateTranslationCachePage(&mmu, HLPageSize);
+    HLMemoryManagementUnitHostAddress(&mmu, HLPageSize, 8, HLMemoryPermissionRead, host);
+    EXPECT_EQ(host, nullptr);
+
+    delete[] mmu.memory;
+}
+
+TEST(MemoryTest, BulkPhysicalAccess)
+{
+    const uint64_t size = 3 * HLPageSize + 100;
+    HLMemoryManagementUnit mmu{};
+    mmu.memory = new uint8_t[size]{0};
+    mmu.memoryLimit = size;
+
+    std::vector<uint8_t> data(2 * HLPageSize);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = uint8_t(i * 7);
+    }
+
+    // unaligned and across a page boundary
+    HLMemoryResult result = HLMemoryResultOK;
+    EXPECT_EQ(HLMemoryManagementUnitWritePhysical(&mmu, HLPageSize - 3, data.data(), data.size(), &result), data.size());
+    EXPECT_EQ(result, HLMemoryResultOK);
+    EXPECT_EQ(memcmp(mmu.memory + HLPageSize - 3, data.data(), data.size()), 0);
+    EXPECT_EQ(mmu.memory[HLPageSize - 4], 0);
+
+    std::vector<uint8_t> readBack(data.size());
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysical(&mmu, HLPageSize - 3, readBack.data(), readBack.size(), &result), data.size());
+    EXPECT_EQ(readBack, data);
+
+    EXPECT_EQ(HLMemoryManagementUnitFillPhysical(&mmu, 1, 0x5A, 10, &result), 10);
+    EXPECT_EQ(mmu.memory[0], 0);
+    EXPECT_EQ(mmu.memory[10], 0x5A);
+    EXPECT_EQ(mmu.memory[11], 0);
+    EXPECT_EQ(result, HLMemoryResultOK);
+
+    // everything up to the end of memory happens, then it faults there
+    EXPECT_EQ(HLMemoryManagementUnitFillPhysical(&mmu, size - 50, 0x11, 200, &result), 50);
+    EXPECT_EQ(result, HLMemoryResultBus);
+    EXPECT_EQ(mmu.memory[size - 1], 0x11);
+
+    result = HLMemoryResultOK;
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysical(&mmu, size + 1, readBack.data(), 1, &result), 0);
+    EXPECT_EQ(result, HLMemoryResultBus);
+
+    delete[] mmu.memory;
+}
+
+TEST(MemoryTest, BulkVirtualAccess)
+{
+    HLMemoryManagementUnit mmu{};
+    mmu.memory = new uint8_t[3 * HLPageSize]{0};
+    mmu.memoryLimit = 3 * HLPageSize;
+    mmu.pageTableBase = 0;
+
+    // virtual page 0 maps to physical page 0, where the tables are, and
+    // virtual page 1 to physical page 2; virtual page 2 is unmapped
+    uint64_t pde = 0b1101;
+    memcpy(mmu.memory, &pde, sizeof(pde));
+    pde = (2 * HLPageSize) | 0b1101;
+    memcpy(mmu.memory + 8, &pde, sizeof(pde));
+
+    std::vector<uint8_t> data(HLPageSize + 64, 0x77);
+    HLMemoryResult result = HLMemoryResultOK;
+    EXPECT_EQ(HLMemoryManagementUnitWriteVirtual(&mmu, HLPageSize - 32, data.data(), data.size(), &result), HLPageSize + 32);
+    EXPECT_EQ(result, HLMemoryResultUnmappedLevel5);
+    EXPECT_EQ(mmu.memory[3 * HLPageSize - 1], 0x77);
+    EXPECT_EQ(mmu.memory[2 * HLPageSize - 1], 0);
+
+    // one walk per page, not per byte
+    EXPECT_EQ(mmu.translationCache.misses, 3);
+
+    result = HLMemoryResultOK;
+    std::vector<uint8_t> readBack(HLPageSize, 0);
+    EXPECT_EQ(HLMemoryManagementUnitReadVirtual(&mmu, HLPageSize, readBack.data(), readBack.size(), &result), HLPageSize);
+    EXPECT_EQ(result, HLMemoryResultOK);
+    EXPECT_EQ(readBack, std::vector<uint8_t>(HLPageSize, 0x77));
+
+    EXPECT_EQ(HLMemoryManagementUnitFillVirtual(&mmu, HLPageSize + 4, 0, 4, &result), 4);
+    EXPECT_EQ(mmu.memory[2 * HLPageSize + 4], 0);
+    EXPECT_EQ(mmu.memory[2 * HLPageSize + 8], 0x77);
+
+    // read only pages can't be filled
+    pde = (2 * HLPageSize) | 0b0101;
+    memcpy(mmu.memory + 8, &pde, sizeof(pde));
+    HLMemoryManagementUnitFlushTranslationCache(&mmu);
+    EXPECT_EQ(HLMemoryManagementUnitFillVirtual(&mmu, HLPageSize, 0, 1, &result), 0);
+    EXPECT_EQ(result, HLMemoryResultAccessViolation);
+
+    delete[] mmu.memory;
+}
@@ -0,0 +1,155 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "system.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+extern int allocationBudget;
+extern HLMemoryAllocation failingAlloc;
+
+TEST(MultiCoreTest, CoresRunInParallel) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_EQ(HLSystemSetCoreCount(system, 4), 4);
+        ASSERT_EQ(HLSystemCoreCount(system), 4);
+        EXPECT_EQ(HLSystemCore(system, 0), system);
+        EXPECT_EQ(HLSystemCore(system, 4), nullptr);
+
+        std::vector<uint8_t> program;
+        for (int i = 0; i < 100; i++) {
+            HLInstruction instruction = i == 99
+                ? ASMOpcode_int | ASMImm_F(255)
+                : ASMOpcode_bra | ASMFunc_bra | ASMImm_B(0);
+            for (int shift = 0; shift < 32; shift += 8) {
+                program.push_back(uint8_t(instruction >> shift));
+            }
+        }
+        system->memory.memory = program.data();
+        system->memory.memoryLimit = program.size();
+
+        EXPECT_EQ(HLSystemRunCores(system, 60), HLStopBudgetExhausted);
+        EXPECT_EQ(HLSystemRunCores(system, 60), HLStopHalted);
+        for (uint32_t i = 0; i < 4; i++) {
+            HLSystem* core = HLSystemCore(system, i);
+            EXPECT_EQ(core->coreIndex, i);
+            EXPECT_EQ(HLSystemStopReason(core), HLStopHalted);
+            EXPECT_EQ(core->cpu.cycles, 100);
+            EXPECT_EQ(core->testCode, 1);
+            EXPECT_EQ(core->memory.memory, program.data());
+            if (i > 0) {
+                // devices and ports are core 0's alone
+                EXPECT_EQ(core->dma, nullptr);
+                EXPECT_EQ(core->bus, nullptr);
+            }
+        }
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(MultiCoreTest, SettingCoresIsAllOrNothing) {
+    HLSystem* system;
+    allocationBudget = 0;
+    HLSystemInitWithEngine(&system, &failingAlloc, HLExecutionEngineBlocks);
+    EXPECT_EQ(system, nullptr);
+
+    // fail each allocation in turn until every core can be set up
+    uint32_t count = 1;
+    for (int budget = 0; count == 1; budget++) {
+        ASSERT_LT(budget, 100);
+        HLSystemInitWithEngine(&system, &alloc, HLExecutionEngineBlocks);
+        system->allocator = &failingAlloc;
+        allocationBudget = budget;
+        count = HLSystemSetCoreCount(system, 3);
+        EXPECT_EQ(HLSystemCoreCount(system), count);
+        if (count == 1) {
+            EXPECT_EQ(HLSystemCore(system, 0), system);
+            EXPECT_EQ(HLSystemCore(system, 1), nullptr);
+        }
+        HLSystemDone(&system);
+    }
+    EXPECT_EQ(count, 3);
+}
+
+TEST(MultiCoreTest, CoresHaveTheirOwnTranslationCaches) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    HLSystemSetCoreCount(system, 2);
+    HLSystem* other = HLSystemCore(system, 1);
+
+    uint64_t memory[2048] = {};
+    system->memory.memory = reinterpret_cast<uint8_t*>(memory);
+    system->memory.memoryLimit = sizeof(memory);
+    uint8_t program[] = { ASM(ASMOpcode_int | ASMImm_F(255)) };
+    memcpy(memory, program, sizeof(program));
+    HLSystemRunCores(system, 1);
+
+    // every level points at the table at 0, so every page maps to 0
+    const uint64_t identity = 0b11111;
+    for (int i = 0; i < 2048; i++) {
+        memory[i] = identity;
+    }
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitTranslateAddress(&other->memory, 0, HLMemoryPermissionRead, &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+    EXPECT_EQ(other->memory.translationCache.misses, 1);
+    EXPECT_EQ(system->memory.translationCache.misses, 0);
+
+    HLSystemDone(&system);
+}
+
+TEST(MultiCoreTest, CodeWrittenByOneCoreReachesTheOthers) {
+    HLSystem* system;
+    HLSystemInitWithEngine(&system, &alloc, HLExecutionEngineBlocks);
+    HLSystemSetCoreCount(system, 2);
+    uint8_t memory[HLPageSize] = { ASM(ASMOpcode_int | ASMImm_F(254)) };
+    system->memory.memory = memory;
+    system->memory.memoryLimit = sizeof(memory);
+
+    EXPECT_EQ(HLSystemRunCores(system, 10), HLStopHalted);
+    EXPECT_EQ(system->testCode, 0);
+    EXPECT_EQ(HLSystemCore(system, 1)->testCode, 0);
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysicalUInt32(&HLSystemCore(system, 1)->memory, 0, ASMOpcode_int | ASMImm_F(255), &result);
+    ASSERT_EQ(result, HLMemoryResultOK);
+
+    system->cpu.registers[HLRegIP] = 0;
+    HLSystemCore(system, 1)->cpu.registers[HLRegIP] = 0;
+    EXPECT_EQ(HLSystemRunCores(system, 10), HLStopHalted);
+    EXPECT_EQ(system->testCode, 1);
+    EXPECT_EQ(HLSystemCore(system, 1)->testCode, 1);
+
+    HLSystemDone(&system);
+}
+
+TEST(MultiCoreTest, InterruptsCanBeRaisedFromOtherThreads) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    HLSystemSetCoreCount(system, 3);
+    HLSystem* target = HLSystemCore(system, 2);
+
+    EXPECT_EQ(HLInterruptControllerTakePending(&target->interrupts), -1);
+
+    std::thread first([&] { HLSystemRaiseInterrupt(target, 200); });
+    std::thread second([&] { HLSystemRaiseInterrupt(target, 37); });
+    first.join();
+    second.join();
+
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), -1);
+    EXPECT_EQ(HLInterruptControllerTakePending(&target->interrupts), 37);
+    EXPECT_EQ(HLInterruptControllerTakePending(&target->interrupts), 200);
+    EXPECT_EQ(HLInterruptControllerTakePending(&target->interrupts), -1);
+
+    HLSystemDone(&system);
+}
@@ -0,0 +1,161 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <string>
+
+#include "system.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+static std::string WriteImage(const char* name, const uint8_t* data, size_t size) {
+    std::string path = testing::TempDir() + name;
+    FILE* file = fopen(path.c_str(), "wb");
+    fwrite(data, 1, size, file);
+    fclose(file);
+    return path;
+}
+
+TEST(PhysicalMemoryTest, ReservedMemoryIsZeroedAndWritable) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+
+    // far more than we touch; only the touched pages cost anything
+    const uint64_t size = 4ull << 30;
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, size));
+    EXPECT_EQ(system->memory.memoryLimit, size);
+    EXPECT_FALSE(HLSystemReservePhysicalMemory(system, HLPageSize + 1));
+
+    HLMemoryResult result = HLMemoryResultOK;
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&system->memory, size - 8, &result), 0);
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, size - 8, 0x1234, &result);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&system->memory, size - 8, &result), 0x1234);
+    EXPECT_EQ(result, HLMemoryResultOK);
+
+    HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0, ASMOpcode_int | ASMImm_F(255), &result);
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+
+    HLSystemDone(&system);
+}
+
+TEST(PhysicalMemoryTest, ImagesAreMappedCopyOnWrite) {
+    uint8_t image[] = {
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(1)),
+        ASM(0xAA),
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+    };
+    std::string path = WriteImage("halley_image_test.bin", image, sizeof(image));
+
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    EXPECT_FALSE(HLSystemMapImage(system, path.c_str(), 0));
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, 4 * HLPageSize));
+    EXPECT_FALSE(HLSystemMapImage(system, path.c_str(), 4));
+    EXPECT_FALSE(HLSystemMapImage(system, path.c_str(), 4 * HLPageSize));
+    EXPECT_FALSE(HLSystemMapImage(system, "/nonexistent/halley.bin", 0));
+    ASSERT_TRUE(HLSystemMapImage(system, path.c_str(), HLPageSize));
+
+    system->cpu.registers[HLRegIP] = HLPageSize;
+    HLSystemExec(system);
+    EXPECT_EQ(system->testCode, 1);
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, HLPageSize + 4, 0xBBBBBBBB, &result);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt32(&system->memory, HLPageSize + 4, &result), 0xBBBBBBBB);
+    HLSystemDone(&system);
+
+    uint8_t contents[sizeof(image)];
+    FILE* file = fopen(path.c_str(), "rb");
+    ASSERT_EQ(fread(contents, 1, sizeof(contents), file), sizeof(contents));
+    fclose(file);
+    remove(path.c_str());
+    EXPECT_EQ(memcmp(contents, image, sizeof(image)), 0);
+}
+
+TEST(PhysicalMemoryTest, ReplacingMemoryDropsCachedCode) {
+    uint8_t image[] = { ASM(ASMOpcode_int | ASMImm_F(255)) };
+    std::string path = WriteImage("halley_replace_test.bin", image, sizeof(image));
+
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks }) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, 2 * HLPageSize));
+
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0, ASMOpcode_int | ASMImm_F(254), &result);
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 0);
+
+        ASSERT_TRUE(HLSystemMapImage(system, path.c_str(), 0));
+        system->cpu.registers[HLRegIP] = 0;
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 1);
+
+        // released pages read as zero, even where an image was mapped
+        EXPECT_FALSE(HLSystemReleasePhysicalMemory(system, 0, 1));
+        EXPECT_FALSE(HLSystemReleasePhysicalMemory(system, 0, 3 * HLPageSize));
+        ASSERT_TRUE(HLSystemReleasePhysicalMemory(system, 0, HLPageSize));
+        EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt32(&system->memory, 0, &result), 0);
+        EXPECT_EQ(result, HLMemoryResultOK);
+
+        HLSystemDone(&system);
+    }
+    remove(path.c_str());
+}
+
+TEST(PhysicalMemoryTest, WritesMarkPagesDirty) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, 100 * HLPageSize));
+
+    // nothing is tracked until asked for
+    HLMemoryResult result = HLMemoryResultOK;
+    uint64_t dirty[2] = { 1, 1 };
+    HLMemoryManagementUnitWritePhysicalUInt8(&system->memory, 3 * HLPageSize, 1, &result);
+    EXPECT_EQ(HLSystemTakeDirtyPages(system, dirty, 100), 0);
+    EXPECT_EQ(dirty[0], 0);
+
+    // then everything starts out dirty
+    ASSERT_TRUE(HLSystemTrackDirtyPages(system, true));
+    EXPECT_EQ(HLSystemTakeDirtyPages(system, dirty, 100), 100);
+    EXPECT_EQ(dirty[0], UINT64_MAX);
+    EXPECT_EQ(dirty[1], (1ull << 36) - 1);
+    EXPECT_EQ(HLSystemTakeDirtyPages(system, dirty, 100), 0);
+
+    HLMemoryManagementUnitWritePhysicalUInt8(&system->memory, 1 * HLPageSize + 1, 1, &result);
+    HLMemoryManagementUnitWritePhysicalUInt16(&system->memory, 1 * HLPageSize + 2, 1, &result);
+    HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 64 * HLPageSize, 1, &result);
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 99 * HLPageSize, 1, &result);
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 100 * HLPageSize, 1, &result);
+    EXPECT_EQ(result, HLMemoryResultBus);
+    ASSERT_TRUE(HLSystemReleasePhysicalMemory(system, 4 * HLPageSize, 2 * HLPageSize));
+
+    // pages past pageCount stay dirty for later
+    EXPECT_EQ(HLSystemTakeDirtyPages(system, dirty, 65), 4);
+    EXPECT_EQ(dirty[0], 0x32);
+    EXPECT_EQ(dirty[1], 1);
+    EXPECT_EQ(HLSystemTakeDirtyPages(system, dirty, 100), 1);
+    EXPECT_EQ(dirty[0], 0);
+    EXPECT_EQ(dirty[1], 1ull << 35);
+
+    // other cores share the bitmap once they have run
+    ASSERT_EQ(HLSystemSetCoreCount(system, 2), 2);
+    HLMemoryManagementUnitWritePhysicalUInt32(&system->memory, 0, ASMOpcode_int | ASMImm_F(254), &result);
+    HLSystemExec(system);
+    HLMemoryManagementUnitWritePhysicalUInt8(&HLSystemCore(system, 1)->memory, 7 * HLPageSize, 1, &result);
+    EXPECT_EQ(HLSystemTakeDirtyPages(system, dirty, 100), 2);
+    EXPECT_EQ(dirty[0], 0x81);
+
+    ASSERT_TRUE(HLSystemTrackDirtyPages(system, false));
+    HLMemoryManagementUnitWritePhysicalUInt8(&system->memory, 0, 1, &result);
+    EXPECT_EQ(HLSystemTakeDirtyPages(system, dirty, 100), 0);
+
+    HLSystemDone(&system);
+}
@@ -0,0 +1,148 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <string>
+
+#include "system.h"
+#include "ring.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "ring_p.h"
+#include "io_bus_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+#define RING_PORT 0x80
+#define OUTI(reg, port) ASM(ASMOpcode_outi | ASMImm_M(RING_PORT + port) | ASMRs1_M(reg))
+
+// sets the ring up with RA to RD, rings the doorbell with RE, then halts
+static const uint8_t ringProgram[] = {
+    OUTI(HLRegRA, HLRingPortDescriptors),
+    OUTI(HLRegRB, HLRingPortCompletions),
+    OUTI(HLRegRC, HLRingPortSize),
+    OUTI(HLRegRD, HLRingPortVector),
+    OUTI(HLRegRE, HLRingPortDoorbell),
+    ASM(ASMOpcode_int | ASMImm_F(255)),
+};
+
+struct StreamDevice {
+    std::string output;
+    uint32_t calls = 0;
+};
+
+static uint64_t StreamDeviceHandle(void* userData, HLSystem* system, const HLRingBuffer* buffer) {
+    StreamDevice* device = static_cast<StreamDevice*>(userData);
+    device->calls++;
+    if (buffer->flags & HLRingDescriptorHostWrites) {
+        memset(buffer->data, 'x', buffer->length);
+    } else {
+        device->output.append(reinterpret_cast<const char*>(buffer->data), buffer->length);
+    }
+    return buffer->length * 10;
+}
+
+static void WriteDescriptor(HLSystem* system, uint64_t table, uint64_t index, uint64_t address, uint32_t length, uint32_t flags) {
+    HLMemoryResult result = HLMemoryResultOK;
+    HLRingDescriptor descriptor = { address, length, flags };
+    HLMemoryManagementUnitWritePhysical(&system->memory, table + index * sizeof(descriptor), &descriptor, sizeof(descriptor), &result);
+    ASSERT_EQ(result, HLMemoryResultOK);
+}
+
+static HLRingCompletion ReadCompletion(HLSystem* system, uint64_t table, uint64_t index) {
+    HLMemoryResult result = HLMemoryResultOK;
+    HLRingCompletion completion;
+    HLMemoryManagementUnitReadPhysical(&system->memory, table + index * sizeof(completion), &completion, sizeof(completion), &result);
+    EXPECT_EQ(result, HLMemoryResultOK);
+    return completion;
+}
+
+TEST(RingTest, StreamsBuffersInBatches) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, 4 * HLPageSize));
+
+    StreamDevice device;
+    ASSERT_TRUE(HLSystemAttachRing(system, RING_PORT, StreamDeviceHandle, &device));
+    EXPECT_FALSE(HLSystemAttachRing(system, RING_PORT + 2, StreamDeviceHandle, &device));
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysical(&system->memory, 0, ringProgram, sizeof(ringProgram), &result);
+    HLMemoryManagementUnitWritePhysical(&system->memory, 0x1000, "hello, ", 7, &result);
+    HLMemoryManagementUnitWritePhysical(&system->memory, 0x2000 - 3, "world", 5, &result);
+    WriteDescriptor(system, 0x400, 0, 0x1000, 7, 0);
+    WriteDescriptor(system, 0x400, 1, 0x2000 - 3, 5, 0);
+    WriteDescriptor(system, 0x400, 2, 4 * HLPageSize - 4, 5, 0);
+    WriteDescriptor(system, 0x400, 3, 0x3000, 4, HLRingDescriptorHostWrites);
+
+    system->cpu.registers[HLRegRA] = 0x400;
+    system->cpu.registers[HLRegRB] = 0x800;
+    system->cpu.registers[HLRegRC] = 4;
+    system->cpu.registers[HLRegRD] = 33;
+    system->cpu.registers[HLRegRE] = 4;
+    HLSystemExec(system);
+    ASSERT_EQ(system->testCode, 1);
+    HLRingWait(system->rings);
+
+    EXPECT_EQ(device.output, "hello, world");
+    EXPECT_EQ(device.calls, 3);
+    EXPECT_EQ(memcmp(system->memory.memory + 0x3000, "xxxx", 4), 0);
+    EXPECT_EQ(HLSystemPortRead(system, RING_PORT + HLRingPortUsed), 4);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), 33);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), -1);
+
+    HLRingCompletion completion = ReadCompletion(system, 0x800, 1);
+    EXPECT_EQ(completion.index, 1);
+    EXPECT_EQ(completion.status, HLRingStatusOK);
+    EXPECT_EQ(completion.result, 50);
+    completion = ReadCompletion(system, 0x800, 2);
+    EXPECT_EQ(completion.index, 2);
+    EXPECT_EQ(completion.status, HLRingStatusFault);
+    completion = ReadCompletion(system, 0x800, 3);
+    EXPECT_EQ(completion.status, HLRingStatusOK);
+    EXPECT_EQ(completion.result, 40);
+
+    // the table wraps around, and the doorbell can't get more than a table ahead
+    WriteDescriptor(system, 0x400, 0, 0x1000, 5, 0);
+    HLSystemPortWrite(system, RING_PORT + HLRingPortDoorbell, 9);
+    EXPECT_EQ(HLSystemPortRead(system, RING_PORT + HLRingPortDoorbell), 4);
+    HLSystemPortWrite(system, RING_PORT + HLRingPortDoorbell, 5);
+    HLRingWait(system->rings);
+    EXPECT_EQ(device.output, "hello, worldhello");
+    EXPECT_EQ(ReadCompletion(system, 0x800, 0).index, 4);
+    EXPECT_EQ(HLSystemPortRead(system, RING_PORT + HLRingPortUsed), 5);
+
+    HLSystemDone(&system);
+}
+
+TEST(RingTest, RingsCanBeRungWhileBusy) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+    StreamDevice device;
+    ASSERT_TRUE(HLSystemAttachRing(system, RING_PORT, StreamDeviceHandle, &device));
+    HLSystemPortWrite(system, RING_PORT + HLRingPortDescriptors, 0x400);
+    HLSystemPortWrite(system, RING_PORT + HLRingPortCompletions, 0x800);
+    HLSystemPortWrite(system, RING_PORT + HLRingPortSize, 16);
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysical(&system->memory, 0x1000, "0123456789", 10, &result);
+
+    std::string expected;
+    for (uint64_t i = 0; i < 1000; i++) {
+        // don't overwrite descriptors the host hasn't completed yet
+        while (i - HLSystemPortRead(system, RING_PORT + HLRingPortUsed) >= 16) {
+        }
+        WriteDescriptor(system, 0x400, i % 16, 0x1000 + i % 10, 1, 0);
+        HLSystemPortWrite(system, RING_PORT + HLRingPortDoorbell, i + 1);
+        expected += char('0' + i % 10);
+    }
+    HLRingWait(system->rings);
+    EXPECT_EQ(device.output, expected);
+    EXPECT_EQ(HLSystemPortRead(system, RING_PORT + HLRingPortUsed), 1000);
+
+    HLSystemDone(&system);
+}
@@ -0,0 +1,135 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "system.h"
+#include "scheduler.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+extern int allocationBudget;
+extern HLMemoryAllocation failingAlloc;
+
+// length instructions counting the int 255 at the end
+static std::vector<uint8_t> StraightLineProgram(int length) {
+    std::vector<uint8_t> program;
+    for (int i = 0; i < length; i++) {
+        HLInstruction instruction = i == length - 1
+            ? ASMOpcode_int | ASMImm_F(255)
+            : ASMOpcode_bra | ASMFunc_bra | ASMImm_B(0);
+        for (int shift = 0; shift < 32; shift += 8) {
+            program.push_back(uint8_t(instruction >> shift));
+        }
+    }
+    return program;
+}
+
+TEST(SchedulerTest, RunsGuestsToCompletion) {
+    const int guestCount = 32;
+    std::vector<std::vector<uint8_t>> programs;
+    HLScheduler* scheduler;
+    ASSERT_TRUE(HLSchedulerInit(&scheduler, &alloc, 4, guestCount, 7));
+
+    uint64_t expectedCycles = 0;
+    for (int i = 0; i < guestCount; i++) {
+        programs.push_back(StraightLineProgram(10 + i * 3));
+        expectedCycles += programs.back().size() / 4;
+    }
+    for (int i = 0; i < guestCount; i++) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, i % 2 ? HLExecutionEngineBlocks : HLExecutionEngineInterpreter);
+        system->memory.memory = programs[i].data();
+        system->memory.memoryLimit = programs[i].size();
+        EXPECT_EQ(HLSchedulerAdd(scheduler, system), i);
+    }
+    HLSchedulerWait(scheduler);
+
+    for (int i = 0; i < guestCount; i++) {
+        EXPECT_EQ(HLSchedulerGuestState(scheduler, i), HLGuestHalted);
+        EXPECT_EQ(HLSchedulerGuestStopReason(scheduler, i), HLStopHalted);
+    }
+
+    HLSchedulerStatistics statistics;
+    HLSchedulerGetStatistics(scheduler, &statistics);
+    EXPECT_EQ(statistics.cycles, expectedCycles);
+    EXPECT_GE(statistics.slices, expectedCycles / 7);
+
+    HLSchedulerDone(&scheduler);
+    EXPECT_EQ(scheduler, nullptr);
+}
+
+TEST(SchedulerTest, InitFailsCleanlyWhenAllocationFails) {
+    // scheduler, guests, workers and one queue per worker
+    for (int budget = 0; budget < 6; budget++) {
+        HLScheduler* scheduler;
+        allocationBudget = budget;
+        EXPECT_FALSE(HLSchedulerInit(&scheduler, &failingAlloc, 3, 4, 100));
+        EXPECT_EQ(scheduler, nullptr);
+    }
+
+    HLScheduler* scheduler;
+    allocationBudget = 6;
+    ASSERT_TRUE(HLSchedulerInit(&scheduler, &failingAlloc, 3, 4, 100));
+    HLSchedulerWait(scheduler);
+    HLSchedulerDone(&scheduler);
+}
+
+TEST(SchedulerTest, RejectsGuestsWhenFull) {
+    std::vector<uint8_t> program = StraightLineProgram(1);
+    HLScheduler* scheduler;
+    ASSERT_TRUE(HLSchedulerInit(&scheduler, &alloc, 1, 1, 100));
+
+    HLSystem* first;
+    HLSystemInit(&first, &alloc);
+    first->memory.memory = program.data();
+    first->memory.memoryLimit = program.size();
+    EXPECT_EQ(HLSchedulerAdd(scheduler, first), 0);
+
+    HLSystem* second;
+    HLSystemInit(&second, &alloc);
+    EXPECT_EQ(HLSchedulerAdd(scheduler, second), -1);
+    HLSystemDone(&second);
+
+    HLSchedulerWait(scheduler);
+    EXPECT_EQ(first->testCode, 1);
+
+    HLSchedulerDone(&scheduler);
+}
+
+TEST(SchedulerTest, SuspendedGuestsWaitForResume) {
+    uint8_t program[] = {
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-1)),
+    };
+    HLScheduler* scheduler;
+    ASSERT_TRUE(HLSchedulerInit(&scheduler, &alloc, 2, 1, 50));
+
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    system->memory.memory = program;
+    system->memory.memoryLimit = sizeof(program);
+    int guest = HLSchedulerAdd(scheduler, system);
+
+    HLSchedulerSuspend(scheduler, guest);
+    HLSchedulerWait(scheduler);
+    EXPECT_EQ(HLSchedulerGuestState(scheduler, guest), HLGuestWaiting);
+    EXPECT_EQ(HLSchedulerGuestStopReason(scheduler, guest), HLStopBudgetExhausted);
+
+    uint64_t cycles = system->cpu.cycles;
+    EXPECT_EQ(cycles % 50, 0);
+
+    // the loop never ends, so it only stops again when asked
+    HLSchedulerResume(scheduler, guest);
+    EXPECT_EQ(HLSchedulerGuestState(scheduler, guest), HLGuestRunnable);
+    HLSchedulerSuspend(scheduler, guest);
+    HLSchedulerWait(scheduler);
+    EXPECT_EQ(HLSchedulerGuestState(scheduler, guest), HLGuestWaiting);
+    EXPECT_GT(system->cpu.cycles, cycles);
+
+    HLSchedulerDone(&scheduler);
+}
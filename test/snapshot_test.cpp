@@ -0,0 +1,324 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <string>
+
+#include "system.h"
+#include "snapshot.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "interrupt_controller_p.h"
+#include "io_bus_p.h"
+#include "timer_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+TEST(SnapshotTest, ForksResumeWhereTheSnapshotWasTaken) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks }) {
+        uint8_t program[] = {
+            ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(0)),
+            ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(0)),
+            ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(0)),
+            ASM(ASMOpcode_int | ASMImm_F(255)),
+        };
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        system->memory.memory = program;
+        system->memory.memoryLimit = sizeof(program);
+
+        EXPECT_EQ(HLSystemRun(system, 2), HLStopBudgetExhausted);
+        HLSnapshot* snapshot;
+        ASSERT_TRUE(HLSnapshotCreate(&snapshot, system));
+
+        for (int i = 0; i < 2; i++) {
+            HLSystem* fork;
+            ASSERT_TRUE(HLSnapshotFork(snapshot, &fork, &alloc));
+            EXPECT_EQ(fork->engine, system->engine);
+            EXPECT_NE(fork->memory.memory, system->memory.memory);
+            EXPECT_EQ(fork->memory.memoryLimit, sizeof(program));
+            EXPECT_EQ(fork->cpu.registers[HLRegIP], 8);
+            EXPECT_EQ(fork->cpu.cycles, 2);
+
+            HLSystemExec(fork);
+            EXPECT_EQ(fork->testCode, 1);
+            EXPECT_EQ(fork->cpu.cycles, 4);
+            HLSystemDone(&fork);
+        }
+
+        HLSnapshotDone(&snapshot);
+        EXPECT_EQ(snapshot, nullptr);
+        HLSystemDone(&system);
+    }
+}
+
+TEST(SnapshotTest, ForksCopyPagesOnWrite) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    const uint64_t size = 256ull << 20;
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, size));
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0, 1, &result);
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, size / 2, 2, &result);
+    system->memory.pageTableBase = 0x4000;
+
+    HLSnapshot* snapshot;
+    ASSERT_TRUE(HLSnapshotCreate(&snapshot, system));
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0, 3, &result);
+
+    HLSystem* first;
+    HLSystem* second;
+    ASSERT_TRUE(HLSnapshotFork(snapshot, &first, &alloc));
+    ASSERT_TRUE(HLSnapshotFork(snapshot, &second, &alloc));
+    HLSnapshotDone(&snapshot);
+
+    EXPECT_EQ(first->memory.memoryLimit, size);
+    EXPECT_EQ(first->memory.pageTableBase, 0x4000);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&first->memory, 0, &result), 1);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&first->memory, size / 2, &result), 2);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&first->memory, size - 8, &result), 0);
+
+    HLMemoryManagementUnitWritePhysicalUInt64(&first->memory, size / 2, 4, &result);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&first->memory, size / 2, &result), 4);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&second->memory, size / 2, &result), 2);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&second->memory, 0, &result), 1);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&system->memory, 0, &result), 3);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&system->memory, size / 2, &result), 2);
+    EXPECT_EQ(result, HLMemoryResultOK);
+
+    HLSystemDone(&first);
+    HLSystemDone(&second);
+    HLSystemDone(&system);
+}
+
+TEST(SnapshotTest, EveryCoreIsCaptured) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_EQ(HLSystemSetCoreCount(system, 3), 3);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+    for (uint32_t i = 0; i < 3; i++) {
+        HLSystemCore(system, i)->cpu.registers[HLRegRA] = 100 + i;
+    }
+    HLSystemRaiseInterrupt(HLSystemCore(system, 2), 12);
+
+    HLSnapshot* snapshot;
+    ASSERT_TRUE(HLSnapshotCreate(&snapshot, HLSystemCore(system, 1)));
+    HLSystem* fork;
+    ASSERT_TRUE(HLSnapshotFork(snapshot, &fork, &alloc));
+    HLSnapshotDone(&snapshot);
+
+    ASSERT_EQ(HLSystemCoreCount(fork), 3);
+    for (uint32_t i = 0; i < 3; i++) {
+        EXPECT_EQ(HLSystemCore(fork, i)->cpu.registers[HLRegRA], 100 + i);
+        EXPECT_EQ(HLSystemCore(fork, i)->coreIndex, i);
+    }
+    EXPECT_EQ(HLInterruptControllerTakePending(&HLSystemCore(fork, 2)->interrupts), 12);
+
+    HLSystemDone(&fork);
+    HLSystemDone(&system);
+}
+
+// the timer of system is due in 7 cycles and fires every 10 after that
+static void ExpectTimerPending(HLSystem* system) {
+    EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortControl), HLTimerEnabled | HLTimerPeriodic);
+    EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortVector), 7);
+    EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortPeriod), 10);
+    EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortCounter), 7);
+    EXPECT_EQ(HLSystemRun(system, 6), HLStopBudgetExhausted);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), -1);
+    EXPECT_EQ(HLSystemRun(system, 1), HLStopBudgetExhausted);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), 7);
+    EXPECT_EQ(HLSystemRun(system, 10), HLStopBudgetExhausted);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), 7);
+}
+
+TEST(SnapshotTest, TimersAreCaptured) {
+    std::string path = testing::TempDir() + "halley_snapshot_timer_test.snap";
+    remove(path.c_str());
+
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+    // without a vector table, the interrupts stay pending for us to see
+    const uint8_t program[] = {
+        ASM(ASMOpcode_outi | ASMImm_M(HLTimerPortBase + HLTimerPortPeriod) | ASMRs1_M(HLRegRB)),
+        ASM(ASMOpcode_outi | ASMImm_M(HLTimerPortBase + HLTimerPortVector) | ASMRs1_M(HLRegRC)),
+        ASM(ASMOpcode_outi | ASMImm_M(HLTimerPortBase + HLTimerPortControl) | ASMRs1_M(HLRegRD)),
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-1)),
+    };
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysical(&system->memory, 0, program, sizeof(program), &result);
+    ASSERT_EQ(result, HLMemoryResultOK);
+    system->cpu.registers[HLRegRB] = 10;
+    system->cpu.registers[HLRegRC] = 7;
+    system->cpu.registers[HLRegRD] = HLTimerEnabled | HLTimerPeriodic;
+    // armed at cycle 3, so due at 13
+    EXPECT_EQ(HLSystemRun(system, 6), HLStopBudgetExhausted);
+
+    HLSnapshot* snapshot;
+    ASSERT_TRUE(HLSnapshotCreate(&snapshot, system));
+    HLSystem* fork;
+    ASSERT_TRUE(HLSnapshotFork(snapshot, &fork, &alloc));
+    HLSnapshotDone(&snapshot);
+    ExpectTimerPending(fork);
+    HLSystemDone(&fork);
+
+    ASSERT_TRUE(HLSnapshotWriteFile(system, path.c_str()));
+    HLSystem* restored;
+    ASSERT_TRUE(HLSnapshotRestoreFile(&restored, &alloc, path.c_str()));
+    ExpectTimerPending(restored);
+    HLSystemDone(&restored);
+
+    ExpectTimerPending(system);
+    HLSystemDone(&system);
+    remove(path.c_str());
+}
+
+static long FileSize(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+TEST(SnapshotTest, FilesRestoreTheLatestCheckpoint) {
+    std::string path = testing::TempDir() + "halley_snapshot_test.snap";
+    remove(path.c_str());
+
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    const uint64_t size = 64 * HLPageSize;
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, size));
+    ASSERT_EQ(HLSystemSetCoreCount(system, 2), 2);
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0, 1, &result);
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 5 * HLPageSize, 2, &result);
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 6 * HLPageSize, 3, &result);
+    HLSystemCore(system, 1)->cpu.registers[HLRegRA] = 10;
+    system->memory.pageTableBase = 0x8000;
+
+    // no file yet, so this writes a full snapshot
+    ASSERT_TRUE(HLSnapshotCheckpointFile(system, path.c_str()));
+    long full = FileSize(path);
+    EXPECT_EQ(full % HLPageSize, 0);
+    EXPECT_EQ(full, 4 * HLPageSize);
+
+    // one page changes and one goes back to zero
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 5 * HLPageSize, 4, &result);
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 6 * HLPageSize, 0, &result);
+    HLSystemCore(system, 1)->cpu.registers[HLRegRA] = 11;
+    ASSERT_TRUE(HLSnapshotCheckpointFile(system, path.c_str()));
+    EXPECT_EQ(FileSize(path), full + 2 * HLPageSize);
+
+    // nothing changed, so only the state is appended
+    ASSERT_TRUE(HLSnapshotCheckpointFile(system, path.c_str()));
+    EXPECT_EQ(FileSize(path), full + 3 * HLPageSize);
+
+    HLSystem* restored;
+    ASSERT_TRUE(HLSnapshotRestoreFile(&restored, &alloc, path.c_str()));
+    ASSERT_EQ(HLSystemCoreCount(restored), 2);
+    EXPECT_EQ(restored->memory.memoryLimit, size);
+    EXPECT_EQ(restored->memory.pageTableBase, 0x8000);
+    EXPECT_EQ(HLSystemCore(restored, 1)->cpu.registers[HLRegRA], 11);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&restored->memory, 0, &result), 1);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&restored->memory, 5 * HLPageSize, &result), 4);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&restored->memory, 6 * HLPageSize, &result), 0);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&restored->memory, size - 8, &result), 0);
+
+    // restored memory is a private copy of the file
+    HLMemoryManagementUnitWritePhysicalUInt64(&restored->memory, 0, 5, &result);
+    HLSystemDone(&restored);
+    ASSERT_TRUE(HLSnapshotRestoreFile(&restored, &alloc, path.c_str()));
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&restored->memory, 0, &result), 1);
+    EXPECT_EQ(result, HLMemoryResultOK);
+    HLSystemDone(&restored);
+
+    // a full write starts the file over
+    ASSERT_TRUE(HLSnapshotWriteFile(system, path.c_str()));
+    EXPECT_EQ(FileSize(path), 3 * HLPageSize);
+
+    HLSystemDone(&system);
+    remove(path.c_str());
+}
+
+TEST(SnapshotTest, CheckpointsOnlyLookAtDirtyPages) {
+    std::string path = testing::TempDir() + "halley_dirty_test.snap";
+    remove(path.c_str());
+
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, 8 * HLPageSize));
+    ASSERT_TRUE(HLSystemTrackDirtyPages(system, true));
+
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0, 1, &result);
+    ASSERT_TRUE(HLSnapshotWriteFile(system, path.c_str()));
+    uint64_t dirty;
+    EXPECT_EQ(HLSystemTakeDirtyPages(system, &dirty, 8), 0);
+
+    HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 2 * HLPageSize, 2, &result);
+    // a change the tracking can't see is left out
+    system->memory.memory[3 * HLPageSize] = 3;
+    ASSERT_TRUE(HLSnapshotCheckpointFile(system, path.c_str()));
+
+    HLSystem* restored;
+    ASSERT_TRUE(HLSnapshotRestoreFile(&restored, &alloc, path.c_str()));
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&restored->memory, 0, &result), 1);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&restored->memory, 2 * HLPageSize, &result), 2);
+    EXPECT_EQ(HLMemoryManagementUnitReadPhysicalUInt64(&restored->memory, 3 * HLPageSize, &result), 0);
+    HLSystemDone(&restored);
+
+    HLSystemDone(&system);
+    remove(path.c_str());
+}
+
+TEST(SnapshotTest, TornCheckpointsAreIgnored) {
+    uint8_t program[] = {
+        ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(0)),
+        ASM(ASMOpcode_int | ASMImm_F(255)),
+        ASM(0xAAAAAAAA),
+    };
+    std::string path = testing::TempDir() + "halley_torn_test.snap";
+    remove(path.c_str());
+
+    HLSystem* system;
+    HLSystemInitWithEngine(&system, &alloc, HLExecutionEngineBlocks);
+    system->memory.memory = program;
+    system->memory.memoryLimit = sizeof(program);
+    EXPECT_EQ(HLSystemRun(system, 1), HLStopBudgetExhausted);
+    ASSERT_TRUE(HLSnapshotWriteFile(system, path.c_str()));
+    long full = FileSize(path);
+
+    // what a crash part way through a checkpoint leaves behind
+    FILE* file = fopen(path.c_str(), "ab");
+    std::string garbage(HLPageSize + 100, 'x');
+    fwrite(garbage.data(), 1, garbage.size(), file);
+    fclose(file);
+
+    HLSystem* restored;
+    ASSERT_TRUE(HLSnapshotRestoreFile(&restored, &alloc, path.c_str()));
+    EXPECT_EQ(restored->engine, HLExecutionEngineBlocks);
+    EXPECT_EQ(restored->memory.memoryLimit, sizeof(program));
+    EXPECT_EQ(restored->cpu.cycles, 1);
+    HLSystemExec(restored);
+    EXPECT_EQ(restored->testCode, 1);
+    HLSystemDone(&restored);
+
+    // the next checkpoint replaces the torn one
+    ASSERT_TRUE(HLSnapshotCheckpointFile(system, path.c_str()));
+    EXPECT_EQ(FileSize(path), full + HLPageSize);
+    ASSERT_TRUE(HLSnapshotRestoreFile(&restored, &alloc, path.c_str()));
+    HLSystemDone(&restored);
+
+    HLSystemDone(&system);
+    EXPECT_FALSE(HLSnapshotRestoreFile(&restored, &alloc, "/nonexistent/halley.snap"));
+    remove(path.c_str());
+}
@@ -0,0 +1,181 @@
+// SPDX-FileCopyrightText: 2024 Janet Blackquill <uhhadd@gmail.com>
+//
+// SPDX-License-Identifier: MIT
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+
+#include "system.h"
+#include "memory_allocation.h"
+#include "system_p.h"
+#include "interrupt_controller_p.h"
+#include "io_bus_p.h"
+#include "timer_p.h"
+#include "assembler.h"
+
+extern HLMemoryAllocation alloc;
+
+#define OUTI(reg, port) ASM(ASMOpcode_outi | ASMImm_M(port) | ASMRs1_M(reg))
+#define INI(reg, port) ASM(ASMOpcode_ini | ASMImm_M(port) | ASMRde_M(reg))
+
+// arms the timer with RB to RD, then spins
+static const uint8_t timerProgram[] = {
+    OUTI(HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+    OUTI(HLRegRB, HLTimerPortBase + HLTimerPortPeriod),
+    OUTI(HLRegRC, HLTimerPortBase + HLTimerPortVector),
+    OUTI(HLRegRD, HLTimerPortBase + HLTimerPortControl),
+    ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-1)),
+};
+
+static void LoadTimerProgram(HLSystem* system, uint64_t vectorTable, uint64_t period, HLTimerControl control) {
+    HLMemoryResult result = HLMemoryResultOK;
+    HLMemoryManagementUnitWritePhysical(&system->memory, 0, timerProgram, sizeof(timerProgram), &result);
+    ASSERT_EQ(result, HLMemoryResultOK);
+    system->cpu.registers[HLRegRA] = vectorTable;
+    system->cpu.registers[HLRegRB] = period;
+    system->cpu.registers[HLRegRC] = 7;
+    system->cpu.registers[HLRegRD] = control;
+}
+
+TEST(TimerTest, InterruptsArriveAtTheSameCycleOnEveryEngine) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+        const uint8_t handler[] = {
+            INI(HLRegRE, HLInterruptPortBase + HLInterruptPortInService),
+            ASM(ASMOpcode_int | ASMImm_F(255)),
+        };
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0x400, handler, sizeof(handler), &result);
+        HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0x800 + 8 * 7, 0x400, &result);
+        LoadTimerProgram(system, 0x800, 1000, HLTimerEnabled);
+
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 1);
+        EXPECT_EQ(system->cpu.registers[HLRegRE], 7);
+        // armed by the fourth instruction, then two in the handler
+        EXPECT_EQ(system->cpu.cycles, 4 + 1000 + 2);
+        EXPECT_EQ(system->interrupts.returnAddress, 16);
+        EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortControl), 0);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(TimerTest, ArmingInsideABlockFiresInsideIt) {
+    for (HLExecutionEngine engine : { HLExecutionEngineInterpreter, HLExecutionEngineBlocks, HLExecutionEngineJIT }) {
+        SCOPED_TRACE((int)engine);
+        HLSystem* system;
+        HLSystemInitWithEngine(&system, &alloc, engine);
+        ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+        if (system->jit != nullptr) {
+            system->jit->threshold = 0;
+        }
+
+        // the whole program is one block, compiled before it first runs
+        const uint8_t program[] = {
+            OUTI(HLRegRA, HLInterruptPortBase + HLInterruptPortVectorTable),
+            OUTI(HLRegRB, HLTimerPortBase + HLTimerPortPeriod),
+            OUTI(HLRegRC, HLTimerPortBase + HLTimerPortVector),
+            OUTI(HLRegRD, HLTimerPortBase + HLTimerPortControl),
+            INI(HLRegRE, HLTimerPortBase + HLTimerPortVector),
+            INI(HLRegRE, HLTimerPortBase + HLTimerPortVector),
+            INI(HLRegRE, HLTimerPortBase + HLTimerPortVector),
+            ASM(ASMOpcode_bra | ASMFunc_bra | ASMImm_B(-1)),
+        };
+        const uint8_t handler[] = {
+            ASM(ASMOpcode_int | ASMImm_F(255)),
+        };
+        HLMemoryResult result = HLMemoryResultOK;
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0, program, sizeof(program), &result);
+        HLMemoryManagementUnitWritePhysical(&system->memory, 0x400, handler, sizeof(handler), &result);
+        HLMemoryManagementUnitWritePhysicalUInt64(&system->memory, 0x800 + 8 * 7, 0x400, &result);
+        system->cpu.registers[HLRegRA] = 0x800;
+        system->cpu.registers[HLRegRB] = 1;
+        system->cpu.registers[HLRegRC] = 7;
+        system->cpu.registers[HLRegRD] = HLTimerEnabled;
+
+        HLSystemExec(system);
+        EXPECT_EQ(system->testCode, 1);
+        // due one instruction after it was armed
+        EXPECT_EQ(system->interrupts.returnAddress, 20);
+
+        HLSystemDone(&system);
+    }
+}
+
+TEST(TimerTest, PeriodicTimersKeepFiring) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+    ASSERT_TRUE(HLSystemReservePhysicalMemory(system, HLPageSize));
+
+    // without a vector table, the interrupts stay pending for us to see
+    LoadTimerProgram(system, 0, 10, HLTimerEnabled | HLTimerPeriodic);
+    HLSystemRun(system, 4);
+    for (int i = 0; i < 5; i++) {
+        EXPECT_EQ(HLSystemRun(system, 9), HLStopBudgetExhausted);
+        EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), -1);
+        EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortCounter), 1);
+        EXPECT_EQ(HLSystemRun(system, 1), HLStopBudgetExhausted);
+        EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), 7);
+        EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortCounter), 10);
+    }
+
+    HLSystemPortWrite(system, HLTimerPortBase + HLTimerPortControl, 0);
+    EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortCounter), 0);
+    HLSystemRun(system, 100);
+    EXPECT_EQ(HLInterruptControllerTakePending(&system->interrupts), -1);
+
+    HLSystemDone(&system);
+}
+
+TEST(TimerTest, WallClockTimersFireWhileTheCoreIsIdle) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+
+    HLSystemPortWrite(system, HLTimerPortBase + HLTimerPortPeriod, 1000000);
+    HLSystemPortWrite(system, HLTimerPortBase + HLTimerPortVector, 7);
+    HLSystemPortWrite(system, HLTimerPortBase + HLTimerPortControl, HLTimerEnabled | HLTimerWallClock);
+
+    int interrupt = -1;
+    auto start = std::chrono::steady_clock::now();
+    while (interrupt < 0 && std::chrono::steady_clock::now() - start < std::chrono::seconds(10)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        interrupt = HLInterruptControllerTakePending(&system->interrupts);
+    }
+    EXPECT_EQ(interrupt, 7);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(1));
+    EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortControl), HLTimerWallClock);
+
+    HLSystemDone(&system);
+}
+
+TEST(TimerTest, FullEventQueuesTurnTheTimerOff) {
+    HLSystem* system;
+    HLSystemInit(&system, &alloc);
+
+    HLEvent events[HLEventQueueSize];
+    for (HLEvent& event : events) {
+        HLEventInit(&event, [](void*, HLSystem*) {}, nullptr);
+        ASSERT_TRUE(HLEventQueueSchedule(&system->events, &event, 1000));
+    }
+
+    HLSystemPortWrite(system, HLTimerPortBase + HLTimerPortPeriod, 10);
+    HLSystemPortWrite(system, HLTimerPortBase + HLTimerPortControl, HLTimerEnabled | HLTimerPeriodic);
+    EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortControl), HLTimerPeriodic);
+    EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortCounter), 0);
+
+    // with room again, arming works as usual
+    HLEventQueueCancel(&system->events, &events[0]);
+    HLSystemPortWrite(system, HLTimerPortBase + HLTimerPortControl, HLTimerEnabled);
+    EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortControl), HLTimerEnabled);
+    EXPECT_EQ(HLSystemPortRead(system, HLTimerPortBase + HLTimerPortCounter), 10);
+
+    for (HLEvent& event : events) {
+        HLEventQueueCancel(&system->events, &event);
+    }
+    HLSystemDone(&system);
+}